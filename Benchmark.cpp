@@ -0,0 +1,1364 @@
+﻿//------------------------------------------------------------------------------
+// <copyright file="Benchmark.cpp" company="Microsoft">
+//     Copyright (c) Microsoft Corporation.  All rights reserved.
+// </copyright>
+//------------------------------------------------------------------------------
+
+// Times the CPU side of the frame pipeline on synthetic frames, and optionally on the
+// first frames of a recording, and prints the results as JSON so builds can be compared.
+// Given a pose trace recorded by the application, it also scores head pose prediction tunings.
+
+#include <windows.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <algorithm>
+#include <atomic>
+#include <thread>
+#include <vector>
+#include "NuiApi.h"
+#include "ColorMapping.h"
+#include "CpuFeatures.h"
+#include "DepthCodec.h"
+#include "FrameProfiler.h"
+#include "FrameSource.h"
+#include "HeadPosePredictor.h"
+#include "HeadTrackingWorker.h"
+#include "PointCloud.h"
+#include "ReplayFrameSource.h"
+#include "SharedFrameRing.h"
+#include "SkeletonSelection.h"
+#include "SkeletonSmoother.h"
+#include "FrameBufferPool.h"
+#include "SoftwareRenderer.h"
+#include "TsdfVolume.h"
+#include "WorkerPool.h"
+
+namespace
+{
+    // same rows per band as the application uses
+    const int cMinRowsPerBand = 16;
+
+    /// <summary>
+    /// One depth frame with everything derived from it that the benchmarks read
+    /// </summary>
+    struct BenchmarkFrame
+    {
+        const char*                     szName;
+        int                             depthWidth;
+        int                             depthHeight;
+        int                             colorWidth;
+        int                             colorHeight;
+        std::vector<USHORT>             depth;
+        std::vector<int32_t>            colorCoordinates;
+        std::vector<uint8_t>            color;
+    };
+
+    /// <summary>
+    /// Result of timing one case
+    /// </summary>
+    struct BenchmarkResult
+    {
+        const char*                     szBenchmark;
+        const char*                     szVariant;
+        const char*                     szFrame;
+        const char*                     szUnit;
+        unsigned int                    threads;
+        double                          items;
+        double                          bytes;
+        double                          medianNs;
+        double                          minNs;
+        double                          speedup;
+    };
+
+    /// <summary>
+    /// Run a case repeatedly and keep the median and fastest time of one run
+    /// </summary>
+    template <class TFunc>
+    void TimeRuns(int iterations, TFunc func, double* pMedianNs, double* pMinNs)
+    {
+        // warm caches, page in buffers and wake the pool before timing
+        for (int i = 0; i < 3; ++i)
+        {
+            func();
+        }
+
+        std::vector<double> durations(iterations);
+        double nsPerTick = 1000000000.0 / ProfilerFrequency();
+        for (int i = 0; i < iterations; ++i)
+        {
+            int64_t start = ProfilerNow();
+            func();
+            durations[i] = (ProfilerNow() - start) * nsPerTick;
+        }
+
+        std::sort(durations.begin(), durations.end());
+        *pMedianNs = durations[durations.size() / 2];
+        *pMinNs = durations[0];
+    }
+
+    /// <summary>
+    /// Small deterministic generator, so synthetic frames are the same from build to build
+    /// </summary>
+    uint32_t NextRandom(uint32_t* pState)
+    {
+        *pState = *pState * 1664525u + 1013904223u;
+        return *pState >> 8;
+    }
+
+    /// <summary>
+    /// Build a frame resembling a person in front of a wall, with the holes and
+    /// out of range pixels a real sensor produces
+    /// </summary>
+    void BuildSyntheticFrame(BenchmarkFrame* pFrame)
+    {
+        pFrame->szName = "synthetic";
+        pFrame->depthWidth = 640;
+        pFrame->depthHeight = 480;
+        pFrame->colorWidth = 640;
+        pFrame->colorHeight = 480;
+
+        int depthPixels = pFrame->depthWidth * pFrame->depthHeight;
+        pFrame->depth.resize(depthPixels);
+        pFrame->colorCoordinates.resize(depthPixels * 2);
+        pFrame->color.resize(pFrame->colorWidth * pFrame->colorHeight * 4);
+
+        uint32_t state = 12345;
+        for (int y = 0; y < pFrame->depthHeight; ++y)
+        {
+            for (int x = 0; x < pFrame->depthWidth; ++x)
+            {
+                int i = y * pFrame->depthWidth + x;
+                int dx = x - pFrame->depthWidth / 2;
+                int dy = y - pFrame->depthHeight / 2;
+
+                // wall at 3.5m, a rounded figure at 1.5m, sparse holes and the far corner beyond range
+                int depthMm = 3500 + (x + y) % 64;
+                if (dx * dx + dy * dy < 150 * 150)
+                {
+                    depthMm = 1500 + (dx * dx + dy * dy) / 100;
+                }
+                if (0 == NextRandom(&state) % 10 || (x > 560 && y > 400))
+                {
+                    depthMm = 0;
+                }
+
+                pFrame->depth[i] = static_cast<USHORT>(depthMm << 3);
+
+                // the color camera sits a few centimeters to the side, so mapped pixels shift with depth
+                int shift = depthMm > 0 ? 25000 / (depthMm / 10 + 1) : 0;
+                pFrame->colorCoordinates[i * 2] = x * pFrame->colorWidth / pFrame->depthWidth + shift;
+                pFrame->colorCoordinates[i * 2 + 1] = y * pFrame->colorHeight / pFrame->depthHeight;
+            }
+        }
+
+        for (size_t i = 0; i < pFrame->color.size(); ++i)
+        {
+            pFrame->color[i] = static_cast<uint8_t>(NextRandom(&state));
+        }
+    }
+
+    /// <summary>
+    /// Load the first depth and color frames of a recording
+    /// </summary>
+    HRESULT LoadRecordedFrame(LPCWSTR szFileName, BenchmarkFrame* pFrame)
+    {
+        CReplayFrameSource source(false, false);
+        HRESULT hr = source.Open(szFileName);
+        if (FAILED(hr)) { return hr; }
+
+        DWORD width, height;
+        NuiImageResolutionToSize(source.GetDepthResolution(), width, height);
+        pFrame->depthWidth = static_cast<int>(width);
+        pFrame->depthHeight = static_cast<int>(height);
+        NuiImageResolutionToSize(source.GetColorResolution(), width, height);
+        pFrame->colorWidth = static_cast<int>(width);
+        pFrame->colorHeight = static_cast<int>(height);
+        pFrame->szName = "recorded";
+
+        int depthPixels = pFrame->depthWidth * pFrame->depthHeight;
+        pFrame->depth.resize(depthPixels);
+        pFrame->colorCoordinates.resize(depthPixels * 2);
+        pFrame->color.resize(pFrame->colorWidth * pFrame->colorHeight * 4);
+
+        FrameSourceImage image;
+        hr = source.AcquireDepthFrame(&image);
+        if (FAILED(hr)) { return hr; }
+        CopyImageRows(&pFrame->depth[0], pFrame->depthWidth * sizeof(USHORT), image.pBits, image.pitch, pFrame->depthWidth * sizeof(USHORT), pFrame->depthHeight);
+        source.ReleaseDepthFrame();
+
+        hr = source.AcquireColorFrame(&image);
+        if (FAILED(hr)) { return hr; }
+        CopyImageRows(&pFrame->color[0], pFrame->colorWidth * 4, image.pBits, image.pitch, pFrame->colorWidth * 4, pFrame->colorHeight);
+        source.ReleaseColorFrame();
+
+        return source.MapDepthFrameToColorCoordinates(&pFrame->depth[0], reinterpret_cast<LONG*>(&pFrame->colorCoordinates[0]));
+    }
+
+    /// <summary>
+    /// Arguments of GeneratePointCloudBand
+    /// </summary>
+    struct GeneratePointCloudBands
+    {
+        GeneratePointCloudFunc          pfnGenerate;
+        const PointCloudDesc*           pDesc;
+
+        // each band writes from its first pixel's slot on, leaving gaps
+        PointCloudPoint*                pPoints;
+    };
+
+    void GeneratePointCloudBand(void* pContext, int rowBegin, int rowEnd)
+    {
+        const GeneratePointCloudBands* pBands = static_cast<const GeneratePointCloudBands*>(pContext);
+        pBands->pfnGenerate(*pBands->pDesc, rowBegin, rowEnd, pBands->pPoints + rowBegin * pBands->pDesc->depthWidth);
+    }
+
+    /// <summary>
+    /// Arguments of MergePointCloudBand, the rows of every sensor's frame stacked on each other
+    /// </summary>
+    struct MergePointCloudBands
+    {
+        GeneratePointCloudFunc          pfnGenerate;
+        TransformPointCloudFunc         pfnTransform;
+        const PointCloudDesc*           pDesc;
+        const PointCloudTransform*      pTransforms;
+
+        // a frame's worth of slots per sensor, each band writes from its first pixel's slot on
+        PointCloudPoint*                pPoints;
+    };
+
+    void MergePointCloudBand(void* pContext, int rowBegin, int rowEnd)
+    {
+        const MergePointCloudBands* pBands = static_cast<const MergePointCloudBands*>(pContext);
+        const PointCloudDesc& desc = *pBands->pDesc;
+
+        // a band may straddle two sensors' frames
+        while (rowBegin < rowEnd)
+        {
+            int sensor = rowBegin / desc.depthHeight;
+            int frameRow = rowBegin - sensor * desc.depthHeight;
+            int frameRowEnd = (std::min)(desc.depthHeight, frameRow + rowEnd - rowBegin);
+
+            PointCloudPoint* pPoints = pBands->pPoints + rowBegin * desc.depthWidth;
+            int count = pBands->pfnGenerate(desc, frameRow, frameRowEnd, pPoints);
+            pBands->pfnTransform(pBands->pTransforms[sensor], pPoints, count);
+
+            rowBegin += frameRowEnd - frameRow;
+        }
+    }
+
+    /// <summary>
+    /// Thread counts to measure scaling at, powers of two up to the hardware thread count
+    /// </summary>
+    std::vector<unsigned int> GetThreadCounts(unsigned int maxThreads)
+    {
+        std::vector<unsigned int> counts;
+        for (unsigned int count = 1; count < maxThreads; count *= 2)
+        {
+            counts.push_back(count);
+        }
+        counts.push_back(maxThreads);
+        return counts;
+    }
+
+    /// <summary>
+    /// Time every supported MapColorToDepth implementation at every thread count
+    /// </summary>
+    void BenchmarkMapColorToDepth(const BenchmarkFrame& frame, const std::vector<unsigned int>& threadCounts, int iterations, std::vector<BenchmarkResult>* pResults)
+    {
+        struct Variant
+        {
+            const char*                 szName;
+            MapColorToDepthFunc         pfnMap;
+            bool                        bSupported;
+        };
+
+        const CpuFeatures& features = GetCpuFeatures();
+        const Variant variants[] =
+        {
+            { "scalar", MapColorToDepthScalar, true },
+            { "sse41", MapColorToDepthSSE41, features.bSSE41 },
+            { "avx2", MapColorToDepthAVX2, features.bAVX2 },
+
+            // the best of the above compiled for this frame's resolutions, if they are a sensor pair
+            { "specialized", GetSpecializedMapColorToDepthFunc(frame.colorWidth, frame.colorHeight, frame.depthWidth), true },
+        };
+
+        ColorMappingDesc desc;
+        desc.pColorCoordinates = &frame.colorCoordinates[0];
+        desc.pColor = &frame.color[0];
+        desc.colorWidth = frame.colorWidth;
+        desc.colorHeight = frame.colorHeight;
+        desc.depthWidth = frame.depthWidth;
+        desc.colorToDepthDivisor = frame.colorWidth / frame.depthWidth;
+
+        size_t destPitch = frame.colorWidth * 4;
+        std::vector<uint8_t> dest(destPitch * frame.colorHeight);
+        double pixels = static_cast<double>(frame.colorWidth) * frame.colorHeight;
+
+        for (size_t v = 0; v < _countof(variants); ++v)
+        {
+            if (!variants[v].bSupported || NULL == variants[v].pfnMap)
+            {
+                continue;
+            }
+
+            double singleThreadNs = 0.0;
+            for (size_t t = 0; t < threadCounts.size(); ++t)
+            {
+                CWorkerPool pool;
+                pool.Start(threadCounts[t]);
+
+                BenchmarkResult result;
+                result.szBenchmark = "map_color_to_depth";
+                result.szVariant = variants[v].szName;
+                result.szFrame = frame.szName;
+                result.szUnit = "pixel";
+                result.threads = threadCounts[t];
+                result.items = pixels;
+
+                // per output pixel: a coordinate pair read, a color pixel read and written
+                result.bytes = pixels * (8 + 4 + 4);
+
+                TimeRuns(iterations, [&]() { MapColorToDepthParallel(desc, variants[v].pfnMap, &dest[0], destPitch, &pool); },
+                    &result.medianNs, &result.minNs);
+
+                if (1 == threadCounts[t])
+                {
+                    singleThreadNs = result.medianNs;
+                }
+                result.speedup = singleThreadNs > 0.0 ? singleThreadNs / result.medianNs : 1.0;
+
+                pResults->push_back(result);
+            }
+        }
+    }
+
+    /// <summary>
+    /// Time the CPU copy of the geometry shader's unprojection at every thread count
+    /// </summary>
+    void BenchmarkPointCloud(const BenchmarkFrame& frame, const std::vector<unsigned int>& threadCounts, int iterations, std::vector<BenchmarkResult>* pResults)
+    {
+        struct Variant
+        {
+            const char*                 szName;
+            GeneratePointCloudFunc      pfnGenerate;
+            TransformPointCloudFunc     pfnTransform;
+        };
+
+        const Variant variants[] =
+        {
+            { "scalar", GeneratePointCloudScalar, TransformPointCloudScalar },
+            { "sse2", GeneratePointCloudSSE2, TransformPointCloudSSE2 },
+        };
+
+        // the shader samples color already remapped into depth space
+        ColorMappingDesc mapping;
+        mapping.pColorCoordinates = &frame.colorCoordinates[0];
+        mapping.pColor = &frame.color[0];
+        mapping.colorWidth = frame.colorWidth;
+        mapping.colorHeight = frame.colorHeight;
+        mapping.depthWidth = frame.depthWidth;
+        mapping.colorToDepthDivisor = frame.colorWidth / frame.depthWidth;
+
+        std::vector<uint8_t> mappedColor(frame.color.size());
+        MapColorToDepthScalar(mapping, &mappedColor[0], frame.colorWidth * 4, 0, frame.colorHeight);
+
+        PointCloudDesc desc;
+        desc.pDepth = &frame.depth[0];
+        desc.pColor = &mappedColor[0];
+        desc.colorPitch = frame.colorWidth * 4;
+        desc.depthWidth = frame.depthWidth;
+        desc.depthHeight = frame.depthHeight;
+        desc.colorWidth = frame.colorWidth;
+        desc.colorHeight = frame.colorHeight;
+        desc.xyScale = tanf(NUI_CAMERA_DEPTH_NOMINAL_HORIZONTAL_FOV * 3.14159265f / 180.0f * 0.5f) / (frame.depthWidth * 0.5f);
+
+        std::vector<PointCloudPoint> points(frame.depthWidth * frame.depthHeight);
+        double pixels = static_cast<double>(points.size());
+        int pointCount = GeneratePointCloudScalar(desc, 0, frame.depthHeight, &points[0]);
+
+        for (size_t v = 0; v < _countof(variants); ++v)
+        {
+            GeneratePointCloudBands bands;
+            bands.pfnGenerate = variants[v].pfnGenerate;
+            bands.pDesc = &desc;
+            bands.pPoints = &points[0];
+
+            double singleThreadNs = 0.0;
+            for (size_t t = 0; t < threadCounts.size(); ++t)
+            {
+                CWorkerPool pool;
+                pool.Start(threadCounts[t]);
+
+                BenchmarkResult result;
+                result.szBenchmark = "generate_point_cloud";
+                result.szVariant = variants[v].szName;
+                result.szFrame = frame.szName;
+                result.szUnit = "pixel";
+                result.threads = threadCounts[t];
+                result.items = pixels;
+
+                // every depth read, four color texels read and a point written per valid pixel
+                result.bytes = pixels * 2 + pointCount * (16.0 + sizeof(PointCloudPoint));
+
+                TimeRuns(iterations, [&]() { pool.ParallelFor(0, frame.depthHeight, cMinRowsPerBand, GeneratePointCloudBand, &bands); },
+                    &result.medianNs, &result.minNs);
+
+                if (1 == threadCounts[t])
+                {
+                    singleThreadNs = result.medianNs;
+                }
+                result.speedup = singleThreadNs > 0.0 ? singleThreadNs / result.medianNs : 1.0;
+
+                pResults->push_back(result);
+            }
+        }
+
+        // several sensors unprojected and moved into the first one's space, as the merged cloud is
+        const int cMergedSensors = 3;
+        PointCloudTransform transforms[cMergedSensors];
+        for (int s = 0; s < cMergedSensors; ++s)
+        {
+            // sensors spaced around the scene, a third of a turn apart
+            float angle = s * 2.0f * 3.14159265f / cMergedSensors;
+            SetIdentityTransform(&transforms[s]);
+            transforms[s].m[0][0] = cosf(angle);
+            transforms[s].m[0][2] = -sinf(angle);
+            transforms[s].m[2][0] = sinf(angle);
+            transforms[s].m[2][2] = cosf(angle);
+            transforms[s].m[3][0] = 2.0f * sinf(angle);
+            transforms[s].m[3][2] = 2.0f * (1.0f - cosf(angle));
+        }
+
+        std::vector<PointCloudPoint> mergedPoints(points.size() * cMergedSensors);
+
+        for (size_t v = 0; v < _countof(variants); ++v)
+        {
+            MergePointCloudBands bands;
+            bands.pfnGenerate = variants[v].pfnGenerate;
+            bands.pfnTransform = variants[v].pfnTransform;
+            bands.pDesc = &desc;
+            bands.pTransforms = transforms;
+            bands.pPoints = &mergedPoints[0];
+
+            double singleThreadNs = 0.0;
+            for (size_t t = 0; t < threadCounts.size(); ++t)
+            {
+                CWorkerPool pool;
+                pool.Start(threadCounts[t]);
+
+                BenchmarkResult result;
+                result.szBenchmark = "merge_point_clouds";
+                result.szVariant = variants[v].szName;
+                result.szFrame = frame.szName;
+                result.szUnit = "pixel";
+                result.threads = threadCounts[t];
+                result.items = pixels * cMergedSensors;
+
+                // as generate_point_cloud per sensor, plus every point read and written again
+                result.bytes = cMergedSensors * (pixels * 2 + pointCount * (16.0 + 3 * sizeof(PointCloudPoint)));
+
+                TimeRuns(iterations, [&]() { pool.ParallelFor(0, frame.depthHeight * cMergedSensors, cMinRowsPerBand, MergePointCloudBand, &bands); },
+                    &result.medianNs, &result.minNs);
+
+                if (1 == threadCounts[t])
+                {
+                    singleThreadNs = result.medianNs;
+                }
+                result.speedup = singleThreadNs > 0.0 ? singleThreadNs / result.medianNs : 1.0;
+
+                pResults->push_back(result);
+            }
+        }
+
+        // the valid pixel list that limits the draws
+        std::vector<uint32_t> indices(frame.depthWidth * frame.depthHeight);
+
+        BenchmarkResult result;
+        result.szBenchmark = "build_point_indices";
+        result.szVariant = "sse2";
+        result.szFrame = frame.szName;
+        result.szUnit = "pixel";
+        result.threads = 1;
+        result.items = pixels;
+
+        // every depth read, an index written per valid pixel
+        result.bytes = pixels * 2 + pointCount * 4.0;
+
+        TimeRuns(iterations, [&]() { BuildPointIndices(&frame.depth[0], frame.depthWidth, 0, frame.depthHeight, &indices[0]); },
+            &result.medianNs, &result.minNs);
+        result.speedup = 1.0;
+
+        pResults->push_back(result);
+    }
+
+    /// <summary>
+    /// Time the software renderer drawing the Kinect view at every thread count
+    /// </summary>
+    void BenchmarkSoftwareRenderer(const BenchmarkFrame& frame, const std::vector<unsigned int>& threadCounts, int iterations, std::vector<BenchmarkResult>* pResults)
+    {
+        ColorMappingDesc mapping;
+        mapping.pColorCoordinates = &frame.colorCoordinates[0];
+        mapping.pColor = &frame.color[0];
+        mapping.colorWidth = frame.colorWidth;
+        mapping.colorHeight = frame.colorHeight;
+        mapping.depthWidth = frame.depthWidth;
+        mapping.colorToDepthDivisor = frame.colorWidth / frame.depthWidth;
+
+        std::vector<uint8_t> mappedColor(frame.color.size());
+        MapColorToDepthScalar(mapping, &mappedColor[0], frame.colorWidth * 4, 0, frame.colorHeight);
+
+        PointCloudDesc desc;
+        desc.pDepth = &frame.depth[0];
+        desc.pColor = &mappedColor[0];
+        desc.colorPitch = frame.colorWidth * 4;
+        desc.depthWidth = frame.depthWidth;
+        desc.depthHeight = frame.depthHeight;
+        desc.colorWidth = frame.colorWidth;
+        desc.colorHeight = frame.colorHeight;
+        desc.xyScale = tanf(NUI_CAMERA_DEPTH_NOMINAL_HORIZONTAL_FOV * 3.14159265f / 180.0f * 0.5f) / (frame.depthWidth * 0.5f);
+
+        // the application's default camera at the sensor, XMMatrixPerspectiveFovLH(XM_PIDIV4, 4:3, 0.1, 100)
+        const float nearZ = 0.1f;
+        const float farZ = 100.0f;
+        float yScale = 1.0f / tanf(3.14159265f / 8.0f);
+
+        SplatConstants constants = {};
+        constants.view[0][0] = constants.view[1][1] = constants.view[2][2] = constants.view[3][3] = 1.0f;
+        constants.projection[0][0] = yScale * frame.depthHeight / frame.depthWidth;
+        constants.projection[1][1] = yScale;
+        constants.projection[2][2] = farZ / (farZ - nearZ);
+        constants.projection[2][3] = 1.0f;
+        constants.projection[3][2] = -nearZ * farZ / (farZ - nearZ);
+        constants.rect[0] = constants.rect[2] = 0.4f;
+        constants.rect[1] = constants.rect[3] = 0.6f;
+
+        // the user view's eyes, 0.2 apart, share the projection like the application's do
+        StereoSplatConstants stereo;
+        for (int eye = 0; eye < 2; ++eye)
+        {
+            memcpy(stereo.eyeView[eye], constants.view, sizeof(constants.view));
+            stereo.eyeView[eye][3][0] = eye ? -0.1f : 0.1f;
+            stereo.eyeView[eye][3][2] = 0.1f;
+        }
+        memcpy(stereo.projection, constants.projection, sizeof(stereo.projection));
+        memcpy(stereo.rect, constants.rect, sizeof(stereo.rect));
+
+        SplatViewport viewport = { 0, 0, frame.depthWidth, frame.depthHeight };
+        SplatViewport eyeViewports[2] =
+        {
+            { 0, 0, frame.depthWidth / 2, frame.depthHeight },
+            { frame.depthWidth / 2, 0, frame.depthWidth / 2, frame.depthHeight }
+        };
+
+        enum RenderMode
+        {
+            RENDER_KINECT_VIEW,
+            RENDER_USER_TWO_PASS,
+            RENDER_USER_SINGLE_PASS
+        };
+
+        struct Variant
+        {
+            const char*                 szName;
+            RenderMode                  mode;
+        };
+
+        const Variant variants[] =
+        {
+            { "kinect_view", RENDER_KINECT_VIEW },
+            { "user_view_two_pass", RENDER_USER_TWO_PASS },
+            { "user_view_single_pass", RENDER_USER_SINGLE_PASS },
+        };
+
+        double pixels = static_cast<double>(frame.depth.size());
+
+        for (size_t v = 0; v < _countof(variants); ++v)
+        {
+            RenderMode mode = variants[v].mode;
+
+            double singleThreadNs = 0.0;
+            for (size_t t = 0; t < threadCounts.size(); ++t)
+            {
+                CWorkerPool pool;
+                pool.Start(threadCounts[t]);
+
+                CSoftwareRenderer renderer;
+                renderer.Resize(frame.depthWidth, frame.depthHeight);
+
+                BenchmarkResult result;
+                result.szBenchmark = "software_render";
+                result.szVariant = variants[v].szName;
+                result.szFrame = frame.szName;
+                result.szUnit = "pixel";
+                result.threads = threadCounts[t];
+                result.items = pixels;
+
+                // depth and color read, color and depth target written
+                result.bytes = pixels * (2 + 4 + 4 + 4);
+
+                TimeRuns(iterations, [&]()
+                {
+                    renderer.Clear(0xff000000);
+                    renderer.SetPoints(desc, &pool);
+
+                    if (RENDER_KINECT_VIEW == mode)
+                    {
+                        renderer.DrawSplats(constants, viewport, &pool);
+                    }
+                    else if (RENDER_USER_TWO_PASS == mode)
+                    {
+                        for (int eye = 0; eye < 2; ++eye)
+                        {
+                            memcpy(constants.view, stereo.eyeView[eye], sizeof(constants.view));
+                            renderer.DrawSplats(constants, eyeViewports[eye], &pool);
+                        }
+                    }
+                    else
+                    {
+                        renderer.DrawStereoSplats(stereo, eyeViewports, &pool);
+                    }
+                }, &result.medianNs, &result.minNs);
+
+                if (1 == threadCounts[t])
+                {
+                    singleThreadNs = result.medianNs;
+                }
+                result.speedup = singleThreadNs > 0.0 ? singleThreadNs / result.medianNs : 1.0;
+
+                pResults->push_back(result);
+            }
+        }
+    }
+
+    /// <summary>
+    /// Time fusing the frame into a voxel volume and extracting its surface at every thread count
+    /// </summary>
+    void BenchmarkTsdfVolume(const BenchmarkFrame& frame, const std::vector<unsigned int>& threadCounts, int iterations, std::vector<BenchmarkResult>* pResults)
+    {
+        ColorMappingDesc mapping;
+        mapping.pColorCoordinates = &frame.colorCoordinates[0];
+        mapping.pColor = &frame.color[0];
+        mapping.colorWidth = frame.colorWidth;
+        mapping.colorHeight = frame.colorHeight;
+        mapping.depthWidth = frame.depthWidth;
+        mapping.colorToDepthDivisor = frame.colorWidth / frame.depthWidth;
+
+        std::vector<uint8_t> mappedColor(frame.color.size());
+        MapColorToDepthScalar(mapping, &mappedColor[0], frame.colorWidth * 4, 0, frame.colorHeight);
+
+        PointCloudDesc desc;
+        desc.pDepth = &frame.depth[0];
+        desc.pColor = &mappedColor[0];
+        desc.colorPitch = frame.colorWidth * 4;
+        desc.depthWidth = frame.depthWidth;
+        desc.depthHeight = frame.depthHeight;
+        desc.colorWidth = frame.colorWidth;
+        desc.colorHeight = frame.colorHeight;
+        desc.xyScale = tanf(NUI_CAMERA_DEPTH_NOMINAL_HORIZONTAL_FOV * 3.14159265f / 180.0f * 0.5f) / (frame.depthWidth * 0.5f);
+
+        double pixels = static_cast<double>(frame.depthWidth) * frame.depthHeight;
+
+        // the application's volume, every frame after the first finds its blocks allocated
+        CTsdfVolume volume;
+        volume.Create(TsdfVolumeParams());
+
+        std::vector<PointCloudPoint> vertices;
+        {
+            CWorkerPool pool;
+            volume.Integrate(desc, &pool);
+        }
+
+        double integrateSingleNs = 0.0;
+        double extractSingleNs = 0.0;
+        for (size_t t = 0; t < threadCounts.size(); ++t)
+        {
+            CWorkerPool pool;
+            pool.Start(threadCounts[t]);
+
+            BenchmarkResult result;
+            result.szBenchmark = "tsdf_integrate";
+            result.szVariant = "scalar";
+            result.szFrame = frame.szName;
+            result.szUnit = "pixel";
+            result.threads = threadCounts[t];
+            result.items = pixels;
+
+            TimeRuns(iterations, [&]() { volume.Integrate(desc, &pool); }, &result.medianNs, &result.minNs);
+
+            // every depth read, every visible voxel read and written
+            const TsdfVolumeStats& stats = volume.GetStats();
+            result.bytes = pixels * 2 + stats.visibleBlockCount * (cTsdfBlockVoxels * 16.0);
+
+            if (1 == threadCounts[t])
+            {
+                integrateSingleNs = result.medianNs;
+            }
+            result.speedup = integrateSingleNs > 0.0 ? integrateSingleNs / result.medianNs : 1.0;
+
+            pResults->push_back(result);
+
+            result.szBenchmark = "tsdf_extract";
+            result.szUnit = "block";
+            result.items = stats.blockCount;
+
+            TimeRuns(iterations, [&]() { volume.ExtractSurface(&pool, &vertices); }, &result.medianNs, &result.minNs);
+
+            // every voxel and the layer of neighbors around its block read, the triangles written
+            double apronVoxels = (cTsdfBlockSize + 2.0) * (cTsdfBlockSize + 2.0) * (cTsdfBlockSize + 2.0);
+            result.bytes = stats.blockCount * apronVoxels * 8.0 + vertices.size() * sizeof(PointCloudPoint);
+
+            if (1 == threadCounts[t])
+            {
+                extractSingleNs = result.medianNs;
+            }
+            result.speedup = extractSingleNs > 0.0 ? extractSingleNs / result.medianNs : 1.0;
+
+            pResults->push_back(result);
+        }
+    }
+
+    /// <summary>
+    /// Time the frame copies done by the capture threads, tightly packed and with padded rows
+    /// </summary>
+    void BenchmarkCopies(const BenchmarkFrame& frame, int iterations, std::vector<BenchmarkResult>* pResults)
+    {
+        struct CopyCase
+        {
+            const char*                 szBenchmark;
+            const uint8_t*              pSrc;
+            UINT                        rowBytes;
+            UINT                        rows;
+            double                      pixels;
+        };
+
+        const CopyCase cases[] =
+        {
+            { "copy_depth", reinterpret_cast<const uint8_t*>(&frame.depth[0]), static_cast<UINT>(frame.depthWidth * sizeof(USHORT)), static_cast<UINT>(frame.depthHeight), static_cast<double>(frame.depthWidth) * frame.depthHeight },
+            { "copy_color", &frame.color[0], static_cast<UINT>(frame.colorWidth * 4), static_cast<UINT>(frame.colorHeight), static_cast<double>(frame.colorWidth) * frame.colorHeight },
+        };
+
+        for (size_t c = 0; c < _countof(cases); ++c)
+        {
+            const CopyCase& copy = cases[c];
+
+            // mapped textures commonly pad rows, which forces a copy per row
+            UINT paddedPitch = (copy.rowBytes + 255) / 256 * 256 + 64;
+            std::vector<uint8_t> dest(paddedPitch * copy.rows);
+
+            for (int padded = 0; padded < 2; ++padded)
+            {
+                UINT destPitch = padded ? paddedPitch : copy.rowBytes;
+
+                BenchmarkResult result;
+                result.szBenchmark = copy.szBenchmark;
+                result.szVariant = padded ? "padded" : "packed";
+                result.szFrame = frame.szName;
+                result.szUnit = "pixel";
+                result.threads = 1;
+                result.items = copy.pixels;
+
+                // read and written once
+                result.bytes = 2.0 * copy.rowBytes * copy.rows;
+
+                TimeRuns(iterations, [&]() { CopyImageRows(&dest[0], destPitch, copy.pSrc, copy.rowBytes, copy.rowBytes, copy.rows); },
+                    &result.medianNs, &result.minNs);
+                result.speedup = 1.0;
+
+                pResults->push_back(result);
+            }
+        }
+    }
+
+    /// <summary>
+    /// Time publishing frames into the shared memory ring, alone and with a reader on another
+    /// thread touching every depth pixel of every frame it gets
+    /// </summary>
+    void BenchmarkSharedFrameRing(const BenchmarkFrame& frame, int iterations, std::vector<BenchmarkResult>* pResults)
+    {
+        const UINT cSlotCount = 4;
+        const int cFrames = 100;
+
+        WCHAR name[64];
+        swprintf_s(name, L"Local\\DepthWithColorBench%lu", GetCurrentProcessId());
+
+        CSharedFrameWriter writer;
+        if (FAILED(writer.Create(name, cSlotCount, frame.depthWidth, frame.depthHeight, frame.colorWidth, frame.colorHeight)))
+        {
+            fputs("Could not create the shared frame ring, skipping it\n", stderr);
+            return;
+        }
+
+        UINT depthRowBytes = static_cast<UINT>(frame.depthWidth * sizeof(USHORT));
+        UINT colorRowBytes = static_cast<UINT>(frame.colorWidth * 4);
+        double frameBytes = static_cast<double>(depthRowBytes) * frame.depthHeight + static_cast<double>(colorRowBytes) * frame.colorHeight;
+
+        for (int withReader = 0; withReader < 2; ++withReader)
+        {
+            std::atomic<bool> stop(false);
+            std::thread readerThread;
+            if (withReader)
+            {
+                readerThread = std::thread([&]()
+                {
+                    CSharedFrameReader reader;
+                    if (FAILED(reader.Open(name)))
+                    {
+                        return;
+                    }
+
+                    volatile UINT sink = 0;
+                    SharedFrameView view;
+                    while (!stop.load())
+                    {
+                        if (!reader.AcquireNext(&view))
+                        {
+                            std::this_thread::yield();
+                            continue;
+                        }
+
+                        UINT sum = 0;
+                        for (int i = 0; i < frame.depthWidth * frame.depthHeight; ++i)
+                        {
+                            sum += view.pDepth[i];
+                        }
+
+                        if (reader.Validate(view))
+                        {
+                            sink = sink + sum;
+                        }
+                    }
+                });
+            }
+
+            BenchmarkResult result;
+            result.szBenchmark = "shared_frame_ring";
+            result.szVariant = withReader ? "publish_with_reader" : "publish";
+            result.szFrame = frame.szName;
+            result.szUnit = "frame";
+            result.threads = withReader ? 2 : 1;
+            result.items = cFrames;
+            result.bytes = frameBytes * cFrames;
+
+            TimeRuns(iterations, [&]()
+            {
+                for (int f = 0; f < cFrames; ++f)
+                {
+                    SharedFrameSlot slot;
+                    writer.BeginFrame(&slot);
+                    slot.pInfo->depthFrameNumber = f;
+                    CopyImageRows(slot.pDepth, depthRowBytes, &frame.depth[0], depthRowBytes, depthRowBytes, static_cast<UINT>(frame.depthHeight));
+                    CopyImageRows(slot.pColor, colorRowBytes, &frame.color[0], colorRowBytes, colorRowBytes, static_cast<UINT>(frame.colorHeight));
+                    writer.EndFrame();
+                }
+            }, &result.medianNs, &result.minNs);
+            result.speedup = 1.0;
+
+            stop.store(true);
+            if (readerThread.joinable())
+            {
+                readerThread.join();
+            }
+
+            pResults->push_back(result);
+        }
+    }
+
+    /// <summary>
+    /// Time compressing and decompressing depth for recordings, each frame alone and as the
+    /// difference to the previous one. Bytes are those of the raw frame, so the rate compares
+    /// with copy_depth.
+    /// </summary>
+    void BenchmarkDepthCodec(const BenchmarkFrame& frame, int iterations, std::vector<BenchmarkResult>* pResults)
+    {
+        struct CodecVariant
+        {
+            const char*                 szName;
+            EncodeDepthFunc             encode;
+            DecodeDepthFunc             decode;
+        };
+
+        const CodecVariant variants[] =
+        {
+            { "scalar", EncodeDepthScalar, DecodeDepthScalar },
+            { "sse2", EncodeDepthSSE2, DecodeDepthSSE2 },
+        };
+
+        size_t pixelCount = frame.depth.size();
+        double rawBytes = static_cast<double>(pixelCount * sizeof(USHORT));
+
+        // the next frame of a mostly still scene, every fourth row moved by a millimeter
+        std::vector<USHORT> next(frame.depth);
+        for (int y = 0; y < frame.depthHeight; y += 4)
+        {
+            for (int x = 0; x < frame.depthWidth; ++x)
+            {
+                USHORT& pixel = next[y * frame.depthWidth + x];
+                pixel = pixel ? static_cast<USHORT>(pixel + (1 << 3)) : 0;
+            }
+        }
+
+        std::vector<uint32_t> encoded((DepthCodecMaxEncodedSize(pixelCount) + 3) / 4);
+        std::vector<USHORT> decoded(pixelCount);
+        uint8_t* pEncoded = reinterpret_cast<uint8_t*>(&encoded[0]);
+
+        for (int delta = 0; delta < 2; ++delta)
+        {
+            const USHORT* pDepth = delta ? &next[0] : &frame.depth[0];
+            const USHORT* pReference = delta ? &frame.depth[0] : NULL;
+
+            double scalarEncodeNs = 0.0;
+            double scalarDecodeNs = 0.0;
+
+            for (size_t v = 0; v < _countof(variants); ++v)
+            {
+                const CodecVariant& variant = variants[v];
+                size_t size = variant.encode(pDepth, pReference, pixelCount, pEncoded);
+
+                BenchmarkResult result;
+                result.szBenchmark = delta ? "depth_encode_delta" : "depth_encode";
+                result.szVariant = variant.szName;
+                result.szFrame = frame.szName;
+                result.szUnit = "pixel";
+                result.threads = 1;
+                result.items = static_cast<double>(pixelCount);
+                result.bytes = rawBytes;
+
+                TimeRuns(iterations, [&]() { variant.encode(pDepth, pReference, pixelCount, pEncoded); },
+                    &result.medianNs, &result.minNs);
+                if (0 == v)
+                {
+                    scalarEncodeNs = result.medianNs;
+                }
+                result.speedup = scalarEncodeNs > 0.0 ? scalarEncodeNs / result.medianNs : 1.0;
+
+                pResults->push_back(result);
+
+                result.szBenchmark = delta ? "depth_decode_delta" : "depth_decode";
+
+                TimeRuns(iterations, [&]() { variant.decode(pEncoded, size, pReference, pixelCount, &decoded[0]); },
+                    &result.medianNs, &result.minNs);
+                if (0 == v)
+                {
+                    scalarDecodeNs = result.medianNs;
+                }
+                result.speedup = scalarDecodeNs > 0.0 ? scalarDecodeNs / result.medianNs : 1.0;
+
+                pResults->push_back(result);
+            }
+
+            fprintf(stderr, "%s: depth compressed %.2f:1%s\n", frame.szName,
+                rawBytes / variants[0].encode(pDepth, pReference, pixelCount, pEncoded), delta ? " against the previous frame" : "");
+        }
+    }
+
+    struct BenchmarkVector
+    {
+        float                           x;
+        float                           y;
+        float                           z;
+    };
+
+    /// <summary>
+    /// Time the face tracking hint selection, with and without a previous head position
+    /// </summary>
+    void BenchmarkClosestSkeleton(int iterations, std::vector<BenchmarkResult>* pResults)
+    {
+        const int cCalls = 100000;
+        volatile int sink = 0;
+
+        bool tracked[NUI_SKELETON_COUNT] = { true, false, true, true, false, true };
+        BenchmarkVector heads[NUI_SKELETON_COUNT];
+        for (int i = 0; i < NUI_SKELETON_COUNT; ++i)
+        {
+            heads[i].x = 0.3f * i - 0.8f;
+            heads[i].y = 0.4f + 0.01f * i;
+            heads[i].z = 2.5f - 0.2f * i;
+        }
+
+        for (int withPrevious = 0; withPrevious < 2; ++withPrevious)
+        {
+            BenchmarkVector previous = { 0.0f, 0.0f, 0.0f };
+            if (withPrevious)
+            {
+                previous = heads[2];
+            }
+
+            BenchmarkResult result;
+            result.szBenchmark = "get_closest_hint";
+            result.szVariant = withPrevious ? "previous_head" : "closest_to_camera";
+            result.szFrame = "synthetic";
+            result.szUnit = "call";
+            result.threads = 1;
+            result.items = cCalls;
+            result.bytes = static_cast<double>(cCalls) * (sizeof(tracked) + sizeof(heads));
+
+            TimeRuns(iterations, [&]()
+            {
+                for (int i = 0; i < cCalls; ++i)
+                {
+                    // nudge the input so the loop can't be hoisted
+                    previous.x += withPrevious ? 1e-7f : 0.0f;
+                    sink = sink + SelectClosestSkeleton(tracked, heads, NUI_SKELETON_COUNT, previous);
+                }
+            }, &result.medianNs, &result.minNs);
+            result.speedup = 1.0;
+
+            pResults->push_back(result);
+        }
+    }
+
+    /// <summary>
+    /// Time the skeleton smoothing kernels on every joint of six tracked skeletons
+    /// </summary>
+    void BenchmarkSkeletonSmoother(int iterations, std::vector<BenchmarkResult>* pResults)
+    {
+        struct Variant
+        {
+            const char*                 szName;
+            SmoothJointsFunc            pfnSmooth;
+        };
+
+        const Variant variants[] =
+        {
+            { "scalar", SmoothJointsScalar },
+            { "sse2", SmoothJointsSSE2 },
+        };
+
+        const int cJoints = CSkeletonSmoother::cJointCount;
+        const int cFrames = 1000;
+
+        // out, raw, valid, five parameters, history and twelve state streams
+        std::vector<float> streams[22];
+        for (size_t i = 0; i < _countof(streams); ++i)
+        {
+            streams[i].assign(cJoints, 0.0f);
+        }
+
+        SkeletonJointSmoothing params;
+        for (int i = 0; i < cJoints; ++i)
+        {
+            streams[3][i] = 0.1f * (i % 5);
+            streams[4][i] = 1.0f + 0.02f * (i % NUI_SKELETON_POSITION_COUNT);
+            streams[5][i] = 2.0f;
+            streams[6][i] = 1.0f;
+            streams[7][i] = params.smoothing;
+            streams[8][i] = params.correction;
+            streams[9][i] = params.prediction;
+            streams[10][i] = params.jitterRadius;
+            streams[11][i] = params.maxDeviationRadius;
+        }
+
+        SkeletonJointStreams s;
+        s.count = cJoints;
+        s.pRawX = &streams[3][0];
+        s.pRawY = &streams[4][0];
+        s.pRawZ = &streams[5][0];
+        s.pOutX = &streams[0][0];
+        s.pOutY = &streams[1][0];
+        s.pOutZ = &streams[2][0];
+        s.pValid = &streams[6][0];
+        s.pSmoothing = &streams[7][0];
+        s.pCorrection = &streams[8][0];
+        s.pPrediction = &streams[9][0];
+        s.pJitterRadius = &streams[10][0];
+        s.pMaxDeviation = &streams[11][0];
+        s.pHistory = &streams[12][0];
+        s.pPrevRawX = &streams[13][0];
+        s.pPrevRawY = &streams[14][0];
+        s.pPrevRawZ = &streams[15][0];
+        s.pFilteredX = &streams[16][0];
+        s.pFilteredY = &streams[17][0];
+        s.pFilteredZ = &streams[18][0];
+        s.pTrendX = &streams[19][0];
+        s.pTrendY = &streams[20][0];
+        s.pTrendZ = &streams[21][0];
+
+        double scalarNs = 0.0;
+        for (size_t v = 0; v < _countof(variants); ++v)
+        {
+            BenchmarkResult result;
+            result.szBenchmark = "smooth_skeleton";
+            result.szVariant = variants[v].szName;
+            result.szFrame = "synthetic";
+            result.szUnit = "joint";
+            result.threads = 1;
+            result.items = static_cast<double>(cJoints) * cFrames;
+            result.bytes = result.items * 3 * sizeof(float) * 2;
+
+            TimeRuns(iterations, [&]()
+            {
+                for (int f = 0; f < cFrames; ++f)
+                {
+                    variants[v].pfnSmooth(s);
+                }
+            }, &result.medianNs, &result.minNs);
+
+            if (0 == v)
+            {
+                scalarNs = result.medianNs;
+            }
+            result.speedup = scalarNs / result.medianNs;
+
+            pResults->push_back(result);
+        }
+    }
+
+    /// <summary>
+    /// Prediction error of one head pose predictor tuning on a recorded trace
+    /// </summary>
+    struct PosePredictionResult
+    {
+        HeadPosePredictorParams         params;
+        double                          latencyMs;
+        HeadPosePredictionError         error;
+    };
+
+    /// <summary>
+    /// Score a grid of smoothing and lead settings on a recorded pose trace
+    /// </summary>
+    void EvaluatePoseTrace(const std::vector<HeadPoseSample>& trace, double latencyMs, std::vector<PosePredictionResult>* pResults)
+    {
+        const float cMinCutoffs[] = { 0.5f, 1.0f, 2.0f };
+        const float cBetas[] = { 0.0f, 10.0f, 20.0f };
+        const float cLeadScales[] = { 0.0f, 0.5f, 1.0f };
+
+        for (size_t c = 0; c < _countof(cMinCutoffs); ++c)
+        {
+            for (size_t b = 0; b < _countof(cBetas); ++b)
+            {
+                for (size_t l = 0; l < _countof(cLeadScales); ++l)
+                {
+                    PosePredictionResult result;
+                    result.params.minCutoff = cMinCutoffs[c];
+                    result.params.beta = cBetas[b];
+                    result.params.leadScale = cLeadScales[l];
+                    result.latencyMs = latencyMs;
+                    if (EvaluateHeadPosePredictor(&trace[0], trace.size(), result.params, latencyMs, &result.error))
+                    {
+                        pResults->push_back(result);
+                    }
+                }
+            }
+        }
+    }
+
+    /// <summary>
+    /// Self-test of a module and the benchmarks whose timings depend on it being right
+    /// </summary>
+    struct SelfTest
+    {
+        bool                            (*pfnVerify)();
+        const char*                     szFailure;
+
+        // NULL terminated, empty for modules with no benchmark of their own
+        const char*                     szBenchmarks[5];
+    };
+
+    const SelfTest cSelfTests[] =
+    {
+        { VerifyMapColorToDepth, "MapColorToDepth implementations disagree", { "map_color_to_depth" } },
+        { VerifyPointCloud, "GeneratePointCloud implementations disagree", { "generate_point_cloud", "merge_point_clouds", "build_point_indices" } },
+        { VerifyStereoSplats, "Single pass stereo disagrees with drawing each eye", { "software_render" } },
+        { VerifyHeadTrackingWorker, "Face tracking worker does not skip to the newest frame", { NULL } },
+        { VerifyFrameBufferPool, "Frame buffer pool does not align, share or recycle its buffers", { NULL } },
+        { VerifySkeletonSmoother, "Skeleton smoothing implementations disagree", { "smooth_skeleton" } },
+        { VerifyHeadPosePredictor, "Head pose prediction does not improve on the raw positions", { NULL } },
+        { VerifySharedFrameRing, "Shared frame ring readers see torn or missing frames", { "shared_frame_ring" } },
+        { VerifyDepthCodec, "Depth frames do not survive compression unchanged", { "depth_encode", "depth_decode", "depth_encode_delta", "depth_decode_delta" } },
+        { VerifyTsdfVolume, "Fused surface is off the synthetic planes or eviction exceeds the budget", { "tsdf_integrate", "tsdf_extract" } },
+    };
+
+    void WriteResults(FILE* pFile, const std::vector<BenchmarkResult>& results, const std::vector<const char*>& unverifiedBenchmarks, int failedTests,
+        const std::vector<PosePredictionResult>& predictions, unsigned int hardwareThreads, int iterations)
+    {
+        const CpuFeatures& features = GetCpuFeatures();
+
+        fprintf(pFile, "{\n  \"sse41\": %s,\n  \"avx2\": %s,\n  \"hardwareThreads\": %u,\n  \"iterations\": %d,\n  \"failedSelfTests\": %d,\n  \"results\": [\n",
+            features.bSSE41 ? "true" : "false", features.bAVX2 ? "true" : "false", hardwareThreads, iterations, failedTests);
+
+        for (size_t i = 0; i < results.size(); ++i)
+        {
+            const BenchmarkResult& result = results[i];
+
+            // timings of code that gives wrong results are kept but must not be compared
+            bool bVerified = true;
+            for (size_t u = 0; u < unverifiedBenchmarks.size(); ++u)
+            {
+                bVerified = bVerified && 0 != strcmp(unverifiedBenchmarks[u], result.szBenchmark);
+            }
+
+            fprintf(pFile, "    {\"benchmark\": \"%s\", \"variant\": \"%s\", \"frame\": \"%s\", \"threads\": %u, "
+                "\"unit\": \"%s\", \"items\": %.0f, \"median_ns\": %.0f, \"min_ns\": %.0f, "
+                "\"ns_per_item\": %.4f, \"bytes_per_second\": %.0f, \"speedup\": %.3f, \"verified\": %s}%s\n",
+                result.szBenchmark, result.szVariant, result.szFrame, result.threads,
+                result.szUnit, result.items, result.medianNs, result.minNs,
+                result.medianNs / result.items, result.bytes / (result.medianNs * 1e-9), result.speedup,
+                bVerified ? "true" : "false",
+                i + 1 < results.size() ? "," : "");
+        }
+
+        fputs("  ]", pFile);
+
+        if (!predictions.empty())
+        {
+            fputs(",\n  \"posePrediction\": [\n", pFile);
+            for (size_t i = 0; i < predictions.size(); ++i)
+            {
+                const PosePredictionResult& result = predictions[i];
+                fprintf(pFile, "    {\"min_cutoff\": %.2f, \"beta\": %.1f, \"derivative_cutoff\": %.2f, \"lead_scale\": %.2f, "
+                    "\"latency_ms\": %.1f, \"samples\": %u, \"rms_error_m\": %.5f, \"max_error_m\": %.5f, \"jitter_m_per_s\": %.4f}%s\n",
+                    result.params.minCutoff, result.params.beta, result.params.derivativeCutoff, result.params.leadScale,
+                    result.latencyMs, static_cast<unsigned int>(result.error.count), result.error.rmsError, result.error.maxError, result.error.jitter,
+                    i + 1 < predictions.size() ? "," : "");
+            }
+
+            fputs("  ]", pFile);
+        }
+
+        fputs("\n}\n", pFile);
+    }
+}
+
+/// <summary>
+/// Entry point for the benchmark
+/// </summary>
+/// <param name="argc">number of arguments</param>
+/// <param name="argv">arguments</param>
+/// <returns>0 on success, 1 for bad arguments or files, 2 if a self-test failed</returns>
+int wmain(int argc, wchar_t* argv[])
+{
+    LPCWSTR szReplayFile = NULL;
+    LPCWSTR szOutputFile = NULL;
+    LPCWSTR szPoseTraceFile = NULL;
+    double poseLatencyMs = 60.0;
+    int iterations = 50;
+    unsigned int maxThreads = std::thread::hardware_concurrency();
+    if (0 == maxThreads)
+    {
+        maxThreads = 1;
+    }
+
+    for (int i = 1; i < argc; ++i)
+    {
+        bool hasValue = (i + 1 < argc);
+
+        if (0 == _wcsicmp(argv[i], L"-replay") && hasValue)
+        {
+            szReplayFile = argv[++i];
+        }
+        else if (0 == _wcsicmp(argv[i], L"-out") && hasValue)
+        {
+            szOutputFile = argv[++i];
+        }
+        else if (0 == _wcsicmp(argv[i], L"-posetrace") && hasValue)
+        {
+            szPoseTraceFile = argv[++i];
+        }
+        else if (0 == _wcsicmp(argv[i], L"-poselatency") && hasValue && _wtof(argv[i + 1]) > 0.0)
+        {
+            poseLatencyMs = _wtof(argv[++i]);
+        }
+        else if (0 == _wcsicmp(argv[i], L"-iterations") && hasValue && _wtoi(argv[i + 1]) > 0)
+        {
+            iterations = _wtoi(argv[++i]);
+        }
+        else if (0 == _wcsicmp(argv[i], L"-threads") && hasValue && _wtoi(argv[i + 1]) > 0)
+        {
+            maxThreads = static_cast<unsigned int>(_wtoi(argv[++i]));
+        }
+        else
+        {
+            fputs("Usage: DepthWithColor-Bench [-replay <file>] [-out <file>] [-iterations <n>] [-threads <n>] [-posetrace <file> [-poselatency <ms>]]\n", stderr);
+            return 1;
+        }
+    }
+
+    std::vector<BenchmarkFrame> frames(1);
+    BuildSyntheticFrame(&frames[0]);
+
+    if (NULL != szReplayFile)
+    {
+        BenchmarkFrame recorded;
+        HRESULT hr = LoadRecordedFrame(szReplayFile, &recorded);
+        if (FAILED(hr))
+        {
+            fprintf(stderr, "Could not load a frame from the recording, error 0x%08lx\n", hr);
+            return 1;
+        }
+        frames.push_back(recorded);
+    }
+
+    // the self-tests are the only tests of these modules, a failure fails the run
+    std::vector<const char*> unverifiedBenchmarks;
+    int failedTests = 0;
+    for (size_t t = 0; t < _countof(cSelfTests); ++t)
+    {
+        if (cSelfTests[t].pfnVerify())
+        {
+            continue;
+        }
+
+        fprintf(stderr, "%s\n", cSelfTests[t].szFailure);
+        ++failedTests;
+        for (size_t b = 0; b < _countof(cSelfTests[t].szBenchmarks) && NULL != cSelfTests[t].szBenchmarks[b]; ++b)
+        {
+            unverifiedBenchmarks.push_back(cSelfTests[t].szBenchmarks[b]);
+        }
+    }
+
+    std::vector<PosePredictionResult> predictions;
+    if (NULL != szPoseTraceFile)
+    {
+        std::vector<HeadPoseSample> trace;
+        FILE* pTraceFile = NULL;
+        bool bRead = (0 == _wfopen_s(&pTraceFile, szPoseTraceFile, L"r")) && ReadHeadPoseTrace(pTraceFile, &trace);
+        if (NULL != pTraceFile)
+        {
+            fclose(pTraceFile);
+        }
+
+        if (!bRead || trace.empty())
+        {
+            fputs("Could not read the pose trace\n", stderr);
+            return 1;
+        }
+
+        EvaluatePoseTrace(trace, poseLatencyMs, &predictions);
+    }
+
+    std::vector<unsigned int> threadCounts = GetThreadCounts(maxThreads);
+    std::vector<BenchmarkResult> results;
+
+    for (size_t f = 0; f < frames.size(); ++f)
+    {
+        BenchmarkMapColorToDepth(frames[f], threadCounts, iterations, &results);
+        BenchmarkPointCloud(frames[f], threadCounts, iterations, &results);
+        BenchmarkSoftwareRenderer(frames[f], threadCounts, iterations, &results);
+        BenchmarkTsdfVolume(frames[f], threadCounts, iterations, &results);
+        BenchmarkCopies(frames[f], iterations, &results);
+        BenchmarkSharedFrameRing(frames[f], iterations, &results);
+        BenchmarkDepthCodec(frames[f], iterations, &results);
+    }
+
+    BenchmarkClosestSkeleton(iterations, &results);
+    BenchmarkSkeletonSmoother(iterations, &results);
+
+    FILE* pFile = stdout;
+    if (NULL != szOutputFile && 0 != _wfopen_s(&pFile, szOutputFile, L"w"))
+    {
+        fputs("Could not open the output file\n", stderr);
+        return 1;
+    }
+
+    WriteResults(pFile, results, unverifiedBenchmarks, failedTests, predictions, maxThreads, iterations);
+
+    if (stdout != pFile)
+    {
+        fclose(pFile);
+    }
+
+    return (0 == failedTests) ? 0 : 2;
+}
@@ -0,0 +1,528 @@
+﻿//------------------------------------------------------------------------------
+// <copyright file="ColorMapping.cpp" company="Microsoft">
+//     Copyright (c) Microsoft Corporation.  All rights reserved.
+// </copyright>
+//------------------------------------------------------------------------------
+
+#include "ColorMapping.h"
+#include "CpuFeatures.h"
+#include "FrameProfiler.h"
+#include "WorkerPool.h"
+
+#include <string.h>
+#include <vector>
+#include <immintrin.h>
+
+namespace
+{
+    /// <summary>
+    /// log2 of the divisor, or -1 if it isn't a power of two
+    /// The vector kernels index depth columns with a shift instead of a division
+    /// </summary>
+    int DivisorShift(int divisor)
+    {
+        for (int shift = 0; shift < 31; ++shift)
+        {
+            if ((1 << shift) == divisor)
+            {
+                return shift;
+            }
+        }
+
+        return -1;
+    }
+
+    /// <summary>
+    /// Image sizes a kernel is compiled for
+    /// A size of 0, or a shift of -1, is read from the description at run time instead, so the
+    /// specializations for the sensor's resolutions get their strides and bounds as constants
+    /// </summary>
+    template <int cColorWidth, int cColorHeight, int cDepthWidth, int cShift>
+    struct MappingShape
+    {
+        static int ColorWidth(const ColorMappingDesc& desc) { return cColorWidth ? cColorWidth : desc.colorWidth; }
+        static int ColorHeight(const ColorMappingDesc& desc) { return cColorHeight ? cColorHeight : desc.colorHeight; }
+        static int DepthWidth(const ColorMappingDesc& desc) { return cDepthWidth ? cDepthWidth : desc.depthWidth; }
+        static int Divisor(const ColorMappingDesc& desc) { return cShift >= 0 ? 1 << cShift : desc.colorToDepthDivisor; }
+        static int Shift(const ColorMappingDesc& desc) { return cShift >= 0 ? cShift : DivisorShift(desc.colorToDepthDivisor); }
+    };
+
+    typedef MappingShape<0, 0, 0, -1> RuntimeShape;
+
+    /// <summary>
+    /// Remap a single pixel
+    /// </summary>
+    inline uint32_t MapPixel(const ColorMappingDesc& desc, int depthIndex, int colorWidth, int colorHeight)
+    {
+        // retrieve the depth to color mapping for the current depth pixel
+        int32_t colorInDepthX = desc.pColorCoordinates[depthIndex * 2];
+        int32_t colorInDepthY = desc.pColorCoordinates[depthIndex * 2 + 1];
+
+        // make sure the depth pixel maps to a valid point in color space
+        if ( colorInDepthX >= 0 && colorInDepthX < colorWidth && colorInDepthY >= 0 && colorInDepthY < colorHeight )
+        {
+            // calculate index into color array
+            int32_t colorIndex = colorInDepthX + colorInDepthY * colorWidth;
+            return reinterpret_cast<const uint32_t*>(desc.pColor)[colorIndex];
+        }
+
+        return 0;
+    }
+
+    template <class Shape>
+    void MapColorToDepthScalarT(const ColorMappingDesc& desc, uint8_t* pDest, size_t destPitch, int rowBegin, int rowEnd)
+    {
+        const int colorWidth = Shape::ColorWidth(desc);
+        const int colorHeight = Shape::ColorHeight(desc);
+        const int depthWidth = Shape::DepthWidth(desc);
+        const int divisor = Shape::Divisor(desc);
+
+        // loop over each row and column of the color
+        for (int y = rowBegin; y < rowEnd; ++y)
+        {
+            uint32_t* pOut = reinterpret_cast<uint32_t*>(pDest + destPitch * y);
+            for (int x = 0; x < colorWidth; ++x)
+            {
+                // calculate index into depth array
+                int depthIndex = x/divisor + y/divisor * depthWidth;
+
+                pOut[x] = MapPixel(desc, depthIndex, colorWidth, colorHeight);
+            }
+        }
+    }
+
+    template <class Shape>
+    CPU_TARGET_SSE41
+    void MapColorToDepthSSE41T(const ColorMappingDesc& desc, uint8_t* pDest, size_t destPitch, int rowBegin, int rowEnd)
+    {
+        const int shift = Shape::Shift(desc);
+        if (shift < 0)
+        {
+            MapColorToDepthScalarT<Shape>(desc, pDest, destPitch, rowBegin, rowEnd);
+            return;
+        }
+
+        const int colorWidth = Shape::ColorWidth(desc);
+        const int colorHeight = Shape::ColorHeight(desc);
+        const int depthWidth = Shape::DepthWidth(desc);
+
+        const uint32_t* pColor = reinterpret_cast<const uint32_t*>(desc.pColor);
+        const __m128i zero = _mm_setzero_si128();
+        const __m128i width = _mm_set1_epi32(colorWidth);
+        const __m128i height = _mm_set1_epi32(colorHeight);
+
+        for (int y = rowBegin; y < rowEnd; ++y)
+        {
+            uint32_t* pOut = reinterpret_cast<uint32_t*>(pDest + destPitch * y);
+            int depthRow = (y >> shift) * depthWidth;
+
+            int x = 0;
+            for (; x + 4 <= colorWidth; x += 4)
+            {
+                __m128i cx, cy;
+                if (0 == shift)
+                {
+                    // four consecutive depth pixels, split the x, y pairs apart
+                    const float* pPairs = reinterpret_cast<const float*>(desc.pColorCoordinates + 2 * (depthRow + x));
+                    __m128 a = _mm_loadu_ps(pPairs);
+                    __m128 b = _mm_loadu_ps(pPairs + 4);
+                    cx = _mm_castps_si128(_mm_shuffle_ps(a, b, _MM_SHUFFLE(2, 0, 2, 0)));
+                    cy = _mm_castps_si128(_mm_shuffle_ps(a, b, _MM_SHUFFLE(3, 1, 3, 1)));
+                }
+                else
+                {
+                    const int32_t* p0 = desc.pColorCoordinates + 2 * (depthRow + ((x + 0) >> shift));
+                    const int32_t* p1 = desc.pColorCoordinates + 2 * (depthRow + ((x + 1) >> shift));
+                    const int32_t* p2 = desc.pColorCoordinates + 2 * (depthRow + ((x + 2) >> shift));
+                    const int32_t* p3 = desc.pColorCoordinates + 2 * (depthRow + ((x + 3) >> shift));
+                    cx = _mm_setr_epi32(p0[0], p1[0], p2[0], p3[0]);
+                    cy = _mm_setr_epi32(p0[1], p1[1], p2[1], p3[1]);
+                }
+
+                // 0 <= cx < width && 0 <= cy < height
+                __m128i valid = _mm_and_si128(
+                    _mm_andnot_si128(_mm_cmpgt_epi32(zero, cx), _mm_cmpgt_epi32(width, cx)),
+                    _mm_andnot_si128(_mm_cmpgt_epi32(zero, cy), _mm_cmpgt_epi32(height, cy)));
+
+                // out of range lanes read pixel 0 and are cleared afterwards
+                __m128i colorIndex = _mm_and_si128(_mm_add_epi32(cx, _mm_mullo_epi32(cy, width)), valid);
+
+                __m128i pixels = _mm_setr_epi32(
+                    pColor[_mm_extract_epi32(colorIndex, 0)],
+                    pColor[_mm_extract_epi32(colorIndex, 1)],
+                    pColor[_mm_extract_epi32(colorIndex, 2)],
+                    pColor[_mm_extract_epi32(colorIndex, 3)]);
+
+                _mm_storeu_si128(reinterpret_cast<__m128i*>(pOut + x), _mm_and_si128(pixels, valid));
+            }
+
+            for (; x < colorWidth; ++x)
+            {
+                pOut[x] = MapPixel(desc, depthRow + (x >> shift), colorWidth, colorHeight);
+            }
+        }
+    }
+
+    template <class Shape>
+    CPU_TARGET_AVX2
+    void MapColorToDepthAVX2T(const ColorMappingDesc& desc, uint8_t* pDest, size_t destPitch, int rowBegin, int rowEnd)
+    {
+        const int shift = Shape::Shift(desc);
+        if (shift < 0)
+        {
+            MapColorToDepthScalarT<Shape>(desc, pDest, destPitch, rowBegin, rowEnd);
+            return;
+        }
+
+        const int colorWidth = Shape::ColorWidth(desc);
+        const int colorHeight = Shape::ColorHeight(desc);
+        const int depthWidth = Shape::DepthWidth(desc);
+
+        const int* pCoordinates = reinterpret_cast<const int*>(desc.pColorCoordinates);
+        const int* pColor = reinterpret_cast<const int*>(desc.pColor);
+        const __m256i zero = _mm256_setzero_si256();
+        const __m256i width = _mm256_set1_epi32(colorWidth);
+        const __m256i height = _mm256_set1_epi32(colorHeight);
+        const __m256i lanes = _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7);
+        const __m256i deinterleave = _mm256_setr_epi32(0, 2, 4, 6, 1, 3, 5, 7);
+
+        for (int y = rowBegin; y < rowEnd; ++y)
+        {
+            uint32_t* pOut = reinterpret_cast<uint32_t*>(pDest + destPitch * y);
+            int depthRow = (y >> shift) * depthWidth;
+            const __m256i depthRowBase = _mm256_set1_epi32(depthRow);
+
+            int x = 0;
+            for (; x + 8 <= colorWidth; x += 8)
+            {
+                __m256i cx, cy;
+                if (0 == shift)
+                {
+                    // eight consecutive depth pixels, split the x, y pairs apart
+                    const __m256i* pPairs = reinterpret_cast<const __m256i*>(pCoordinates + 2 * (depthRow + x));
+                    __m256i a = _mm256_permutevar8x32_epi32(_mm256_loadu_si256(pPairs), deinterleave);
+                    __m256i b = _mm256_permutevar8x32_epi32(_mm256_loadu_si256(pPairs + 1), deinterleave);
+                    cx = _mm256_permute2x128_si256(a, b, 0x20);
+                    cy = _mm256_permute2x128_si256(a, b, 0x31);
+                }
+                else
+                {
+                    __m256i column = _mm256_srli_epi32(_mm256_add_epi32(_mm256_set1_epi32(x), lanes), shift);
+                    __m256i pairIndex = _mm256_slli_epi32(_mm256_add_epi32(column, depthRowBase), 1);
+                    cx = _mm256_i32gather_epi32(pCoordinates, pairIndex, 4);
+                    cy = _mm256_i32gather_epi32(pCoordinates + 1, pairIndex, 4);
+                }
+
+                // 0 <= cx < width && 0 <= cy < height
+                __m256i valid = _mm256_and_si256(
+                    _mm256_andnot_si256(_mm256_cmpgt_epi32(zero, cx), _mm256_cmpgt_epi32(width, cx)),
+                    _mm256_andnot_si256(_mm256_cmpgt_epi32(zero, cy), _mm256_cmpgt_epi32(height, cy)));
+
+                // masked off lanes are neither loaded nor written, they keep the zero source
+                __m256i colorIndex = _mm256_add_epi32(cx, _mm256_mullo_epi32(cy, width));
+                __m256i pixels = _mm256_mask_i32gather_epi32(zero, pColor, colorIndex, valid, 4);
+
+                _mm256_storeu_si256(reinterpret_cast<__m256i*>(pOut + x), pixels);
+            }
+
+            for (; x < colorWidth; ++x)
+            {
+                pOut[x] = MapPixel(desc, depthRow + (x >> shift), colorWidth, colorHeight);
+            }
+        }
+    }
+
+    /// <summary>
+    /// Kernels compiled for one pair of sensor resolutions
+    /// </summary>
+    struct SpecializedMapping
+    {
+        int                             colorWidth;
+        int                             colorHeight;
+        int                             depthWidth;
+        MapColorToDepthFunc             pfnScalar;
+        MapColorToDepthFunc             pfnSSE41;
+        MapColorToDepthFunc             pfnAVX2;
+    };
+
+#define SPECIALIZED_MAPPING(colorWidth, colorHeight, depthWidth, shift) \
+    { colorWidth, colorHeight, depthWidth, \
+      MapColorToDepthScalarT< MappingShape<colorWidth, colorHeight, depthWidth, shift> >, \
+      MapColorToDepthSSE41T< MappingShape<colorWidth, colorHeight, depthWidth, shift> >, \
+      MapColorToDepthAVX2T< MappingShape<colorWidth, colorHeight, depthWidth, shift> > }
+
+    // every color resolution the sensor offers, with the depth resolutions at most as large
+    const SpecializedMapping cSpecializedMappings[] =
+    {
+        SPECIALIZED_MAPPING(640, 480, 640, 0),
+        SPECIALIZED_MAPPING(640, 480, 320, 1),
+        SPECIALIZED_MAPPING(1280, 960, 640, 1),
+        SPECIALIZED_MAPPING(1280, 960, 320, 2),
+    };
+
+#undef SPECIALIZED_MAPPING
+
+    const SpecializedMapping* FindSpecializedMapping(int colorWidth, int colorHeight, int depthWidth)
+    {
+        for (size_t i = 0; i < sizeof(cSpecializedMappings) / sizeof(cSpecializedMappings[0]); ++i)
+        {
+            const SpecializedMapping& mapping = cSpecializedMappings[i];
+            if (mapping.colorWidth == colorWidth && mapping.colorHeight == colorHeight && mapping.depthWidth == depthWidth)
+            {
+                return &mapping;
+            }
+        }
+
+        return NULL;
+    }
+
+    /// <summary>
+    /// Run an implementation on a band of rows and compare it with the scalar reference
+    /// </summary>
+    bool MatchesReference(MapColorToDepthFunc pfnMap, const ColorMappingDesc& desc, int rowEnd)
+    {
+        // pad the rows to check the pitch is honored
+        size_t pitch = desc.colorWidth * 4 + 20;
+        std::vector<uint8_t> expected(pitch * rowEnd, 0xcd);
+        std::vector<uint8_t> actual(pitch * rowEnd, 0xcd);
+
+        MapColorToDepthScalar(desc, &expected[0], pitch, 0, rowEnd);
+        pfnMap(desc, &actual[0], pitch, 0, rowEnd);
+
+        return 0 == memcmp(&expected[0], &actual[0], actual.size());
+    }
+
+    /// <summary>
+    /// Fill the coordinates and color of a synthetic remap, coordinates stray outside the image on all sides
+    /// </summary>
+    void FillMappingInputs(int colorWidth, int colorHeight, int depthPixels, unsigned int* pSeed, std::vector<int32_t>* pCoordinates, std::vector<uint32_t>* pColor)
+    {
+        unsigned int seed = *pSeed;
+
+        pCoordinates->resize(depthPixels * 2);
+        for (size_t i = 0; i < pCoordinates->size(); i += 2)
+        {
+            seed = seed * 1664525 + 1013904223;
+            (*pCoordinates)[i] = static_cast<int32_t>((seed >> 8) % (colorWidth + 20)) - 10;
+            seed = seed * 1664525 + 1013904223;
+            (*pCoordinates)[i + 1] = static_cast<int32_t>((seed >> 8) % (colorHeight + 20)) - 10;
+        }
+
+        pColor->resize(colorWidth * colorHeight);
+        for (size_t i = 0; i < pColor->size(); ++i)
+        {
+            seed = seed * 1664525 + 1013904223;
+            (*pColor)[i] = seed | 1;
+        }
+
+        *pSeed = seed;
+    }
+}
+
+/// <summary>
+/// Reference implementation, one pixel at a time
+/// </summary>
+void MapColorToDepthScalar(const ColorMappingDesc& desc, uint8_t* pDest, size_t destPitch, int rowBegin, int rowEnd)
+{
+    MapColorToDepthScalarT<RuntimeShape>(desc, pDest, destPitch, rowBegin, rowEnd);
+}
+
+/// <summary>
+/// SSE4.1 implementation, four pixels at a time
+/// </summary>
+CPU_TARGET_SSE41
+void MapColorToDepthSSE41(const ColorMappingDesc& desc, uint8_t* pDest, size_t destPitch, int rowBegin, int rowEnd)
+{
+    MapColorToDepthSSE41T<RuntimeShape>(desc, pDest, destPitch, rowBegin, rowEnd);
+}
+
+/// <summary>
+/// AVX2 implementation, eight pixels at a time using hardware gathers
+/// </summary>
+CPU_TARGET_AVX2
+void MapColorToDepthAVX2(const ColorMappingDesc& desc, uint8_t* pDest, size_t destPitch, int rowBegin, int rowEnd)
+{
+    MapColorToDepthAVX2T<RuntimeShape>(desc, pDest, destPitch, rowBegin, rowEnd);
+}
+
+/// <summary>
+/// Fastest implementation the running CPU supports compiled for exactly these image sizes
+/// </summary>
+/// <param name="colorWidth">width of the color image</param>
+/// <param name="colorHeight">height of the color image</param>
+/// <param name="depthWidth">width of the depth image</param>
+/// <returns>remap function, or NULL if the sizes are not a sensor resolution pair</returns>
+MapColorToDepthFunc GetSpecializedMapColorToDepthFunc(int colorWidth, int colorHeight, int depthWidth)
+{
+    const SpecializedMapping* pMapping = FindSpecializedMapping(colorWidth, colorHeight, depthWidth);
+    if (NULL == pMapping)
+    {
+        return NULL;
+    }
+
+    const CpuFeatures& features = GetCpuFeatures();
+
+    if (features.bAVX2)
+    {
+        return pMapping->pfnAVX2;
+    }
+
+    if (features.bSSE41)
+    {
+        return pMapping->pfnSSE41;
+    }
+
+    return pMapping->pfnScalar;
+}
+
+/// <summary>
+/// Pick the fastest implementation the running CPU supports for the given image sizes
+/// Sensor resolution pairs get a kernel compiled for them, other sizes a generic one
+/// </summary>
+/// <param name="colorWidth">width of the color image</param>
+/// <param name="colorHeight">height of the color image</param>
+/// <param name="depthWidth">width of the depth image</param>
+/// <returns>remap function</returns>
+MapColorToDepthFunc GetMapColorToDepthFunc(int colorWidth, int colorHeight, int depthWidth)
+{
+    MapColorToDepthFunc pfnMap = GetSpecializedMapColorToDepthFunc(colorWidth, colorHeight, depthWidth);
+    if (NULL != pfnMap)
+    {
+        return pfnMap;
+    }
+
+    const CpuFeatures& features = GetCpuFeatures();
+
+    if (features.bAVX2)
+    {
+        return MapColorToDepthAVX2;
+    }
+
+    if (features.bSSE41)
+    {
+        return MapColorToDepthSSE41;
+    }
+
+    return MapColorToDepthScalar;
+}
+
+namespace
+{
+    // Fewer rows than this aren't worth waking another thread for
+    const int cMinRowsPerBand = 16;
+
+    /// <summary>
+    /// Arguments of MapColorToDepthBand
+    /// </summary>
+    struct MapColorToDepthBands
+    {
+        MapColorToDepthFunc             pfnMap;
+        const ColorMappingDesc*         pDesc;
+        uint8_t*                        pDest;
+        size_t                          destPitch;
+    };
+
+    /// <summary>
+    /// Remap one band of rows, called from the worker pool
+    /// </summary>
+    /// <param name="pContext">MapColorToDepthBands describing the remap</param>
+    /// <param name="rowBegin">first row of the band</param>
+    /// <param name="rowEnd">one past the last row of the band</param>
+    void MapColorToDepthBand(void* pContext, int rowBegin, int rowEnd)
+    {
+        PROFILE_SCOPE("map color to depth band");
+
+        const MapColorToDepthBands* pBands = static_cast<const MapColorToDepthBands*>(pContext);
+        pBands->pfnMap(*pBands->pDesc, pBands->pDest, pBands->destPitch, rowBegin, rowEnd);
+    }
+}
+
+/// <summary>
+/// Remap the whole color image into depth space, split into bands of rows on the worker pool
+/// </summary>
+/// <param name="desc">remap inputs</param>
+/// <param name="pfnMap">implementation to remap each band with</param>
+/// <param name="pDest">destination image, colorWidth x colorHeight BGRX</param>
+/// <param name="destPitch">bytes between destination rows</param>
+/// <param name="pPool">threads to remap bands with</param>
+void MapColorToDepthParallel(const ColorMappingDesc& desc, MapColorToDepthFunc pfnMap, uint8_t* pDest, size_t destPitch, CWorkerPool* pPool)
+{
+    MapColorToDepthBands bands = { pfnMap, &desc, pDest, destPitch };
+    pPool->ParallelFor(0, desc.colorHeight, cMinRowsPerBand, MapColorToDepthBand, &bands);
+}
+
+/// <summary>
+/// Compare every supported implementation, generic and specialized, against the scalar reference on synthetic data
+/// </summary>
+/// <returns>true if all implementations agree</returns>
+bool VerifyMapColorToDepth()
+{
+    const CpuFeatures& features = GetCpuFeatures();
+
+    // odd widths exercise the scalar tails
+    static const int divisors[] = { 1, 2, 3 };
+    const int colorWidth = 86;
+    const int colorHeight = 30;
+
+    unsigned int seed = 12345;
+    bool match = true;
+
+    std::vector<int32_t> coordinates;
+    std::vector<uint32_t> color;
+
+    for (size_t d = 0; d < sizeof(divisors) / sizeof(divisors[0]); ++d)
+    {
+        ColorMappingDesc desc;
+        desc.colorWidth = colorWidth;
+        desc.colorHeight = colorHeight;
+        desc.colorToDepthDivisor = divisors[d];
+        desc.depthWidth = (colorWidth + divisors[d] - 1) / divisors[d];
+        int depthHeight = (colorHeight + divisors[d] - 1) / divisors[d];
+
+        FillMappingInputs(colorWidth, colorHeight, desc.depthWidth * depthHeight, &seed, &coordinates, &color);
+        desc.pColorCoordinates = &coordinates[0];
+        desc.pColor = reinterpret_cast<const uint8_t*>(&color[0]);
+
+        if (features.bSSE41)
+        {
+            match = match && MatchesReference(MapColorToDepthSSE41, desc, colorHeight);
+        }
+
+        if (features.bAVX2)
+        {
+            match = match && MatchesReference(MapColorToDepthAVX2, desc, colorHeight);
+        }
+    }
+
+    // the kernels compiled for sensor resolutions, a few rows of each is enough to cover every stride
+    for (size_t i = 0; i < sizeof(cSpecializedMappings) / sizeof(cSpecializedMappings[0]); ++i)
+    {
+        const SpecializedMapping& mapping = cSpecializedMappings[i];
+
+        ColorMappingDesc desc;
+        desc.colorWidth = mapping.colorWidth;
+        desc.colorHeight = mapping.colorHeight;
+        desc.depthWidth = mapping.depthWidth;
+        desc.colorToDepthDivisor = mapping.colorWidth / mapping.depthWidth;
+        int depthHeight = mapping.colorHeight / desc.colorToDepthDivisor;
+
+        FillMappingInputs(desc.colorWidth, desc.colorHeight, desc.depthWidth * depthHeight, &seed, &coordinates, &color);
+        desc.pColorCoordinates = &coordinates[0];
+        desc.pColor = reinterpret_cast<const uint8_t*>(&color[0]);
+
+        const int rows = 9;
+        match = match && MatchesReference(mapping.pfnScalar, desc, rows);
+
+        if (features.bSSE41)
+        {
+            match = match && MatchesReference(mapping.pfnSSE41, desc, rows);
+        }
+
+        if (features.bAVX2)
+        {
+            match = match && MatchesReference(mapping.pfnAVX2, desc, rows);
+        }
+    }
+
+    return match;
+}
@@ -0,0 +1,91 @@
+﻿//------------------------------------------------------------------------------
+// <copyright file="ColorMapping.h" company="Microsoft">
+//     Copyright (c) Microsoft Corporation.  All rights reserved.
+// </copyright>
+//------------------------------------------------------------------------------
+
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+class CWorkerPool;
+
+/// <summary>
+/// Inputs of the color to depth remap
+/// For every color pixel (x, y) the output is the color pixel that the depth pixel
+/// (x / divisor, y / divisor) maps to, or zero if it maps outside the color image
+/// </summary>
+struct ColorMappingDesc
+{
+    // x, y pair per depth pixel, as produced by the sensor's coordinate mapping
+    const int32_t*                      pColorCoordinates;
+
+    // BGRX color image, tightly packed
+    const uint8_t*                      pColor;
+
+    int                                 colorWidth;
+    int                                 colorHeight;
+    int                                 depthWidth;
+    int                                 colorToDepthDivisor;
+};
+
+/// <summary>
+/// Remap a band of rows of the color image into depth space
+/// </summary>
+/// <param name="desc">remap inputs</param>
+/// <param name="pDest">destination image, colorWidth x colorHeight BGRX</param>
+/// <param name="destPitch">bytes between destination rows</param>
+/// <param name="rowBegin">first row to produce</param>
+/// <param name="rowEnd">one past the last row to produce</param>
+typedef void (*MapColorToDepthFunc)(const ColorMappingDesc& desc, uint8_t* pDest, size_t destPitch, int rowBegin, int rowEnd);
+
+/// <summary>
+/// Reference implementation, one pixel at a time
+/// </summary>
+void MapColorToDepthScalar(const ColorMappingDesc& desc, uint8_t* pDest, size_t destPitch, int rowBegin, int rowEnd);
+
+/// <summary>
+/// SSE4.1 implementation, four pixels at a time
+/// </summary>
+void MapColorToDepthSSE41(const ColorMappingDesc& desc, uint8_t* pDest, size_t destPitch, int rowBegin, int rowEnd);
+
+/// <summary>
+/// AVX2 implementation, eight pixels at a time using hardware gathers
+/// </summary>
+void MapColorToDepthAVX2(const ColorMappingDesc& desc, uint8_t* pDest, size_t destPitch, int rowBegin, int rowEnd);
+
+/// <summary>
+/// Fastest implementation the running CPU supports compiled for exactly these image sizes
+/// </summary>
+/// <param name="colorWidth">width of the color image</param>
+/// <param name="colorHeight">height of the color image</param>
+/// <param name="depthWidth">width of the depth image</param>
+/// <returns>remap function, or NULL if the sizes are not a sensor resolution pair</returns>
+MapColorToDepthFunc GetSpecializedMapColorToDepthFunc(int colorWidth, int colorHeight, int depthWidth);
+
+/// <summary>
+/// Pick the fastest implementation the running CPU supports for the given image sizes
+/// Sensor resolution pairs get a kernel compiled for them, other sizes a generic one
+/// </summary>
+/// <param name="colorWidth">width of the color image</param>
+/// <param name="colorHeight">height of the color image</param>
+/// <param name="depthWidth">width of the depth image</param>
+/// <returns>remap function</returns>
+MapColorToDepthFunc GetMapColorToDepthFunc(int colorWidth, int colorHeight, int depthWidth);
+
+/// <summary>
+/// Remap the whole color image into depth space, split into bands of rows on the worker pool
+/// </summary>
+/// <param name="desc">remap inputs</param>
+/// <param name="pfnMap">implementation to remap each band with</param>
+/// <param name="pDest">destination image, colorWidth x colorHeight BGRX</param>
+/// <param name="destPitch">bytes between destination rows</param>
+/// <param name="pPool">threads to remap bands with</param>
+void MapColorToDepthParallel(const ColorMappingDesc& desc, MapColorToDepthFunc pfnMap, uint8_t* pDest, size_t destPitch, CWorkerPool* pPool);
+
+/// <summary>
+/// Compare every supported implementation, generic and specialized, against the scalar reference on synthetic data
+/// </summary>
+/// <returns>true if all implementations agree</returns>
+bool VerifyMapColorToDepth();
@@ -0,0 +1,300 @@
+﻿//------------------------------------------------------------------------------
+// <copyright file="CommandLine.cpp" company="Microsoft">
+//     Copyright (c) Microsoft Corporation.  All rights reserved.
+// </copyright>
+//------------------------------------------------------------------------------
+
+#include "CommandLine.h"
+#include <shellapi.h>
+#include <stdlib.h>
+
+/// <summary>
+/// Parse the application command line
+/// </summary>
+/// <param name="lpCmdLine">command line as passed to wWinMain</param>
+/// <param name="pOptions">receives the parsed options</param>
+/// <returns>S_OK on success, E_INVALIDARG on an unknown or incomplete option</returns>
+HRESULT ParseCommandLine(LPCWSTR lpCmdLine, CommandLineOptions* pOptions)
+{
+    if (NULL == lpCmdLine || L'\0' == lpCmdLine[0])
+    {
+        return S_OK;
+    }
+
+    int argc = 0;
+    LPWSTR* argv = CommandLineToArgvW(lpCmdLine, &argc);
+    if (NULL == argv)
+    {
+        return HRESULT_FROM_WIN32(GetLastError());
+    }
+
+    HRESULT hr = S_OK;
+    for (int i = 0; i < argc && SUCCEEDED(hr); ++i)
+    {
+        LPCWSTR arg = argv[i];
+        bool hasValue = (i + 1 < argc);
+
+        if (0 == _wcsicmp(arg, L"-replay") && hasValue)
+        {
+            pOptions->replayFile = argv[++i];
+        }
+        else if (0 == _wcsicmp(arg, L"-record") && hasValue)
+        {
+            pOptions->recordFile = argv[++i];
+        }
+        else if (0 == _wcsicmp(arg, L"-stats") && hasValue)
+        {
+            pOptions->statsFile = argv[++i];
+        }
+        else if (0 == _wcsicmp(arg, L"-trace") && hasValue)
+        {
+            pOptions->traceFile = argv[++i];
+        }
+        else if (0 == _wcsicmp(arg, L"-software") && hasValue)
+        {
+            pOptions->softwarePrefix = argv[++i];
+        }
+        else if (0 == _wcsicmp(arg, L"-posetrace") && hasValue)
+        {
+            pOptions->poseTraceFile = argv[++i];
+        }
+        else if (0 == _wcsicmp(arg, L"-poselead") && hasValue)
+        {
+            pOptions->posePrediction.leadScale = static_cast<float>(_wtof(argv[++i]));
+        }
+        else if (0 == _wcsicmp(arg, L"-posesmoothing") && hasValue)
+        {
+            float cutoff = static_cast<float>(_wtof(argv[++i]));
+            if (cutoff > 0.0f)
+            {
+                pOptions->posePrediction.minCutoff = cutoff;
+            }
+            else
+            {
+                hr = E_INVALIDARG;
+            }
+        }
+        else if (0 == _wcsicmp(arg, L"-publish") && hasValue)
+        {
+            pOptions->publishName = argv[++i];
+        }
+        else if (0 == _wcsicmp(arg, L"-addreplay") && hasValue)
+        {
+            pOptions->extraReplayFiles.push_back(argv[++i]);
+        }
+        else if (0 == _wcsicmp(arg, L"-extrinsics") && hasValue)
+        {
+            pOptions->extrinsicsFile = argv[++i];
+        }
+        else if (0 == _wcsicmp(arg, L"-addsensors") && hasValue)
+        {
+            int sensorCount = _wtoi(argv[++i]);
+            if (sensorCount > 0)
+            {
+                pOptions->extraSensorCount = static_cast<UINT>(sensorCount);
+            }
+            else
+            {
+                hr = E_INVALIDARG;
+            }
+        }
+        else if (0 == _wcsicmp(arg, L"-fusion"))
+        {
+            pOptions->bFusion = true;
+        }
+        else if (0 == _wcsicmp(arg, L"-fusionvoxel") && hasValue)
+        {
+            float voxelMillimeters = static_cast<float>(_wtof(argv[++i]));
+            if (voxelMillimeters > 0.0f)
+            {
+                // the truncation band stays four voxels wide
+                pOptions->fusion.voxelSize = voxelMillimeters / 1000.0f;
+                pOptions->fusion.truncation = pOptions->fusion.voxelSize * 4.0f;
+            }
+            else
+            {
+                hr = E_INVALIDARG;
+            }
+        }
+        else if (0 == _wcsicmp(arg, L"-fusionblocks") && hasValue)
+        {
+            int blockCount = _wtoi(argv[++i]);
+            if (blockCount > 0)
+            {
+                pOptions->fusion.maxBlocks = blockCount;
+            }
+            else
+            {
+                hr = E_INVALIDARG;
+            }
+        }
+        else if (0 == _wcsicmp(arg, L"-maxfps") && hasValue)
+        {
+            double maxFps = _wtof(argv[++i]);
+            if (maxFps > 0.0)
+            {
+                pOptions->maxFps = maxFps;
+            }
+            else
+            {
+                hr = E_INVALIDARG;
+            }
+        }
+        else if (0 == _wcsicmp(arg, L"-threads") && hasValue)
+        {
+            int threadCount = _wtoi(argv[++i]);
+            if (threadCount > 0)
+            {
+                pOptions->threadCount = static_cast<UINT>(threadCount);
+            }
+            else
+            {
+                hr = E_INVALIDARG;
+            }
+        }
+        else if (0 == _wcsicmp(arg, L"-sync") && hasValue)
+        {
+            LPCWSTR policy = argv[++i];
+            if (0 == _wcsicmp(policy, L"drop"))
+            {
+                pOptions->syncPolicy = FRAME_SYNC_DROP;
+            }
+            else if (0 == _wcsicmp(policy, L"wait"))
+            {
+                pOptions->syncPolicy = FRAME_SYNC_WAIT;
+            }
+            else if (0 == _wcsicmp(policy, L"nearest"))
+            {
+                pOptions->syncPolicy = FRAME_SYNC_NEAREST;
+            }
+            else
+            {
+                hr = E_INVALIDARG;
+            }
+        }
+        else if (0 == _wcsicmp(arg, L"-depthcodec") && hasValue)
+        {
+            LPCWSTR codec = argv[++i];
+            if (0 == _wcsicmp(codec, L"raw"))
+            {
+                pOptions->depthCodec = RECORDING_DEPTH_RAW;
+            }
+            else if (0 == _wcsicmp(codec, L"rvl"))
+            {
+                pOptions->depthCodec = RECORDING_DEPTH_RVL;
+            }
+            else if (0 == _wcsicmp(codec, L"delta"))
+            {
+                pOptions->depthCodec = RECORDING_DEPTH_RVL_DELTA;
+            }
+            else
+            {
+                hr = E_INVALIDARG;
+            }
+        }
+        else if (0 == _wcsicmp(arg, L"-stereo") && hasValue)
+        {
+            LPCWSTR mode = argv[++i];
+            if (0 == _wcsicmp(mode, L"single"))
+            {
+                pOptions->bSinglePassStereo = true;
+            }
+            else if (0 == _wcsicmp(mode, L"twopass"))
+            {
+                pOptions->bSinglePassStereo = false;
+            }
+            else
+            {
+                hr = E_INVALIDARG;
+            }
+        }
+        else if (0 == _wcsicmp(arg, L"-facesearch") && hasValue)
+        {
+            LPCWSTR region = argv[++i];
+            if (0 == _wcsicmp(region, L"head"))
+            {
+                pOptions->bFaceSearchHeadRegion = true;
+            }
+            else if (0 == _wcsicmp(region, L"full"))
+            {
+                pOptions->bFaceSearchHeadRegion = false;
+            }
+            else
+            {
+                hr = E_INVALIDARG;
+            }
+        }
+        else if (0 == _wcsicmp(arg, L"-depthres") && hasValue)
+        {
+            LPCWSTR resolution = argv[++i];
+            if (0 == _wcsicmp(resolution, L"80x60"))
+            {
+                pOptions->depthResolution = NUI_IMAGE_RESOLUTION_80x60;
+            }
+            else if (0 == _wcsicmp(resolution, L"320x240"))
+            {
+                pOptions->depthResolution = NUI_IMAGE_RESOLUTION_320x240;
+            }
+            else if (0 == _wcsicmp(resolution, L"640x480"))
+            {
+                pOptions->depthResolution = NUI_IMAGE_RESOLUTION_640x480;
+            }
+            else
+            {
+                hr = E_INVALIDARG;
+            }
+        }
+        else if (0 == _wcsicmp(arg, L"-colorres") && hasValue)
+        {
+            LPCWSTR resolution = argv[++i];
+            if (0 == _wcsicmp(resolution, L"640x480"))
+            {
+                pOptions->colorResolution = NUI_IMAGE_RESOLUTION_640x480;
+            }
+            else if (0 == _wcsicmp(resolution, L"1280x960"))
+            {
+                pOptions->colorResolution = NUI_IMAGE_RESOLUTION_1280x960;
+            }
+            else
+            {
+                hr = E_INVALIDARG;
+            }
+        }
+        else if (0 == _wcsicmp(arg, L"-synctolerance") && hasValue)
+        {
+            pOptions->syncToleranceMs = _wtoi(argv[++i]);
+        }
+        else if (0 == _wcsicmp(arg, L"-syncwait") && hasValue)
+        {
+            pOptions->syncWaitMs = _wtoi(argv[++i]);
+        }
+        else if (0 == _wcsicmp(arg, L"-stubtracker"))
+        {
+            pOptions->bStubHeadTracker = true;
+        }
+        else if (0 == _wcsicmp(arg, L"-buildshaders"))
+        {
+            pOptions->bBuildShaders = true;
+        }
+        else if (0 == _wcsicmp(arg, L"-largepages"))
+        {
+            pOptions->bLargePages = true;
+        }
+        else if (0 == _wcsicmp(arg, L"-fast"))
+        {
+            pOptions->bFastReplay = true;
+        }
+        else if (0 == _wcsicmp(arg, L"-headless"))
+        {
+            pOptions->bHeadless = true;
+        }
+        else
+        {
+            hr = E_INVALIDARG;
+        }
+    }
+
+    LocalFree(argv);
+
+    return hr;
+}
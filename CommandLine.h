@@ -0,0 +1,122 @@
+﻿//------------------------------------------------------------------------------
+// <copyright file="CommandLine.h" company="Microsoft">
+//     Copyright (c) Microsoft Corporation.  All rights reserved.
+// </copyright>
+//------------------------------------------------------------------------------
+
+#pragma once
+
+#include <windows.h>
+#include <string>
+#include <vector>
+#include "NuiApi.h"
+#include "FrameRecorder.h"
+#include "FrameSynchronizer.h"
+#include "HeadPosePredictor.h"
+#include "TsdfVolume.h"
+
+/// <summary>
+/// Options parsed from the application command line
+///   -replay <file>   play back a recording instead of using a sensor
+///   -fast            deliver replayed frames as fast as they are consumed
+///   -headless        hide the windows and exit once the recording ends
+///   -record <file>   record the incoming frames
+///   -depthcodec <codec>  how recorded depth is stored: raw, rvl compressed or delta compressed against the previous frame
+///   -stats <file>    write throughput statistics on exit
+///   -trace <file>    time the frame stages, write a Chrome trace on exit and add stage percentiles to the statistics
+///   -threads <n>     threads used for per-pixel work, 1 disables threading
+///   -sync <policy>   pairing of mismatched depth and color frames: drop, wait or nearest
+///   -synctolerance <ms>  largest timestamp difference of frames that belong together
+///   -syncwait <ms>   how long the wait policy holds mismatched frames
+///   -stereo <mode>   user view eyes drawn in a single pass or one pass each: single or twopass
+///   -software <prefix>  also render both views on the CPU, written to <prefix>-kinect.bmp and <prefix>-user.bmp on exit
+///   -stubtracker     replace face tracking with a stub that follows the skeleton's head
+///   -facesearch <region>  where new faces are searched for: head, around the skeleton's head, or full
+///   -poselead <scale>  fraction of the measured latency the head position is predicted ahead, 0 only smooths
+///   -posesmoothing <hz>  cutoff of the head position filter at rest, lower is steadier but lags more
+///   -posetrace <file>  write the tracked head positions on exit, for tuning the prediction offline
+///   -largepages      back the frame buffers with large pages, needs the lock pages in memory privilege
+///   -depthres <w>x<h>  depth stream resolution: 80x60, 320x240 or 640x480
+///   -colorres <w>x<h>  color stream resolution: 640x480 or 1280x960, a whole multiple of the depth resolution
+///   -buildshaders    compile the shaders into the bytecode cache and exit, run as a build step
+///   -maxfps <n>      render at most this many frames per second, frames are only drawn when something changed
+///   -publish <name>  publish every synchronized frame into a shared memory ring of this name, for other processes
+///   -addsensors <n>  also draw the point clouds of this many more connected Kinects
+///   -addreplay <file>  also draw the point cloud of a recording at the same resolutions, may be repeated
+///   -extrinsics <file>  calibration moving each additional sensor into the first one's space, identity without it
+///   -fusion          fuse the first sensor's frames into a voxel volume, F toggles drawing its surface instead of the point cloud
+///   -fusionvoxel <mm>  edge of a fused voxel
+///   -fusionblocks <n>  voxel blocks the fused volume keeps, the least recently seen are dropped beyond it
+/// </summary>
+struct CommandLineOptions
+{
+    std::wstring                        replayFile;
+    std::wstring                        recordFile;
+    std::wstring                        statsFile;
+    std::wstring                        traceFile;
+    std::wstring                        softwarePrefix;
+    std::wstring                        poseTraceFile;
+    std::wstring                        publishName;
+    std::wstring                        extrinsicsFile;
+    std::vector<std::wstring>           extraReplayFiles;
+    bool                                bFastReplay;
+    bool                                bHeadless;
+    bool                                bSinglePassStereo;
+    bool                                bStubHeadTracker;
+    bool                                bFaceSearchHeadRegion;
+    bool                                bLargePages;
+    bool                                bBuildShaders;
+    bool                                bFusion;
+
+    // 0 uses every hardware thread
+    UINT                                threadCount;
+
+    // connected Kinects besides the first, they come before the extra replays in the extrinsics
+    UINT                                extraSensorCount;
+
+    // 0 renders as soon as anything changed
+    double                              maxFps;
+
+    HeadPosePredictorParams             posePrediction;
+
+    TsdfVolumeParams                    fusion;
+
+    // replays use the resolutions they were recorded at instead
+    NUI_IMAGE_RESOLUTION                depthResolution;
+    NUI_IMAGE_RESOLUTION                colorResolution;
+
+    RecordingDepthCodec                 depthCodec;
+
+    FrameSyncPolicy                     syncPolicy;
+    int                                 syncToleranceMs;
+    int                                 syncWaitMs;
+
+    CommandLineOptions() :
+        bFastReplay(false),
+        bHeadless(false),
+        bSinglePassStereo(true),
+        bStubHeadTracker(false),
+        bFaceSearchHeadRegion(true),
+        bLargePages(false),
+        bBuildShaders(false),
+        bFusion(false),
+        threadCount(0),
+        extraSensorCount(0),
+        maxFps(0.0),
+        depthResolution(NUI_IMAGE_RESOLUTION_640x480),
+        colorResolution(NUI_IMAGE_RESOLUTION_640x480),
+        depthCodec(RECORDING_DEPTH_RVL),
+        syncPolicy(FRAME_SYNC_WAIT),
+        syncToleranceMs(17),
+        syncWaitMs(34)
+    {
+    }
+};
+
+/// <summary>
+/// Parse the application command line
+/// </summary>
+/// <param name="lpCmdLine">command line as passed to wWinMain</param>
+/// <param name="pOptions">receives the parsed options</param>
+/// <returns>S_OK on success, E_INVALIDARG on an unknown or incomplete option</returns>
+HRESULT ParseCommandLine(LPCWSTR lpCmdLine, CommandLineOptions* pOptions);
@@ -0,0 +1,91 @@
+﻿//------------------------------------------------------------------------------
+// <copyright file="CpuFeatures.cpp" company="Microsoft">
+//     Copyright (c) Microsoft Corporation.  All rights reserved.
+// </copyright>
+//------------------------------------------------------------------------------
+
+#include "CpuFeatures.h"
+#include <windows.h>
+
+#if defined(_MSC_VER)
+#include <intrin.h>
+#include <immintrin.h>
+#else
+#include <cpuid.h>
+#endif
+
+namespace
+{
+    void CpuId(int leaf, int subLeaf, int regs[4])
+    {
+#if defined(_MSC_VER)
+        __cpuidex(regs, leaf, subLeaf);
+#else
+        unsigned int a = 0, b = 0, c = 0, d = 0;
+        __cpuid_count(leaf, subLeaf, a, b, c, d);
+        regs[0] = a; regs[1] = b; regs[2] = c; regs[3] = d;
+#endif
+    }
+
+    unsigned long long XGetBV()
+    {
+#if defined(_MSC_VER)
+        return _xgetbv(0);
+#else
+        unsigned int eax = 0, edx = 0;
+        __asm__ volatile ("xgetbv" : "=a"(eax), "=d"(edx) : "c"(0));
+        return (static_cast<unsigned long long>(edx) << 32) | eax;
+#endif
+    }
+
+    CpuFeatures DetectCpuFeatures()
+    {
+        CpuFeatures features = { false, false };
+
+        int regs[4];
+        CpuId(0, 0, regs);
+        int maxLeaf = regs[0];
+
+        if (maxLeaf < 1)
+        {
+            return features;
+        }
+
+        CpuId(1, 0, regs);
+        features.bSSE41 = (regs[2] & (1 << 19)) != 0;
+
+        // AVX2 also needs the OS to save the upper halves of the ymm registers
+        bool osxsave = (regs[2] & (1 << 27)) != 0;
+        bool avx = (regs[2] & (1 << 28)) != 0;
+        if (maxLeaf >= 7 && osxsave && avx && (XGetBV() & 0x6) == 0x6)
+        {
+            CpuId(7, 0, regs);
+            features.bAVX2 = (regs[1] & (1 << 5)) != 0;
+        }
+
+        return features;
+    }
+
+    INIT_ONCE g_cpuFeaturesOnce = INIT_ONCE_STATIC_INIT;
+    CpuFeatures g_cpuFeatures;
+
+    BOOL CALLBACK DetectCpuFeaturesOnce(PINIT_ONCE, PVOID, PVOID*)
+    {
+        g_cpuFeatures = DetectCpuFeatures();
+        return TRUE;
+    }
+}
+
+/// <summary>
+/// Query the running CPU and OS for SIMD support
+/// The result is computed on first use and cached
+/// </summary>
+/// <returns>supported extensions</returns>
+const CpuFeatures& GetCpuFeatures()
+{
+    // the capture threads, the worker pool and the render thread may all ask first
+    // other callers wait for the detection and see its result once it returns
+    InitOnceExecuteOnce(&g_cpuFeaturesOnce, DetectCpuFeaturesOnce, NULL, NULL);
+
+    return g_cpuFeatures;
+}
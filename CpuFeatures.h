@@ -0,0 +1,33 @@
+﻿//------------------------------------------------------------------------------
+// <copyright file="CpuFeatures.h" company="Microsoft">
+//     Copyright (c) Microsoft Corporation.  All rights reserved.
+// </copyright>
+//------------------------------------------------------------------------------
+
+#pragma once
+
+// Functions using instruction sets beyond the build's baseline are tagged with these.
+// MSVC accepts any intrinsic anywhere, GCC and Clang need the target spelled out.
+#if defined(__GNUC__)
+#define CPU_TARGET_SSE41 __attribute__((target("sse4.1")))
+#define CPU_TARGET_AVX2  __attribute__((target("avx2")))
+#else
+#define CPU_TARGET_SSE41
+#define CPU_TARGET_AVX2
+#endif
+
+/// <summary>
+/// Instruction set extensions usable on the running machine
+/// </summary>
+struct CpuFeatures
+{
+    bool                                bSSE41;
+    bool                                bAVX2;
+};
+
+/// <summary>
+/// Query the running CPU and OS for SIMD support
+/// The result is computed on first use and cached
+/// </summary>
+/// <returns>supported extensions</returns>
+const CpuFeatures& GetCpuFeatures();
@@ -0,0 +1,556 @@
+﻿//------------------------------------------------------------------------------
+// <copyright file="DepthCodec.cpp" company="Microsoft">
+//     Copyright (c) Microsoft Corporation.  All rights reserved.
+// </copyright>
+//------------------------------------------------------------------------------
+
+#include "DepthCodec.h"
+
+#include <string.h>
+#include <vector>
+#include <emmintrin.h>
+
+#if defined(_MSC_VER)
+#include <intrin.h>
+#endif
+
+namespace
+{
+    /// <summary>
+    /// Index of the lowest set bit, mask must not be zero
+    /// </summary>
+    inline unsigned int CountTrailingZeros(uint32_t mask)
+    {
+#if defined(_MSC_VER)
+        unsigned long index;
+        _BitScanForward(&index, mask);
+        return index;
+#else
+        return __builtin_ctz(mask);
+#endif
+    }
+
+    /// <summary>
+    /// Map a 16 bit difference to a small number, 0, -1, 1, -2 become 0, 1, 2, 3
+    /// </summary>
+    inline uint32_t ZigZag(uint32_t difference)
+    {
+        difference &= 0xffff;
+        return ((difference << 1) ^ (0 - (difference >> 15))) & 0xffff;
+    }
+
+    inline uint16_t UnZigZag(uint32_t number)
+    {
+        return static_cast<uint16_t>((number >> 1) ^ (0 - (number & 1)));
+    }
+
+    /// <summary>
+    /// Pixel to code, the difference to the reference in delta frames
+    /// </summary>
+    inline uint16_t Residual(const uint16_t* pDepth, const uint16_t* pReference, size_t i)
+    {
+        return pReference ? static_cast<uint16_t>(pDepth[i] - pReference[i]) : pDepth[i];
+    }
+
+    inline __m128i LoadResidual(const uint16_t* pDepth, const uint16_t* pReference, size_t i)
+    {
+        __m128i depth = _mm_loadu_si128(reinterpret_cast<const __m128i*>(pDepth + i));
+        return pReference ? _mm_sub_epi16(depth, _mm_loadu_si128(reinterpret_cast<const __m128i*>(pReference + i))) : depth;
+    }
+
+    /// <summary>
+    /// Packs 4 bit codes into 32 bit words, first code in the top bits
+    /// </summary>
+    class CCodeWriter
+    {
+    public:
+        explicit CCodeWriter(uint32_t* pOut) : m_pStart(pOut), m_pOut(pOut), m_word(0), m_count(0) {}
+
+        void PutCode(uint32_t code)
+        {
+            m_word = (m_word << 4) | code;
+            if (8 == ++m_count)
+            {
+                *m_pOut++ = m_word;
+                m_count = 0;
+            }
+        }
+
+        /// <summary>
+        /// Code a number 3 bits at a time, low bits first, the top bit of a code says more follow
+        /// </summary>
+        void PutNumber(uint32_t number)
+        {
+            while (number >= 8)
+            {
+                PutCode(8 | (number & 7));
+                number >>= 3;
+            }
+
+            PutCode(number);
+        }
+
+        /// <summary>
+        /// Write out the last partial word, padded with zero codes
+        /// </summary>
+        /// <returns>words written</returns>
+        size_t Finish()
+        {
+            if (m_count > 0)
+            {
+                *m_pOut++ = m_word << (4 * (8 - m_count));
+                m_count = 0;
+            }
+
+            return m_pOut - m_pStart;
+        }
+
+    private:
+        uint32_t*                       m_pStart;
+        uint32_t*                       m_pOut;
+        uint32_t                        m_word;
+        int                             m_count;
+    };
+
+    /// <summary>
+    /// Reads the codes written by CCodeWriter, running past the end reads zeros and is remembered
+    /// </summary>
+    class CCodeReader
+    {
+    public:
+        CCodeReader(const uint32_t* pIn, size_t wordCount) : m_pIn(pIn), m_pEnd(pIn + wordCount), m_word(0), m_count(0), m_bOverrun(false) {}
+
+        uint32_t GetCode()
+        {
+            if (0 == m_count)
+            {
+                if (m_pIn == m_pEnd)
+                {
+                    m_bOverrun = true;
+                    return 0;
+                }
+
+                m_word = *m_pIn++;
+                m_count = 8;
+            }
+
+            uint32_t code = m_word >> 28;
+            m_word <<= 4;
+            --m_count;
+            return code;
+        }
+
+        uint32_t GetNumber()
+        {
+            uint32_t number = 0;
+            for (unsigned int shift = 0; shift < 32; shift += 3)
+            {
+                uint32_t code = GetCode();
+                number |= (code & 7) << shift;
+                if (0 == (code & 8))
+                {
+                    return number;
+                }
+            }
+
+            // more codes than a 32 bit number has, the frame is damaged
+            m_bOverrun = true;
+            return 0;
+        }
+
+        bool IsOverrun() const { return m_bOverrun; }
+
+    private:
+        const uint32_t*                 m_pIn;
+        const uint32_t*                 m_pEnd;
+        uint32_t                        m_word;
+        int                             m_count;
+        bool                            m_bOverrun;
+    };
+
+    /// <summary>
+    /// Complete the header once the codes are written
+    /// </summary>
+    size_t FinishFrame(uint8_t* pOut, CCodeWriter& writer, const uint16_t* pReference, size_t pixelCount)
+    {
+        DepthCodecHeader* pHeader = reinterpret_cast<DepthCodecHeader*>(pOut);
+        pHeader->magic = cDepthCodecMagic;
+        pHeader->flags = pReference ? cDepthCodecDelta : 0;
+        pHeader->pixelCount = static_cast<uint32_t>(pixelCount);
+        pHeader->wordCount = static_cast<uint32_t>(writer.Finish());
+
+        return sizeof(DepthCodecHeader) + pHeader->wordCount * sizeof(uint32_t);
+    }
+
+    /// <summary>
+    /// Check an encoded frame against what the caller expects
+    /// </summary>
+    /// <returns>the header, or NULL if the frame cannot be decoded</returns>
+    const DepthCodecHeader* CheckFrame(const uint8_t* pIn, size_t size, const uint16_t* pReference, size_t pixelCount)
+    {
+        if (size < sizeof(DepthCodecHeader))
+        {
+            return NULL;
+        }
+
+        const DepthCodecHeader* pHeader = reinterpret_cast<const DepthCodecHeader*>(pIn);
+        if (cDepthCodecMagic != pHeader->magic || pixelCount != pHeader->pixelCount ||
+            pHeader->wordCount > (size - sizeof(DepthCodecHeader)) / sizeof(uint32_t) ||
+            (0 != (pHeader->flags & cDepthCodecDelta) && NULL == pReference))
+        {
+            return NULL;
+        }
+
+        return pHeader;
+    }
+
+    /// <summary>
+    /// End of the run of zero or of nonzero pixels starting at i, eight pixels at a time
+    /// </summary>
+    inline size_t FindRunEndSSE2(const uint16_t* pDepth, const uint16_t* pReference, size_t i, size_t pixelCount, bool bZeros)
+    {
+        // movemask yields two bits per pixel, set for zero pixels
+        const __m128i zero = _mm_setzero_si128();
+        uint32_t runMask = bZeros ? 0xffff : 0;
+        for (; i + 8 <= pixelCount; i += 8)
+        {
+            uint32_t mask = static_cast<uint32_t>(_mm_movemask_epi8(_mm_cmpeq_epi16(LoadResidual(pDepth, pReference, i), zero)));
+            if (mask != runMask)
+            {
+                return i + CountTrailingZeros(mask ^ runMask) / 2;
+            }
+        }
+
+        while (i < pixelCount && (0 == Residual(pDepth, pReference, i)) == bZeros)
+        {
+            ++i;
+        }
+
+        return i;
+    }
+}
+
+/// <summary>
+/// Largest possible encoded size of a frame, the output buffer passed to the encoders needs this much room
+/// </summary>
+/// <param name="pixelCount">pixels in the frame</param>
+/// <returns>size in bytes</returns>
+size_t DepthCodecMaxEncodedSize(size_t pixelCount)
+{
+    // A pixel takes at most 6 codes. A pair of runs costs at most one code per run length over
+    // the pixels' own codes, except at the start and end of the frame where a run may be empty
+    // and its length 11 codes long. One more word holds the padding of the last codes.
+    return sizeof(DepthCodecHeader) + pixelCount * 3 + 16 + sizeof(uint32_t);
+}
+
+/// <summary>
+/// Reference encoder, one pixel at a time
+/// </summary>
+size_t EncodeDepthScalar(const uint16_t* pDepth, const uint16_t* pReference, size_t pixelCount, uint8_t* pOut)
+{
+    CCodeWriter writer(reinterpret_cast<uint32_t*>(pOut + sizeof(DepthCodecHeader)));
+
+    uint16_t previous = 0;
+    size_t i = 0;
+    while (i < pixelCount)
+    {
+        size_t runStart = i;
+        while (i < pixelCount && 0 == Residual(pDepth, pReference, i))
+        {
+            ++i;
+        }
+
+        writer.PutNumber(static_cast<uint32_t>(i - runStart));
+
+        runStart = i;
+        while (i < pixelCount && 0 != Residual(pDepth, pReference, i))
+        {
+            ++i;
+        }
+
+        writer.PutNumber(static_cast<uint32_t>(i - runStart));
+
+        for (size_t j = runStart; j < i; ++j)
+        {
+            uint16_t value = Residual(pDepth, pReference, j);
+            writer.PutNumber(ZigZag(value - previous));
+            previous = value;
+        }
+    }
+
+    return FinishFrame(pOut, writer, pReference, pixelCount);
+}
+
+/// <summary>
+/// SSE2 encoder, finds runs and computes differences eight pixels at a time
+/// </summary>
+size_t EncodeDepthSSE2(const uint16_t* pDepth, const uint16_t* pReference, size_t pixelCount, uint8_t* pOut)
+{
+    CCodeWriter writer(reinterpret_cast<uint32_t*>(pOut + sizeof(DepthCodecHeader)));
+
+    uint16_t previous = 0;
+    size_t i = 0;
+    while (i < pixelCount)
+    {
+        size_t runStart = i;
+        i = FindRunEndSSE2(pDepth, pReference, i, pixelCount, true);
+        writer.PutNumber(static_cast<uint32_t>(i - runStart));
+
+        runStart = i;
+        i = FindRunEndSSE2(pDepth, pReference, i, pixelCount, false);
+        writer.PutNumber(static_cast<uint32_t>(i - runStart));
+
+        // each pixel's predecessor is the pixel before it in the run, the previous run's last
+        // pixel for the first, which arrives in the top lane of the last block
+        size_t j = runStart;
+        __m128i previousBlock = _mm_slli_si128(_mm_cvtsi32_si128(previous), 14);
+        for (; j + 8 <= i; j += 8)
+        {
+            __m128i current = LoadResidual(pDepth, pReference, j);
+            __m128i predecessor = _mm_or_si128(_mm_slli_si128(current, 2), _mm_srli_si128(previousBlock, 14));
+            __m128i difference = _mm_sub_epi16(current, predecessor);
+            __m128i zigzag = _mm_xor_si128(_mm_slli_epi16(difference, 1), _mm_srai_epi16(difference, 15));
+
+            uint16_t numbers[8];
+            _mm_storeu_si128(reinterpret_cast<__m128i*>(numbers), zigzag);
+            for (int k = 0; k < 8; ++k)
+            {
+                writer.PutNumber(numbers[k]);
+            }
+
+            previousBlock = current;
+        }
+
+        previous = static_cast<uint16_t>(_mm_extract_epi16(previousBlock, 7));
+
+        for (; j < i; ++j)
+        {
+            uint16_t value = Residual(pDepth, pReference, j);
+            writer.PutNumber(ZigZag(value - previous));
+            previous = value;
+        }
+    }
+
+    return FinishFrame(pOut, writer, pReference, pixelCount);
+}
+
+/// <summary>
+/// Reference decoder, one pixel at a time
+/// </summary>
+bool DecodeDepthScalar(const uint8_t* pIn, size_t size, const uint16_t* pReference, size_t pixelCount, uint16_t* pDepth)
+{
+    const DepthCodecHeader* pHeader = CheckFrame(pIn, size, pReference, pixelCount);
+    if (NULL == pHeader)
+    {
+        return false;
+    }
+
+    CCodeReader reader(reinterpret_cast<const uint32_t*>(pHeader + 1), pHeader->wordCount);
+
+    uint16_t previous = 0;
+    size_t i = 0;
+    while (i < pixelCount)
+    {
+        size_t zeros = reader.GetNumber();
+        size_t nonzeros = reader.GetNumber();
+        if (reader.IsOverrun() || zeros > pixelCount - i || nonzeros > pixelCount - i - zeros)
+        {
+            return false;
+        }
+
+        for (; zeros > 0; --zeros)
+        {
+            pDepth[i++] = 0;
+        }
+
+        for (; nonzeros > 0; --nonzeros)
+        {
+            previous = static_cast<uint16_t>(previous + UnZigZag(reader.GetNumber()));
+            pDepth[i++] = previous;
+        }
+    }
+
+    if (reader.IsOverrun())
+    {
+        return false;
+    }
+
+    if (0 != (pHeader->flags & cDepthCodecDelta))
+    {
+        for (i = 0; i < pixelCount; ++i)
+        {
+            pDepth[i] = static_cast<uint16_t>(pDepth[i] + pReference[i]);
+        }
+    }
+
+    return true;
+}
+
+/// <summary>
+/// SSE2 decoder, fills zero runs, sums the differences of nonzero runs and adds the reference eight pixels at a time
+/// The codes themselves can only be read one after the other.
+/// </summary>
+bool DecodeDepthSSE2(const uint8_t* pIn, size_t size, const uint16_t* pReference, size_t pixelCount, uint16_t* pDepth)
+{
+    const DepthCodecHeader* pHeader = CheckFrame(pIn, size, pReference, pixelCount);
+    if (NULL == pHeader)
+    {
+        return false;
+    }
+
+    CCodeReader reader(reinterpret_cast<const uint32_t*>(pHeader + 1), pHeader->wordCount);
+
+    const __m128i zero = _mm_setzero_si128();
+    uint16_t previous = 0;
+    size_t i = 0;
+    while (i < pixelCount)
+    {
+        size_t zeros = reader.GetNumber();
+        size_t nonzeros = reader.GetNumber();
+        if (reader.IsOverrun() || zeros > pixelCount - i || nonzeros > pixelCount - i - zeros)
+        {
+            return false;
+        }
+
+        size_t runEnd = i + zeros;
+        for (; i + 8 <= runEnd; i += 8)
+        {
+            _mm_storeu_si128(reinterpret_cast<__m128i*>(pDepth + i), zero);
+        }
+
+        for (; i < runEnd; ++i)
+        {
+            pDepth[i] = 0;
+        }
+
+        // a running sum over the lanes in three shifted adds, starting from the previous run's last pixel
+        for (; nonzeros >= 8; nonzeros -= 8, i += 8)
+        {
+            // inserted lane by lane, eight narrow stores read back as one vector would stall the load
+            __m128i sum = _mm_cvtsi32_si128(UnZigZag(reader.GetNumber()));
+            sum = _mm_insert_epi16(sum, UnZigZag(reader.GetNumber()), 1);
+            sum = _mm_insert_epi16(sum, UnZigZag(reader.GetNumber()), 2);
+            sum = _mm_insert_epi16(sum, UnZigZag(reader.GetNumber()), 3);
+            sum = _mm_insert_epi16(sum, UnZigZag(reader.GetNumber()), 4);
+            sum = _mm_insert_epi16(sum, UnZigZag(reader.GetNumber()), 5);
+            sum = _mm_insert_epi16(sum, UnZigZag(reader.GetNumber()), 6);
+            sum = _mm_insert_epi16(sum, UnZigZag(reader.GetNumber()), 7);
+            sum = _mm_add_epi16(sum, _mm_slli_si128(sum, 2));
+            sum = _mm_add_epi16(sum, _mm_slli_si128(sum, 4));
+            sum = _mm_add_epi16(sum, _mm_slli_si128(sum, 8));
+            sum = _mm_add_epi16(sum, _mm_set1_epi16(static_cast<short>(previous)));
+            _mm_storeu_si128(reinterpret_cast<__m128i*>(pDepth + i), sum);
+
+            previous = static_cast<uint16_t>(_mm_extract_epi16(sum, 7));
+        }
+
+        for (; nonzeros > 0; --nonzeros)
+        {
+            previous = static_cast<uint16_t>(previous + UnZigZag(reader.GetNumber()));
+            pDepth[i++] = previous;
+        }
+    }
+
+    if (reader.IsOverrun())
+    {
+        return false;
+    }
+
+    if (0 != (pHeader->flags & cDepthCodecDelta))
+    {
+        for (i = 0; i + 8 <= pixelCount; i += 8)
+        {
+            __m128i residual = _mm_loadu_si128(reinterpret_cast<const __m128i*>(pDepth + i));
+            __m128i reference = _mm_loadu_si128(reinterpret_cast<const __m128i*>(pReference + i));
+            _mm_storeu_si128(reinterpret_cast<__m128i*>(pDepth + i), _mm_add_epi16(residual, reference));
+        }
+
+        for (; i < pixelCount; ++i)
+        {
+            pDepth[i] = static_cast<uint16_t>(pDepth[i] + pReference[i]);
+        }
+    }
+
+    return true;
+}
+
+/// <summary>
+/// Whether an encoded frame needs the reference frame to decode
+/// </summary>
+/// <param name="pIn">encoded frame</param>
+/// <param name="size">encoded size in bytes</param>
+/// <returns>true for a delta frame</returns>
+bool IsDepthDeltaFrame(const uint8_t* pIn, size_t size)
+{
+    return size >= sizeof(DepthCodecHeader) && 0 != (reinterpret_cast<const DepthCodecHeader*>(pIn)->flags & cDepthCodecDelta);
+}
+
+/// <summary>
+/// Round trip synthetic frames through every encoder and decoder, alone and as delta frames
+/// </summary>
+/// <returns>true if every frame comes back unchanged and the SSE2 encoder matches the reference</returns>
+bool VerifyDepthCodec()
+{
+    // an odd size exercises the scalar tails
+    const size_t pixelCount = 86 * 30 + 3;
+
+    // a person in front of a wall with holes, noise, every player index and the extreme values,
+    // then the same scene moved slightly to serve as the next frame
+    std::vector<uint16_t> frames[4];
+    unsigned int seed = 12345;
+    for (size_t f = 0; f < 2; ++f)
+    {
+        frames[f].resize(pixelCount);
+        for (size_t i = 0; i < pixelCount; ++i)
+        {
+            seed = seed * 1664525 + 1013904223;
+            size_t x = i % 86 + f;
+            uint16_t depth = static_cast<uint16_t>((x > 30 && x < 60 ? 1500 : 3000) + (seed >> 28));
+            uint16_t player = static_cast<uint16_t>(x > 30 && x < 60 ? (i / 86) % 8 : 0);
+            frames[f][i] = static_cast<uint16_t>((depth << 3) | player);
+
+            if (0 == (i / 11) % 4 || 0 == (seed >> 8) % 7)
+            {
+                frames[f][i] = 0;
+            }
+        }
+
+        frames[f][1] = 0xffff;
+        frames[f][2] = 1;
+    }
+
+    frames[2].assign(pixelCount, 0);
+    frames[3].assign(pixelCount, 0xffff);
+
+    std::vector<uint8_t> scalar(DepthCodecMaxEncodedSize(pixelCount));
+    std::vector<uint8_t> sse2(scalar.size());
+    std::vector<uint16_t> decoded(pixelCount);
+
+    bool match = true;
+    for (size_t f = 0; f < 4 && match; ++f)
+    {
+        // alone, and relative to the first frame
+        for (int delta = 0; delta < 2 && match; ++delta)
+        {
+            const uint16_t* pReference = delta ? &frames[0][0] : NULL;
+            size_t scalarSize = EncodeDepthScalar(&frames[f][0], pReference, pixelCount, &scalar[0]);
+            size_t sse2Size = EncodeDepthSSE2(&frames[f][0], pReference, pixelCount, &sse2[0]);
+            match = scalarSize == sse2Size && scalarSize <= scalar.size() && 0 == memcmp(&scalar[0], &sse2[0], scalarSize);
+            match = match && (0 != delta) == IsDepthDeltaFrame(&scalar[0], scalarSize);
+
+            match = match && DecodeDepthScalar(&scalar[0], scalarSize, pReference, pixelCount, &decoded[0]);
+            match = match && 0 == memcmp(&decoded[0], &frames[f][0], pixelCount * sizeof(uint16_t));
+
+            decoded.assign(pixelCount, 1);
+            match = match && DecodeDepthSSE2(&scalar[0], scalarSize, pReference, pixelCount, &decoded[0]);
+            match = match && 0 == memcmp(&decoded[0], &frames[f][0], pixelCount * sizeof(uint16_t));
+
+            // cut short, resized or missing its reference, a frame is refused rather than misread
+            match = match && !DecodeDepthSSE2(&scalar[0], scalarSize - sizeof(uint32_t), pReference, pixelCount, &decoded[0]);
+            match = match && !DecodeDepthScalar(&scalar[0], scalarSize, pReference, pixelCount - 1, &decoded[0]);
+            match = match && (!delta || !DecodeDepthScalar(&scalar[0], scalarSize, NULL, pixelCount, &decoded[0]));
+        }
+    }
+
+    return match;
+}
@@ -0,0 +1,100 @@
+﻿//------------------------------------------------------------------------------
+// <copyright file="DepthCodec.h" company="Microsoft">
+//     Copyright (c) Microsoft Corporation.  All rights reserved.
+// </copyright>
+//------------------------------------------------------------------------------
+
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Lossless compression of D13P3 depth frames, player index bits included, after RVL (run length
+// and variable length coding, Wilson 2017). The frame alternates runs of zero pixels and runs of
+// nonzero pixels. Each pair of runs is coded as the two run lengths followed by every nonzero
+// pixel, as the zigzag coded difference to the previous nonzero pixel. Numbers are coded in
+// 4 bit codes holding 3 bits of the number and a continuation bit, low bits first, packed most
+// significant code first into little endian 32 bit words.
+//
+// A delta frame codes the difference to a reference frame instead, the previous frame of a
+// recording, so pixels that did not change become zero runs.
+//
+// Encoded frame: DepthCodecHeader, then wordCount code words.
+
+const uint32_t cDepthCodecMagic = 0x31564c52;
+
+// the frame is coded relative to a reference frame
+const uint32_t cDepthCodecDelta = 1;
+
+/// <summary>
+/// Start of an encoded frame
+/// </summary>
+struct DepthCodecHeader
+{
+    uint32_t                            magic;
+    uint32_t                            flags;
+    uint32_t                            pixelCount;
+    uint32_t                            wordCount;
+};
+
+/// <summary>
+/// Largest possible encoded size of a frame, the output buffer passed to the encoders needs this much room
+/// </summary>
+/// <param name="pixelCount">pixels in the frame</param>
+/// <returns>size in bytes</returns>
+size_t DepthCodecMaxEncodedSize(size_t pixelCount);
+
+/// <summary>
+/// Encode a tightly packed depth frame
+/// </summary>
+/// <param name="pDepth">pixels to encode</param>
+/// <param name="pReference">frame to code the difference to, NULL for a frame that stands alone</param>
+/// <param name="pixelCount">pixels in the frame</param>
+/// <param name="pOut">receives the encoded frame, 4 byte aligned with DepthCodecMaxEncodedSize bytes of room</param>
+/// <returns>encoded size in bytes</returns>
+typedef size_t (*EncodeDepthFunc)(const uint16_t* pDepth, const uint16_t* pReference, size_t pixelCount, uint8_t* pOut);
+
+/// <summary>
+/// Decode a frame
+/// </summary>
+/// <param name="pIn">encoded frame, 4 byte aligned</param>
+/// <param name="size">encoded size in bytes</param>
+/// <param name="pReference">the reference frame the encoder was given, ignored for a frame that stands alone</param>
+/// <param name="pixelCount">pixels expected in the frame</param>
+/// <param name="pDepth">receives the pixels, tightly packed</param>
+/// <returns>true if the frame decoded, false if it is damaged, of another size, or needs a missing reference</returns>
+typedef bool (*DecodeDepthFunc)(const uint8_t* pIn, size_t size, const uint16_t* pReference, size_t pixelCount, uint16_t* pDepth);
+
+/// <summary>
+/// Reference encoder, one pixel at a time
+/// </summary>
+size_t EncodeDepthScalar(const uint16_t* pDepth, const uint16_t* pReference, size_t pixelCount, uint8_t* pOut);
+
+/// <summary>
+/// SSE2 encoder, finds runs and computes differences eight pixels at a time
+/// </summary>
+size_t EncodeDepthSSE2(const uint16_t* pDepth, const uint16_t* pReference, size_t pixelCount, uint8_t* pOut);
+
+/// <summary>
+/// Reference decoder, one pixel at a time
+/// </summary>
+bool DecodeDepthScalar(const uint8_t* pIn, size_t size, const uint16_t* pReference, size_t pixelCount, uint16_t* pDepth);
+
+/// <summary>
+/// SSE2 decoder, fills zero runs, sums the differences of nonzero runs and adds the reference eight pixels at a time
+/// </summary>
+bool DecodeDepthSSE2(const uint8_t* pIn, size_t size, const uint16_t* pReference, size_t pixelCount, uint16_t* pDepth);
+
+/// <summary>
+/// Whether an encoded frame needs the reference frame to decode
+/// </summary>
+/// <param name="pIn">encoded frame</param>
+/// <param name="size">encoded size in bytes</param>
+/// <returns>true for a delta frame</returns>
+bool IsDepthDeltaFrame(const uint8_t* pIn, size_t size);
+
+/// <summary>
+/// Round trip synthetic frames through every encoder and decoder, alone and as delta frames
+/// </summary>
+/// <returns>true if every frame comes back unchanged and the SSE2 encoder matches the reference</returns>
+bool VerifyDepthCodec();
@@ -5,6 +5,16 @@
 //------------------------------------------------------------------------------
 
 #include "DepthWithColor-D3D.h"
+#include "KinectFrameSource.h"
+#include "ReplayFrameSource.h"
+#include "CommandLine.h"
+#include "FrameProfiler.h"
+#include "PointCloud.h"
+#include "DepthCodec.h"
+#include "SkeletonSelection.h"
+#include "FaceTrackLibTracker.h"
+#include <stdio.h>
+#include <algorithm>
 
 #ifdef SAMPLE_OPTIONS
 #include "Options.h"
@@ -17,8 +27,60 @@ using namespace DirectX;
 // Global Variables
 CDepthWithColorD3D g_Application;  // Application class
 
+// how often headless runs check whether the recording has ended
+const DWORD cHeadlessPollMs = 100;
+
 LRESULT CALLBACK WndProc(HWND, UINT, WPARAM, LPARAM);
 
+/// <summary>
+/// Add the sensors drawn along with the primary one, connected Kinects first and then recordings
+/// </summary>
+/// <param name="options">parsed command line</param>
+/// <returns>S_OK on success, ERROR_INVALID_DATA for missing or malformed extrinsics, otherwise failure code</returns>
+static HRESULT AddSensors(const CommandLineOptions& options)
+{
+    size_t sensorCount = options.extraSensorCount + options.extraReplayFiles.size();
+
+    // without a calibration every sensor is assumed to sit where the primary one does
+    PointCloudTransform identity;
+    SetIdentityTransform(&identity);
+    std::vector<PointCloudTransform> extrinsics(sensorCount, identity);
+
+    if (!options.extrinsicsFile.empty())
+    {
+        FILE* pFile = NULL;
+        if (0 != _wfopen_s(&pFile, options.extrinsicsFile.c_str(), L"r"))
+        {
+            return HRESULT_FROM_WIN32(ERROR_FILE_NOT_FOUND);
+        }
+
+        bool bRead = ReadSensorExtrinsics(pFile, &extrinsics);
+        fclose(pFile);
+
+        if (!bRead || extrinsics.size() < sensorCount)
+        {
+            return HRESULT_FROM_WIN32(ERROR_INVALID_DATA);
+        }
+    }
+
+    // the primary Kinect is the first ready one, unless a recording stands in for it
+    UINT connectedIndex = options.replayFile.empty() ? 1 : 0;
+
+    HRESULT hr = S_OK;
+    size_t sensor = 0;
+    for (UINT i = 0; i < options.extraSensorCount && SUCCEEDED(hr); ++i, ++sensor)
+    {
+        hr = g_Application.AddConnectedSensor(connectedIndex + i, extrinsics[sensor]);
+    }
+
+    for (size_t i = 0; i < options.extraReplayFiles.size() && SUCCEEDED(hr); ++i, ++sensor)
+    {
+        hr = g_Application.AddReplaySensor(options.extraReplayFiles[i].c_str(), !options.bFastReplay, !options.bHeadless, extrinsics[sensor]);
+    }
+
+    return hr;
+}
+
 /// <summary>
 /// Entry point for the application
 /// </summary>
@@ -30,25 +92,110 @@ LRESULT CALLBACK WndProc(HWND, UINT, WPARAM, LPARAM);
 int WINAPI wWinMain(HINSTANCE hInstance, HINSTANCE hPrevInstance, LPWSTR lpCmdLine, int nCmdShow)
 {
     UNREFERENCED_PARAMETER(hPrevInstance);
-    UNREFERENCED_PARAMETER(lpCmdLine);
+
+    CommandLineOptions options;
+    if ( FAILED( ParseCommandLine(lpCmdLine, &options) ) || FAILED( g_Application.SetResolutions(options.depthResolution, options.colorResolution) ) )
+    {
+        MessageBox(NULL, L"Usage: DepthWithColor-D3D [-replay <file> [-fast] [-headless]] [-record <file> [-depthcodec raw|rvl|delta]] [-stats <file>] [-threads <n>] [-stereo single|twopass] [-software <prefix>] [-stubtracker] [-facesearch head|full] [-poselead <scale>] [-posesmoothing <hz>] [-posetrace <file>] [-largepages] [-depthres <w>x<h>] [-colorres <w>x<h>] [-buildshaders] [-maxfps <n>] [-publish <name>] [-addsensors <n>] [-addreplay <file>]... [-extrinsics <file>] [-fusion [-fusionvoxel <mm>] [-fusionblocks <n>]]", L"Error", MB_ICONHAND | MB_OK);
+        return 0;
+    }
+
+    // The build step only fills the shader cache, it needs neither a window nor a sensor
+    if (options.bBuildShaders)
+    {
+        return SUCCEEDED( CDepthWithColorD3D::BuildShaderCache() ) ? 0 : 1;
+    }
+
+    CFrameProfiler::SetThreadName("render");
+    CFrameProfiler::Enable(!options.traceFile.empty());
+
+    g_Application.SetThreadCount(options.threadCount);
+    g_Application.ConfigureSync(options.syncPolicy, options.syncToleranceMs, options.syncWaitMs);
+    g_Application.EnableSoftwareRenderer(!options.softwarePrefix.empty());
+    if (options.bFusion)
+    {
+        g_Application.EnableFusion(options.fusion);
+    }
+    g_Application.SetSinglePassStereo(options.bSinglePassStereo);
+    g_Application.UseStubHeadTracker(options.bStubHeadTracker);
+    g_Application.SetFaceSearchRegion(options.bFaceSearchHeadRegion);
+    g_Application.SetHeadPosePrediction(options.posePrediction);
+    g_Application.RecordPoseTrace(!options.poseTraceFile.empty());
+    g_Application.UseLargePages(options.bLargePages && CFrameBufferPool::EnableLargePages());
+
+    // Headless runs still need windows for the swap chains, they just stay hidden
+    if (options.bHeadless)
+    {
+        nCmdShow = SW_HIDE;
+    }
 
     if ( FAILED( g_Application.InitWindow(hInstance, nCmdShow) ) )
     {
         return 0;
     }
 
+    if (!options.replayFile.empty())
+    {
+        if ( FAILED( g_Application.CreateReplaySource(options.replayFile.c_str(), !options.bFastReplay, !options.bHeadless) ) )
+        {
+            MessageBox(NULL, L"Could not open the recording!", L"Error", MB_ICONHAND | MB_OK);
+            return 0;
+        }
+    }
+    else if ( FAILED( g_Application.CreateFirstConnected() ) )
+    {
+        MessageBox(NULL, L"No ready Kinect found!", L"Error", MB_ICONHAND | MB_OK);
+        return 0;
+    }
+
+    // The other sensors are checked against the resolutions the primary one settled on
+    if ( FAILED( AddSensors(options) ) )
+    {
+        MessageBox(NULL, L"Could not add the additional sensors!", L"Error", MB_ICONHAND | MB_OK);
+        return 0;
+    }
+
+    // The textures and the point index buffer are sized for the resolutions, which a replay may have changed
     if ( FAILED( g_Application.InitDevice() ) )
     {
         return 0;
     }
 
-    if ( FAILED( g_Application.CreateFirstConnected() ) )
+    if (!options.recordFile.empty())
     {
-        MessageBox(NULL, L"No ready Kinect found!", L"Error", MB_ICONHAND | MB_OK);
+        if ( FAILED( g_Application.StartRecording(options.recordFile.c_str(), options.depthCodec) ) )
+        {
+            MessageBox(NULL, L"Could not create the recording!", L"Error", MB_ICONHAND | MB_OK);
+            return 0;
+        }
+    }
+
+    if (!options.publishName.empty())
+    {
+        if ( FAILED( g_Application.StartPublishing(options.publishName.c_str()) ) )
+        {
+            MessageBox(NULL, L"Could not create the shared frame ring!", L"Error", MB_ICONHAND | MB_OK);
+            return 0;
+        }
+    }
+
+    // Benchmark replays must not drop frames the renderer was too slow for
+    if ( FAILED( g_Application.StartCapture(!options.replayFile.empty() && options.bFastReplay) ) )
+    {
+        MessageBox(NULL, L"Could not start capturing frames!", L"Error", MB_ICONHAND | MB_OK);
         return 0;
     }
 
+    CFrameScheduler& scheduler = g_Application.GetFrameScheduler();
+    scheduler.SetMaxFrameRate(options.maxFps);
+    scheduler.Start();
+
+    LARGE_INTEGER frequency, start, end;
+    QueryPerformanceFrequency(&frequency);
+    QueryPerformanceCounter(&start);
+
     // Main message loop
+    // Sleeps until a frame arrives or input changes the view instead of rendering flat out
     MSG msg = {0};
     while (WM_QUIT != msg.message)
     {
@@ -59,7 +206,98 @@ int WINAPI wWinMain(HINSTANCE hInstance, HINSTANCE hPrevInstance, LPWSTR lpCmdLi
         }
         else
         {
-            g_Application.Render();
+            if (scheduler.IsFrameDue())
+            {
+                g_Application.Render();
+            }
+
+            if (options.bHeadless && g_Application.IsEndOfStream())
+            {
+                break;
+            }
+
+            // nothing announces the end of a recording, headless runs check for it now and then
+            scheduler.Wait(options.bHeadless ? cHeadlessPollMs : INFINITE);
+        }
+    }
+
+    QueryPerformanceCounter(&end);
+
+    // The capture threads feed some of the statistics, and stage timings are only
+    // complete once no thread is recording any more
+    g_Application.StopThreads();
+
+    // Report throughput of the whole Render() path
+    double seconds = static_cast<double>(end.QuadPart - start.QuadPart) / frequency.QuadPart;
+    UINT frames = g_Application.GetDepthFrameCount();
+    const FrameSyncStats& sync = g_Application.GetSyncStats();
+    ULONGLONG validPoints = g_Application.GetValidPointCount();
+    ULONGLONG totalPoints = g_Application.GetTotalPointCount();
+    const CHeadTrackingWorker& headTracking = g_Application.GetHeadTracking();
+    const SkeletonSmootherStats& smoothing = g_Application.GetSkeletonSmootherStats();
+    double smoothingSamples = smoothing.samples > 0 ? static_cast<double>(smoothing.samples) : 1.0;
+    const CFrameCapture& capture = g_Application.GetCapture();
+    const ShaderCacheStats& shaders = g_Application.GetShaderCacheStats();
+    FrameSchedulerStats pacing;
+    scheduler.GetStats(&pacing);
+    double pacingSeconds = pacing.elapsedMs > 0.0 ? pacing.elapsedMs * 0.001 : 1.0;
+    const CFrameRecorder* pRecorder = g_Application.GetRecorder();
+    double rawDepthBytes = pRecorder ? static_cast<double>(pRecorder->GetRawDepthBytes()) : 0.0;
+    double recordedDepthBytes = pRecorder ? static_cast<double>(pRecorder->GetWrittenDepthBytes()) : 0.0;
+    const TsdfVolumeStats& fusion = g_Application.GetFusionStats();
+    WCHAR stats[2048];
+    swprintf_s(stats, L"frames=%u seconds=%.3f fps=%.2f ms/frame=%.3f paired=%u skipped=%u held=%u skew_avg_ms=%.2f skew_max_ms=%lld skipped_skew_max_ms=%lld skeleton_skew_avg_ms=%.2f skeleton_skew_max_ms=%lld points_valid=%llu points_total=%llu points_valid_pct=%.1f face_submitted=%ld face_skipped=%ld face_tracked=%ld skeleton_jitter_raw_mm=%.2f skeleton_jitter_smoothed_mm=%.2f skeleton_deviation_mm=%.2f frame_buffers=%u frame_buffer_growth=%u large_pages=%d shader_cache_hits=%u shader_cache_misses=%u shader_compile_ms=%.1f shader_load_ms=%.1f renders=%u renders_drawn=%u render_idle_pct=%.1f render_cpu_ms_per_s=%.1f render_cpu_idle_ms_per_s=%.1f frames_published=%ld depth_recorded_mb=%.1f depth_compression_ratio=%.2f sensors=%u sensor_frames=%u fusion_frames=%u fusion_blocks=%u fusion_evicted=%u fusion_dropped=%u fusion_triangles=%u\n",
+        frames, seconds, seconds > 0.0 ? frames / seconds : 0.0, frames > 0 ? seconds * 1000.0 / frames : 0.0,
+        sync.pairedCount, sync.skippedCount, sync.heldCount,
+        sync.pairedCount > 0 ? static_cast<double>(sync.pairedSkewSum) / sync.pairedCount : 0.0, sync.pairedSkewMax, sync.skippedSkewMax,
+        sync.skeletonCount > 0 ? static_cast<double>(sync.skeletonSkewSum) / sync.skeletonCount : 0.0, sync.skeletonSkewMax,
+        validPoints, totalPoints, totalPoints > 0 ? validPoints * 100.0 / totalPoints : 0.0,
+        headTracking.GetSubmittedCount(), headTracking.GetSkippedCount(), headTracking.GetTrackedCount(),
+        smoothing.rawJitterSum * 1000.0 / smoothingSamples, smoothing.smoothedJitterSum * 1000.0 / smoothingSamples, smoothing.deviationSum * 1000.0 / smoothingSamples,
+        capture.GetFrameBufferCount(), capture.GetFrameBufferGrowCount(), capture.IsLargePages() ? 1 : 0,
+        shaders.hitCount, shaders.missCount, shaders.compileMs, shaders.loadMs,
+        pacing.renderCount, pacing.drawnCount, pacing.waitMs * 100.0 / (pacingSeconds * 1000.0),
+        pacing.cpuMs / pacingSeconds, (std::max)(0.0, 1000.0 - pacing.cpuMs / pacingSeconds),
+        g_Application.GetPublishedFrameCount(),
+        recordedDepthBytes / (1024.0 * 1024.0), recordedDepthBytes > 0 ? rawDepthBytes / recordedDepthBytes : 0.0,
+        g_Application.GetSensorCount(), g_Application.GetAdditionalSensorFrameCount(),
+        fusion.frameCount, fusion.blockCount, fusion.evictedCount, fusion.droppedCount, g_Application.GetFusedTriangleCount());
+    OutputDebugStringW(stats);
+
+    std::string profile;
+    if (!options.traceFile.empty())
+    {
+        CFrameProfiler::Enable(false);
+
+        profile = CFrameProfiler::FormatSummary();
+        OutputDebugStringA(profile.c_str());
+
+        FILE* pFile = NULL;
+        if (0 == _wfopen_s(&pFile, options.traceFile.c_str(), L"w"))
+        {
+            CFrameProfiler::WriteChromeTrace(pFile);
+            fclose(pFile);
+        }
+    }
+
+    if (!options.softwarePrefix.empty())
+    {
+        g_Application.WriteSoftwareImages(options.softwarePrefix.c_str());
+    }
+
+    if (!options.poseTraceFile.empty())
+    {
+        g_Application.WritePoseTrace(options.poseTraceFile.c_str());
+    }
+
+    if (!options.statsFile.empty())
+    {
+        FILE* pFile = NULL;
+        if (0 == _wfopen_s(&pFile, options.statsFile.c_str(), L"w"))
+        {
+            fputws(stats, pFile);
+            fputs(profile.c_str(), pFile);
+            fclose(pFile);
         }
     }
 
@@ -103,21 +341,7 @@ LRESULT CALLBACK WndProc(HWND hWnd, UINT message, WPARAM wParam, LPARAM lParam)
 /// </summary>
 CDepthWithColorD3D::CDepthWithColorD3D()
 {
-
-
-    // get resolution as DWORDS, but store as LONGs to avoid casts later
-    DWORD width = 0;
-    DWORD height = 0;
-
-    NuiImageResolutionToSize(cDepthResolution, width, height);
-    m_depthWidth  = static_cast<LONG>(width);
-    m_depthHeight = static_cast<LONG>(height);
-
-    NuiImageResolutionToSize(cColorResolution, width, height);
-    m_colorWidth  = static_cast<LONG>(width);
-    m_colorHeight = static_cast<LONG>(height);
-
-    m_colorToDepthDivisor = m_colorWidth/m_depthWidth;
+    SetResolutions(NUI_IMAGE_RESOLUTION_640x480, NUI_IMAGE_RESOLUTION_640x480);
 
     m_hInst = NULL;
     m_hWnd = NULL;
@@ -131,11 +355,13 @@ CDepthWithColorD3D::CDepthWithColorD3D()
     m_pVertexLayout = NULL;
     m_pVertexBuffer = NULL;
     m_pCBChangesEveryFrame = NULL;
+    m_pCBStereoEveryFrame = NULL;
     m_projection;
 
     m_pVertexShader = NULL;
     m_pPixelShader = NULL;
     m_pGeometryShader = NULL;
+    m_pStereoGeometryShader = NULL;
 
     m_xyScale = 0.0f;
     
@@ -143,41 +369,70 @@ CDepthWithColorD3D::CDepthWithColorD3D()
     m_windowResX = 640;
     m_windowResY = 480;
 
-    m_pDepthTexture2D = NULL;
-    m_pDepthTextureRV = NULL;
-    m_pColorTexture2D = NULL;
-    m_pColorTextureRV = NULL;
     m_pColorSampler = NULL;
+    m_validPointSum = 0;
+    m_totalPointSum = 0;
+
+    m_bSoftwareRender = false;
+    m_bSinglePassStereo = true;
+
+    m_bFusion = false;
+    m_bShowFusion = false;
+    m_fusionFramesSinceExtract = 0;
+    m_pFusedVertexBuffer = NULL;
+    m_fusedVertexCapacity = 0;
+    m_fusedVertexCount = 0;
+    m_pSurfaceVertexShader = NULL;
+    m_pSurfaceLayout = NULL;
 
     m_bDepthReceived = false;
     m_bColorReceived = false;
 
-    m_hNextDepthFrameEvent = INVALID_HANDLE_VALUE;
-    m_pDepthStreamHandle = INVALID_HANDLE_VALUE;
-    m_hNextColorFrameEvent = INVALID_HANDLE_VALUE;
-    m_pColorStreamHandle = INVALID_HANDLE_VALUE;
-	m_hNextSkeletonEvent = INVALID_HANDLE_VALUE;
-	m_pSkeletonStreamhandle = INVALID_HANDLE_VALUE;
+    m_pFrameSource = NULL;
+    m_pRecorder = NULL;
+    m_depthFrameCount = 0;
 
 
 
-    m_depthD16 = new USHORT[m_depthWidth*m_depthHeight];
-    m_colorCoordinates = new LONG[m_depthWidth*m_depthHeight*2];
-    m_colorRGBX = new BYTE[m_colorWidth*m_colorHeight*cBytesPerPixel];
+    m_depthD16 = NULL;
+    m_colorRGBX = NULL;
+    m_colorCoordinates = NULL;
+
+    QueryPerformanceFrequency(&m_qpcFrequency);
+    m_syncPolicy = FRAME_SYNC_WAIT;
+    m_syncToleranceMs = 17;
+    m_syncWaitMs = 34;
+    m_skeletonHistoryCount = 0;
+    m_skeletonHistoryNext = 0;
 
     m_bNearMode = false;
 
     m_bPaused = false;
 
-	m_pFaceTracker = NULL;
-	m_pFTResult = NULL;
-	m_LastTrackSucceeded = false;
-	m_XCenterFace = 0;
-	m_YCenterFace = 0;
+	m_pHeadTracker = NULL;
+	m_bStubHeadTracker = false;
+	m_bFaceSearchHeadRegion = true;
+	m_sensorClockOffsetMs = 0.0;
+	m_bSensorClockOffset = false;
+	m_poseToPresentMs = 0.0;
+	m_poseUpdateTime = 0;
+	m_bRecordPoseTrace = false;
 
 	ftRect[0] = ftRect[1] = ftRect[2] = ftRect[3] = 0.0f;
+
+	// face tracking may run before the first skeleton frame arrives
+	for (int i = 0; i < NUI_SKELETON_COUNT; i++)
+	{
+		m_HeadPoint[i] = m_NeckPoint[i] = FT_VECTOR3D(0, 0, 0);
+		m_SkeletonTracked[i] = false;
+	}
 	faceTranslation[0] = faceTranslation[1] = faceTranslation[2] = -1.0f;
+	memcpy(m_headPosition, faceTranslation, sizeof(m_headPosition));
+	memcpy(m_drawnHeadPosition, faceTranslation, sizeof(m_drawnHeadPosition));
 
+	// the capture and tracking threads wake the render thread when they have something new
+	m_capture.SetPublishEvent(m_frameScheduler.GetWakeEvent());
+	m_headTracking.SetPublishEvent(m_frameScheduler.GetWakeEvent());
 }
 
 /// <summary>
@@ -185,11 +440,18 @@ CDepthWithColorD3D::CDepthWithColorD3D()
 /// </summary>
 CDepthWithColorD3D::~CDepthWithColorD3D()
 {
-    if (NULL != m_pNuiSensor)
+    // the capture threads use the source and the recorder, the tracking thread may read frames shared from the source
+    m_capture.Stop();
+    m_headTracking.Stop();
+
+    SAFE_DELETE(m_pRecorder);
+    SAFE_DELETE(m_pFrameSource);
+
+    for (size_t i = 0; i < m_sensors.size(); ++i)
     {
-        m_pNuiSensor->NuiShutdown();
-        m_pNuiSensor->Release();
+        delete m_sensors[i];
     }
+    m_sensors.clear();
 
     if (m_pImmediateContext) 
     {
@@ -197,34 +459,26 @@ CDepthWithColorD3D::~CDepthWithColorD3D()
     }
     
     SAFE_RELEASE(m_pCBChangesEveryFrame);
+    SAFE_RELEASE(m_pCBStereoEveryFrame);
     SAFE_RELEASE(m_pGeometryShader);
+    SAFE_RELEASE(m_pStereoGeometryShader);
     SAFE_RELEASE(m_pPixelShader);
     SAFE_RELEASE(m_pVertexBuffer);
     SAFE_RELEASE(m_pVertexLayout);
     SAFE_RELEASE(m_pVertexShader);
+    SAFE_RELEASE(m_pFusedVertexBuffer);
+    SAFE_RELEASE(m_pSurfaceLayout);
+    SAFE_RELEASE(m_pSurfaceVertexShader);
     SAFE_RELEASE(m_pDepthStencil);
     SAFE_RELEASE(m_pDepthStencilView);
-    SAFE_RELEASE(m_pDepthTexture2D);
-    SAFE_RELEASE(m_pDepthTextureRV);
-    SAFE_RELEASE(m_pColorTexture2D);
-    SAFE_RELEASE(m_pColorTextureRV);
     SAFE_RELEASE(m_pColorSampler);
     SAFE_RELEASE(m_pRenderTargetView);
     SAFE_RELEASE(m_pSwapChain);
     SAFE_RELEASE(m_pImmediateContext);
     SAFE_RELEASE(m_pd3dDevice);
 
-	SAFE_RELEASE(m_pFaceTracker);
-	SAFE_RELEASE(m_pFTResult);
-
-    CloseHandle(m_hNextDepthFrameEvent);
-    CloseHandle(m_hNextColorFrameEvent);
-	CloseHandle(m_hNextSkeletonEvent);
-
-    // done with pixel data
-    delete[] m_colorRGBX;
-    delete[] m_colorCoordinates;
-    delete[] m_depthD16;
+	// the worker using the tracker was stopped with the capture threads
+	SAFE_DELETE(m_pHeadTracker);
 }
 
 /// <summary>
@@ -301,6 +555,7 @@ LRESULT CDepthWithColorD3D::HandleMessages(HWND hWnd, UINT uMsg, WPARAM wParam,
             {
                 m_bPaused = true;
             }
+            m_frameScheduler.Invalidate();
             break;
 
         // handle restore from minimized
@@ -309,16 +564,34 @@ LRESULT CDepthWithColorD3D::HandleMessages(HWND hWnd, UINT uMsg, WPARAM wParam,
             {
                 m_bPaused = false;
             }
+            m_frameScheduler.Invalidate();
+            break;
+
+        // uncovered windows need the last frame drawn again
+        case WM_PAINT:
+            m_frameScheduler.Invalidate();
             break;
 
         case WM_KEYDOWN:
         {
             int nKey = static_cast<int>(wParam);
 
+            // the camera moves on keys, and near mode changes what is drawn
+            m_frameScheduler.Invalidate();
+
             if (nKey == 'N')
             {
                 ToggleNearMode();
             }
+            else if (nKey == 'F' && m_bFusion)
+            {
+                // the surface is extracted again before it is drawn
+                m_bShowFusion = !m_bShowFusion;
+                if (m_bShowFusion)
+                {
+                    UploadFusedSurface();
+                }
+            }
             break;
         }
     }
@@ -326,255 +599,495 @@ LRESULT CDepthWithColorD3D::HandleMessages(HWND hWnd, UINT uMsg, WPARAM wParam,
     return 0;
 }
 
+/// <summary>
+/// Choose the stream resolutions, call before the frame source and the device are created
+/// Replays switch to the resolutions they were recorded at
+/// </summary>
+/// <param name="depthResolution">resolution of the depth stream</param>
+/// <param name="colorResolution">resolution of the color stream, a whole multiple of the depth resolution</param>
+/// <returns>S_OK on success, E_INVALIDARG for a combination the color mapping cannot handle</returns>
+HRESULT CDepthWithColorD3D::SetResolutions(NUI_IMAGE_RESOLUTION depthResolution, NUI_IMAGE_RESOLUTION colorResolution)
+{
+    // get resolution as DWORDS, but store as LONGs to avoid casts later
+    DWORD depthWidth = 0;
+    DWORD depthHeight = 0;
+    DWORD colorWidth = 0;
+    DWORD colorHeight = 0;
+    NuiImageResolutionToSize(depthResolution, depthWidth, depthHeight);
+    NuiImageResolutionToSize(colorResolution, colorWidth, colorHeight);
+
+    // every color pixel is remapped from the depth pixel it falls in
+    if (0 == depthWidth || 0 == depthHeight || 0 != colorWidth % depthWidth || colorWidth / depthWidth != colorHeight / depthHeight)
+    {
+        return E_INVALIDARG;
+    }
+
+    m_depthResolution = depthResolution;
+    m_colorResolution = colorResolution;
+
+    m_depthWidth  = static_cast<LONG>(depthWidth);
+    m_depthHeight = static_cast<LONG>(depthHeight);
+    m_colorWidth  = static_cast<LONG>(colorWidth);
+    m_colorHeight = static_cast<LONG>(colorHeight);
+
+    m_colorToDepthDivisor = m_colorWidth/m_depthWidth;
+
+    m_pfnMapColorToDepth = GetMapColorToDepthFunc(m_colorWidth, m_colorHeight, m_depthWidth);
+
+    return S_OK;
+}
+
 /// <summary>
 /// Create the first connected Kinect found 
 /// </summary>
 /// <returns>indicates success or failure</returns>
 HRESULT CDepthWithColorD3D::CreateFirstConnected()
 {
-    INuiSensor * pNuiSensor = NULL;
-    HRESULT hr;
+    CKinectFrameSource* pKinect = new CKinectFrameSource(m_depthResolution, m_colorResolution);
 
-    int iSensorCount = 0;
-    hr = NuiGetSensorCount(&iSensorCount);
-    if (FAILED(hr) ) { return hr; }
-
-    // Look at each Kinect sensor
-    for (int i = 0; i < iSensorCount; ++i)
+    HRESULT hr = pKinect->CreateFirstConnected();
+    if (FAILED(hr))
     {
-        // Create the sensor so we can check status, if we can't create it, move on to the next
-        hr = NuiCreateSensorByIndex(i, &pNuiSensor);
-        if (FAILED(hr))
-        {
-            continue;
-        }
+        delete pKinect;
+        return hr;
+    }
 
-        // Get the status of the sensor, and if connected, then we can initialize it
-        hr = pNuiSensor->NuiStatus();
-        if (S_OK == hr)
-        {
-            m_pNuiSensor = pNuiSensor;
-            break;
-        }
+    m_pFrameSource = pKinect;
 
-        // This sensor wasn't OK, so release it since we're not using it
-        pNuiSensor->Release();
-    }
+    return InitializeFrameSource();
+}
+
+/// <summary>
+/// Play back a recording instead of using a sensor
+/// </summary>
+/// <param name="szFileName">path of the recording</param>
+/// <param name="bRealTime">true to pace frames by their timestamps, false to deliver as fast as possible</param>
+/// <param name="bLoop">true to restart the recording when it ends</param>
+/// <returns>S_OK on success, otherwise failure code</returns>
+HRESULT CDepthWithColorD3D::CreateReplaySource(LPCWSTR szFileName, bool bRealTime, bool bLoop)
+{
+    CReplayFrameSource* pReplay = new CReplayFrameSource(bRealTime, bLoop);
 
-    if (NULL == m_pNuiSensor)
+    HRESULT hr = pReplay->Open(szFileName);
+    if (SUCCEEDED(hr) && FAILED(SetResolutions(pReplay->GetDepthResolution(), pReplay->GetColorResolution())))
     {
-        return E_FAIL;
+        hr = HRESULT_FROM_WIN32(ERROR_BAD_FORMAT);
     }
 
-    // Initialize the Kinect and specify that we'll be using depth and color
-    hr = m_pNuiSensor->NuiInitialize(NUI_INITIALIZE_FLAG_USES_COLOR | NUI_INITIALIZE_FLAG_USES_DEPTH_AND_PLAYER_INDEX | NUI_INITIALIZE_FLAG_USES_SKELETON); 
-    if (FAILED(hr) ) { return hr; }
-
-    // Create an event that will be signaled when depth data is available
-    m_hNextDepthFrameEvent = CreateEvent(NULL, TRUE, FALSE, NULL);
-
-    // Open a depth image stream to receive depth frames
-    hr = m_pNuiSensor->NuiImageStreamOpen(
-        NUI_IMAGE_TYPE_DEPTH_AND_PLAYER_INDEX,
-        cDepthResolution,
-        0,
-        2,
-        m_hNextDepthFrameEvent,
-        &m_pDepthStreamHandle);
-    if (FAILED(hr) ) { return hr; }
-
-    // Create an event that will be signaled when color data is available
-    m_hNextColorFrameEvent = CreateEvent(NULL, TRUE, FALSE, NULL);
-
-    // Open a color image stream to receive color frames
-    hr = m_pNuiSensor->NuiImageStreamOpen(
-        NUI_IMAGE_TYPE_COLOR,
-        cColorResolution,
-        0,
-        2,
-        m_hNextColorFrameEvent,
-        &m_pColorStreamHandle );
-    if (FAILED(hr) ) { return hr; }
-
-	m_hNextSkeletonEvent = CreateEventW(NULL, TRUE, FALSE, NULL);
-	DWORD dwSkeletonFlags = NUI_SKELETON_TRACKING_FLAG_ENABLE_IN_NEAR_RANGE	| NUI_SKELETON_TRACKING_FLAG_ENABLE_SEATED_SUPPORT;
-	hr = m_pNuiSensor->NuiSkeletonTrackingEnable(m_hNextSkeletonEvent, dwSkeletonFlags);
-	if (FAILED(hr)) { return hr; }
-
-    // Start with near mode on
-    ToggleNearMode();
+    if (FAILED(hr))
+    {
+        delete pReplay;
+        return hr;
+    }
 
-	FT_CAMERA_CONFIG videoConfig;
-	FT_CAMERA_CONFIG depthConfig;
-	FT_CAMERA_CONFIG* pDepthConfig = NULL;
+    m_pFrameSource = pReplay;
 
+    // older recordings hold skeletons that were smoothed while recording
+    m_capture.SetSkeletonSmoothing(pReplay->HasRawSkeletons());
 
-	videoConfig.FocalLength = NUI_CAMERA_COLOR_NOMINAL_FOCAL_LENGTH_IN_PIXELS;
-	videoConfig.Height = m_colorHeight;
-	videoConfig.Width = m_colorWidth;
+    return InitializeFrameSource();
+}
 
-	depthConfig.FocalLength = NUI_CAMERA_DEPTH_NOMINAL_FOCAL_LENGTH_IN_PIXELS *2.0f;
-	depthConfig.Width = m_depthWidth;
-	depthConfig.Height = m_depthHeight; 
-	pDepthConfig = &depthConfig;
+/// <summary>
+/// Add another connected Kinect, its point cloud is drawn along with the primary sensor's
+/// Call after the primary sensor is created and before the device
+/// </summary>
+/// <param name="connectedIndex">which of the ready sensors to use, counting from 0, the primary Kinect is 0</param>
+/// <param name="extrinsics">transform from the sensor's space into the primary sensor's</param>
+/// <returns>S_OK on success, otherwise failure code</returns>
+HRESULT CDepthWithColorD3D::AddConnectedSensor(UINT connectedIndex, const PointCloudTransform& extrinsics)
+{
+    CKinectFrameSource* pKinect = new CKinectFrameSource(m_depthResolution, m_colorResolution);
 
-	m_pFaceTracker = FTCreateFaceTracker(_opt);
-	if (!m_pFaceTracker)
-	{
-		MessageBoxW(m_hWnd, L"Could not create the face tracker.\n", L"Face Tracker Initialization Error\n", MB_OK);
-		return 2;
-	}
-	
+    // only the primary sensor's skeletons are used, tracking them elsewhere would just cost time
+    HRESULT hr = pKinect->CreateConnected(connectedIndex, false);
+    if (FAILED(hr))
+    {
+        delete pKinect;
+        return hr;
+    }
 
-	hr = m_pFaceTracker->Initialize(&videoConfig, pDepthConfig, NULL, NULL);
-	if (FAILED(hr))
-	{
-		MessageBoxW(m_hWnd, L"Could initialized the face tracker.\n", L"Face Tracker Initialization Error\n", MB_OK);
-		return 2;
-	}
+    pKinect->SetNearMode(m_bNearMode);
 
-	hr = m_pFaceTracker->CreateFTResult(&m_pFTResult);
-	if (FAILED(hr) || !m_pFTResult)
-	{
-		MessageBoxW(m_hWnd, L"Could not initialize the face tracker result.\n", L"Face Tracker Initialization Error\n", MB_OK);
-		return 4;
-	}
+    CSensorCloud* pSensor = new CSensorCloud(pKinect, extrinsics);
+    pSensor->ConfigureSync(m_syncPolicy, m_syncToleranceMs, m_syncWaitMs);
+    m_sensors.push_back(pSensor);
 
-	m_colorImage = FTCreateImage();
-	if (!m_colorImage || FAILED(hr = m_colorImage->Attach(m_colorWidth,m_colorHeight, m_colorRGBX, FTIMAGEFORMAT_UINT8_B8G8R8X8,m_colorWidth*4)))
-	{
-		return 5;
-	}
+    return hr;
+}
 
-	if (pDepthConfig)
-	{
-		m_depthImage = FTCreateImage();
-		if (!m_depthImage || FAILED(hr = m_depthImage->Attach(m_depthWidth,m_colorHeight,m_depthD16, FTIMAGEFORMAT_UINT16_D13P3, m_depthWidth)))
-		{
-			return 6;
-		}
-	}
+/// <summary>
+/// Add a recording played back as another sensor, its point cloud is drawn along with the primary sensor's
+/// Call after the primary sensor is created and before the device
+/// </summary>
+/// <param name="szFileName">path of the recording, made at the primary sensor's resolutions</param>
+/// <param name="bRealTime">true to pace frames by their timestamps, false to deliver as fast as possible</param>
+/// <param name="bLoop">true to restart the recording when it ends</param>
+/// <param name="extrinsics">transform from the sensor's space into the primary sensor's</param>
+/// <returns>S_OK on success, ERROR_BAD_FORMAT for a recording at other resolutions, otherwise failure code</returns>
+HRESULT CDepthWithColorD3D::AddReplaySensor(LPCWSTR szFileName, bool bRealTime, bool bLoop, const PointCloudTransform& extrinsics)
+{
+    CReplayFrameSource* pReplay = new CReplayFrameSource(bRealTime, bLoop);
 
+    // every sensor shares the shaders' depth size and the remap implementation
+    HRESULT hr = pReplay->Open(szFileName);
+    if (SUCCEEDED(hr) && (pReplay->GetDepthResolution() != m_depthResolution || pReplay->GetColorResolution() != m_colorResolution))
+    {
+        hr = HRESULT_FROM_WIN32(ERROR_BAD_FORMAT);
+    }
 
-	SetCenterOfImage(NULL);
-	m_LastTrackSucceeded = false;
+    if (FAILED(hr))
+    {
+        delete pReplay;
+        return hr;
+    }
 
-	m_hint3D[0] = m_hint3D[1] = FT_VECTOR3D(0, 0, 0);
+    CSensorCloud* pSensor = new CSensorCloud(pReplay, extrinsics);
+    pSensor->ConfigureSync(m_syncPolicy, m_syncToleranceMs, m_syncWaitMs);
+    m_sensors.push_back(pSensor);
 
     return hr;
 }
 
-void CDepthWithColorD3D::SetCenterOfImage(IFTResult* pResult)
+/// <summary>
+/// Frame pairs drawn from the additional sensors, summed over all of them
+/// </summary>
+UINT CDepthWithColorD3D::GetAdditionalSensorFrameCount() const
 {
-	float centerX = ((float)m_colorWidth) / 2.0f;
-	float centerY = ((float)m_colorHeight) / 2.0f;
-	if (pResult)
-	{
-		if (SUCCEEDED(pResult->GetStatus()))
-		{
-			RECT faceRect;
-			pResult->GetFaceRect(&faceRect);
-			centerX = (faceRect.left + faceRect.right) / 2.0f;
-			centerY = (faceRect.top + faceRect.bottom) / 2.0f;
-		}
-		m_XCenterFace += 0.02f*(centerX - m_XCenterFace);
-		m_YCenterFace += 0.02f*(centerY - m_YCenterFace);
-	}
-	else
-	{
-		m_XCenterFace = centerX;
-		m_YCenterFace = centerY;
-	}
+    UINT frameCount = 0;
+    for (size_t i = 0; i < m_sensors.size(); ++i)
+    {
+        frameCount += m_sensors[i]->GetFrameCount();
+    }
+
+    return frameCount;
 }
 
 /// <summary>
-/// Toggles between near and default mode
-/// Does nothing on a non-Kinect for Windows device
+/// Record every frame received from the frame source
 /// </summary>
-/// <returns>S_OK for success, or failure code</returns>
-HRESULT CDepthWithColorD3D::ToggleNearMode()
+/// <param name="szFileName">path of the recording</param>
+/// <param name="depthCodec">how depth frames are stored</param>
+/// <returns>S_OK on success, otherwise failure code</returns>
+HRESULT CDepthWithColorD3D::StartRecording(LPCWSTR szFileName, RecordingDepthCodec depthCodec)
 {
-    HRESULT hr = E_FAIL;
-
-    if ( m_pNuiSensor )
+    if (NULL == m_pFrameSource)
     {
-        hr = m_pNuiSensor->NuiImageStreamSetImageFrameFlags(m_pDepthStreamHandle, m_bNearMode ? 0 : NUI_IMAGE_STREAM_FLAG_ENABLE_NEAR_MODE);
+        return E_UNEXPECTED;
+    }
 
-        if ( SUCCEEDED(hr) )
-        {
-            m_bNearMode = !m_bNearMode;
-        }
+    m_pRecorder = new CFrameRecorder();
+
+    HRESULT hr = m_pRecorder->Open(szFileName, m_depthResolution, m_colorResolution, m_pFrameSource, depthCodec);
+    if (FAILED(hr))
+    {
+        SAFE_DELETE(m_pRecorder);
     }
 
     return hr;
 }
 
 /// <summary>
-/// Compile and set layout for shaders
+/// Publish every synchronized frame into a named shared memory ring, for other processes
+/// Call once the resolutions are settled
 /// </summary>
-/// <returns>S_OK for success, or failure code</returns>
-HRESULT CDepthWithColorD3D::LoadShaders()
+/// <param name="szName">name of the ring</param>
+/// <returns>S_OK on success, otherwise failure code</returns>
+HRESULT CDepthWithColorD3D::StartPublishing(LPCWSTR szName)
 {
-    // Compile the geometry shader
-    ID3D10Blob* pBlob = NULL;
-    HRESULT hr = CompileShaderFromFile(L"DepthWithColor-D3D.fx", "GS", "gs_4_0", &pBlob);
-    if ( FAILED(hr) ) { return hr; };
-
-    // Create the geometry shader
-    hr = m_pd3dDevice->CreateGeometryShader(pBlob->GetBufferPointer(), pBlob->GetBufferSize(), NULL, &m_pGeometryShader);
-    SAFE_RELEASE(pBlob);
-    if ( FAILED(hr) ) { return hr; }
-
-    // Compile the pixel shader
-    hr = CompileShaderFromFile(L"DepthWithColor-D3D.fx", "PS", "ps_4_0", &pBlob);
-    if ( FAILED(hr) ) { return hr; }
-
-    // Create the pixel shader
-    hr = m_pd3dDevice->CreatePixelShader(pBlob->GetBufferPointer(), pBlob->GetBufferSize(), NULL, &m_pPixelShader);
-    SAFE_RELEASE(pBlob);
-    if ( FAILED(hr) ) { return hr; }
+    // a quarter second at 30fps before a stalled reader loses frames
+    const UINT cSharedFrameSlots = 8;
 
-    // Compile the vertex shader
-    hr = CompileShaderFromFile(L"DepthWithColor-D3D.fx", "VS", "vs_4_0", &pBlob);
-    if ( FAILED(hr) ) { return hr; }
+    return m_frameRing.Create(szName, cSharedFrameSlots, m_depthWidth, m_depthHeight, m_colorWidth, m_colorHeight);
+}
 
-    // Create the vertex shader
-    hr = m_pd3dDevice->CreateVertexShader(pBlob->GetBufferPointer(), pBlob->GetBufferSize(), NULL, &m_pVertexShader);
-    if ( SUCCEEDED(hr) )
+/// <summary>
+/// Start draining the frame source on capture threads
+/// Call once the source and any recording are set up
+/// </summary>
+/// <param name="bLossless">true to deliver every frame, pacing the source to rendering, false to keep only the latest</param>
+/// <returns>S_OK on success, otherwise failure code</returns>
+HRESULT CDepthWithColorD3D::StartCapture(bool bLossless)
+{
+    if (NULL == m_pFrameSource)
     {
-        // Define the vertex input layout
-        D3D11_INPUT_ELEMENT_DESC layout[] = { { "POSITION", 0, DXGI_FORMAT_R16_SINT, 0, 0, D3D11_INPUT_PER_VERTEX_DATA, 0 } };
-
-        // Create the vertex input layout
-        hr = m_pd3dDevice->CreateInputLayout(layout, ARRAYSIZE(layout), pBlob->GetBufferPointer(), pBlob->GetBufferSize(), &m_pVertexLayout);
+        return E_UNEXPECTED;
     }
 
-    SAFE_RELEASE(pBlob);
-    if ( FAILED(hr) ) { return hr; }
+    HRESULT hr = m_capture.Start(m_pFrameSource, m_pRecorder, m_depthWidth, m_depthHeight, m_colorWidth, m_colorHeight, bLossless);
 
-    // Set the input vertex layout
-    // In this case we don't actually use it for anything
-    // All the work is done in the geometry shader, but we need something here
-    // We only need to set this once since we have only one vertex format
-    m_pImmediateContext->IASetInputLayout(m_pVertexLayout);
+    // the other sensors wake the render thread the same way the primary one does
+    for (size_t i = 0; i < m_sensors.size() && SUCCEEDED(hr); ++i)
+    {
+        hr = m_sensors[i]->StartCapture(bLossless, m_frameScheduler.GetWakeEvent());
+    }
 
     return hr;
 }
 
 /// <summary>
-/// Create Direct3D device and swap chain
+/// Stop the capture threads, the head tracking thread and the worker pool, so no thread but the caller's records stages
+/// Later renders run the pool's work inline
 /// </summary>
-/// <returns>S_OK for success, or failure code</returns>
-HRESULT CDepthWithColorD3D::InitDevice()
+void CDepthWithColorD3D::StopThreads()
 {
-    HRESULT hr = S_OK;
+    // no new frames arrive afterwards
+    m_capture.Stop();
 
-    RECT rc;
-    GetClientRect(m_hWnd, &rc);
-    UINT width = rc.right - rc.left;
-    UINT height = rc.bottom - rc.top;
+    for (size_t i = 0; i < m_sensors.size(); ++i)
+    {
+        m_sensors[i]->StopCapture();
+    }
 
-    UINT createDeviceFlags = 0;
+    m_headTracking.Stop();
+    m_workerPool.Stop();
+}
+
+/// <summary>
+/// Set how depth and color frames are paired, for every sensor
+/// </summary>
+/// <param name="policy">what to do with frames further apart than the tolerance</param>
+/// <param name="toleranceMs">largest timestamp difference of frames that belong together</param>
+/// <param name="maxWaitMs">how long the wait policy holds mismatched frames</param>
+void CDepthWithColorD3D::ConfigureSync(FrameSyncPolicy policy, int toleranceMs, int maxWaitMs)
+{
+    m_syncPolicy = policy;
+    m_syncToleranceMs = toleranceMs;
+    m_syncWaitMs = maxWaitMs;
+
+    m_synchronizer.Configure(policy, toleranceMs, maxWaitMs);
+
+    for (size_t i = 0; i < m_sensors.size(); ++i)
+    {
+        m_sensors[i]->ConfigureSync(policy, toleranceMs, maxWaitMs);
+    }
+}
+
+/// <summary>
+/// Whether the frame sources of every sensor have delivered their last frame
+/// </summary>
+bool CDepthWithColorD3D::IsEndOfStream() const
+{
+    if (NULL == m_pFrameSource || !m_pFrameSource->IsEndOfStream() || !m_capture.IsDrained())
+    {
+        return false;
+    }
+
+    for (size_t i = 0; i < m_sensors.size(); ++i)
+    {
+        if (!m_sensors[i]->IsEndOfStream())
+        {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+/// <summary>
+/// Set up face tracking once a frame source is available
+/// </summary>
+/// <returns>S_OK on success, otherwise failure code</returns>
+HRESULT CDepthWithColorD3D::InitializeFrameSource()
+{
+    HRESULT hr = S_OK;
+
+    // Start with near mode on
+    ToggleNearMode();
+
+	if (m_bStubHeadTracker)
+	{
+		m_pHeadTracker = new CStubHeadTracker(0);
+	}
+	else
+	{
+		CFaceTrackLibTracker* pFaceTracker = new CFaceTrackLibTracker();
+		m_pHeadTracker = pFaceTracker;
+		pFaceTracker->SetUseHeadRegion(m_bFaceSearchHeadRegion);
+
+		hr = pFaceTracker->Initialize(_opt, m_colorWidth, m_colorHeight, m_depthWidth, m_depthHeight);
+		if (FAILED(hr))
+		{
+			// carry on without face tracking, the user view keeps its default eye position
+			MessageBoxW(m_hWnd, L"Could not initialize the face tracker.\n", L"Face Tracker Initialization Error\n", MB_OK);
+			SAFE_DELETE(m_pHeadTracker);
+			return S_FALSE;
+		}
+	}
+
+	hr = m_headTracking.Start(m_pHeadTracker, m_colorWidth, m_colorHeight, m_depthWidth, m_depthHeight);
+	if (FAILED(hr)) { return hr; }
+
+	m_headPredictor.Reset();
+
+	m_hint3D[0] = m_hint3D[1] = FT_VECTOR3D(0, 0, 0);
+
+    return hr;
+}
+
+/// <summary>
+/// Toggles between near and default mode
+/// Does nothing on a non-Kinect for Windows device
+/// </summary>
+/// <returns>S_OK for success, or failure code</returns>
+HRESULT CDepthWithColorD3D::ToggleNearMode()
+{
+    HRESULT hr = E_FAIL;
+
+    if ( m_pFrameSource )
+    {
+        hr = m_pFrameSource->SetNearMode(!m_bNearMode);
+
+        if ( SUCCEEDED(hr) )
+        {
+            m_bNearMode = !m_bNearMode;
+
+            // recordings have no range to switch, only the other Kinects follow
+            for (size_t i = 0; i < m_sensors.size(); ++i)
+            {
+                m_sensors[i]->SetNearMode(m_bNearMode);
+            }
+        }
+    }
+
+    return hr;
+}
+
+namespace
+{
+    // shaders are read relative to the working directory, and cached next to them
+    const WCHAR cShaderFile[] = L"DepthWithColor-D3D.fx";
+    const WCHAR cShaderCacheDirectory[] = L"ShaderCache";
+
+    // every entry point LoadShaders loads, for building the cache ahead of time
+    const LPCSTR cShaderEntryPoints[][2] =
+    {
+        { "GS", "gs_4_0" },
+        { "GSStereo", "gs_4_0" },
+        { "PS", "ps_4_0" },
+        { "VS", "vs_4_0" },
+        { "VSSurface", "vs_4_0" },
+    };
+}
+
+/// <summary>
+/// Compile every shader into the bytecode cache without creating a device, the offline build step
+/// </summary>
+/// <returns>S_OK for success, or failure code</returns>
+HRESULT CDepthWithColorD3D::BuildShaderCache()
+{
+    CShaderCache cache;
+    HRESULT hr = cache.Open(cShaderFile, cShaderCacheDirectory, 0);
+
+    for (size_t i = 0; i < _countof(cShaderEntryPoints) && SUCCEEDED(hr); ++i)
+    {
+        ID3D10Blob* pBlob = NULL;
+        hr = cache.Load(cShaderEntryPoints[i][0], cShaderEntryPoints[i][1], &pBlob);
+        SAFE_RELEASE(pBlob);
+    }
+
+    return hr;
+}
+
+/// <summary>
+/// Load shaders from the bytecode cache, compiling those missing, and set layout for shaders
+/// </summary>
+/// <returns>S_OK for success, or failure code</returns>
+HRESULT CDepthWithColorD3D::LoadShaders()
+{
+    HRESULT hr = m_shaderCache.Open(cShaderFile, cShaderCacheDirectory, 0);
+    if ( FAILED(hr) ) { return hr; }
+
+    // Load the geometry shader
+    ID3D10Blob* pBlob = NULL;
+    hr = m_shaderCache.Load("GS", "gs_4_0", &pBlob);
+    if ( FAILED(hr) ) { return hr; };
+
+    // Create the geometry shader
+    hr = m_pd3dDevice->CreateGeometryShader(pBlob->GetBufferPointer(), pBlob->GetBufferSize(), NULL, &m_pGeometryShader);
+    SAFE_RELEASE(pBlob);
+    if ( FAILED(hr) ) { return hr; }
+
+    // Load the single pass stereo geometry shader
+    hr = m_shaderCache.Load("GSStereo", "gs_4_0", &pBlob);
+    if ( FAILED(hr) ) { return hr; }
+
+    // Create the single pass stereo geometry shader
+    hr = m_pd3dDevice->CreateGeometryShader(pBlob->GetBufferPointer(), pBlob->GetBufferSize(), NULL, &m_pStereoGeometryShader);
+    SAFE_RELEASE(pBlob);
+    if ( FAILED(hr) ) { return hr; }
+
+    // Load the pixel shader
+    hr = m_shaderCache.Load("PS", "ps_4_0", &pBlob);
+    if ( FAILED(hr) ) { return hr; }
+
+    // Create the pixel shader
+    hr = m_pd3dDevice->CreatePixelShader(pBlob->GetBufferPointer(), pBlob->GetBufferSize(), NULL, &m_pPixelShader);
+    SAFE_RELEASE(pBlob);
+    if ( FAILED(hr) ) { return hr; }
+
+    // Load the vertex shader
+    hr = m_shaderCache.Load("VS", "vs_4_0", &pBlob);
+    if ( FAILED(hr) ) { return hr; }
+
+    // Create the vertex shader
+    hr = m_pd3dDevice->CreateVertexShader(pBlob->GetBufferPointer(), pBlob->GetBufferSize(), NULL, &m_pVertexShader);
+    if ( SUCCEEDED(hr) )
+    {
+        // Define the vertex input layout
+        D3D11_INPUT_ELEMENT_DESC layout[] = { { "POSITION", 0, DXGI_FORMAT_R16_SINT, 0, 0, D3D11_INPUT_PER_VERTEX_DATA, 0 } };
+
+        // Create the vertex input layout
+        hr = m_pd3dDevice->CreateInputLayout(layout, ARRAYSIZE(layout), pBlob->GetBufferPointer(), pBlob->GetBufferSize(), &m_pVertexLayout);
+    }
+
+    SAFE_RELEASE(pBlob);
+    if ( FAILED(hr) ) { return hr; }
+
+    // Load the fused surface vertex shader
+    hr = m_shaderCache.Load("VSSurface", "vs_4_0", &pBlob);
+    if ( FAILED(hr) ) { return hr; }
+
+    // Create the fused surface vertex shader
+    hr = m_pd3dDevice->CreateVertexShader(pBlob->GetBufferPointer(), pBlob->GetBufferSize(), NULL, &m_pSurfaceVertexShader);
+    if ( SUCCEEDED(hr) )
+    {
+        // PointCloudPoint, the BGRX bytes read back as RGB
+        D3D11_INPUT_ELEMENT_DESC layout[] =
+        {
+            { "POSITION", 0, DXGI_FORMAT_R32G32B32_FLOAT, 0, 0, D3D11_INPUT_PER_VERTEX_DATA, 0 },
+            { "COLOR", 0, DXGI_FORMAT_B8G8R8A8_UNORM, 0, 12, D3D11_INPUT_PER_VERTEX_DATA, 0 },
+        };
+
+        hr = m_pd3dDevice->CreateInputLayout(layout, ARRAYSIZE(layout), pBlob->GetBufferPointer(), pBlob->GetBufferSize(), &m_pSurfaceLayout);
+    }
+
+    SAFE_RELEASE(pBlob);
+    if ( FAILED(hr) ) { return hr; }
+
+    // Set the input vertex layout
+    // In this case we don't actually use it for anything
+    // All the work is done in the geometry shader, but we need something here
+    // Only the fused surface has vertices of its own, it sets its layout and puts this one back
+    m_pImmediateContext->IASetInputLayout(m_pVertexLayout);
+
+    return hr;
+}
+
+/// <summary>
+/// Create Direct3D device and swap chain
+/// </summary>
+/// <returns>S_OK for success, or failure code</returns>
+HRESULT CDepthWithColorD3D::InitDevice()
+{
+    HRESULT hr = S_OK;
+
+    RECT rc;
+    GetClientRect(m_hWnd, &rc);
+    UINT width = rc.right - rc.left;
+    UINT height = rc.bottom - rc.top;
+
+    UINT createDeviceFlags = 0;
 
     // Likely won't be very performant in reference
     D3D_DRIVER_TYPE driverTypes[] =
@@ -706,45 +1219,15 @@ HRESULT CDepthWithColorD3D::InitDevice()
 
     m_pImmediateContext->OMSetRenderTargets(1, &m_pRenderTargetView, m_pDepthStencilView);
 
-    // Create depth texture
-    D3D11_TEXTURE2D_DESC depthTexDesc = {0};
-    depthTexDesc.Width = m_depthWidth;
-    depthTexDesc.Height = m_depthHeight;
-    depthTexDesc.MipLevels = 1;
-    depthTexDesc.ArraySize = 1;
-    depthTexDesc.Format = DXGI_FORMAT_R16_SINT;
-    depthTexDesc.SampleDesc.Count = 1;
-    depthTexDesc.SampleDesc.Quality = 0;
-    depthTexDesc.Usage = D3D11_USAGE_DYNAMIC;
-    depthTexDesc.BindFlags = D3D11_BIND_SHADER_RESOURCE;
-    depthTexDesc.CPUAccessFlags = D3D11_CPU_ACCESS_WRITE;
-    depthTexDesc.MiscFlags = 0;
-
-    hr = m_pd3dDevice->CreateTexture2D(&depthTexDesc, NULL, &m_pDepthTexture2D);
-    if ( FAILED(hr) ) { return hr; }
-    
-    hr = m_pd3dDevice->CreateShaderResourceView(m_pDepthTexture2D, NULL, &m_pDepthTextureRV);
-    if ( FAILED(hr) ) { return hr; }
-
-    // Create color texture
-    D3D11_TEXTURE2D_DESC colorTexDesc = {0};
-    colorTexDesc.Width = m_colorWidth;
-    colorTexDesc.Height = m_colorHeight;
-    colorTexDesc.MipLevels = 1;
-    colorTexDesc.ArraySize = 1;
-    colorTexDesc.Format = DXGI_FORMAT_B8G8R8A8_UNORM;
-    colorTexDesc.SampleDesc.Count = 1;
-    colorTexDesc.SampleDesc.Quality = 0;
-    colorTexDesc.Usage = D3D11_USAGE_DYNAMIC;
-    colorTexDesc.BindFlags = D3D11_BIND_SHADER_RESOURCE;
-    colorTexDesc.CPUAccessFlags = D3D11_CPU_ACCESS_WRITE;
-    colorTexDesc.MiscFlags = 0;
-
-    hr = m_pd3dDevice->CreateTexture2D( &colorTexDesc, NULL, &m_pColorTexture2D );
+    // Create the depth and color textures and the list of depth pixels to draw of every sensor
+    hr = m_sensorTextures.Create(m_pd3dDevice, m_depthWidth, m_depthHeight, m_colorWidth, m_colorHeight);
     if ( FAILED(hr) ) { return hr; }
 
-    hr = m_pd3dDevice->CreateShaderResourceView(m_pColorTexture2D, NULL, &m_pColorTextureRV);
-    if ( FAILED(hr) ) { return hr; }
+    for (size_t i = 0; i < m_sensors.size(); ++i)
+    {
+        hr = m_sensors[i]->CreateTextures(m_pd3dDevice, m_depthWidth, m_depthHeight, m_colorWidth, m_colorHeight);
+        if ( FAILED(hr) ) { return hr; }
+    }
 
     // Setup the viewport
     D3D11_VIEWPORT vp;
@@ -790,6 +1273,10 @@ HRESULT CDepthWithColorD3D::InitDevice()
     hr = m_pd3dDevice->CreateBuffer(&bd, NULL, &m_pCBChangesEveryFrame);
     if ( FAILED(hr) ) { return hr; }
 
+    bd.ByteWidth = sizeof(CBStereoEveryFrame);
+    hr = m_pd3dDevice->CreateBuffer(&bd, NULL, &m_pCBStereoEveryFrame);
+    if ( FAILED(hr) ) { return hr; }
+
     // Create the sample state
     D3D11_SAMPLER_DESC sampDesc;
     ZeroMemory( &sampDesc, sizeof(sampDesc) );
@@ -847,30 +1334,39 @@ HRESULT CDepthWithColorD3D::InitDevice()
 /// <returns>S_OK for success, or failure code</returns>
 HRESULT CDepthWithColorD3D::ProcessDepth()
 {
-    NUI_IMAGE_FRAME imageFrame;
+    // The capture thread has already copied the frame and computed its color coordinates
+    if ( !m_capture.AcquireDepth() ) { return S_FALSE; }
 
-    HRESULT hr = m_pNuiSensor->NuiImageStreamGetNextFrame(m_pDepthStreamHandle, 0, &imageFrame);
-    if ( FAILED(hr) ) { return hr; }
-   
-    NUI_LOCKED_RECT LockedRect;
-    hr = imageFrame.pFrameTexture->LockRect(0, &LockedRect, NULL, 0);
-    if ( FAILED(hr) ) { return hr; }
+    const CFrameCapture::DepthFrame& frame = m_capture.GetDepth();
+    m_depthD16 = frame.depth.Get<USHORT>();
+    m_colorCoordinates = frame.colorCoordinates.Get<LONG>();
 
-    memcpy(m_depthD16, LockedRect.pBits, LockedRect.size);
     m_bDepthReceived = true;
+    ++m_depthFrameCount;
 
-    hr = imageFrame.pFrameTexture->UnlockRect(0);
-    if ( FAILED(hr) ) { return hr; };
+    return S_OK;
+}
 
-    hr = m_pNuiSensor->NuiImageStreamReleaseFrame(m_pDepthStreamHandle, &imageFrame);
+/// <summary>
+/// Copy the current depth frame to the depth texture
+/// </summary>
+/// <returns>S_OK for success, or failure code</returns>
+HRESULT CDepthWithColorD3D::UploadDepth()
+{
+    return m_sensorTextures.UploadDepth(m_pImmediateContext, m_depthD16);
+}
 
-    // copy to our d3d 11 depth texture
-    D3D11_MAPPED_SUBRESOURCE msT;
-    hr = m_pImmediateContext->Map(m_pDepthTexture2D, NULL, D3D11_MAP_WRITE_DISCARD, NULL, &msT);
+/// <summary>
+/// Upload the indices of the depth pixels worth drawing, so draws scale with the scene instead of the sensor
+/// </summary>
+/// <returns>S_OK for success, or failure code</returns>
+HRESULT CDepthWithColorD3D::UploadPointIndices()
+{
+    HRESULT hr = m_sensorTextures.UploadPointIndices(m_pImmediateContext, m_depthD16, &m_workerPool);
     if ( FAILED(hr) ) { return hr; }
 
-    memcpy(msT.pData, m_depthD16, LockedRect.size);    
-    m_pImmediateContext->Unmap(m_pDepthTexture2D, NULL);
+    m_validPointSum += m_sensorTextures.GetPointCount();
+    m_totalPointSum += m_depthWidth * m_depthHeight;
 
     return hr;
 }
@@ -881,39 +1377,48 @@ HRESULT CDepthWithColorD3D::ProcessDepth()
 /// <returns>S_OK for success, or failure code</returns>
 HRESULT CDepthWithColorD3D::ProcessColor()
 {
-    NUI_IMAGE_FRAME imageFrame;
+    if ( !m_capture.AcquireColor() ) { return S_FALSE; }
 
-    HRESULT hr = m_pNuiSensor->NuiImageStreamGetNextFrame(m_pColorStreamHandle, 0, &imageFrame);
-    if ( FAILED(hr) ) { return hr; }
-  
-    NUI_LOCKED_RECT LockedRect;
-    hr = imageFrame.pFrameTexture->LockRect(0, &LockedRect, NULL, 0);
-    if ( FAILED(hr) ) { return hr; }
+    m_colorRGBX = m_capture.GetColor().color.GetData();
 
-    memcpy(m_colorRGBX, LockedRect.pBits, LockedRect.size);
     m_bColorReceived = true;
 
-    hr = imageFrame.pFrameTexture->UnlockRect(0);
-    if ( FAILED(hr) ) { return hr; };
-
-    hr = m_pNuiSensor->NuiImageStreamReleaseFrame(m_pColorStreamHandle, &imageFrame);
-    
-    return hr;
+    return S_OK;
 }
 
 HRESULT CDepthWithColorD3D::ProcessSkeleton()
 {
-	NUI_SKELETON_FRAME SkeletonFrame = { 0 };
+	if (!m_capture.AcquireSkeleton())
+	{
+		return S_FALSE;
+	}
 
-	HRESULT hr = NuiSkeletonGetNextFrame(0, &SkeletonFrame);
-	NUI_TRANSFORM_SMOOTH_PARAMETERS somewhatLatentParams =
-	{ 0.5f, 0.1f, 0.5f, 0.1f, 0.1f };
-	if (FAILED(hr))
+	// Only remembered here, the frame matching the next depth frame is picked once it pairs up
+	m_skeletonHistory[m_skeletonHistoryNext] = m_capture.GetSkeleton();
+	m_skeletonHistoryNext = (m_skeletonHistoryNext + 1) % cSkeletonHistory;
+	if (m_skeletonHistoryCount < cSkeletonHistory)
 	{
-		return hr;
+		++m_skeletonHistoryCount;
+	}
+
+	return S_OK;
+}
+
+bool CDepthWithColorD3D::SelectSkeleton()
+{
+	int64_t timeStamps[cSkeletonHistory];
+	for (int i = 0; i < m_skeletonHistoryCount; i++)
+	{
+		timeStamps[i] = m_skeletonHistory[i].liTimeStamp.QuadPart;
+	}
+
+	int selected = m_synchronizer.SelectNearest(timeStamps, m_skeletonHistoryCount, m_capture.GetDepth().timeStamp);
+	if (selected < 0)
+	{
+		return false;
 	}
 
-	m_pNuiSensor->NuiTransformSmooth(&SkeletonFrame, &somewhatLatentParams);
+	const NUI_SKELETON_FRAME& SkeletonFrame = m_skeletonHistory[selected];
 
 	for (int i = 0; i < NUI_SKELETON_COUNT; i++)
 	{
@@ -921,13 +1426,12 @@ HRESULT CDepthWithColorD3D::ProcessSkeleton()
 			NUI_SKELETON_POSITION_TRACKED == SkeletonFrame.SkeletonData[i].eSkeletonPositionTrackingState[NUI_SKELETON_POSITION_HEAD] &&
 			NUI_SKELETON_POSITION_TRACKED == SkeletonFrame.SkeletonData[i].eSkeletonPositionTrackingState[NUI_SKELETON_POSITION_SHOULDER_CENTER])
 		{
+			// already smoothed on the capture thread
+			const Vector4& head = SkeletonFrame.SkeletonData[i].SkeletonPositions[NUI_SKELETON_POSITION_HEAD];
+			const Vector4& neck = SkeletonFrame.SkeletonData[i].SkeletonPositions[NUI_SKELETON_POSITION_SHOULDER_CENTER];
 			m_SkeletonTracked[i] = true;
-			m_HeadPoint[i].x = SkeletonFrame.SkeletonData[i].SkeletonPositions[NUI_SKELETON_POSITION_HEAD].x;
-			m_HeadPoint[i].y = SkeletonFrame.SkeletonData[i].SkeletonPositions[NUI_SKELETON_POSITION_HEAD].y;
-			m_HeadPoint[i].z = SkeletonFrame.SkeletonData[i].SkeletonPositions[NUI_SKELETON_POSITION_HEAD].z;
-			m_NeckPoint[i].x = SkeletonFrame.SkeletonData[i].SkeletonPositions[NUI_SKELETON_POSITION_SHOULDER_CENTER].x;
-			m_NeckPoint[i].y = SkeletonFrame.SkeletonData[i].SkeletonPositions[NUI_SKELETON_POSITION_SHOULDER_CENTER].y;
-			m_NeckPoint[i].z = SkeletonFrame.SkeletonData[i].SkeletonPositions[NUI_SKELETON_POSITION_SHOULDER_CENTER].z;
+			m_HeadPoint[i] = FT_VECTOR3D(head.x, head.y, head.z);
+			m_NeckPoint[i] = FT_VECTOR3D(neck.x, neck.y, neck.z);
 		}
 		else
 		{
@@ -935,47 +1439,18 @@ HRESULT CDepthWithColorD3D::ProcessSkeleton()
 			m_SkeletonTracked[i] = false;
 		}
 	}
+
+	return true;
 }
 
 HRESULT CDepthWithColorD3D::GetClosestHint(FT_VECTOR3D* pHint3D)
 {
-	int selectedSkeleton = -1;
-	float smallestDistance = 0;
-
 	if (!pHint3D)
 	{
 		return(E_POINTER);
 	}
 
-	if (pHint3D[1].x == 0 && pHint3D[1].y == 0 && pHint3D[1].z == 0)
-	{
-		// Get the skeleton closest to the camera
-		for (int i = 0; i < NUI_SKELETON_COUNT; i++)
-		{
-			if (m_SkeletonTracked[i] && (smallestDistance == 0 || m_HeadPoint[i].z < smallestDistance))
-			{
-				smallestDistance = m_HeadPoint[i].z;
-				selectedSkeleton = i;
-			}
-		}
-	}
-	else
-	{   // Get the skeleton closest to the previous position
-		for (int i = 0; i < NUI_SKELETON_COUNT; i++)
-		{
-			if (m_SkeletonTracked[i])
-			{
-				float d = abs(m_HeadPoint[i].x - pHint3D[1].x) +
-					abs(m_HeadPoint[i].y - pHint3D[1].y) +
-					abs(m_HeadPoint[i].z - pHint3D[1].z);
-				if (smallestDistance == 0 || d < smallestDistance)
-				{
-					smallestDistance = d;
-					selectedSkeleton = i;
-				}
-			}
-		}
-	}
+	int selectedSkeleton = SelectClosestSkeleton(m_SkeletonTracked, m_HeadPoint, NUI_SKELETON_COUNT, pHint3D[1]);
 	if (selectedSkeleton == -1)
 	{
 		return E_FAIL;
@@ -993,59 +1468,93 @@ HRESULT CDepthWithColorD3D::GetClosestHint(FT_VECTOR3D* pHint3D)
 /// <returns>S_OK for success, or failure code</returns>
 HRESULT CDepthWithColorD3D::MapColorToDepth()
 {
-    HRESULT hr;
-
-    // Get of x, y coordinates for color in depth space
-    // This will allow us to later compensate for the differences in location, angle, etc between the depth and color cameras
-    m_pNuiSensor->NuiImageGetColorPixelCoordinateFrameFromDepthPixelFrameAtResolution(
-        cColorResolution,
-        cDepthResolution,
-        m_depthWidth*m_depthHeight,
-        m_depthD16,
-        m_depthWidth*m_depthHeight*2,
-        m_colorCoordinates
-        );
+    PROFILE_SCOPE("map color to depth");
+
+    ColorMappingDesc desc;
+    GetColorMappingDesc(&desc);
 
     // copy to our d3d 11 color texture
-    D3D11_MAPPED_SUBRESOURCE msT;
-    hr = m_pImmediateContext->Map(m_pColorTexture2D, NULL, D3D11_MAP_WRITE_DISCARD, NULL, &msT);
+    HRESULT hr = m_sensorTextures.UploadColor(m_pImmediateContext, desc, m_pfnMapColorToDepth, &m_workerPool);
     if ( FAILED(hr) ) { return hr; }
-    
-    // loop over each row and column of the color
-    for (LONG y = 0; y < m_colorHeight; ++y)
+
+    // reading back the write-combined mapping would be slow, the software renderer and fusion get their own remap
+    if (m_bSoftwareRender || m_bFusion)
     {
-        LONG* pDest = (LONG*)((BYTE*)msT.pData + msT.RowPitch * y);
-        for (LONG x = 0; x < m_colorWidth; ++x)
-        {
-            // calculate index into depth array
-            int depthIndex = x/m_colorToDepthDivisor + y/m_colorToDepthDivisor * m_depthWidth;
+        m_softwareColor.resize(m_colorWidth * m_colorHeight * cBytesPerPixel);
 
-            // retrieve the depth to color mapping for the current depth pixel
-            LONG colorInDepthX = m_colorCoordinates[depthIndex * 2];
-            LONG colorInDepthY = m_colorCoordinates[depthIndex * 2 + 1];
+        MapColorToDepthParallel(desc, m_pfnMapColorToDepth, &m_softwareColor[0], m_colorWidth * cBytesPerPixel, &m_workerPool);
 
-            // make sure the depth pixel maps to a valid point in color space
-            if ( colorInDepthX >= 0 && colorInDepthX < m_colorWidth && colorInDepthY >= 0 && colorInDepthY < m_colorHeight )
-            {
-                // calculate index into color array
-                LONG colorIndex = colorInDepthX + colorInDepthY * m_colorWidth;
+        // holding the handle keeps the paired depth out of the pool until the next pair
+        m_softwareDepth = m_capture.GetDepth().depth;
+    }
 
-                // set source for copy to the color pixel
-                LONG* pSrc = (LONG *)m_colorRGBX + colorIndex;
-                *pDest = *pSrc;
-            }
-            else
-            {
-                *pDest = 0;
-            }
+    return hr;
+}
 
-            pDest++;
-        }
+/// <summary>
+/// Describe the remap of the current color frame to depth space
+/// </summary>
+/// <param name="pDesc">receives the description</param>
+void CDepthWithColorD3D::GetColorMappingDesc(ColorMappingDesc* pDesc) const
+{
+    // m_colorCoordinates was filled in by the depth capture thread
+    // the sensor's LONG coordinates are 32 bit, which the remap kernels rely on
+    C_ASSERT(sizeof(LONG) == sizeof(int32_t));
+
+    pDesc->pColorCoordinates = reinterpret_cast<const int32_t*>(m_colorCoordinates);
+    pDesc->pColor = m_colorRGBX;
+    pDesc->colorWidth = m_colorWidth;
+    pDesc->colorHeight = m_colorHeight;
+    pDesc->depthWidth = m_depthWidth;
+    pDesc->colorToDepthDivisor = m_colorToDepthDivisor;
+}
+
+/// <summary>
+/// Publish the current frame pair, skeleton hint and newest face pose to the shared memory ring
+/// </summary>
+void CDepthWithColorD3D::PublishFrame()
+{
+    if (!m_frameRing.IsOpen())
+    {
+        return;
     }
 
-    m_pImmediateContext->Unmap(m_pColorTexture2D, NULL);
+    PROFILE_SCOPE("publish frame");
 
-    return hr;
+    // readers still looking at the frame this slot held find it overwritten when they validate
+    SharedFrameSlot slot;
+    m_frameRing.BeginFrame(&slot);
+
+    const CFrameCapture::DepthFrame& depth = m_capture.GetDepth();
+    slot.pInfo->depthFrameNumber = depth.frameNumber;
+    slot.pInfo->depthTimeStamp = depth.timeStamp;
+    slot.pInfo->colorTimeStamp = m_capture.GetColor().timeStamp;
+
+    UINT depthRowBytes = static_cast<UINT>(m_depthWidth * sizeof(USHORT));
+    CopyImageRows(slot.pDepth, depthRowBytes, m_depthD16, depthRowBytes, depthRowBytes, static_cast<UINT>(m_depthHeight));
+
+    // remapped once more straight into the slot, like the software renderer's copy
+    ColorMappingDesc desc;
+    GetColorMappingDesc(&desc);
+
+    MapColorToDepthParallel(desc, m_pfnMapColorToDepth, slot.pColor, m_colorWidth * cBytesPerPixel, &m_workerPool);
+
+    slot.pInfo->bHasHint = SUCCEEDED(GetClosestHint(m_hint3D));
+    for (int i = 0; i < 2; ++i)
+    {
+        slot.pInfo->hint[i][0] = m_hint3D[i].x;
+        slot.pInfo->hint[i][1] = m_hint3D[i].y;
+        slot.pInfo->hint[i][2] = m_hint3D[i].z;
+    }
+
+    // tracking lags the frames, readers match the pose to its frame by timestamp
+    const HeadPose& pose = m_headTracking.GetPose();
+    slot.pInfo->bFaceTracked = pose.bTracked;
+    memcpy(slot.pInfo->faceTranslation, pose.translation, sizeof(slot.pInfo->faceTranslation));
+    memcpy(slot.pInfo->faceRect, pose.rect, sizeof(slot.pInfo->faceRect));
+    slot.pInfo->faceTimeStamp = pose.timeStamp;
+
+    m_frameRing.EndFrame();
 }
 
 /// <summary>
@@ -1054,51 +1563,88 @@ HRESULT CDepthWithColorD3D::MapColorToDepth()
 /// <returns>S_OK for success, or failure code</returns>
 HRESULT CDepthWithColorD3D::Render()
 {
+    // Input and window changes always redraw, otherwise only new content does
+    bool bDraw = m_frameScheduler.BeginFrame();
+
     if (m_bPaused)
     {
+        m_frameScheduler.EndFrame(false, false);
         return S_OK;
     }
 
-    bool needToMapColorToDepth = false;
-	bool gotHint = false;
+    PROFILE_SCOPE("render");
+
+    // The capture threads drain the sensor, we just pick up whatever is newest without waiting
+    bool newDepth = ( S_OK == ProcessDepth() );
+    bool newColor = ( S_OK == ProcessColor() );
+    ProcessSkeleton();
+
+    bool bHeadMoved = false;
 
-    if ( WAIT_OBJECT_0 == WaitForSingleObject(m_hNextDepthFrameEvent, 0) )
+    // If we have not yet received any data for either color or depth since we started up, we shouldn't draw
+    if (m_bDepthReceived && m_bColorReceived)
     {
-        // if we have received any valid new depth data we may need to draw
-        if ( SUCCEEDED(ProcessDepth()) )
+        LARGE_INTEGER now;
+        QueryPerformanceCounter(&now);
+
+        // Only frames taken at about the same time are combined, otherwise the color would be misregistered
+        FrameSyncDecision decision = m_synchronizer.Update(
+            newDepth, m_capture.GetDepth().timeStamp,
+            newColor, m_capture.GetColor().timeStamp,
+            now.QuadPart * 1000 / m_qpcFrequency.QuadPart);
+
+        if (FRAME_SYNC_PAIRED == decision)
         {
-            needToMapColorToDepth = true;
+            // the quickest a frame ever arrived bounds the offset between the sensor and our clock
+            double offsetMs = now.QuadPart * 1000.0 / m_qpcFrequency.QuadPart - m_capture.GetDepth().timeStamp;
+            if (!m_bSensorClockOffset || offsetMs < m_sensorClockOffsetMs)
+            {
+                m_sensorClockOffsetMs = offsetMs;
+                m_bSensorClockOffset = true;
+            }
+
+            UploadDepth();
+            UploadPointIndices();
+            MapColorToDepth();
+
+            if (m_bFusion)
+            {
+                UpdateFusion();
+            }
+
+            // the skeleton only provides hints, face tracking runs without one too
+            SelectSkeleton();
+            SubmitHeadTracking();
+            PublishFrame();
+
+            bDraw = true;
         }
+
+        // tracking finishes whenever it does, the views use the newest pose available
+        // prediction keeps moving the head for a while after the last pose
+        UpdateHeadPose();
+        bHeadMoved = 0 != memcmp(m_headPosition, m_drawnHeadPosition, sizeof(m_headPosition));
     }
 
-    if ( WAIT_OBJECT_0 == WaitForSingleObject(m_hNextColorFrameEvent, 0) )
+    // the other sensors pair and upload their own frames, any of them having something new redraws
+    for (size_t i = 0; i < m_sensors.size(); ++i)
     {
-        // if we have received any valid new color data we may need to draw
-        if ( SUCCEEDED(ProcessColor()) )
+        if (m_sensors[i]->Update(m_pImmediateContext, m_pfnMapColorToDepth, &m_workerPool))
         {
-            needToMapColorToDepth = true;
+            bDraw = true;
         }
     }
-	if (WAIT_OBJECT_0 == WaitForSingleObject(m_hNextSkeletonEvent, 0))
-	{
-		if (SUCCEEDED(ProcessSkeleton()))
-		{
-			gotHint = true;
-		}
-	}
-
 
-    // If we have not yet received any data for either color or depth since we started up, we shouldn't draw
-    if (!m_bDepthReceived || !m_bColorReceived)
+    // Nothing new to show, the last presented frames stay on screen
+    if (!bDraw && !bHeadMoved)
     {
-        needToMapColorToDepth = false;
+        m_frameScheduler.EndFrame(false, false);
+        return S_OK;
     }
+
+    memcpy(m_drawnHeadPosition, m_headPosition, sizeof(m_drawnHeadPosition));
+
 	float ClearColor[4] = { 0.0f, 0.0f, 0.0f, 1.0f };
-    if (needToMapColorToDepth & gotHint)
-    {
-        MapColorToDepth();
-		CheckCameraInput();
-    }
 
 
 	
@@ -1131,24 +1677,29 @@ HRESULT CDepthWithColorD3D::Render()
     cb.Projection = XMMatrixTranspose(m_projection);
     cb.XYScale = XMFLOAT4(m_xyScale, -m_xyScale, 0.f, 0.f); 
 	cb.Rectangle = XMFLOAT4(ftRect[0], ftRect[1], ftRect[2], ftRect[3]);
-    m_pImmediateContext->UpdateSubresource(m_pCBChangesEveryFrame, 0, NULL, &cb, 0, 0);
+    cb.DepthSize = XMFLOAT4(static_cast<float>(m_depthWidth), static_cast<float>(m_depthHeight), 1.0f / m_depthWidth, 1.0f / m_depthHeight);
 
     // Set up shaders
     m_pImmediateContext->VSSetShader(m_pVertexShader, NULL, 0);
 
     m_pImmediateContext->GSSetShader(m_pGeometryShader, NULL, 0);
     m_pImmediateContext->GSSetConstantBuffers(0, 1, &m_pCBChangesEveryFrame);
-    m_pImmediateContext->GSSetShaderResources(0, 1, &m_pDepthTextureRV);
-    m_pImmediateContext->GSSetShaderResources(1, 1, &m_pColorTextureRV);
     m_pImmediateContext->GSSetSamplers(0, 1, &m_pColorSampler);
 
     m_pImmediateContext->PSSetShader(m_pPixelShader, NULL, 0);
 
     // Draw the scene
-    m_pImmediateContext->Draw(m_depthWidth * m_depthHeight, 0);
+    // Draws only queue work, the GPU time of a view shows up in its Present
+    {
+        PROFILE_SCOPE("draw kinect view");
+        DrawPointClouds(&cb);
+    }
 
     // Present our back buffer to our front buffer
-    m_pSwapChain->Present(0, 0);
+    {
+        PROFILE_SCOPE("present kinect view");
+        m_pSwapChain->Present(0, 0);
+    }
 
 
 
@@ -1161,129 +1712,495 @@ HRESULT CDepthWithColorD3D::Render()
 	// Clear the depth buffer to 1.0 (max depth)
 	m_pImmediateContext->ClearDepthStencilView(m_pDepthStencilView, D3D11_CLEAR_DEPTH, 1.0f, 0);
 
-	vp.Width = static_cast<FLOAT>(m_windowResX/2);
-	vp.Height = static_cast<FLOAT>(m_windowResY);
-	vp.MinDepth = 0.0f;
-	vp.MaxDepth = 1.0f;
-	vp.TopLeftX = 0;
-	vp.TopLeftY = 0;
-	m_pImmediateContext->RSSetViewports(1, &vp);
-
-
-	XMVECTOR m_eye = XMVectorSet(faceTranslation[0]-0.1,faceTranslation[1],faceTranslation[2]-0.1, 0.0f);
+	XMVECTOR m_eye = XMVectorSet(m_headPosition[0]-0.1,m_headPosition[1],m_headPosition[2]-0.1, 0.0f);
 	XMVECTOR m_at = XMVectorSet(0.f, 0.f, -1.5f, 0.f);
     XMVECTOR m_up = XMVectorSet(0.f, 1.f, 0.f, 0.f);
-	XMMATRIX user_view = XMMatrixLookAtLH(m_eye, m_at, m_up);
+	XMMATRIX left_view = XMMatrixLookAtLH(m_eye, m_at, m_up);
+
+	m_eye = XMVectorSet(m_headPosition[0]+0.1, m_headPosition[1], m_headPosition[2] - 0.1, 0.0f);
+	XMMATRIX right_view = XMMatrixLookAtLH(m_eye, m_at, m_up);
+
+	// left and right halves of the user window
+	D3D11_VIEWPORT eyeViewports[2];
+	for (int eye = 0; eye < 2; ++eye)
+	{
+		eyeViewports[eye].Width = static_cast<FLOAT>(m_windowResX / 2);
+		eyeViewports[eye].Height = static_cast<FLOAT>(m_windowResY);
+		eyeViewports[eye].MinDepth = 0.0f;
+		eyeViewports[eye].MaxDepth = 1.0f;
+		eyeViewports[eye].TopLeftX = static_cast<FLOAT>(eye * (m_windowResX / 2));
+		eyeViewports[eye].TopLeftY = 0;
+	}
+
+	// the fused surface has no stereo geometry shader, it is drawn once per eye
+	if (m_bSinglePassStereo && !m_bShowFusion)
+	{
+		// Both eyes come out of one pass, the geometry shader picks the viewport
+		// Projection, XYScale and Rectangle are still bound from the Kinect view
+		CBStereoEveryFrame stereo;
+		stereo.EyeView[0] = XMMatrixTranspose(left_view);
+		stereo.EyeView[1] = XMMatrixTranspose(right_view);
+		m_pImmediateContext->UpdateSubresource(m_pCBStereoEveryFrame, 0, NULL, &stereo, 0, 0);
 
-	// Update variables that change once per frame
-	//CBChangesEveryFrame cb;
-	cb.View = XMMatrixTranspose(user_view);
-	//cb.Projection = XMMatrixTranspose(m_projection);
-	//cb.XYScale = XMFLOAT4(m_xyScale, -m_xyScale, 0.f, 0.f);
-	//cb.Rectangle = XMFLOAT4(ftRect[0], ftRect[1], ftRect[2], ftRect[3]);
-	m_pImmediateContext->UpdateSubresource(m_pCBChangesEveryFrame, 0, NULL, &cb, 0, 0);
+		m_pImmediateContext->RSSetViewports(2, eyeViewports);
+		m_pImmediateContext->GSSetShader(m_pStereoGeometryShader, NULL, 0);
+		m_pImmediateContext->GSSetConstantBuffers(1, 1, &m_pCBStereoEveryFrame);
 
-	// Set up shaders
-	m_pImmediateContext->VSSetShader(m_pVertexShader, NULL, 0);
+		{
+			PROFILE_SCOPE("draw both eyes");
+			DrawPointClouds(&cb);
+		}
+	}
+	else
+	{
+		m_pImmediateContext->RSSetViewports(1, &eyeViewports[0]);
 
-	m_pImmediateContext->GSSetShader(m_pGeometryShader, NULL, 0);
-	m_pImmediateContext->GSSetConstantBuffers(0, 1, &m_pCBChangesEveryFrame);
-	m_pImmediateContext->GSSetShaderResources(0, 1, &m_pDepthTextureRV);
-	m_pImmediateContext->GSSetShaderResources(1, 1, &m_pColorTextureRV);
-	m_pImmediateContext->GSSetSamplers(0, 1, &m_pColorSampler);
+		// Update variables that change once per frame
+		cb.View = XMMatrixTranspose(left_view);
 
-	m_pImmediateContext->PSSetShader(m_pPixelShader, NULL, 0);
+		// Set up shaders
+		m_pImmediateContext->VSSetShader(m_pVertexShader, NULL, 0);
 
-	// Draw the scene
-	m_pImmediateContext->Draw(m_depthWidth * m_depthHeight, 0);
+		m_pImmediateContext->GSSetShader(m_pGeometryShader, NULL, 0);
+		m_pImmediateContext->GSSetConstantBuffers(0, 1, &m_pCBChangesEveryFrame);
+		m_pImmediateContext->GSSetSamplers(0, 1, &m_pColorSampler);
 
+		m_pImmediateContext->PSSetShader(m_pPixelShader, NULL, 0);
 
-	vp.Width = static_cast<FLOAT>(m_windowResX / 2);
-	vp.Height = static_cast<FLOAT>(m_windowResY);
-	vp.MinDepth = 0.0f;
-	vp.MaxDepth = 1.0f;
-	vp.TopLeftX = m_windowResX / 2;
-	vp.TopLeftY = 0;
-	m_pImmediateContext->RSSetViewports(1, &vp);
+		// Draw the scene
+		{
+			PROFILE_SCOPE("draw left eye");
+			DrawPointClouds(&cb);
+		}
 
-	m_eye = XMVectorSet(faceTranslation[0]+0.1, faceTranslation[1], faceTranslation[2] - 0.1, 0.0f);
-	m_at = XMVectorSet(0.f, 0.f, -1.5f, 0.f);
-	m_up = XMVectorSet(0.f, 1.f, 0.f, 0.f);
-	user_view = XMMatrixLookAtLH(m_eye, m_at, m_up);
+		m_pImmediateContext->RSSetViewports(1, &eyeViewports[1]);
 
-	// Update variables that change once per frame
-	//CBChangesEveryFrame cb;
-	cb.View = XMMatrixTranspose(user_view);
-	//cb.Projection = XMMatrixTranspose(m_projection);
-	//cb.XYScale = XMFLOAT4(m_xyScale, -m_xyScale, 0.f, 0.f);
-	//cb.Rectangle = XMFLOAT4(ftRect[0], ftRect[1], ftRect[2], ftRect[3]);
-	m_pImmediateContext->UpdateSubresource(m_pCBChangesEveryFrame, 0, NULL, &cb, 0, 0);
+		// Update variables that change once per frame
+		cb.View = XMMatrixTranspose(right_view);
 
-	// Set up shaders
-	m_pImmediateContext->VSSetShader(m_pVertexShader, NULL, 0);
+		// Set up shaders
+		m_pImmediateContext->VSSetShader(m_pVertexShader, NULL, 0);
 
-	m_pImmediateContext->GSSetShader(m_pGeometryShader, NULL, 0);
-	m_pImmediateContext->GSSetConstantBuffers(0, 1, &m_pCBChangesEveryFrame);
-	m_pImmediateContext->GSSetShaderResources(0, 1, &m_pDepthTextureRV);
-	m_pImmediateContext->GSSetShaderResources(1, 1, &m_pColorTextureRV);
-	m_pImmediateContext->GSSetSamplers(0, 1, &m_pColorSampler);
+		m_pImmediateContext->GSSetShader(m_pGeometryShader, NULL, 0);
+		m_pImmediateContext->GSSetConstantBuffers(0, 1, &m_pCBChangesEveryFrame);
+		m_pImmediateContext->GSSetSamplers(0, 1, &m_pColorSampler);
 
-	m_pImmediateContext->PSSetShader(m_pPixelShader, NULL, 0);
+		m_pImmediateContext->PSSetShader(m_pPixelShader, NULL, 0);
 
-	// Draw the scene
-	m_pImmediateContext->Draw(m_depthWidth * m_depthHeight, 0);
+		// Draw the scene
+		{
+			PROFILE_SCOPE("draw right eye");
+			DrawPointClouds(&cb);
+		}
+	}
 
+	// the CPU copies are drawn while the GPU works through the queued draws
+	if (m_bSoftwareRender && !m_softwareColor.empty())
+	{
+		RenderSoftware(m_camera.View, left_view, right_view);
+	}
 
 	// Present our back buffer to our front buffer
-	return m_pSwapChain_user->Present(0, 0);
+	HRESULT hr;
+	{
+		PROFILE_SCOPE("present user view");
+		hr = m_pSwapChain_user->Present(0, 0);
+	}
+
+	// how long the head position waits for the screen, the next frame predicts that far ahead
+	if (0 != m_poseUpdateTime)
+	{
+		LARGE_INTEGER presented;
+		QueryPerformanceCounter(&presented);
+		double poseToPresentMs = (presented.QuadPart - m_poseUpdateTime) * 1000.0 / m_qpcFrequency.QuadPart;
+		m_poseToPresentMs += 0.1 * (poseToPresentMs - m_poseToPresentMs);
+	}
+
+	m_frameScheduler.EndFrame(true, bHeadMoved);
+
+	return hr;
+}
+
+/// <summary>
+/// Draw the point cloud of every sensor, each moved into the primary sensor's space
+/// </summary>
+/// <param name="pCB">per frame constants of the view, its World is overwritten per sensor</param>
+void CDepthWithColorD3D::DrawPointClouds(CBChangesEveryFrame* pCB)
+{
+    pCB->World = XMMatrixIdentity();
+    m_pImmediateContext->UpdateSubresource(m_pCBChangesEveryFrame, 0, NULL, pCB, 0, 0);
+
+    // the fused surface stands in for the primary sensor's cloud, the others are still drawn as points
+    if (m_bShowFusion)
+    {
+        DrawFusedSurface();
+    }
+    else
+    {
+        m_sensorTextures.Bind(m_pImmediateContext);
+        m_pImmediateContext->Draw(m_sensorTextures.GetPointCount(), 0);
+    }
+
+    for (size_t i = 0; i < m_sensors.size(); ++i)
+    {
+        const CSensorTextures& textures = m_sensors[i]->GetTextures();
+        if (0 == textures.GetPointCount())
+        {
+            continue;
+        }
+
+        // the extrinsics are row vector matrices like XMMATRIX, the shader wants them transposed
+        XMFLOAT4X4 world(&m_sensors[i]->GetExtrinsics().m[0][0]);
+        pCB->World = XMMatrixTranspose(XMLoadFloat4x4(&world));
+        m_pImmediateContext->UpdateSubresource(m_pCBChangesEveryFrame, 0, NULL, pCB, 0, 0);
+
+        textures.Bind(m_pImmediateContext);
+        m_pImmediateContext->Draw(textures.GetPointCount(), 0);
+    }
+}
+
+// integrated frames between extractions of the shown surface, extracting takes several times longer than integrating
+static const UINT cFusionExtractInterval = 15;
+
+/// <summary>
+/// Fuse the primary sensor's frames into a voxel volume, F toggles drawing its surface instead of the point cloud
+/// </summary>
+/// <param name="params">resolution and memory budget of the volume</param>
+void CDepthWithColorD3D::EnableFusion(const TsdfVolumeParams& params)
+{
+    m_fusion.Create(params);
+    m_bFusion = true;
+}
+
+/// <summary>
+/// Fuse the current frame pair into the volume, and extract its surface again when it is shown and due
+/// </summary>
+/// <returns>S_OK on success, otherwise failure code</returns>
+HRESULT CDepthWithColorD3D::UpdateFusion()
+{
+    PROFILE_SCOPE("fuse frame");
+
+    PointCloudDesc desc;
+    desc.pDepth = m_softwareDepth.Get<USHORT>();
+    desc.pColor = &m_softwareColor[0];
+    desc.colorPitch = m_colorWidth * cBytesPerPixel;
+    desc.depthWidth = m_depthWidth;
+    desc.depthHeight = m_depthHeight;
+    desc.colorWidth = m_colorWidth;
+    desc.colorHeight = m_colorHeight;
+    desc.xyScale = m_xyScale;
+
+    m_fusion.Integrate(desc, &m_workerPool);
+
+    ++m_fusionFramesSinceExtract;
+    if (!m_bShowFusion || m_fusionFramesSinceExtract < cFusionExtractInterval)
+    {
+        return S_OK;
+    }
+
+    return UploadFusedSurface();
+}
+
+/// <summary>
+/// Extract the fused surface and copy it into the fused vertex buffer, growing the buffer as needed
+/// </summary>
+/// <returns>S_OK on success, otherwise failure code</returns>
+HRESULT CDepthWithColorD3D::UploadFusedSurface()
+{
+    PROFILE_SCOPE("extract fused surface");
+
+    m_fusion.ExtractSurface(&m_workerPool, &m_fusedVertices);
+    m_fusionFramesSinceExtract = 0;
+
+    UINT vertexCount = static_cast<UINT>(m_fusedVertices.size());
+    if (0 == vertexCount)
+    {
+        m_fusedVertexCount = 0;
+        return S_OK;
+    }
+
+    // the surface grows as the scene is seen, doubling keeps reallocations rare
+    if (vertexCount > m_fusedVertexCapacity)
+    {
+        SAFE_RELEASE(m_pFusedVertexBuffer);
+        m_fusedVertexCount = 0;
+        m_fusedVertexCapacity = (std::max)(vertexCount, m_fusedVertexCapacity * 2);
+
+        D3D11_BUFFER_DESC bd = {0};
+        bd.ByteWidth = m_fusedVertexCapacity * sizeof(PointCloudPoint);
+        bd.Usage = D3D11_USAGE_DYNAMIC;
+        bd.BindFlags = D3D11_BIND_VERTEX_BUFFER;
+        bd.CPUAccessFlags = D3D11_CPU_ACCESS_WRITE;
+
+        HRESULT hr = m_pd3dDevice->CreateBuffer(&bd, NULL, &m_pFusedVertexBuffer);
+        if ( FAILED(hr) )
+        {
+            m_fusedVertexCapacity = 0;
+            return hr;
+        }
+    }
+
+    D3D11_MAPPED_SUBRESOURCE msT;
+    HRESULT hr = m_pImmediateContext->Map(m_pFusedVertexBuffer, NULL, D3D11_MAP_WRITE_DISCARD, NULL, &msT);
+    if ( FAILED(hr) ) { return hr; }
+
+    memcpy(msT.pData, &m_fusedVertices[0], vertexCount * sizeof(PointCloudPoint));
+    m_pImmediateContext->Unmap(m_pFusedVertexBuffer, NULL);
+
+    m_fusedVertexCount = vertexCount;
+
+    return hr;
+}
+
+/// <summary>
+/// Draw the fused surface with the point cloud shaders set up, restoring them afterwards
+/// </summary>
+void CDepthWithColorD3D::DrawFusedSurface()
+{
+    if (0 == m_fusedVertexCount)
+    {
+        return;
+    }
+
+    // real vertices this time, transformed by the vertex shader with nothing to expand
+    UINT stride = sizeof(PointCloudPoint);
+    UINT offset = 0;
+    m_pImmediateContext->IASetInputLayout(m_pSurfaceLayout);
+    m_pImmediateContext->IASetVertexBuffers(0, 1, &m_pFusedVertexBuffer, &stride, &offset);
+    m_pImmediateContext->IASetPrimitiveTopology(D3D11_PRIMITIVE_TOPOLOGY_TRIANGLELIST);
+    m_pImmediateContext->VSSetShader(m_pSurfaceVertexShader, NULL, 0);
+    m_pImmediateContext->VSSetConstantBuffers(0, 1, &m_pCBChangesEveryFrame);
+    m_pImmediateContext->GSSetShader(NULL, NULL, 0);
+
+    m_pImmediateContext->Draw(m_fusedVertexCount, 0);
+
+    // back to the placeholder points the geometry shader expands
+    stride = 0;
+    m_pImmediateContext->IASetInputLayout(m_pVertexLayout);
+    m_pImmediateContext->IASetVertexBuffers(0, 1, &m_pVertexBuffer, &stride, &offset);
+    m_pImmediateContext->IASetPrimitiveTopology(D3D11_PRIMITIVE_TOPOLOGY_POINTLIST);
+    m_pImmediateContext->VSSetShader(m_pVertexShader, NULL, 0);
+    m_pImmediateContext->GSSetShader(m_pGeometryShader, NULL, 0);
+}
+
+/// <summary>
+/// Copy a view or projection matrix into the software renderer's layout, row vectors like XMFLOAT4X4
+/// </summary>
+/// <param name="matrix">matrix to copy</param>
+/// <param name="result">receives the matrix</param>
+static void StoreSplatMatrix(const XMMATRIX& matrix, float result[4][4])
+{
+    XMFLOAT4X4 stored;
+    XMStoreFloat4x4(&stored, matrix);
+    memcpy(result, stored.m, sizeof(stored.m));
+}
+
+/// <summary>
+/// Draw the current frame with the software renderer, using the same matrices as the D3D draws
+/// </summary>
+/// <param name="kinectView">view matrix of the Kinect view</param>
+/// <param name="leftView">view matrix of the left eye</param>
+/// <param name="rightView">view matrix of the right eye</param>
+void CDepthWithColorD3D::RenderSoftware(const XMMATRIX& kinectView, const XMMATRIX& leftView, const XMMATRIX& rightView)
+{
+    PROFILE_SCOPE("software render");
+
+    // same clear color as the back buffers
+    const uint32_t clearColor = 0xff000000;
+
+    PointCloudDesc desc;
+    desc.pDepth = m_softwareDepth.Get<USHORT>();
+    desc.pColor = &m_softwareColor[0];
+    desc.colorPitch = m_colorWidth * cBytesPerPixel;
+    desc.depthWidth = m_depthWidth;
+    desc.depthHeight = m_depthHeight;
+    desc.colorWidth = m_colorWidth;
+    desc.colorHeight = m_colorHeight;
+    desc.xyScale = m_xyScale;
+
+    SplatConstants constants;
+    StoreSplatMatrix(kinectView, constants.view);
+    StoreSplatMatrix(m_projection, constants.projection);
+    memcpy(constants.rect, ftRect, sizeof(constants.rect));
+
+    if (m_softwareKinectView.GetWidth() != m_windowResX || m_softwareKinectView.GetHeight() != m_windowResY)
+    {
+        m_softwareKinectView.Resize(m_windowResX, m_windowResY);
+        m_softwareUserView.Resize(m_windowResX, m_windowResY);
+    }
+
+    // both views draw the same points
+    m_softwareKinectView.SetPoints(desc, &m_workerPool);
+    m_softwareUserView.SetPoints(desc, &m_workerPool);
+
+    {
+        PROFILE_SCOPE("software kinect view");
+
+        SplatViewport viewport = { 0, 0, m_windowResX, m_windowResY };
+        m_softwareKinectView.Clear(clearColor);
+        m_softwareKinectView.DrawSplats(constants, viewport, &m_workerPool);
+    }
+
+    {
+        PROFILE_SCOPE("software user view");
+
+        m_softwareUserView.Clear(clearColor);
+
+        SplatViewport eyeViewports[2] =
+        {
+            { 0, 0, m_windowResX / 2, m_windowResY },
+            { m_windowResX / 2, 0, m_windowResX / 2, m_windowResY }
+        };
+
+        // same pass structure as the D3D user view
+        if (m_bSinglePassStereo)
+        {
+            StereoSplatConstants stereo;
+            StoreSplatMatrix(leftView, stereo.eyeView[0]);
+            StoreSplatMatrix(rightView, stereo.eyeView[1]);
+            memcpy(stereo.projection, constants.projection, sizeof(stereo.projection));
+            memcpy(stereo.rect, constants.rect, sizeof(stereo.rect));
+            m_softwareUserView.DrawStereoSplats(stereo, eyeViewports, &m_workerPool);
+        }
+        else
+        {
+            StoreSplatMatrix(leftView, constants.view);
+            m_softwareUserView.DrawSplats(constants, eyeViewports[0], &m_workerPool);
+
+            StoreSplatMatrix(rightView, constants.view);
+            m_softwareUserView.DrawSplats(constants, eyeViewports[1], &m_workerPool);
+        }
+    }
 }
 
-// Get a video image and process it.
-bool CDepthWithColorD3D::CheckCameraInput()
+/// <summary>
+/// Write the last software rendered views as bitmaps
+/// </summary>
+/// <param name="szPrefix">path prefix, -kinect.bmp and -user.bmp are appended</param>
+/// <returns>S_OK on success, otherwise failure code</returns>
+HRESULT CDepthWithColorD3D::WriteSoftwareImages(LPCWSTR szPrefix) const
 {
-	HRESULT hrFT = E_FAIL;
+    struct Image
+    {
+        LPCWSTR                         szSuffix;
+        const CSoftwareRenderer*        pRenderer;
+    };
+
+    const Image images[] =
+    {
+        { L"-kinect.bmp", &m_softwareKinectView },
+        { L"-user.bmp", &m_softwareUserView },
+    };
+
+    for (size_t i = 0; i < _countof(images); ++i)
+    {
+        std::wstring fileName = std::wstring(szPrefix) + images[i].szSuffix;
+
+        FILE* pFile = NULL;
+        if (0 != _wfopen_s(&pFile, fileName.c_str(), L"wb"))
+        {
+            return E_FAIL;
+        }
+
+        bool bWritten = images[i].pRenderer->WriteBitmap(pFile);
+        fclose(pFile);
+
+        if (!bWritten)
+        {
+            return E_FAIL;
+        }
+    }
 
-	if (m_bColorReceived && m_bDepthReceived)
-		// Do face tracking
+    return S_OK;
+}
+
+/// <summary>
+/// Hand the current frame pair and skeleton hint to the face tracking worker
+/// </summary>
+void CDepthWithColorD3D::SubmitHeadTracking()
+{
+	if (!m_headTracking.IsRunning())
 	{
-		FT_SENSOR_DATA sensorData;
-		sensorData.pDepthFrame = m_depthImage;
-		sensorData.pVideoFrame = m_colorImage;
-		sensorData.ViewOffset = { 0, 0 };
-		sensorData.ZoomFactor = 1.0f;
-
-		FT_VECTOR3D* hint = NULL;
-		if (SUCCEEDED(GetClosestHint(m_hint3D)))
-		{
-			hint = m_hint3D;
-		}
-		if (m_LastTrackSucceeded)
+		return;
+	}
+
+	PROFILE_SCOPE("submit face tracking");
+
+	// the worker holds on to the captured buffers, the next frames arrive in other ones
+	HeadTrackerFrame& frame = m_headTracking.GetNextFrame();
+	frame.color = m_capture.GetColor().color;
+	frame.depth = m_capture.GetDepth().depth;
+	frame.timeStamp = m_capture.GetDepth().timeStamp;
+
+	frame.bHasHint = SUCCEEDED(GetClosestHint(m_hint3D));
+	if (frame.bHasHint)
+	{
+		for (int i = 0; i < 2; ++i)
 		{
-			hrFT = m_pFaceTracker->ContinueTracking(&sensorData, hint, m_pFTResult);
+			frame.hint[i][0] = m_hint3D[i].x;
+			frame.hint[i][1] = m_hint3D[i].y;
+			frame.hint[i][2] = m_hint3D[i].z;
 		}
-		else
+	}
+
+	m_headTracking.Submit();
+}
+
+/// <summary>
+/// Pick up the newest pose from the face tracking worker and predict the head
+/// position for when this frame reaches the screen
+/// </summary>
+/// <returns>true if a new pose arrived</returns>
+bool CDepthWithColorD3D::UpdateHeadPose()
+{
+	LARGE_INTEGER now;
+	QueryPerformanceCounter(&now);
+	m_poseUpdateTime = now.QuadPart;
+
+	bool bNewPose = m_headTracking.AcquirePose();
+
+	// a failed track keeps the last position and rectangle
+	const HeadPose& pose = m_headTracking.GetPose();
+	if (bNewPose && pose.bTracked)
+	{
+		memcpy(faceTranslation, pose.translation, sizeof(faceTranslation));
+		memcpy(ftRect, pose.rect, sizeof(ftRect));
+
+		HeadPoseSample sample;
+		sample.timeMs = pose.timeStamp + m_sensorClockOffsetMs;
+		memcpy(sample.position, pose.translation, sizeof(sample.position));
+		m_headPredictor.AddSample(sample.position, sample.timeMs);
+
+		if (m_bRecordPoseTrace)
 		{
-			hrFT = m_pFaceTracker->StartTracking(&sensorData, NULL, hint, m_pFTResult);
+			m_poseTrace.push_back(sample);
 		}
 	}
-	
 
-	m_LastTrackSucceeded = SUCCEEDED(hrFT) && SUCCEEDED(m_pFTResult->GetStatus());
-	if (m_LastTrackSucceeded)
+	double presentMs = now.QuadPart * 1000.0 / m_qpcFrequency.QuadPart + m_poseToPresentMs;
+	if (!m_headPredictor.Predict(presentMs, m_headPosition))
 	{
-		RECT Test;
-		FLOAT pScale, pRotation[3];
-			m_pFTResult->Get3DPose(&pScale,pRotation,faceTranslation);
-		m_pFTResult->GetFaceRect(&Test);
-		ftRect[0] = (float)(Test.left / 640.0f);
-		ftRect[1] = (float)(Test.right / 640.0f);
-		ftRect[2] = (float)(Test.top / 480.0f);
-		ftRect[3] = (float)(Test.bottom/ 480.0f);
+		memcpy(m_headPosition, faceTranslation, sizeof(m_headPosition));
 	}
-	else
+
+	return bNewPose;
+}
+
+/// <summary>
+/// Write the recorded head positions, for tuning the predictor offline
+/// </summary>
+/// <param name="szFileName">file to write</param>
+/// <returns>S_OK on success, otherwise failure code</returns>
+HRESULT CDepthWithColorD3D::WritePoseTrace(LPCWSTR szFileName) const
+{
+	FILE* pFile = NULL;
+	if (0 != _wfopen_s(&pFile, szFileName, L"w"))
 	{
-		m_pFTResult->Reset();
+		return E_FAIL;
 	}
-	SetCenterOfImage(m_pFTResult);
-	return m_LastTrackSucceeded;
-}
\ No newline at end of file
+
+	bool bWritten = WriteHeadPoseTrace(pFile, m_poseTrace);
+	fclose(pFile);
+
+	return bWritten ? S_OK : E_FAIL;
+}
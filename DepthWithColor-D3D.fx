@@ -6,6 +6,7 @@
 
 Texture2D<int>    txDepth  : register(t0);
 Texture2D<float4> txColor  : register(t1);
+Buffer<uint>      txPointIndices : register(t2);
 SamplerState      samColor : register(s0);
 
 //--------------------------------------------------------------------------------------
@@ -17,17 +18,33 @@ cbuffer cbChangesEveryFrame : register(b0)
     matrix  Projection;
     float4  XYScale;
 	float4  rect;
+
+    // depth image width and height in pixels, then their reciprocals
+    float4  DepthSize;
+
+    // moves the points of the sensor being drawn into the primary sensor's space, identity for the primary sensor
+    matrix  World;
+};
+
+// view matrices of the left and right eye for the single pass stereo geometry shader
+// Projection, XYScale, rect, DepthSize and World come from cbChangesEveryFrame
+cbuffer cbStereoEveryFrame : register(b1)
+{
+    matrix  EyeView[2];
 };
 
 //--------------------------------------------------------------------------------------
 // Constants
 //--------------------------------------------------------------------------------------
-static const int DepthWidth = 640;
-static const int DepthHeight = 480;
-static const float2 DepthWidthHeight = float2(DepthWidth, DepthHeight);
-static const float2 DepthHalfWidthHeight = DepthWidthHeight / 2.0;
-static const float2 DepthHalfWidthHeightOffset = DepthHalfWidthHeight - 0.5;
-static const float2 ColorWidthHeight = float2(640, 480);
+// use the minimum of near mode and standard
+static const int minDepth = 300 << 3;
+
+// use the maximum of near mode and standard
+static const int maxDepth = 4000 << 3;
+
+// determine how large to make the point sprite, in depth pixels - scale it up a little to fill in holes
+// it is also made larger further away to prevent aliasing artifacts
+static const float PointSpriteScale = 2.5;
 
 // vertex offsets for building a quad from a depth pixel
 static const float4 quadOffsets[4] = 
@@ -54,12 +71,27 @@ struct GS_INPUT
 {
 };
 
+// one vertex of the fused surface, see CTsdfVolume::ExtractSurface
+struct SURFACE_VS_INPUT
+{
+    float3 Pos : POSITION;
+    float4 Col : COLOR;
+};
+
 struct PS_INPUT
 {
     float4 Pos : SV_POSITION;
     float4 Col : COLOR;
 };
 
+// the extra viewport index is not read by the pixel shader
+struct STEREO_PS_INPUT
+{
+    float4 Pos : SV_POSITION;
+    float4 Col : COLOR;
+    uint   Viewport : SV_ViewportArrayIndex;
+};
+
 //--------------------------------------------------------------------------------------
 // Vertex Shader
 //--------------------------------------------------------------------------------------
@@ -71,32 +103,49 @@ GS_INPUT VS( )
 }
 
 //--------------------------------------------------------------------------------------
-// Geometry Shader
-// 
-// Takes in a single vertex point.  Expands it into the 4 vertices of a quad.
-// Depth is sampled from a texture passed in of the Kinect's depth output.
-// Color is sampled from a texture passed in of the Kinect's color output mapped to depth space.
+// Fused Surface Vertex Shader
+//
+// The fused surface is a triangle list already in the primary sensor's space, in meters.
+// It is transformed like the points, no geometry shader runs after it.
 //--------------------------------------------------------------------------------------
-[maxvertexcount(4)]
-void GS(point GS_INPUT particles[1], uint primID : SV_PrimitiveID, inout TriangleStream<PS_INPUT> triStream)
+PS_INPUT VSSurface(SURFACE_VS_INPUT input)
 {
     PS_INPUT output;
 
-    // use the minimum of near mode and standard
-    static const int minDepth = 300 << 3;
+    float4 WorldPos = mul(float4(input.Pos, 1.0), World);
+    output.Pos = mul(mul(WorldPos, View), Projection);
+    output.Col = input.Col;
 
-    // use the maximum of near mode and standard
-    static const int maxDepth = 4000 << 3;
+    return output;
+}
+
+//--------------------------------------------------------------------------------------
+// Point lookup shared by the geometry shaders
+// 
+// Each point stands for one entry of the valid pixel list built by BuildPointIndices.
+// Depth is sampled from a texture passed in of the Kinect's depth output.
+// GeneratePointCloudScalar and TransformPointCloudScalar in PointCloud.cpp do the same on the CPU,
+// keep them in step.
+//--------------------------------------------------------------------------------------
+bool LoadPoint(uint primID, out float4 WorldPos, out float2 colorTextureCoords, out float sensorDepth)
+{
+    WorldPos = float4(0, 0, 0, 1);
+    colorTextureCoords = float2(0, 0);
+    sensorDepth = 0;
+
+    // only pixels the CPU found in range are drawn, look up which one this is
+    uint pixel = txPointIndices.Load(primID);
 
     // texture load location for the pixel we're on 
-    int3 baseLookupCoords = int3(primID % DepthWidth, primID / DepthWidth, 0);
+    uint depthWidth = (uint)DepthSize.x;
+    int3 baseLookupCoords = int3(pixel % depthWidth, pixel / depthWidth, 0);
 
     int depth = txDepth.Load(baseLookupCoords);
 
     // check that depth is in the valid range
     if (depth < minDepth || depth > maxDepth)
     {
-        return;
+        return false;
     }
     
     // remove player index information and convert to meters
@@ -104,21 +153,56 @@ void GS(point GS_INPUT particles[1], uint primID : SV_PrimitiveID, inout Triangl
     
     // set the base world position here so we don't have to do it per vertex
     // convert x and y lookup coords to world space meters
-    float4 WorldPos;
-    WorldPos.xy = (baseLookupCoords.xy - DepthHalfWidthHeightOffset) * XYScale.xy * realDepth;
+    WorldPos.xy = (baseLookupCoords.xy - (DepthSize.xy / 2.0 - 0.5)) * XYScale.xy * realDepth;
     WorldPos.z = realDepth;
-    WorldPos.w = 1.0;
 
-    // convert to camera space
-    float4 ViewPos = mul(WorldPos, View);
+    // sprites are sized by the distance from their own sensor, whichever space they are drawn in
+    WorldPos = mul(WorldPos, World);
+    sensorDepth = realDepth;
 
     // base color texture sample lookup coords, in [0,1]
-    float2 colorTextureCoords = baseLookupCoords.xy/ColorWidthHeight;
+    // the color texture is remapped into depth space, so it covers the same view at any resolution
+    colorTextureCoords = baseLookupCoords.xy * DepthSize.zw;
+
+    return true;
+}
+
+//--------------------------------------------------------------------------------------
+// Color of one quad corner
+// Color is sampled from a texture passed in of the Kinect's color output mapped to depth space.
+//--------------------------------------------------------------------------------------
+float4 SampleCornerColor(float2 colorTextureCoords, uint c)
+{
+    // sample the color texture for the corner we're at
+	float4 Col = txColor.SampleLevel(samColor, colorTextureCoords + texOffsets4Samples[c], 0);
+	if (colorTextureCoords.x>rect.x && colorTextureCoords.x <rect.y  && colorTextureCoords.y>rect.z && colorTextureCoords.y <rect.w)
+	Col += float4(0.2, 0.0, 0.0, 1.0);
+
+    return Col;
+}
+
+//--------------------------------------------------------------------------------------
+// Geometry Shader
+// 
+// Takes in a single vertex point.  Expands it into the 4 vertices of a quad.
+//--------------------------------------------------------------------------------------
+[maxvertexcount(4)]
+void GS(point GS_INPUT particles[1], uint primID : SV_PrimitiveID, inout TriangleStream<PS_INPUT> triStream)
+{
+    PS_INPUT output;
 
-    // determine how large to make the point sprite - scale it up a little to fill in holes
-    // also make it larger if it is further away to prevent aliasing artifacts
-    static const float4 PointSpriteScaleFactor = float4(1.0/DepthWidth, 1.0/DepthHeight, 0.0, 0.0) * 2.5;
-    float4 quadOffsetScalingFactorInViewspace = PointSpriteScaleFactor * realDepth;
+    float4 WorldPos;
+    float2 colorTextureCoords;
+    float sensorDepth;
+    if (!LoadPoint(primID, WorldPos, colorTextureCoords, sensorDepth))
+    {
+        return;
+    }
+
+    // convert to camera space
+    float4 ViewPos = mul(WorldPos, View);
+
+    float4 quadOffsetScalingFactorInViewspace = float4(DepthSize.zw, 0.0, 0.0) * PointSpriteScale * sensorDepth;
 
     [unroll]
     for (uint c = 0; c < 4; ++c)
@@ -128,14 +212,61 @@ void GS(point GS_INPUT particles[1], uint primID : SV_PrimitiveID, inout Triangl
      
         // then project it
         output.Pos = mul(ViewPosExpanded, Projection);
+        output.Col = SampleCornerColor(colorTextureCoords, c);
+
+        triStream.Append(output);
+    }
+}
 
-        // sample the color texture for the corner we're at
-		output.Col = txColor.SampleLevel(samColor, colorTextureCoords + texOffsets4Samples[c], 0);
-		if (colorTextureCoords.x>rect.x && colorTextureCoords.x <rect.y  && colorTextureCoords.y>rect.z && colorTextureCoords.y <rect.w)
-		output.Col += float4(0.2, 0.0, 0.0, 1.0);
+//--------------------------------------------------------------------------------------
+// Single Pass Stereo Geometry Shader
+// 
+// Takes in a single vertex point.  Expands it into a quad for each eye, sent to viewport 0 and 1.
+// The depth and color lookups are shared by both eyes.
+// CSoftwareRenderer::DrawStereoSplats in SoftwareRenderer.cpp is the CPU reference.
+//--------------------------------------------------------------------------------------
+[maxvertexcount(8)]
+void GSStereo(point GS_INPUT particles[1], uint primID : SV_PrimitiveID, inout TriangleStream<STEREO_PS_INPUT> triStream)
+{
+    STEREO_PS_INPUT output;
 
+    float4 WorldPos;
+    float2 colorTextureCoords;
+    float sensorDepth;
+    if (!LoadPoint(primID, WorldPos, colorTextureCoords, sensorDepth))
+    {
+        return;
+    }
 
-        triStream.Append(output);
+    float4 quadOffsetScalingFactorInViewspace = float4(DepthSize.zw, 0.0, 0.0) * PointSpriteScale * sensorDepth;
+
+    float4 cornerColors[4];
+    [unroll]
+    for (uint c = 0; c < 4; ++c)
+    {
+        cornerColors[c] = SampleCornerColor(colorTextureCoords, c);
+    }
+
+    [unroll]
+    for (uint eye = 0; eye < 2; ++eye)
+    {
+        // convert to this eye's camera space
+        float4 ViewPos = mul(WorldPos, EyeView[eye]);
+
+        [unroll]
+        for (uint c = 0; c < 4; ++c)
+        {
+            float4 ViewPosExpanded = ViewPos +quadOffsets[c] * quadOffsetScalingFactorInViewspace;
+
+            output.Pos = mul(ViewPosExpanded, Projection);
+            output.Col = cornerColors[c];
+            output.Viewport = eye;
+
+            triStream.Append(output);
+        }
+
+        // each eye's quad is a strip of its own
+        triStream.RestartStrip();
     }
 }
 
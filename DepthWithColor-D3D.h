@@ -7,6 +7,7 @@
 #pragma once
 
 #include <windows.h>
+#include <vector>
 
 // This file requires the installation of the DirectX SDK, a link for which is included in the Toolkit Browser
 #include <d3d11.h>
@@ -15,6 +16,22 @@
 #include "NuiApi.h"
 #include "Camera.h"
 #include "DX11Utils.h"
+#include "FrameSource.h"
+#include "FrameRecorder.h"
+#include "FrameCapture.h"
+#include "FrameSynchronizer.h"
+#include "ColorMapping.h"
+#include "WorkerPool.h"
+#include "SoftwareRenderer.h"
+#include "HeadTracker.h"
+#include "HeadTrackingWorker.h"
+#include "HeadPosePredictor.h"
+#include "ShaderCache.h"
+#include "FrameScheduler.h"
+#include "SharedFrameRing.h"
+#include "SensorTextures.h"
+#include "SensorCloud.h"
+#include "TsdfVolume.h"
 #include "resource.h"
 #include <FaceTrackLib.h>
 
@@ -27,15 +44,25 @@ struct CBChangesEveryFrame
 	DirectX::XMMATRIX Projection;
 	DirectX::XMFLOAT4 XYScale;
 	DirectX::XMFLOAT4 Rectangle;
+	DirectX::XMFLOAT4 DepthSize;
+	DirectX::XMMATRIX World;
+};
+
+/// <summary>
+/// Constant buffer for the single pass stereo geometry shader
+/// </summary>
+struct CBStereoEveryFrame
+{
+	DirectX::XMMATRIX EyeView[2];
 };
 
 class CDepthWithColorD3D
 {
 	static const int                    cBytesPerPixel = 4;
 
-	static const NUI_IMAGE_RESOLUTION   cDepthResolution = NUI_IMAGE_RESOLUTION_640x480;
-	static const NUI_IMAGE_RESOLUTION   cColorResolution = NUI_IMAGE_RESOLUTION_640x480;
-	
+	// recent skeleton frames kept to pick the one closest to a depth frame
+	static const int                    cSkeletonHistory = 4;
+
 
 public:
 	/// <summary>
@@ -60,12 +87,242 @@ public:
 	/// <returns>S_OK for success, or failure code</returns>
 	HRESULT                             InitDevice();
 
+	/// <summary>
+	/// Choose the stream resolutions, call before the frame source and the device are created
+	/// Replays switch to the resolutions they were recorded at
+	/// </summary>
+	/// <param name="depthResolution">resolution of the depth stream</param>
+	/// <param name="colorResolution">resolution of the color stream, a whole multiple of the depth resolution</param>
+	/// <returns>S_OK on success, E_INVALIDARG for a combination the color mapping cannot handle</returns>
+	HRESULT                             SetResolutions(NUI_IMAGE_RESOLUTION depthResolution, NUI_IMAGE_RESOLUTION colorResolution);
+
 	/// <summary>
 	/// Create the first connected Kinect found 
 	/// </summary>
 	/// <returns>S_OK on success, otherwise failure code</returns>
 	HRESULT                             CreateFirstConnected();
 
+	/// <summary>
+	/// Play back a recording instead of using a sensor
+	/// </summary>
+	/// <param name="szFileName">path of the recording</param>
+	/// <param name="bRealTime">true to pace frames by their timestamps, false to deliver as fast as possible</param>
+	/// <param name="bLoop">true to restart the recording when it ends</param>
+	/// <returns>S_OK on success, otherwise failure code</returns>
+	HRESULT                             CreateReplaySource(LPCWSTR szFileName, bool bRealTime, bool bLoop);
+
+	/// <summary>
+	/// Add another connected Kinect, its point cloud is drawn along with the primary sensor's
+	/// Call after the primary sensor is created and before the device
+	/// </summary>
+	/// <param name="connectedIndex">which of the ready sensors to use, counting from 0, the primary Kinect is 0</param>
+	/// <param name="extrinsics">transform from the sensor's space into the primary sensor's</param>
+	/// <returns>S_OK on success, otherwise failure code</returns>
+	HRESULT                             AddConnectedSensor(UINT connectedIndex, const PointCloudTransform& extrinsics);
+
+	/// <summary>
+	/// Add a recording played back as another sensor, its point cloud is drawn along with the primary sensor's
+	/// Call after the primary sensor is created and before the device
+	/// </summary>
+	/// <param name="szFileName">path of the recording, made at the primary sensor's resolutions</param>
+	/// <param name="bRealTime">true to pace frames by their timestamps, false to deliver as fast as possible</param>
+	/// <param name="bLoop">true to restart the recording when it ends</param>
+	/// <param name="extrinsics">transform from the sensor's space into the primary sensor's</param>
+	/// <returns>S_OK on success, ERROR_BAD_FORMAT for a recording at other resolutions, otherwise failure code</returns>
+	HRESULT                             AddReplaySensor(LPCWSTR szFileName, bool bRealTime, bool bLoop, const PointCloudTransform& extrinsics);
+
+	/// <summary>
+	/// Number of sensors drawn, the primary one included
+	/// </summary>
+	UINT                                GetSensorCount() const { return static_cast<UINT>(m_sensors.size()) + 1; }
+
+	/// <summary>
+	/// Frame pairs drawn from the additional sensors, summed over all of them
+	/// </summary>
+	UINT                                GetAdditionalSensorFrameCount() const;
+
+	/// <summary>
+	/// Record every frame received from the frame source
+	/// </summary>
+	/// <param name="szFileName">path of the recording</param>
+	/// <param name="depthCodec">how depth frames are stored</param>
+	/// <returns>S_OK on success, otherwise failure code</returns>
+	HRESULT                             StartRecording(LPCWSTR szFileName, RecordingDepthCodec depthCodec);
+
+	/// <summary>
+	/// Recorder, for its compression statistics, NULL unless recording
+	/// </summary>
+	const CFrameRecorder*               GetRecorder() const { return m_pRecorder; }
+
+	/// <summary>
+	/// Publish every synchronized frame into a named shared memory ring, for other processes
+	/// Call once the resolutions are settled
+	/// </summary>
+	/// <param name="szName">name of the ring</param>
+	/// <returns>S_OK on success, otherwise failure code</returns>
+	HRESULT                             StartPublishing(LPCWSTR szName);
+
+	/// <summary>
+	/// Frames published to the shared memory ring
+	/// </summary>
+	LONG                                GetPublishedFrameCount() const { return m_frameRing.GetPublishedCount(); }
+
+	/// <summary>
+	/// Start draining the frame source on capture threads
+	/// Call once the source and any recording are set up
+	/// </summary>
+	/// <param name="bLossless">true to deliver every frame, pacing the source to rendering, false to keep only the latest</param>
+	/// <returns>S_OK on success, otherwise failure code</returns>
+	HRESULT                             StartCapture(bool bLossless);
+
+	/// <summary>
+	/// Stop the capture threads, the head tracking thread and the worker pool, so no thread but the caller's records stages
+	/// Later renders run the pool's work inline
+	/// </summary>
+	void                                StopThreads();
+
+	/// <summary>
+	/// Set how depth and color frames are paired
+	/// </summary>
+	/// <param name="policy">what to do with frames further apart than the tolerance</param>
+	/// <param name="toleranceMs">largest timestamp difference of frames that belong together</param>
+	/// <param name="maxWaitMs">how long the wait policy holds mismatched frames</param>
+	void                                ConfigureSync(FrameSyncPolicy policy, int toleranceMs, int maxWaitMs);
+
+	/// <summary>
+	/// Depth and color pairing statistics
+	/// </summary>
+	const FrameSyncStats&               GetSyncStats() const { return m_synchronizer.GetStats(); }
+
+	/// <summary>
+	/// Jitter and deviation of the skeleton smoothing, complete once capture has stopped
+	/// </summary>
+	const SkeletonSmootherStats&        GetSkeletonSmootherStats() const { return m_capture.GetSkeletonSmoother().GetStats(); }
+
+	/// <summary>
+	/// Frame capture, for its buffer counts
+	/// </summary>
+	const CFrameCapture&                GetCapture() const { return m_capture; }
+
+	/// <summary>
+	/// Decides when Render is called, the message loop waits on it between frames
+	/// </summary>
+	CFrameScheduler&                    GetFrameScheduler() { return m_frameScheduler; }
+
+	/// <summary>
+	/// Shader cache hits, misses and load times of the last LoadShaders
+	/// </summary>
+	const ShaderCacheStats&             GetShaderCacheStats() const { return m_shaderCache.GetStats(); }
+
+	/// <summary>
+	/// Compile every shader into the bytecode cache without creating a device, the offline build step
+	/// </summary>
+	/// <returns>S_OK for success, or failure code</returns>
+	static HRESULT                      BuildShaderCache();
+
+	/// <summary>
+	/// Back the captured frames with large pages, takes effect when capture starts
+	/// </summary>
+	/// <param name="bLargePages">true to ask for large pages</param>
+	void                                UseLargePages(bool bLargePages) { m_capture.SetLargePages(bLargePages); }
+
+	/// <summary>
+	/// Set the number of threads used for per-pixel work
+	/// </summary>
+	/// <param name="threadCount">total threads including the render thread, 0 for one per hardware thread, 1 for no threading</param>
+	void                                SetThreadCount(UINT threadCount) { m_workerPool.Start(threadCount); }
+
+	/// <summary>
+	/// Render both views on the CPU as well, for machines without a usable GPU
+	/// </summary>
+	/// <param name="bEnable">true to run the software renderer every frame</param>
+	void                                EnableSoftwareRenderer(bool bEnable) { m_bSoftwareRender = bEnable; }
+
+	/// <summary>
+	/// Fuse the primary sensor's frames into a voxel volume, F toggles drawing its surface instead of the point cloud
+	/// </summary>
+	/// <param name="params">resolution and memory budget of the volume</param>
+	void                                EnableFusion(const TsdfVolumeParams& params);
+
+	/// <summary>
+	/// Block and eviction counters of the fused volume
+	/// </summary>
+	const TsdfVolumeStats&              GetFusionStats() const { return m_fusion.GetStats(); }
+
+	/// <summary>
+	/// Triangles of the fused surface last extracted
+	/// </summary>
+	UINT                                GetFusedTriangleCount() const { return m_fusedVertexCount / 3; }
+
+	/// <summary>
+	/// Choose how the user view draws its two eyes
+	/// </summary>
+	/// <param name="bSinglePass">true to draw both eyes in one pass, false to draw each eye separately</param>
+	void                                SetSinglePassStereo(bool bSinglePass) { m_bSinglePassStereo = bSinglePass; }
+
+	/// <summary>
+	/// Use the stub head tracker instead of FaceTrackLib, takes effect when the frame source is created
+	/// </summary>
+	/// <param name="bStub">true to follow the skeleton's head instead of tracking the face</param>
+	void                                UseStubHeadTracker(bool bStub) { m_bStubHeadTracker = bStub; }
+
+	/// <summary>
+	/// Search for new faces only around the skeleton's head, takes effect when the frame source is created
+	/// </summary>
+	/// <param name="bHeadRegion">true to search around the head, false to search the whole color image</param>
+	void                                SetFaceSearchRegion(bool bHeadRegion) { m_bFaceSearchHeadRegion = bHeadRegion; }
+
+	/// <summary>
+	/// Face tracking worker, for its frame counts
+	/// </summary>
+	const CHeadTrackingWorker&          GetHeadTracking() const { return m_headTracking; }
+
+	/// <summary>
+	/// Tune the smoothing and prediction of the head position the user view is drawn from
+	/// </summary>
+	/// <param name="params">predictor tuning</param>
+	void                                SetHeadPosePrediction(const HeadPosePredictorParams& params) { m_headPredictor.SetParams(params); }
+
+	/// <summary>
+	/// Keep every tracked head position so it can be written as a pose trace
+	/// </summary>
+	/// <param name="bRecord">true to record the trace</param>
+	void                                RecordPoseTrace(bool bRecord) { m_bRecordPoseTrace = bRecord; }
+
+	/// <summary>
+	/// Write the recorded head positions, for tuning the predictor offline
+	/// </summary>
+	/// <param name="szFileName">file to write</param>
+	/// <returns>S_OK on success, otherwise failure code</returns>
+	HRESULT                             WritePoseTrace(LPCWSTR szFileName) const;
+
+	/// <summary>
+	/// Write the last software rendered views as bitmaps
+	/// </summary>
+	/// <param name="szPrefix">path prefix, -kinect.bmp and -user.bmp are appended</param>
+	/// <returns>S_OK on success, otherwise failure code</returns>
+	HRESULT                             WriteSoftwareImages(LPCWSTR szPrefix) const;
+
+	/// <summary>
+	/// Whether the frame sources of every sensor have delivered their last frame
+	/// </summary>
+	bool                                IsEndOfStream() const;
+
+	/// <summary>
+	/// Number of depth frames processed so far
+	/// </summary>
+	UINT                                GetDepthFrameCount() const { return m_depthFrameCount; }
+
+	/// <summary>
+	/// Number of depth pixels drawn, summed over every uploaded frame
+	/// </summary>
+	ULONGLONG                           GetValidPointCount() const { return m_validPointSum; }
+
+	/// <summary>
+	/// Number of depth pixels the sensor delivered, summed over every uploaded frame
+	/// </summary>
+	ULONGLONG                           GetTotalPointCount() const { return m_totalPointSum; }
+
 	/// <summary>
 	/// Renders a frame
 	/// </summary>
@@ -103,13 +360,24 @@ private:
 	ID3D11Texture2D*                    m_pDepthStencil;
 	ID3D11DepthStencilView*             m_pDepthStencilView;
 	ID3D11InputLayout*                  m_pVertexLayout;
+
+	// compiled shader bytecode kept between runs, so startup skips the compiler
+	CShaderCache                        m_shaderCache;
 	ID3D11Buffer*                       m_pVertexBuffer;
 	ID3D11Buffer*                       m_pCBChangesEveryFrame;
+	ID3D11Buffer*                       m_pCBStereoEveryFrame;
 	DirectX::XMMATRIX                   m_projection;
 
 	ID3D11VertexShader*                 m_pVertexShader;
 	ID3D11PixelShader*                  m_pPixelShader;
 	ID3D11GeometryShader*               m_pGeometryShader;
+	ID3D11GeometryShader*               m_pStereoGeometryShader;
+
+	// both user view eyes from one draw instead of one draw each
+	bool                                m_bSinglePassStereo;
+
+	NUI_IMAGE_RESOLUTION                m_depthResolution;
+	NUI_IMAGE_RESOLUTION                m_colorResolution;
 
 	LONG                                m_depthWidth;
 	LONG                                m_depthHeight;
@@ -125,29 +393,69 @@ private:
 	int                                 m_windowResX;
 	int                                 m_windowResY;
 
-	// Kinect
-	INuiSensor*                         m_pNuiSensor;
-	HANDLE                              m_hNextDepthFrameEvent;
-	HANDLE                              m_pDepthStreamHandle;
-	HANDLE                              m_hNextColorFrameEvent;
-	HANDLE                              m_pColorStreamHandle;
-	HANDLE								m_pSkeletonStreamhandle;
-	HANDLE								m_hNextSkeletonEvent;
+	// Kinect sensor or recording
+	IFrameSource*                       m_pFrameSource;
+	CFrameRecorder*                     m_pRecorder;
+	UINT                                m_depthFrameCount;
+
+	// drains the frame source, one thread per stream
+	CFrameCapture                       m_capture;
 
+	// pairs depth with color and skeleton frames by timestamp
+	CFrameSynchronizer                  m_synchronizer;
+	LARGE_INTEGER                       m_qpcFrequency;
 
-	// for passing depth data as a texture
-	ID3D11Texture2D*                    m_pDepthTexture2D;
-	ID3D11ShaderResourceView*           m_pDepthTextureRV;
+	// applied to the additional sensors as they are added
+	FrameSyncPolicy                     m_syncPolicy;
+	int                                 m_syncToleranceMs;
+	int                                 m_syncWaitMs;
 
-	// for passing color data as a texture
-	ID3D11Texture2D*                    m_pColorTexture2D;
-	ID3D11ShaderResourceView*           m_pColorTextureRV;
+	// sensors besides the primary one, each moved into the primary sensor's space when drawn
+	std::vector<CSensorCloud*>          m_sensors;
+
+	NUI_SKELETON_FRAME                  m_skeletonHistory[cSkeletonHistory];
+	int                                 m_skeletonHistoryCount;
+	int                                 m_skeletonHistoryNext;
+
+
+	// depth, color and the indices of the depth pixels inside the valid range for the primary sensor
+	CSensorTextures                     m_sensorTextures;
 	ID3D11SamplerState*                 m_pColorSampler;
+	ULONGLONG                           m_validPointSum;
+	ULONGLONG                           m_totalPointSum;
 
 	// for mapping depth to color
-	USHORT*                             m_depthD16;
-	BYTE*                               m_colorRGBX;
-	LONG*                               m_colorCoordinates;
+	// these point into the latest frames picked up from the capture threads
+	const USHORT*                       m_depthD16;
+	const BYTE*                         m_colorRGBX;
+	const LONG*                         m_colorCoordinates;
+
+	// fastest color to depth remap the CPU supports, compiled for the stream resolutions where possible
+	MapColorToDepthFunc                 m_pfnMapColorToDepth;
+
+	// splits per-pixel work into row bands
+	CWorkerPool                         m_workerPool;
+
+	// CPU copies of the Kinect view and the user view, color remapped into depth space for them
+	// and the depth frame it was paired with, which m_depthD16 may have moved past since
+	bool                                m_bSoftwareRender;
+	std::vector<BYTE>                   m_softwareColor;
+	CFrameBuffer                        m_softwareDepth;
+	CSoftwareRenderer                   m_softwareKinectView;
+	CSoftwareRenderer                   m_softwareUserView;
+
+	// primary sensor frames fused into a distance field, also reads the CPU color remap
+	// the surface is extracted every few frames while shown, drawn as triangles instead of the point cloud
+	bool                                m_bFusion;
+	bool                                m_bShowFusion;
+	CTsdfVolume                         m_fusion;
+	UINT                                m_fusionFramesSinceExtract;
+	std::vector<PointCloudPoint>        m_fusedVertices;
+	ID3D11Buffer*                       m_pFusedVertexBuffer;
+	UINT                                m_fusedVertexCapacity;
+	UINT                                m_fusedVertexCount;
+	ID3D11VertexShader*                 m_pSurfaceVertexShader;
+	ID3D11InputLayout*                  m_pSurfaceLayout;
 
 	// to prevent drawing until we have data for both streams
 	bool                                m_bDepthReceived;
@@ -158,14 +466,31 @@ private:
 	// if the application is paused, for example in the minimized case
 	bool                                m_bPaused;
 
+	// frames are only drawn when new content, a new head position or input changed the views
+	CFrameScheduler                     m_frameScheduler;
+
+	// frames for other processes, the producer never waits for them
+	CSharedFrameWriter                  m_frameRing;
+
 	//Face Tracker 
-	IFTFaceTracker*						m_pFaceTracker;
-	IFTResult*							m_pFTResult;
-	float								m_XCenterFace;
-	float								m_YCenterFace;
-	bool								m_LastTrackSucceeded;
-	IFTImage*							m_colorImage;
-	IFTImage*							m_depthImage;
+	// runs on its own thread, the render thread only submits frames and picks up poses
+	IHeadTracker*						m_pHeadTracker;
+	CHeadTrackingWorker					m_headTracking;
+	bool								m_bStubHeadTracker;
+	bool								m_bFaceSearchHeadRegion;
+
+	// Head position the user view is drawn from, predicted for when the view reaches the screen
+	// Pose timestamps come from the sensor clock, the offset to the QueryPerformanceCounter clock
+	// is the smallest seen from capture to arrival, so it leaves out the sensor's own fixed delay
+	CHeadPosePredictor					m_headPredictor;
+	float								m_headPosition[3];
+	float								m_drawnHeadPosition[3];
+	double								m_sensorClockOffsetMs;
+	bool								m_bSensorClockOffset;
+	double								m_poseToPresentMs;
+	LONGLONG							m_poseUpdateTime;
+	bool								m_bRecordPoseTrace;
+	std::vector<HeadPoseSample>			m_poseTrace;
 
 	/// <summary>
 	/// Toggles between near and default mode
@@ -174,16 +499,34 @@ private:
 	/// <returns>S_OK for success, or failure code</returns>
 	HRESULT                             ToggleNearMode();
 
+	/// <summary>
+	/// Set up face tracking once a frame source is available
+	/// </summary>
+	/// <returns>S_OK on success, otherwise failure code</returns>
+	HRESULT                             InitializeFrameSource();
+
 	/// <summary>
 	/// Process depth data received from Kinect
 	/// </summary>
-	/// <returns>S_OK for success, or failure code</returns>
+	/// <returns>S_OK for success, S_FALSE if no new frame arrived, or failure code</returns>
 	HRESULT                             ProcessDepth();
 
 	/// <summary>
-	/// Process color data received from Kinect
+	/// Copy the current depth frame to the depth texture
 	/// </summary>
 	/// <returns>S_OK for success, or failure code</returns>
+	HRESULT                             UploadDepth();
+
+	/// <summary>
+	/// Upload the indices of the depth pixels worth drawing
+	/// </summary>
+	/// <returns>S_OK for success, or failure code</returns>
+	HRESULT                             UploadPointIndices();
+
+	/// <summary>
+	/// Process color data received from Kinect
+	/// </summary>
+	/// <returns>S_OK for success, S_FALSE if no new frame arrived, or failure code</returns>
 	HRESULT                             ProcessColor();
 
 	/// <summary>
@@ -193,17 +536,72 @@ private:
 	HRESULT                             MapColorToDepth();
 
 	/// <summary>
-	/// Compile and set layout for shaders
+	/// Describe the remap of the current color frame to depth space
+	/// </summary>
+	/// <param name="pDesc">receives the description</param>
+	void                                GetColorMappingDesc(ColorMappingDesc* pDesc) const;
+
+	/// <summary>
+	/// Publish the current frame pair, skeleton hint and newest face pose to the shared memory ring
+	/// </summary>
+	void                                PublishFrame();
+
+	/// <summary>
+	/// Draw the point clouds of every sensor with the shaders and views already set up
+	/// </summary>
+	/// <param name="pCB">constants of the view, World is set for each sensor</param>
+	void                                DrawPointClouds(CBChangesEveryFrame* pCB);
+
+	/// <summary>
+	/// Fuse the current frame pair into the volume, and extract its surface again when it is shown and due
+	/// </summary>
+	/// <returns>S_OK on success, otherwise failure code</returns>
+	HRESULT                             UpdateFusion();
+
+	/// <summary>
+	/// Extract the fused surface and copy it into the fused vertex buffer, growing the buffer as needed
+	/// </summary>
+	/// <returns>S_OK on success, otherwise failure code</returns>
+	HRESULT                             UploadFusedSurface();
+
+	/// <summary>
+	/// Draw the fused surface with the point cloud shaders set up, restoring them afterwards
+	/// </summary>
+	void                                DrawFusedSurface();
+
+	/// <summary>
+	/// Draw the current frame with the software renderer, using the same matrices as the D3D draws
+	/// </summary>
+	/// <param name="kinectView">view matrix of the Kinect view</param>
+	/// <param name="leftView">view matrix of the left eye</param>
+	/// <param name="rightView">view matrix of the right eye</param>
+	void                                RenderSoftware(const DirectX::XMMATRIX& kinectView, const DirectX::XMMATRIX& leftView, const DirectX::XMMATRIX& rightView);
+
+	/// <summary>
+	/// Load shaders from the bytecode cache, compiling those missing, and set layout for shaders
 	/// </summary>
 	/// <returns>S_OK for success, or failure code</returns>
 	HRESULT                             LoadShaders();
 
-	void								SetCenterOfImage(IFTResult*);
+	/// <summary>
+	/// Hand the current frame pair and skeleton hint to the face tracking worker
+	/// </summary>
+	void								SubmitHeadTracking();
 
-	bool								CheckCameraInput();
+	/// <summary>
+	/// Pick up the newest pose from the face tracking worker
+	/// </summary>
+	/// <returns>true if a new pose arrived</returns>
+	bool								UpdateHeadPose();
 
 	HRESULT								ProcessSkeleton();
 
+	/// <summary>
+	/// Use the recent skeleton frame closest to the current depth frame for face tracking hints
+	/// </summary>
+	/// <returns>true if a skeleton frame was available</returns>
+	bool								SelectSkeleton();
+
 	FT_VECTOR3D m_NeckPoint[NUI_SKELETON_COUNT];
 	FT_VECTOR3D m_HeadPoint[NUI_SKELETON_COUNT];
 	bool        m_SkeletonTracked[NUI_SKELETON_COUNT];
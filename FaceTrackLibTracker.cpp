@@ -0,0 +1,176 @@
+﻿//------------------------------------------------------------------------------
+// <copyright file="FaceTrackLibTracker.cpp" company="Microsoft">
+//     Copyright (c) Microsoft Corporation.  All rights reserved.
+// </copyright>
+//------------------------------------------------------------------------------
+
+#include "FaceTrackLibTracker.h"
+#include "DX11Utils.h"
+
+/// <summary>
+/// Constructor
+/// </summary>
+CFaceTrackLibTracker::CFaceTrackLibTracker() :
+    m_pFaceTracker(NULL),
+    m_pFTResult(NULL),
+    m_pColorImage(NULL),
+    m_pDepthImage(NULL),
+    m_bLastTrackSucceeded(false),
+    m_bUseHeadRegion(true)
+{
+}
+
+/// <summary>
+/// Destructor
+/// </summary>
+CFaceTrackLibTracker::~CFaceTrackLibTracker()
+{
+    SAFE_RELEASE(m_pColorImage);
+    SAFE_RELEASE(m_pDepthImage);
+    SAFE_RELEASE(m_pFTResult);
+    SAFE_RELEASE(m_pFaceTracker);
+}
+
+/// <summary>
+/// Create the face tracker for the given stream resolutions
+/// </summary>
+/// <param name="pOptions">options passed through to FTCreateFaceTracker</param>
+/// <param name="colorWidth">width of the color frames</param>
+/// <param name="colorHeight">height of the color frames</param>
+/// <param name="depthWidth">width of the depth frames</param>
+/// <param name="depthHeight">height of the depth frames</param>
+/// <returns>S_OK on success, otherwise failure code</returns>
+HRESULT CFaceTrackLibTracker::Initialize(PVOID pOptions, LONG colorWidth, LONG colorHeight, LONG depthWidth, LONG depthHeight)
+{
+    // the nominal focal lengths are for 640 wide color and 320 wide depth frames
+    FT_CAMERA_CONFIG videoConfig;
+    videoConfig.FocalLength = NUI_CAMERA_COLOR_NOMINAL_FOCAL_LENGTH_IN_PIXELS * colorWidth / 640.0f;
+    videoConfig.Width = colorWidth;
+    videoConfig.Height = colorHeight;
+
+    FT_CAMERA_CONFIG depthConfig;
+    depthConfig.FocalLength = NUI_CAMERA_DEPTH_NOMINAL_FOCAL_LENGTH_IN_PIXELS * depthWidth / 320.0f;
+    depthConfig.Width = depthWidth;
+    depthConfig.Height = depthHeight;
+
+    m_pFaceTracker = FTCreateFaceTracker(pOptions);
+    if (!m_pFaceTracker)
+    {
+        return E_OUTOFMEMORY;
+    }
+
+    HRESULT hr = m_pFaceTracker->Initialize(&videoConfig, &depthConfig, NULL, NULL);
+    if ( FAILED(hr) ) { return hr; }
+
+    hr = m_pFaceTracker->CreateFTResult(&m_pFTResult);
+    if ( FAILED(hr) ) { return hr; }
+
+    // The images are attached to each frame's buffers as it is tracked
+    m_pColorImage = FTCreateImage();
+    m_pDepthImage = FTCreateImage();
+    if (!m_pColorImage || !m_pDepthImage)
+    {
+        return E_OUTOFMEMORY;
+    }
+
+    m_bLastTrackSucceeded = false;
+
+    return S_OK;
+}
+
+/// <summary>
+/// Find the face in a frame, continuing from the last frame if that one succeeded
+/// </summary>
+/// <param name="frame">frame to search, only valid during the call</param>
+/// <param name="pPose">receives the pose, bTracked is false if no face was found</param>
+/// <returns>S_OK on success, otherwise failure code</returns>
+HRESULT CFaceTrackLibTracker::Track(const HeadTrackerFrame& frame, HeadPose* pPose)
+{
+    if (NULL == pPose)
+    {
+        return E_POINTER;
+    }
+
+    pPose->bTracked = false;
+    pPose->timeStamp = frame.timeStamp;
+
+    if (NULL == m_pFaceTracker)
+    {
+        return E_UNEXPECTED;
+    }
+
+    // face tracking only reads the images
+    HRESULT hr = m_pColorImage->Attach(frame.colorWidth, frame.colorHeight, frame.color.GetData(), FTIMAGEFORMAT_UINT8_B8G8R8X8, frame.colorWidth * 4);
+    if ( FAILED(hr) ) { return hr; }
+
+    hr = m_pDepthImage->Attach(frame.depthWidth, frame.depthHeight, frame.depth.Get<USHORT>(), FTIMAGEFORMAT_UINT16_D13P3, frame.depthWidth * sizeof(USHORT));
+    if ( FAILED(hr) ) { return hr; }
+
+    FT_SENSOR_DATA sensorData;
+    sensorData.pDepthFrame = m_pDepthImage;
+    sensorData.pVideoFrame = m_pColorImage;
+    sensorData.ViewOffset.x = 0;
+    sensorData.ViewOffset.y = 0;
+    sensorData.ZoomFactor = 1.0f;
+
+    FT_VECTOR3D hint3D[2];
+    FT_VECTOR3D* hint = NULL;
+    if (frame.bHasHint)
+    {
+        for (int i = 0; i < 2; ++i)
+        {
+            hint3D[i] = FT_VECTOR3D(frame.hint[i][0], frame.hint[i][1], frame.hint[i][2]);
+        }
+        hint = hint3D;
+    }
+
+    if (m_bLastTrackSucceeded)
+    {
+        hr = m_pFaceTracker->ContinueTracking(&sensorData, hint, m_pFTResult);
+    }
+    else
+    {
+        // Finding a new face is the expensive part, with a skeleton only the area around its head
+        // needs searching. The images stay whole, cropping them would misalign color and depth.
+        RECT region;
+        RECT* pRegion = NULL;
+        if (m_bUseHeadRegion && frame.bHasHint && ProjectHeadRegion(frame.hint[0], frame.hint[1], frame.colorWidth, frame.colorHeight, &region))
+        {
+            pRegion = &region;
+        }
+
+        hr = m_pFaceTracker->StartTracking(&sensorData, pRegion, hint, m_pFTResult);
+    }
+
+    m_bLastTrackSucceeded = SUCCEEDED(hr) && SUCCEEDED(m_pFTResult->GetStatus());
+    if (!m_bLastTrackSucceeded)
+    {
+        m_pFTResult->Reset();
+        return S_OK;
+    }
+
+    FLOAT scale, rotation[3];
+    m_pFTResult->Get3DPose(&scale, rotation, pPose->translation);
+
+    RECT faceRect;
+    m_pFTResult->GetFaceRect(&faceRect);
+    pPose->rect[0] = static_cast<float>(faceRect.left) / frame.colorWidth;
+    pPose->rect[1] = static_cast<float>(faceRect.right) / frame.colorWidth;
+    pPose->rect[2] = static_cast<float>(faceRect.top) / frame.colorHeight;
+    pPose->rect[3] = static_cast<float>(faceRect.bottom) / frame.colorHeight;
+    pPose->bTracked = true;
+
+    return S_OK;
+}
+
+/// <summary>
+/// Forget the last frame, the next Track searches the whole image
+/// </summary>
+void CFaceTrackLibTracker::Reset()
+{
+    m_bLastTrackSucceeded = false;
+    if (m_pFTResult)
+    {
+        m_pFTResult->Reset();
+    }
+}
@@ -0,0 +1,58 @@
+﻿//------------------------------------------------------------------------------
+// <copyright file="FaceTrackLibTracker.h" company="Microsoft">
+//     Copyright (c) Microsoft Corporation.  All rights reserved.
+// </copyright>
+//------------------------------------------------------------------------------
+
+#pragma once
+
+#include <windows.h>
+#include "NuiApi.h"
+#include <FaceTrackLib.h>
+#include "HeadTracker.h"
+
+/// <summary>
+/// Head tracker backed by the Kinect face tracking SDK
+/// </summary>
+class CFaceTrackLibTracker : public IHeadTracker
+{
+public:
+    /// <summary>
+    /// Constructor
+    /// </summary>
+    CFaceTrackLibTracker();
+
+    /// <summary>
+    /// Destructor
+    /// </summary>
+    virtual ~CFaceTrackLibTracker();
+
+    /// <summary>
+    /// Create the face tracker for the given stream resolutions
+    /// </summary>
+    /// <param name="pOptions">options passed through to FTCreateFaceTracker</param>
+    /// <param name="colorWidth">width of the color frames</param>
+    /// <param name="colorHeight">height of the color frames</param>
+    /// <param name="depthWidth">width of the depth frames</param>
+    /// <param name="depthHeight">height of the depth frames</param>
+    /// <returns>S_OK on success, otherwise failure code</returns>
+    HRESULT                             Initialize(PVOID pOptions, LONG colorWidth, LONG colorHeight, LONG depthWidth, LONG depthHeight);
+
+    /// <summary>
+    /// Limit the search for a new face to the region around the skeleton's head
+    /// Frames without a skeleton hint are always searched whole
+    /// </summary>
+    /// <param name="bUseHeadRegion">true to search only around the head, false to search the whole image</param>
+    void                                SetUseHeadRegion(bool bUseHeadRegion) { m_bUseHeadRegion = bUseHeadRegion; }
+
+    virtual HRESULT                     Track(const HeadTrackerFrame& frame, HeadPose* pPose);
+    virtual void                        Reset();
+
+private:
+    IFTFaceTracker*                     m_pFaceTracker;
+    IFTResult*                          m_pFTResult;
+    IFTImage*                           m_pColorImage;
+    IFTImage*                           m_pDepthImage;
+    bool                                m_bLastTrackSucceeded;
+    bool                                m_bUseHeadRegion;
+};
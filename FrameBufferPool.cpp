@@ -0,0 +1,432 @@
+﻿//------------------------------------------------------------------------------
+// <copyright file="FrameBufferPool.cpp" company="Microsoft">
+//     Copyright (c) Microsoft Corporation.  All rights reserved.
+// </copyright>
+//------------------------------------------------------------------------------
+
+#include "FrameBufferPool.h"
+
+#include <new>
+
+/// <summary>
+/// Header in front of every pooled buffer, padded so the buffer after it stays aligned
+/// Headers of wrapped memory stand alone and point at the memory instead
+/// </summary>
+struct CFrameBuffer::Block
+{
+    CFrameBufferPool*                   pPool;
+    volatile LONG                       refCount;
+    BYTE*                               pData;
+    bool                                bWrapped;
+};
+
+namespace
+{
+    // buffers per slab when the pool runs out, a couple of frames more in flight than planned
+    const UINT cGrowCount = 2;
+
+    size_t RoundUp(size_t value, size_t multiple)
+    {
+        return (value + multiple - 1) / multiple * multiple;
+    }
+
+    // the block header takes one alignment unit in front of the buffer
+    const size_t cBlockHeaderSize = CFrameBufferPool::cFrameBufferAlignment;
+}
+
+CFrameBuffer::CFrameBuffer(const CFrameBuffer& other) :
+    m_pBlock(other.m_pBlock)
+{
+    if (m_pBlock)
+    {
+        InterlockedIncrement(&m_pBlock->refCount);
+    }
+}
+
+CFrameBuffer& CFrameBuffer::operator=(const CFrameBuffer& other)
+{
+    // take the new reference first, so assigning a handle to itself keeps the buffer
+    if (other.m_pBlock)
+    {
+        InterlockedIncrement(&other.m_pBlock->refCount);
+    }
+
+    Reset();
+    m_pBlock = other.m_pBlock;
+
+    return *this;
+}
+
+/// <summary>
+/// Let go of the buffer, the handle is empty afterwards
+/// </summary>
+void CFrameBuffer::Reset()
+{
+    if (NULL == m_pBlock)
+    {
+        return;
+    }
+
+    if (0 == InterlockedDecrement(&m_pBlock->refCount))
+    {
+        m_pBlock->pPool->Return(m_pBlock);
+    }
+
+    m_pBlock = NULL;
+}
+
+/// <summary>
+/// Exchange buffers with another handle, without touching either reference count
+/// </summary>
+void CFrameBuffer::Swap(CFrameBuffer& other)
+{
+    Block* pBlock = m_pBlock;
+    m_pBlock = other.m_pBlock;
+    other.m_pBlock = pBlock;
+}
+
+BYTE* CFrameBuffer::GetData() const
+{
+    C_ASSERT(sizeof(Block) <= cBlockHeaderSize);
+    return m_pBlock ? m_pBlock->pData : NULL;
+}
+
+size_t CFrameBuffer::GetSize() const
+{
+    return m_pBlock ? m_pBlock->pPool->GetBufferSize() : 0;
+}
+
+LONG CFrameBuffer::GetRefCount() const
+{
+    return m_pBlock ? m_pBlock->refCount : 0;
+}
+
+/// <summary>
+/// Constructor
+/// </summary>
+CFrameBufferPool::CFrameBufferPool() :
+    m_bufferSize(0),
+    m_blockStride(0),
+    m_bWantLargePages(false),
+    m_bLargePages(false),
+    m_bufferCount(0),
+    m_growCount(0)
+{
+    InitializeCriticalSection(&m_lock);
+}
+
+/// <summary>
+/// Destructor, frees the buffers
+/// </summary>
+CFrameBufferPool::~CFrameBufferPool()
+{
+    Free();
+    DeleteCriticalSection(&m_lock);
+}
+
+/// <summary>
+/// Size the pool, freeing any buffers it had
+/// Every handle given out before must have been released
+/// </summary>
+/// <param name="bufferSize">size of each buffer in bytes</param>
+/// <param name="count">buffers to allocate up front, the pool grows past this when they run out</param>
+/// <param name="bLargePages">back the buffers with large pages, if the process may use them</param>
+/// <returns>S_OK on success, otherwise failure code</returns>
+HRESULT CFrameBufferPool::Initialize(size_t bufferSize, UINT count, bool bLargePages)
+{
+    Free();
+
+    m_bufferSize = bufferSize;
+    m_blockStride = cBlockHeaderSize + RoundUp(bufferSize, cFrameBufferAlignment);
+    m_bWantLargePages = bLargePages;
+    m_bLargePages = bLargePages;
+
+    EnterCriticalSection(&m_lock);
+    HRESULT hr = Grow(count);
+    LeaveCriticalSection(&m_lock);
+
+    // the initial buffers are not counted as growth
+    m_growCount = 0;
+
+    return hr;
+}
+
+/// <summary>
+/// Take a free buffer, growing the pool if none is left
+/// </summary>
+/// <param name="pBuffer">receives the buffer, replacing what the handle held</param>
+/// <returns>S_OK on success, E_OUTOFMEMORY if the pool could not grow</returns>
+HRESULT CFrameBufferPool::Acquire(CFrameBuffer* pBuffer)
+{
+    // Let go of the old buffer first, when nobody else holds it this hands the same one back
+    pBuffer->Reset();
+
+    EnterCriticalSection(&m_lock);
+
+    HRESULT hr = S_OK;
+    if (m_free.empty())
+    {
+        hr = Grow(cGrowCount);
+    }
+
+    CFrameBuffer::Block* pBlock = NULL;
+    if (SUCCEEDED(hr))
+    {
+        pBlock = m_free.back();
+        m_free.pop_back();
+    }
+
+    LeaveCriticalSection(&m_lock);
+
+    if (pBlock)
+    {
+        pBlock->refCount = 1;
+        CFrameBuffer(pBlock).Swap(*pBuffer);
+    }
+
+    return hr;
+}
+
+/// <summary>
+/// Hand out memory the pool does not own through a handle, as if it were one of its buffers
+/// The memory must hold a buffer's worth of bytes, be aligned to cFrameBufferAlignment and
+/// stay valid and unchanged until the last handle lets go of it
+/// </summary>
+/// <param name="pData">memory to share</param>
+/// <param name="pBuffer">receives the handle, replacing what it held</param>
+/// <returns>S_OK on success, E_OUTOFMEMORY if no handle could be allocated</returns>
+HRESULT CFrameBufferPool::Wrap(BYTE* pData, CFrameBuffer* pBuffer)
+{
+    pBuffer->Reset();
+
+    EnterCriticalSection(&m_lock);
+
+    CFrameBuffer::Block* pBlock = NULL;
+    if (!m_freeWrappers.empty())
+    {
+        pBlock = m_freeWrappers.back();
+        m_freeWrappers.pop_back();
+    }
+    else
+    {
+        // the free list grows along with the headers, so Return never allocates
+        pBlock = new (std::nothrow) CFrameBuffer::Block;
+        if (NULL != pBlock)
+        {
+            m_wrappers.push_back(pBlock);
+            m_freeWrappers.reserve(m_wrappers.size());
+        }
+    }
+
+    LeaveCriticalSection(&m_lock);
+
+    if (NULL == pBlock)
+    {
+        return E_OUTOFMEMORY;
+    }
+
+    pBlock->pPool = this;
+    pBlock->refCount = 1;
+    pBlock->pData = pData;
+    pBlock->bWrapped = true;
+    CFrameBuffer(pBlock).Swap(*pBuffer);
+
+    return S_OK;
+}
+
+/// <summary>
+/// Ask for the privilege to lock large pages in memory, which large page allocations need
+/// </summary>
+/// <returns>true if the process holds the privilege now</returns>
+bool CFrameBufferPool::EnableLargePages()
+{
+    HANDLE hToken = NULL;
+    if (!OpenProcessToken(GetCurrentProcess(), TOKEN_ADJUST_PRIVILEGES | TOKEN_QUERY, &hToken))
+    {
+        return false;
+    }
+
+    TOKEN_PRIVILEGES privileges;
+    privileges.PrivilegeCount = 1;
+    privileges.Privileges[0].Attributes = SE_PRIVILEGE_ENABLED;
+
+    // AdjustTokenPrivileges succeeds without granting anything when the account lacks the right
+    bool bEnabled = LookupPrivilegeValueW(NULL, SE_LOCK_MEMORY_NAME, &privileges.Privileges[0].Luid) &&
+        AdjustTokenPrivileges(hToken, FALSE, &privileges, 0, NULL, NULL) &&
+        ERROR_SUCCESS == GetLastError();
+
+    CloseHandle(hToken);
+
+    return bEnabled;
+}
+
+/// <summary>
+/// Allocate a slab of buffers and add them to the free list, called with the lock held
+/// </summary>
+/// <param name="count">buffers to add</param>
+/// <returns>S_OK on success, E_OUTOFMEMORY on failure</returns>
+HRESULT CFrameBufferPool::Grow(UINT count)
+{
+    if (0 == count)
+    {
+        return S_OK;
+    }
+
+    size_t slabSize = m_blockStride * count;
+
+    // Large pages need whole large pages, and fail rather than wait when physical memory is
+    // fragmented, so a failed attempt quietly falls back to ordinary pages
+    Slab slab;
+    slab.pMemory = NULL;
+    slab.bLargePages = false;
+
+    SIZE_T largePage = m_bWantLargePages ? GetLargePageMinimum() : 0;
+    if (0 != largePage)
+    {
+        slab.pMemory = static_cast<BYTE*>(VirtualAlloc(NULL, RoundUp(slabSize, largePage), MEM_RESERVE | MEM_COMMIT | MEM_LARGE_PAGES, PAGE_READWRITE));
+        slab.bLargePages = NULL != slab.pMemory;
+    }
+
+    if (NULL == slab.pMemory)
+    {
+        slab.pMemory = static_cast<BYTE*>(VirtualAlloc(NULL, slabSize, MEM_RESERVE | MEM_COMMIT, PAGE_READWRITE));
+    }
+
+    if (NULL == slab.pMemory)
+    {
+        return E_OUTOFMEMORY;
+    }
+
+    m_slabs.push_back(slab);
+    m_bLargePages = m_bLargePages && slab.bLargePages;
+
+    // the free list never needs to hold more than every buffer
+    m_bufferCount += count;
+    m_free.reserve(m_bufferCount);
+
+    for (UINT i = 0; i < count; ++i)
+    {
+        CFrameBuffer::Block* pBlock = reinterpret_cast<CFrameBuffer::Block*>(slab.pMemory + i * m_blockStride);
+        pBlock->pPool = this;
+        pBlock->refCount = 0;
+        pBlock->pData = reinterpret_cast<BYTE*>(pBlock) + cBlockHeaderSize;
+        pBlock->bWrapped = false;
+        m_free.push_back(pBlock);
+    }
+
+    ++m_growCount;
+
+    return S_OK;
+}
+
+/// <summary>
+/// Free every slab
+/// </summary>
+void CFrameBufferPool::Free()
+{
+    for (size_t i = 0; i < m_slabs.size(); ++i)
+    {
+        VirtualFree(m_slabs[i].pMemory, 0, MEM_RELEASE);
+    }
+
+    m_slabs.clear();
+    m_free.clear();
+    m_bufferCount = 0;
+
+    for (size_t i = 0; i < m_wrappers.size(); ++i)
+    {
+        delete m_wrappers[i];
+    }
+
+    m_wrappers.clear();
+    m_freeWrappers.clear();
+}
+
+/// <summary>
+/// Put a buffer whose last handle was released back on the free list
+/// </summary>
+void CFrameBufferPool::Return(CFrameBuffer::Block* pBlock)
+{
+    // reserved to hold every buffer, so this never allocates
+    EnterCriticalSection(&m_lock);
+    if (pBlock->bWrapped)
+    {
+        m_freeWrappers.push_back(pBlock);
+    }
+    else
+    {
+        m_free.push_back(pBlock);
+    }
+    LeaveCriticalSection(&m_lock);
+}
+
+/// <summary>
+/// Check alignment, sharing and recycling of pooled buffers
+/// </summary>
+/// <returns>true if the pool behaves as expected</returns>
+bool VerifyFrameBufferPool()
+{
+    CFrameBufferPool pool;
+    if ( FAILED(pool.Initialize(1000, 2, false)) )
+    {
+        return false;
+    }
+
+    CFrameBuffer a;
+    CFrameBuffer b;
+    bool match = SUCCEEDED(pool.Acquire(&a)) && SUCCEEDED(pool.Acquire(&b));
+    match = match && 0 == reinterpret_cast<ULONG_PTR>(a.GetData()) % CFrameBufferPool::cFrameBufferAlignment;
+    match = match && 0 == reinterpret_cast<ULONG_PTR>(b.GetData()) % CFrameBufferPool::cFrameBufferAlignment;
+    match = match && a.GetData() != b.GetData() && a.GetSize() == 1000;
+    if (!match)
+    {
+        return false;
+    }
+
+    // buffers must not overlap
+    memset(a.GetData(), 0xaa, a.GetSize());
+    memset(b.GetData(), 0x55, b.GetSize());
+    match = match && 0xaa == a.GetData()[a.GetSize() - 1] && 0x55 == b.GetData()[0];
+
+    // a shared buffer stays with its last holder
+    BYTE* pShared = a.GetData();
+    CFrameBuffer held = a;
+    match = match && 2 == a.GetRefCount();
+    match = match && SUCCEEDED(pool.Acquire(&a)) && a.GetData() != pShared && held.GetData() == pShared;
+    match = match && 1 == held.GetRefCount() && 1 == pool.GetGrowCount();
+
+    // a buffer nobody else holds comes straight back, steady state never grows the pool
+    UINT bufferCount = pool.GetBufferCount();
+    for (int i = 0; i < 100 && match; ++i)
+    {
+        BYTE* pPrevious = b.GetData();
+        match = SUCCEEDED(pool.Acquire(&b)) && b.GetData() == pPrevious;
+
+        CFrameBuffer copy = held;
+        match = match && 2 == held.GetRefCount();
+    }
+
+    match = match && pool.GetBufferCount() == bufferCount;
+
+    // wrapped memory is shared as is and never takes a pooled buffer, its header is recycled
+    BYTE* pExternal = static_cast<BYTE*>(VirtualAlloc(NULL, pool.GetBufferSize(), MEM_RESERVE | MEM_COMMIT, PAGE_READWRITE));
+    match = match && NULL != pExternal;
+    for (int i = 0; i < 3 && match; ++i)
+    {
+        CFrameBuffer wrapped;
+        match = SUCCEEDED(pool.Wrap(pExternal, &wrapped)) && wrapped.GetData() == pExternal;
+        match = match && wrapped.GetSize() == pool.GetBufferSize() && 1 == wrapped.GetRefCount();
+    }
+
+    match = match && pool.GetBufferCount() == bufferCount;
+    if (NULL != pExternal)
+    {
+        VirtualFree(pExternal, 0, MEM_RELEASE);
+    }
+
+    a.Reset();
+    b.Reset();
+    held.Reset();
+
+    return match;
+}
@@ -0,0 +1,192 @@
+﻿//------------------------------------------------------------------------------
+// <copyright file="FrameBufferPool.h" company="Microsoft">
+//     Copyright (c) Microsoft Corporation.  All rights reserved.
+// </copyright>
+//------------------------------------------------------------------------------
+
+#pragma once
+
+#include <windows.h>
+#include <vector>
+
+class CFrameBufferPool;
+
+/// <summary>
+/// Reference counted handle to a buffer of a frame buffer pool
+/// Copying the handle shares the buffer, it goes back to the pool when the last handle lets go.
+/// Handles may be copied and released on any thread, the buffer contents are not synchronized.
+/// </summary>
+class CFrameBuffer
+{
+public:
+    /// <summary>
+    /// Constructor, an empty handle
+    /// </summary>
+    CFrameBuffer() : m_pBlock(NULL) {}
+
+    CFrameBuffer(const CFrameBuffer& other);
+    CFrameBuffer& operator=(const CFrameBuffer& other);
+
+    /// <summary>
+    /// Destructor, releases the buffer
+    /// </summary>
+    ~CFrameBuffer() { Reset(); }
+
+    /// <summary>
+    /// Let go of the buffer, the handle is empty afterwards
+    /// </summary>
+    void                                Reset();
+
+    /// <summary>
+    /// Exchange buffers with another handle, without touching either reference count
+    /// </summary>
+    void                                Swap(CFrameBuffer& other);
+
+    /// <summary>
+    /// Whether the handle holds a buffer
+    /// </summary>
+    bool                                IsEmpty() const { return NULL == m_pBlock; }
+
+    /// <summary>
+    /// Start of the buffer, aligned to cFrameBufferAlignment, or NULL for an empty handle
+    /// </summary>
+    BYTE*                               GetData() const;
+
+    /// <summary>
+    /// Start of the buffer as an array of T
+    /// </summary>
+    template <class T>
+    T*                                  Get() const { return reinterpret_cast<T*>(GetData()); }
+
+    /// <summary>
+    /// Usable size of the buffer in bytes, 0 for an empty handle
+    /// </summary>
+    size_t                              GetSize() const;
+
+    /// <summary>
+    /// Number of handles sharing the buffer, 0 for an empty handle
+    /// </summary>
+    LONG                                GetRefCount() const;
+
+private:
+    friend class CFrameBufferPool;
+
+    struct Block;
+
+    explicit CFrameBuffer(Block* pBlock) : m_pBlock(pBlock) {}
+
+    Block*                              m_pBlock;
+};
+
+/// <summary>
+/// Pool of equally sized frame buffers, aligned to a cache line and optionally backed by large pages
+/// Buffers are carved out of a few large allocations and recycled as their handles are released,
+/// so once the pool has grown to the number of frames in flight no further allocation happens.
+/// The pool must outlive every handle it gave out.
+/// </summary>
+class CFrameBufferPool
+{
+public:
+    // alignment of every buffer, a cache line so SIMD loads and the GPU upload never split one
+    static const size_t                 cFrameBufferAlignment = 64;
+
+    /// <summary>
+    /// Constructor
+    /// </summary>
+    CFrameBufferPool();
+
+    /// <summary>
+    /// Destructor, frees the buffers
+    /// </summary>
+    ~CFrameBufferPool();
+
+    /// <summary>
+    /// Size the pool, freeing any buffers it had
+    /// Every handle given out before must have been released
+    /// </summary>
+    /// <param name="bufferSize">size of each buffer in bytes</param>
+    /// <param name="count">buffers to allocate up front, the pool grows past this when they run out</param>
+    /// <param name="bLargePages">back the buffers with large pages, if the process may use them</param>
+    /// <returns>S_OK on success, otherwise failure code</returns>
+    HRESULT                             Initialize(size_t bufferSize, UINT count, bool bLargePages);
+
+    /// <summary>
+    /// Take a free buffer, growing the pool if none is left
+    /// </summary>
+    /// <param name="pBuffer">receives the buffer, replacing what the handle held</param>
+    /// <returns>S_OK on success, E_OUTOFMEMORY if the pool could not grow</returns>
+    HRESULT                             Acquire(CFrameBuffer* pBuffer);
+
+    /// <summary>
+    /// Hand out memory the pool does not own through a handle, as if it were one of its buffers
+    /// The memory must hold a buffer's worth of bytes, be aligned to cFrameBufferAlignment and
+    /// stay valid and unchanged until the last handle lets go of it
+    /// </summary>
+    /// <param name="pData">memory to share</param>
+    /// <param name="pBuffer">receives the handle, replacing what it held</param>
+    /// <returns>S_OK on success, E_OUTOFMEMORY if no handle could be allocated</returns>
+    HRESULT                             Wrap(BYTE* pData, CFrameBuffer* pBuffer);
+
+    /// <summary>
+    /// Size of each buffer in bytes
+    /// </summary>
+    size_t                              GetBufferSize() const { return m_bufferSize; }
+
+    /// <summary>
+    /// Buffers allocated in total, and how often the pool had to grow past its initial size
+    /// </summary>
+    UINT                                GetBufferCount() const { return m_bufferCount; }
+    UINT                                GetGrowCount() const { return m_growCount; }
+
+    /// <summary>
+    /// Whether the buffers ended up on large pages
+    /// </summary>
+    bool                                IsLargePages() const { return m_bLargePages; }
+
+    /// <summary>
+    /// Ask for the privilege to lock large pages in memory, which large page allocations need
+    /// </summary>
+    /// <returns>true if the process holds the privilege now</returns>
+    static bool                         EnableLargePages();
+
+private:
+    friend class CFrameBuffer;
+
+    // A slab is one allocation holding a run of buffers, each preceded by its block header
+    struct Slab
+    {
+        BYTE*                           pMemory;
+        bool                            bLargePages;
+    };
+
+    // serializes the free list between acquiring and releasing threads
+    CRITICAL_SECTION                    m_lock;
+
+    size_t                              m_bufferSize;
+    size_t                              m_blockStride;
+    bool                                m_bWantLargePages;
+    bool                                m_bLargePages;
+    UINT                                m_bufferCount;
+    UINT                                m_growCount;
+
+    std::vector<Slab>                   m_slabs;
+    std::vector<CFrameBuffer::Block*>   m_free;
+
+    // block headers of wrapped memory, allocated as needed and recycled like the buffers
+    std::vector<CFrameBuffer::Block*>   m_wrappers;
+    std::vector<CFrameBuffer::Block*>   m_freeWrappers;
+
+    HRESULT                             Grow(UINT count);
+    void                                Free();
+    void                                Return(CFrameBuffer::Block* pBlock);
+
+    // not copyable
+    CFrameBufferPool(const CFrameBufferPool&);
+    CFrameBufferPool& operator=(const CFrameBufferPool&);
+};
+
+/// <summary>
+/// Check alignment, sharing and recycling of pooled buffers
+/// </summary>
+/// <returns>true if the pool behaves as expected</returns>
+bool VerifyFrameBufferPool();
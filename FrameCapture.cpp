@@ -0,0 +1,478 @@
+﻿//------------------------------------------------------------------------------
+// <copyright file="FrameCapture.cpp" company="Microsoft">
+//     Copyright (c) Microsoft Corporation.  All rights reserved.
+// </copyright>
+//------------------------------------------------------------------------------
+
+#include "FrameCapture.h"
+#include "FrameProfiler.h"
+
+namespace
+{
+    // a buffer in each triple buffer slot, and the frames face tracking may hold on to
+    const UINT cSlotFrames = 3;
+    const UINT cHeldFrames = 3;
+
+    /// <summary>
+    /// Whether a frame can be shared straight from the source, laid out like a pool buffer
+    /// </summary>
+    bool CanShareImage(const FrameSourceImage& image, UINT rowBytes, UINT rows)
+    {
+        return image.bRetained && (0 == image.pitch || rowBytes == image.pitch) && image.size >= rowBytes * rows &&
+            0 == reinterpret_cast<ULONG_PTR>(image.pBits) % CFrameBufferPool::cFrameBufferAlignment;
+    }
+}
+
+/// <summary>
+/// Constructor
+/// </summary>
+CFrameCapture::CFrameCapture() :
+    m_pSource(NULL),
+    m_pRecorder(NULL),
+    m_bLossless(false),
+    m_depthWidth(0),
+    m_depthHeight(0),
+    m_colorWidth(0),
+    m_colorHeight(0),
+    m_bLargePages(false),
+    m_hStop(NULL),
+    m_hPublished(NULL),
+    m_bSmoothSkeletons(true)
+{
+    for (int i = 0; i < STREAM_COUNT; ++i)
+    {
+        m_hThreads[i] = NULL;
+        m_hConsumed[i] = NULL;
+        m_busy[i] = 0;
+    }
+}
+
+/// <summary>
+/// Destructor, stops the capture threads
+/// </summary>
+CFrameCapture::~CFrameCapture()
+{
+    Stop();
+}
+
+/// <summary>
+/// Start a capture thread per stream
+/// </summary>
+/// <param name="pSource">source to drain, must outlive the capture</param>
+/// <param name="pRecorder">recorder to pass every frame to, or NULL</param>
+/// <param name="depthWidth">width of the depth stream</param>
+/// <param name="depthHeight">height of the depth stream</param>
+/// <param name="colorWidth">width of the color stream</param>
+/// <param name="colorHeight">height of the color stream</param>
+/// <param name="bLossless">true to hold off acquiring until the previous frame was picked up, rather than replace it</param>
+/// <returns>S_OK on success, otherwise failure code</returns>
+HRESULT CFrameCapture::Start(IFrameSource* pSource, CFrameRecorder* pRecorder, LONG depthWidth, LONG depthHeight, LONG colorWidth, LONG colorHeight, bool bLossless)
+{
+    Stop();
+
+    m_pSource = pSource;
+    m_pRecorder = pRecorder;
+    m_bLossless = bLossless;
+    m_depthWidth = depthWidth;
+    m_depthHeight = depthHeight;
+    m_colorWidth = colorWidth;
+    m_colorHeight = colorHeight;
+
+    // Slots pick up a buffer per frame, let go of those from a previous capture first
+    for (int i = 0; i < 3; ++i)
+    {
+        DepthFrame& depth = m_depth.GetSlot(i);
+        depth.depth.Reset();
+        depth.colorCoordinates.Reset();
+        depth.timeStamp = 0;
+        depth.frameNumber = 0;
+
+        ColorFrame& color = m_color.GetSlot(i);
+        color.color.Reset();
+        color.timeStamp = 0;
+        color.frameNumber = 0;
+
+        ZeroMemory(&m_skeleton.GetSlot(i), sizeof(NUI_SKELETON_FRAME));
+    }
+
+    // Allocate the buffers up front, the threads only allocate if frames are held longer than planned
+    HRESULT hr = m_depthPool.Initialize(depthWidth * depthHeight * sizeof(USHORT), cSlotFrames + cHeldFrames, m_bLargePages);
+    if ( SUCCEEDED(hr) )
+    {
+        hr = m_colorCoordinatePool.Initialize(depthWidth * depthHeight * 2 * sizeof(LONG), cSlotFrames, m_bLargePages);
+    }
+    if ( SUCCEEDED(hr) )
+    {
+        hr = m_colorPool.Initialize(colorWidth * colorHeight * 4, cSlotFrames + cHeldFrames, m_bLargePages);
+    }
+    if ( FAILED(hr) ) { return hr; }
+
+    m_skeletonSmoother.Reset();
+
+    m_hStop = CreateEventW(NULL, TRUE, FALSE, NULL);
+    if (NULL == m_hStop)
+    {
+        return HRESULT_FROM_WIN32(GetLastError());
+    }
+
+    for (int i = 0; i < STREAM_COUNT; ++i)
+    {
+        m_contexts[i].pThis = this;
+        m_contexts[i].stream = i;
+
+        m_hConsumed[i] = CreateEventW(NULL, FALSE, FALSE, NULL);
+        if (NULL != m_hConsumed[i])
+        {
+            m_hThreads[i] = CreateThread(NULL, 0, CaptureThread, &m_contexts[i], 0, NULL);
+        }
+
+        if (NULL == m_hThreads[i])
+        {
+            hr = HRESULT_FROM_WIN32(GetLastError());
+            Stop();
+            return hr;
+        }
+
+        // Acquisition latency matters more than rendering
+        SetThreadPriority(m_hThreads[i], THREAD_PRIORITY_ABOVE_NORMAL);
+    }
+
+    return S_OK;
+}
+
+/// <summary>
+/// Stop and join the capture threads
+/// </summary>
+void CFrameCapture::Stop()
+{
+    if (NULL == m_hStop)
+    {
+        return;
+    }
+
+    SetEvent(m_hStop);
+
+    for (int i = 0; i < STREAM_COUNT; ++i)
+    {
+        if (NULL != m_hThreads[i])
+        {
+            WaitForSingleObject(m_hThreads[i], INFINITE);
+            CloseHandle(m_hThreads[i]);
+            m_hThreads[i] = NULL;
+        }
+
+        if (NULL != m_hConsumed[i])
+        {
+            CloseHandle(m_hConsumed[i]);
+            m_hConsumed[i] = NULL;
+        }
+    }
+
+    CloseHandle(m_hStop);
+    m_hStop = NULL;
+}
+
+UINT CFrameCapture::GetFrameBufferCount() const
+{
+    return m_depthPool.GetBufferCount() + m_colorCoordinatePool.GetBufferCount() + m_colorPool.GetBufferCount();
+}
+
+UINT CFrameCapture::GetFrameBufferGrowCount() const
+{
+    return m_depthPool.GetGrowCount() + m_colorCoordinatePool.GetGrowCount() + m_colorPool.GetGrowCount();
+}
+
+bool CFrameCapture::IsLargePages() const
+{
+    return m_depthPool.IsLargePages() && m_colorCoordinatePool.IsLargePages() && m_colorPool.IsLargePages();
+}
+
+bool CFrameCapture::AcquireDepth()
+{
+    if (!m_depth.Acquire())
+    {
+        return false;
+    }
+
+    SetEvent(m_hConsumed[STREAM_DEPTH]);
+    return true;
+}
+
+bool CFrameCapture::AcquireColor()
+{
+    if (!m_color.Acquire())
+    {
+        return false;
+    }
+
+    SetEvent(m_hConsumed[STREAM_COLOR]);
+    return true;
+}
+
+bool CFrameCapture::AcquireSkeleton()
+{
+    if (!m_skeleton.Acquire())
+    {
+        return false;
+    }
+
+    SetEvent(m_hConsumed[STREAM_SKELETON]);
+    return true;
+}
+
+/// <summary>
+/// Whether every frame acquired from the source so far has been picked up
+/// </summary>
+bool CFrameCapture::IsDrained() const
+{
+    for (int i = 0; i < STREAM_COUNT; ++i)
+    {
+        if (0 != m_busy[i] || IsPending(i))
+        {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+/// <summary>
+/// Whether a published frame of a stream is waiting to be picked up
+/// </summary>
+bool CFrameCapture::IsPending(int stream) const
+{
+    switch (stream)
+    {
+    case STREAM_DEPTH:
+        return m_depth.IsPending();
+    case STREAM_COLOR:
+        return m_color.IsPending();
+    default:
+        return m_skeleton.IsPending();
+    }
+}
+
+/// <summary>
+/// Wake whoever waits for new frames
+/// </summary>
+void CFrameCapture::NotifyPublished()
+{
+    if (NULL != m_hPublished)
+    {
+        SetEvent(m_hPublished);
+    }
+}
+
+DWORD WINAPI CFrameCapture::CaptureThread(LPVOID lpParam)
+{
+    ThreadContext* pContext = static_cast<ThreadContext*>(lpParam);
+    pContext->pThis->CaptureLoop(pContext->stream);
+    return 0;
+}
+
+/// <summary>
+/// Wait for frames of one stream and publish them until stopped
+/// </summary>
+/// <param name="stream">stream the thread is responsible for</param>
+void CFrameCapture::CaptureLoop(int stream)
+{
+    HANDLE hFrameEvent;
+    switch (stream)
+    {
+    case STREAM_DEPTH:
+        hFrameEvent = m_pSource->GetNextDepthFrameEvent();
+        CFrameProfiler::SetThreadName("capture depth");
+        break;
+    case STREAM_COLOR:
+        hFrameEvent = m_pSource->GetNextColorFrameEvent();
+        CFrameProfiler::SetThreadName("capture color");
+        break;
+    default:
+        hFrameEvent = m_pSource->GetNextSkeletonEvent();
+        CFrameProfiler::SetThreadName("capture skeleton");
+        break;
+    }
+
+    HANDLE frameWaits[2] = { m_hStop, hFrameEvent };
+    HANDLE consumedWaits[2] = { m_hStop, m_hConsumed[stream] };
+
+    for (;;)
+    {
+        // Lossless capture leaves frames in the source until the last one was picked up
+        if (m_bLossless && IsPending(stream))
+        {
+            if (WAIT_OBJECT_0 + 1 != WaitForMultipleObjects(2, consumedWaits, FALSE, INFINITE))
+            {
+                break;
+            }
+
+            continue;
+        }
+
+        if (WAIT_OBJECT_0 + 1 != WaitForMultipleObjects(2, frameWaits, FALSE, INFINITE))
+        {
+            break;
+        }
+
+        // Cleared only once the frame is published, so IsDrained never misses a frame in flight
+        InterlockedExchange(&m_busy[stream], 1);
+
+        switch (stream)
+        {
+        case STREAM_DEPTH:
+            CaptureDepth();
+            break;
+        case STREAM_COLOR:
+            CaptureColor();
+            break;
+        default:
+            CaptureSkeleton();
+            break;
+        }
+
+        InterlockedExchange(&m_busy[stream], 0);
+    }
+}
+
+/// <summary>
+/// Take a depth frame from the source and compute its color coordinates
+/// </summary>
+/// <returns>S_OK on success, otherwise failure code</returns>
+HRESULT CFrameCapture::CaptureDepth()
+{
+    FrameSourceImage image;
+    HRESULT hr;
+
+    {
+        PROFILE_SCOPE("acquire depth");
+        hr = m_pSource->AcquireDepthFrame(&image);
+        if ( FAILED(hr) ) { return hr; }
+    }
+
+    // The previous frame in this slot may still be held elsewhere, if not its buffers come back
+    // A retained frame is handed on in place, everything else is copied into a pool buffer
+    DepthFrame& frame = m_depth.GetBack();
+    UINT rowBytes = m_depthWidth * sizeof(USHORT);
+    bool bShared = CanShareImage(image, rowBytes, static_cast<UINT>(m_depthHeight));
+    hr = bShared ? m_depthPool.Wrap(image.pBits, &frame.depth) : m_depthPool.Acquire(&frame.depth);
+    if ( SUCCEEDED(hr) )
+    {
+        hr = m_colorCoordinatePool.Acquire(&frame.colorCoordinates);
+    }
+    if ( FAILED(hr) )
+    {
+        m_pSource->ReleaseDepthFrame();
+        return hr;
+    }
+
+    // The source's rows may be padded, the buffer's never are
+    if (!bShared)
+    {
+        PROFILE_SCOPE("copy depth");
+        UINT srcPitch = image.pitch ? image.pitch : rowBytes;
+        UINT rows = min(static_cast<UINT>(m_depthHeight), image.size / srcPitch);
+        CopyImageRows(frame.depth.GetData(), rowBytes, image.pBits, srcPitch, rowBytes, rows);
+    }
+    frame.timeStamp = image.timeStamp;
+    frame.frameNumber = image.frameNumber;
+
+    if (m_pRecorder)
+    {
+        m_pRecorder->WriteDepth(image);
+    }
+
+    hr = m_pSource->ReleaseDepthFrame();
+
+    // Get of x, y coordinates for color in depth space
+    // This will allow us to later compensate for the differences in location, angle, etc between the depth and color cameras
+    {
+        PROFILE_SCOPE("map depth to color coordinates");
+        m_pSource->MapDepthFrameToColorCoordinates(frame.depth.Get<USHORT>(), frame.colorCoordinates.Get<LONG>());
+    }
+
+    m_depth.Publish();
+    NotifyPublished();
+
+    return hr;
+}
+
+/// <summary>
+/// Take a color frame from the source
+/// </summary>
+/// <returns>S_OK on success, otherwise failure code</returns>
+HRESULT CFrameCapture::CaptureColor()
+{
+    FrameSourceImage image;
+    HRESULT hr;
+
+    {
+        PROFILE_SCOPE("acquire color");
+        hr = m_pSource->AcquireColorFrame(&image);
+        if ( FAILED(hr) ) { return hr; }
+    }
+
+    ColorFrame& frame = m_color.GetBack();
+    UINT rowBytes = m_colorWidth * 4;
+    bool bShared = CanShareImage(image, rowBytes, static_cast<UINT>(m_colorHeight));
+    hr = bShared ? m_colorPool.Wrap(image.pBits, &frame.color) : m_colorPool.Acquire(&frame.color);
+    if ( FAILED(hr) )
+    {
+        m_pSource->ReleaseColorFrame();
+        return hr;
+    }
+
+    if (!bShared)
+    {
+        PROFILE_SCOPE("copy color");
+        UINT srcPitch = image.pitch ? image.pitch : rowBytes;
+        UINT rows = min(static_cast<UINT>(m_colorHeight), image.size / srcPitch);
+        CopyImageRows(frame.color.GetData(), rowBytes, image.pBits, srcPitch, rowBytes, rows);
+    }
+    frame.timeStamp = image.timeStamp;
+    frame.frameNumber = image.frameNumber;
+
+    if (m_pRecorder)
+    {
+        m_pRecorder->WriteColor(image);
+    }
+
+    hr = m_pSource->ReleaseColorFrame();
+
+    m_color.Publish();
+    NotifyPublished();
+
+    return hr;
+}
+
+/// <summary>
+/// Fetch a skeleton frame from the source, record it and smooth it
+/// </summary>
+/// <returns>S_OK on success, otherwise failure code</returns>
+HRESULT CFrameCapture::CaptureSkeleton()
+{
+    NUI_SKELETON_FRAME& frame = m_skeleton.GetBack();
+    HRESULT hr;
+
+    {
+        PROFILE_SCOPE("acquire skeleton");
+        hr = m_pSource->GetSkeletonFrame(&frame);
+        if ( FAILED(hr) ) { return hr; }
+    }
+
+    if (m_pRecorder)
+    {
+        m_pRecorder->WriteSkeleton(frame);
+    }
+
+    // Every frame is seen here, the render thread may skip some, and the filters need them all
+    if (m_bSmoothSkeletons)
+    {
+        PROFILE_SCOPE("smooth skeleton");
+        m_skeletonSmoother.Smooth(&frame);
+    }
+
+    m_skeleton.Publish();
+    NotifyPublished();
+
+    return hr;
+}
@@ -0,0 +1,201 @@
+﻿//------------------------------------------------------------------------------
+// <copyright file="FrameCapture.h" company="Microsoft">
+//     Copyright (c) Microsoft Corporation.  All rights reserved.
+// </copyright>
+//------------------------------------------------------------------------------
+
+#pragma once
+
+#include <windows.h>
+#include "NuiApi.h"
+#include "FrameBufferPool.h"
+#include "FrameSource.h"
+#include "FrameRecorder.h"
+#include "TripleBuffer.h"
+#include "SkeletonSmoother.h"
+
+/// <summary>
+/// Drains each stream of a frame source on its own thread
+/// The latest frame of every stream is kept in a triple buffer the render thread
+/// picks up from without blocking, so acquisition no longer depends on render cadence
+///
+/// Each frame is copied at most once, out of the source into a tightly packed pooled buffer, and
+/// not at all when the source retains it, replayed frames in a mapped recording are wrapped instead.
+/// The buffer is then shared by face tracking, the color mapping and the texture upload, any of
+/// which can keep a reference to it while newer frames arrive in other buffers.
+/// </summary>
+class CFrameCapture
+{
+public:
+    /// <summary>
+    /// Depth frame together with the color coordinates of its pixels
+    /// </summary>
+    struct DepthFrame
+    {
+        // USHORT depth and LONG color coordinate pairs, a pixel each
+        CFrameBuffer                    depth;
+        CFrameBuffer                    colorCoordinates;
+        LONGLONG                        timeStamp;
+        DWORD                           frameNumber;
+    };
+
+    /// <summary>
+    /// BGRX color frame
+    /// </summary>
+    struct ColorFrame
+    {
+        CFrameBuffer                    color;
+        LONGLONG                        timeStamp;
+        DWORD                           frameNumber;
+    };
+
+    /// <summary>
+    /// Constructor
+    /// </summary>
+    CFrameCapture();
+
+    /// <summary>
+    /// Destructor, stops the capture threads
+    /// </summary>
+    ~CFrameCapture();
+
+    /// <summary>
+    /// Start a capture thread per stream
+    /// </summary>
+    /// <param name="pSource">source to drain, must outlive the capture</param>
+    /// <param name="pRecorder">recorder to pass every frame to, or NULL</param>
+    /// <param name="depthWidth">width of the depth stream</param>
+    /// <param name="depthHeight">height of the depth stream</param>
+    /// <param name="colorWidth">width of the color stream</param>
+    /// <param name="colorHeight">height of the color stream</param>
+    /// <param name="bLossless">true to hold off acquiring until the previous frame was picked up, rather than replace it</param>
+    /// <returns>S_OK on success, otherwise failure code</returns>
+    HRESULT                             Start(IFrameSource* pSource, CFrameRecorder* pRecorder, LONG depthWidth, LONG depthHeight, LONG colorWidth, LONG colorHeight, bool bLossless);
+
+    /// <summary>
+    /// Stop and join the capture threads
+    /// </summary>
+    void                                Stop();
+
+    /// <summary>
+    /// Smooth skeleton frames as they are captured, after they are recorded
+    /// Call before Start, sources that deliver smoothed skeletons already need it off
+    /// </summary>
+    /// <param name="bSmooth">true to smooth skeletons</param>
+    void                                SetSkeletonSmoothing(bool bSmooth) { m_bSmoothSkeletons = bSmooth; }
+
+    /// <summary>
+    /// Event to signal whenever a stream publishes a frame, so the render thread can sleep until one arrives
+    /// The caller owns the event, call before Start
+    /// </summary>
+    /// <param name="hEvent">event to signal, or NULL for none</param>
+    void                                SetPublishEvent(HANDLE hEvent) { m_hPublished = hEvent; }
+
+    /// <summary>
+    /// Back the frame buffers with large pages, call before Start
+    /// Needs the lock pages in memory privilege, without it ordinary pages are used
+    /// </summary>
+    /// <param name="bLargePages">true to ask for large pages</param>
+    void                                SetLargePages(bool bLargePages) { m_bLargePages = bLargePages; }
+
+    /// <summary>
+    /// Frame buffers allocated by all pools, how often a pool had to grow past its initial
+    /// size because frames were held longer than planned, and whether large pages were used
+    /// </summary>
+    UINT                                GetFrameBufferCount() const;
+    UINT                                GetFrameBufferGrowCount() const;
+    bool                                IsLargePages() const;
+
+    /// <summary>
+    /// The skeleton smoother, tune it before Start and read its statistics after Stop
+    /// </summary>
+    CSkeletonSmoother&                  GetSkeletonSmoother() { return m_skeletonSmoother; }
+    const CSkeletonSmoother&            GetSkeletonSmoother() const { return m_skeletonSmoother; }
+
+    /// <summary>
+    /// Take the newest depth frame, if one arrived since the last call
+    /// The frame stays valid until the next successful call
+    /// </summary>
+    /// <returns>true if GetDepth now returns a new frame</returns>
+    bool                                AcquireDepth();
+    const DepthFrame&                   GetDepth() const { return m_depth.GetFront(); }
+
+    /// <summary>
+    /// Take the newest color frame, if one arrived since the last call
+    /// The frame stays valid until the next successful call
+    /// </summary>
+    /// <returns>true if GetColor now returns a new frame</returns>
+    bool                                AcquireColor();
+    const ColorFrame&                   GetColor() const { return m_color.GetFront(); }
+
+    /// <summary>
+    /// Take the newest skeleton frame, if one arrived since the last call
+    /// </summary>
+    /// <returns>true if GetSkeleton now returns a new frame</returns>
+    bool                                AcquireSkeleton();
+    const NUI_SKELETON_FRAME&           GetSkeleton() const { return m_skeleton.GetFront(); }
+
+    /// <summary>
+    /// Whether every frame acquired from the source so far has been picked up
+    /// </summary>
+    bool                                IsDrained() const;
+
+private:
+    enum
+    {
+        STREAM_DEPTH,
+        STREAM_COLOR,
+        STREAM_SKELETON,
+        STREAM_COUNT
+    };
+
+    struct ThreadContext
+    {
+        CFrameCapture*                  pThis;
+        int                             stream;
+    };
+
+    IFrameSource*                       m_pSource;
+    CFrameRecorder*                     m_pRecorder;
+    bool                                m_bLossless;
+
+    LONG                                m_depthWidth;
+    LONG                                m_depthHeight;
+    LONG                                m_colorWidth;
+    LONG                                m_colorHeight;
+    bool                                m_bLargePages;
+
+    // declared before the frames, so the buffers go back before the pools are freed
+    CFrameBufferPool                    m_depthPool;
+    CFrameBufferPool                    m_colorCoordinatePool;
+    CFrameBufferPool                    m_colorPool;
+
+    HANDLE                              m_hStop;
+    HANDLE                              m_hThreads[STREAM_COUNT];
+    ThreadContext                       m_contexts[STREAM_COUNT];
+
+    // signaled when the render thread picks up a frame, paces lossless capture
+    HANDLE                              m_hConsumed[STREAM_COUNT];
+
+    // signaled after every publish, owned by the caller
+    HANDLE                              m_hPublished;
+
+    // set while a thread holds a frame it has acquired but not yet published
+    volatile LONG                       m_busy[STREAM_COUNT];
+
+    CTripleBuffer<DepthFrame>           m_depth;
+    CTripleBuffer<ColorFrame>           m_color;
+    CTripleBuffer<NUI_SKELETON_FRAME>   m_skeleton;
+
+    // only touched by the skeleton thread while capturing
+    bool                                m_bSmoothSkeletons;
+    CSkeletonSmoother                   m_skeletonSmoother;
+
+    static DWORD WINAPI                 CaptureThread(LPVOID lpParam);
+    void                                CaptureLoop(int stream);
+    bool                                IsPending(int stream) const;
+    void                                NotifyPublished();
+    HRESULT                             CaptureDepth();
+    HRESULT                             CaptureColor();
+    HRESULT                             CaptureSkeleton();
+};
@@ -0,0 +1,296 @@
+﻿//------------------------------------------------------------------------------
+// <copyright file="FrameProfiler.cpp" company="Microsoft">
+//     Copyright (c) Microsoft Corporation.  All rights reserved.
+// </copyright>
+//------------------------------------------------------------------------------
+
+#include "FrameProfiler.h"
+
+#include <algorithm>
+#include <map>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#if defined(_WIN32)
+#include <windows.h>
+#else
+#include <chrono>
+#endif
+
+// Visual C++ before 2015 only has the underscored version
+#if defined(_MSC_VER) && _MSC_VER < 1900
+#define snprintf _snprintf
+#endif
+
+namespace
+{
+    // Stages kept per thread, older ones are overwritten
+    const uint32_t cRingCapacity = 1 << 14;
+
+    struct ProfileEvent
+    {
+        const char*                     szName;
+        int64_t                         start;
+        int64_t                         end;
+    };
+
+    struct ProfileRing
+    {
+        ProfileEvent                    events[cRingCapacity];
+
+        // stages ever written, the owning thread is the only writer
+        std::atomic<uint32_t>           written;
+
+        const char*                     szThreadName;
+        int                             threadId;
+    };
+
+    struct ThreadEvents
+    {
+        const char*                     szThreadName;
+        int                             threadId;
+        std::vector<ProfileEvent>       events;
+    };
+
+    PROFILER_THREAD_LOCAL ProfileRing*  t_pRing = NULL;
+    PROFILER_THREAD_LOCAL const char*   t_szThreadName = NULL;
+
+    // Rings are only ever added, and live until the process exits since threads may still be recording
+    std::mutex                          g_ringsLock;
+    std::vector<ProfileRing*>           g_rings;
+
+    ProfileRing* GetThreadRing()
+    {
+        if (NULL == t_pRing)
+        {
+            ProfileRing* pRing = new ProfileRing;
+            pRing->written.store(0);
+            pRing->szThreadName = t_szThreadName;
+
+            std::lock_guard<std::mutex> lock(g_ringsLock);
+            pRing->threadId = static_cast<int>(g_rings.size()) + 1;
+            g_rings.push_back(pRing);
+
+            t_pRing = pRing;
+        }
+
+        return t_pRing;
+    }
+
+    /// <summary>
+    /// Copy out the stages still held by every ring
+    /// </summary>
+    void Snapshot(std::vector<ThreadEvents>* pThreads)
+    {
+        std::lock_guard<std::mutex> lock(g_ringsLock);
+
+        for (size_t i = 0; i < g_rings.size(); ++i)
+        {
+            const ProfileRing* pRing = g_rings[i];
+            uint32_t written = pRing->written.load(std::memory_order_acquire);
+            uint32_t first = written > cRingCapacity ? written - cRingCapacity : 0;
+
+            ThreadEvents thread;
+            thread.szThreadName = pRing->szThreadName;
+            thread.threadId = pRing->threadId;
+            for (uint32_t e = first; e < written; ++e)
+            {
+                thread.events.push_back(pRing->events[e % cRingCapacity]);
+            }
+
+            pThreads->push_back(thread);
+        }
+    }
+
+    /// <summary>
+    /// Duration of the sample at the given percentile, nearest rank
+    /// </summary>
+    double Percentile(const std::vector<int64_t>& sorted, double percentile)
+    {
+        size_t rank = static_cast<size_t>(percentile / 100.0 * sorted.size() + 0.999999);
+        rank = (std::max)(static_cast<size_t>(1), (std::min)(rank, sorted.size()));
+        return static_cast<double>(sorted[rank - 1]);
+    }
+
+    std::string BuildSummary()
+    {
+        std::vector<ThreadEvents> threads;
+        Snapshot(&threads);
+
+        std::map<std::string, std::vector<int64_t> > stages;
+        for (size_t t = 0; t < threads.size(); ++t)
+        {
+            for (size_t e = 0; e < threads[t].events.size(); ++e)
+            {
+                const ProfileEvent& event = threads[t].events[e];
+                stages[event.szName].push_back(event.end - event.start);
+            }
+        }
+
+        double msPerTick = 1000.0 / ProfilerFrequency();
+        std::string summary;
+
+        for (std::map<std::string, std::vector<int64_t> >::iterator it = stages.begin(); it != stages.end(); ++it)
+        {
+            std::vector<int64_t>& durations = it->second;
+            std::sort(durations.begin(), durations.end());
+
+            double total = 0.0;
+            for (size_t i = 0; i < durations.size(); ++i)
+            {
+                total += static_cast<double>(durations[i]);
+            }
+
+            char line[256];
+            snprintf(line, sizeof(line), "stage=%s count=%u mean_ms=%.4f p50_ms=%.4f p95_ms=%.4f p99_ms=%.4f\n",
+                it->first.c_str(),
+                static_cast<unsigned int>(durations.size()),
+                total / durations.size() * msPerTick,
+                Percentile(durations, 50.0) * msPerTick,
+                Percentile(durations, 95.0) * msPerTick,
+                Percentile(durations, 99.0) * msPerTick);
+            summary += line;
+        }
+
+        return summary;
+    }
+}
+
+std::atomic<bool> CFrameProfiler::s_bEnabled(false);
+
+/// <summary>
+/// Current time in profiler ticks, QueryPerformanceCounter on Windows and steady_clock elsewhere
+/// </summary>
+int64_t ProfilerNow()
+{
+#if defined(_WIN32)
+    LARGE_INTEGER now;
+    QueryPerformanceCounter(&now);
+    return now.QuadPart;
+#else
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+#endif
+}
+
+/// <summary>
+/// Profiler ticks per second
+/// </summary>
+int64_t ProfilerFrequency()
+{
+#if defined(_WIN32)
+    LARGE_INTEGER frequency;
+    QueryPerformanceFrequency(&frequency);
+    return frequency.QuadPart;
+#else
+    return 1000000000;
+#endif
+}
+
+/// <summary>
+/// Name the calling thread in traces
+/// </summary>
+/// <param name="szName">string literal naming the thread</param>
+void CFrameProfiler::SetThreadName(const char* szName)
+{
+    t_szThreadName = szName;
+
+    if (NULL != t_pRing)
+    {
+        t_pRing->szThreadName = szName;
+    }
+}
+
+/// <summary>
+/// Record a completed stage of the calling thread
+/// </summary>
+/// <param name="szName">string literal naming the stage</param>
+/// <param name="start">ProfilerNow at the start of the stage</param>
+/// <param name="end">ProfilerNow at the end of the stage</param>
+void CFrameProfiler::Record(const char* szName, int64_t start, int64_t end)
+{
+    ProfileRing* pRing = GetThreadRing();
+
+    uint32_t written = pRing->written.load(std::memory_order_relaxed);
+    ProfileEvent& event = pRing->events[written % cRingCapacity];
+    event.szName = szName;
+    event.start = start;
+    event.end = end;
+
+    // readers only look at stages below the published count
+    pRing->written.store(written + 1, std::memory_order_release);
+}
+
+/// <summary>
+/// Write every recorded stage in the Chrome trace event format, for chrome://tracing
+/// Call once the recording threads are idle
+/// </summary>
+/// <param name="pFile">file to write to</param>
+void CFrameProfiler::WriteChromeTrace(FILE* pFile)
+{
+    std::vector<ThreadEvents> threads;
+    Snapshot(&threads);
+
+    // Timestamps are made relative to the earliest stage, in microseconds
+    int64_t origin = 0;
+    bool bFirst = true;
+    for (size_t t = 0; t < threads.size(); ++t)
+    {
+        for (size_t e = 0; e < threads[t].events.size(); ++e)
+        {
+            if (bFirst || threads[t].events[e].start < origin)
+            {
+                origin = threads[t].events[e].start;
+                bFirst = false;
+            }
+        }
+    }
+
+    double usPerTick = 1000000.0 / ProfilerFrequency();
+    const char* separator = "";
+
+    fputs("{\"traceEvents\":[\n", pFile);
+
+    for (size_t t = 0; t < threads.size(); ++t)
+    {
+        const ThreadEvents& thread = threads[t];
+
+        if (thread.szThreadName)
+        {
+            fprintf(pFile, "%s{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%d,\"args\":{\"name\":\"%s\"}}",
+                separator, thread.threadId, thread.szThreadName);
+            separator = ",\n";
+        }
+
+        for (size_t e = 0; e < thread.events.size(); ++e)
+        {
+            const ProfileEvent& event = thread.events[e];
+            fprintf(pFile, "%s{\"name\":\"%s\",\"ph\":\"X\",\"pid\":1,\"tid\":%d,\"ts\":%.3f,\"dur\":%.3f}",
+                separator, event.szName, thread.threadId,
+                (event.start - origin) * usPerTick, (event.end - event.start) * usPerTick);
+            separator = ",\n";
+        }
+    }
+
+    fputs("\n]}\n", pFile);
+}
+
+/// <summary>
+/// Write count, mean and p50/p95/p99 durations of every stage, one line per stage
+/// Call once the recording threads are idle
+/// </summary>
+/// <param name="pFile">file to write to</param>
+void CFrameProfiler::WriteSummary(FILE* pFile)
+{
+    fputs(BuildSummary().c_str(), pFile);
+}
+
+/// <summary>
+/// Format the same summary as WriteSummary
+/// Call once the recording threads are idle
+/// </summary>
+/// <returns>the whole summary, however many stages were recorded</returns>
+std::string CFrameProfiler::FormatSummary()
+{
+    return BuildSummary();
+}
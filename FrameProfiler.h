@@ -0,0 +1,121 @@
+﻿//------------------------------------------------------------------------------
+// <copyright file="FrameProfiler.h" company="Microsoft">
+//     Copyright (c) Microsoft Corporation.  All rights reserved.
+// </copyright>
+//------------------------------------------------------------------------------
+
+#pragma once
+
+#include <stdint.h>
+#include <stdio.h>
+#include <atomic>
+#include <string>
+
+// Thread local storage usable for plain pointers on every compiler we build with
+#if defined(_MSC_VER)
+#define PROFILER_THREAD_LOCAL __declspec(thread)
+#else
+#define PROFILER_THREAD_LOCAL __thread
+#endif
+
+/// <summary>
+/// Current time in profiler ticks, QueryPerformanceCounter on Windows and steady_clock elsewhere
+/// </summary>
+int64_t ProfilerNow();
+
+/// <summary>
+/// Profiler ticks per second
+/// </summary>
+int64_t ProfilerFrequency();
+
+/// <summary>
+/// Collects timed stages of every thread into per-thread rings
+/// Each thread writes only its own ring, so recording takes no locks. Stage names must be
+/// string literals, only the pointer is stored. While disabled, scopes cost a single flag test.
+/// </summary>
+class CFrameProfiler
+{
+public:
+    /// <summary>
+    /// Start or stop recording
+    /// </summary>
+    /// <param name="bEnabled">true to record stages</param>
+    static void                         Enable(bool bEnabled) { s_bEnabled.store(bEnabled, std::memory_order_relaxed); }
+
+    /// <summary>
+    /// Whether stages are being recorded
+    /// </summary>
+    static bool                         IsEnabled() { return s_bEnabled.load(std::memory_order_relaxed); }
+
+    /// <summary>
+    /// Name the calling thread in traces
+    /// </summary>
+    /// <param name="szName">string literal naming the thread</param>
+    static void                         SetThreadName(const char* szName);
+
+    /// <summary>
+    /// Record a completed stage of the calling thread
+    /// </summary>
+    /// <param name="szName">string literal naming the stage</param>
+    /// <param name="start">ProfilerNow at the start of the stage</param>
+    /// <param name="end">ProfilerNow at the end of the stage</param>
+    static void                         Record(const char* szName, int64_t start, int64_t end);
+
+    /// <summary>
+    /// Write every recorded stage in the Chrome trace event format, for chrome://tracing
+    /// Call once the recording threads are idle
+    /// </summary>
+    /// <param name="pFile">file to write to</param>
+    static void                         WriteChromeTrace(FILE* pFile);
+
+    /// <summary>
+    /// Write count, mean and p50/p95/p99 durations of every stage, one line per stage
+    /// Call once the recording threads are idle
+    /// </summary>
+    /// <param name="pFile">file to write to</param>
+    static void                         WriteSummary(FILE* pFile);
+
+    /// <summary>
+    /// Format the same summary as WriteSummary
+    /// Call once the recording threads are idle
+    /// </summary>
+    /// <returns>the whole summary, however many stages were recorded</returns>
+    static std::string                  FormatSummary();
+
+private:
+    static std::atomic<bool>            s_bEnabled;
+};
+
+/// <summary>
+/// Times the enclosing scope as one stage
+/// </summary>
+class CProfileScope
+{
+public:
+    explicit CProfileScope(const char* szName) :
+        m_szName(CFrameProfiler::IsEnabled() ? szName : NULL),
+        m_start(m_szName ? ProfilerNow() : 0)
+    {
+    }
+
+    ~CProfileScope()
+    {
+        if (m_szName)
+        {
+            CFrameProfiler::Record(m_szName, m_start, ProfilerNow());
+        }
+    }
+
+private:
+    CProfileScope(const CProfileScope&);
+    CProfileScope& operator=(const CProfileScope&);
+
+    const char*                         m_szName;
+    int64_t                             m_start;
+};
+
+#define PROFILE_CONCAT_INNER(a, b) a##b
+#define PROFILE_CONCAT(a, b) PROFILE_CONCAT_INNER(a, b)
+
+// Time the rest of the enclosing scope under the given stage name
+#define PROFILE_SCOPE(name) CProfileScope PROFILE_CONCAT(profileScope, __COUNTER__)(name)
@@ -0,0 +1,286 @@
+﻿//------------------------------------------------------------------------------
+// <copyright file="FrameRecorder.cpp" company="Microsoft">
+//     Copyright (c) Microsoft Corporation.  All rights reserved.
+// </copyright>
+//------------------------------------------------------------------------------
+
+#include "FrameRecorder.h"
+#include "DepthCodec.h"
+#include "FrameProfiler.h"
+
+namespace
+{
+    // a delta chain restarts once a second at 30fps, so a damaged chunk costs at most that
+    const UINT cDepthKeyFrameInterval = 30;
+}
+
+/// <summary>
+/// Constructor
+/// </summary>
+CFrameRecorder::CFrameRecorder() :
+    m_hFile(INVALID_HANDLE_VALUE),
+    m_position(0),
+    m_depthCodec(RECORDING_DEPTH_RAW),
+    m_depthWidth(0),
+    m_depthHeight(0),
+    m_depthSinceKeyFrame(0),
+    m_rawDepthBytes(0),
+    m_writtenDepthBytes(0)
+{
+    InitializeCriticalSection(&m_lock);
+    ZeroMemory(&m_header, sizeof(m_header));
+}
+
+/// <summary>
+/// Destructor, finalizes and closes the file
+/// </summary>
+CFrameRecorder::~CFrameRecorder()
+{
+    Close();
+    DeleteCriticalSection(&m_lock);
+}
+
+/// <summary>
+/// Create the recording file and write its header
+/// </summary>
+/// <param name="szFileName">path of the recording</param>
+/// <param name="depthResolution">resolution of the depth stream</param>
+/// <param name="colorResolution">resolution of the color stream</param>
+/// <param name="pSource">source to take calibration data from</param>
+/// <param name="depthCodec">how depth frames are stored</param>
+/// <returns>S_OK on success, otherwise failure code</returns>
+HRESULT CFrameRecorder::Open(LPCWSTR szFileName, NUI_IMAGE_RESOLUTION depthResolution, NUI_IMAGE_RESOLUTION colorResolution, IFrameSource* pSource, RecordingDepthCodec depthCodec)
+{
+    DWORD width = 0;
+    DWORD height = 0;
+    NuiImageResolutionToSize(depthResolution, width, height);
+    m_depthWidth = static_cast<LONG>(width);
+    m_depthHeight = static_cast<LONG>(height);
+
+    // sized once, compressing a frame never allocates
+    m_depthCodec = depthCodec;
+    m_depthSinceKeyFrame = 0;
+    m_rawDepthBytes = 0;
+    m_writtenDepthBytes = 0;
+    if (RECORDING_DEPTH_RAW != depthCodec)
+    {
+        size_t pixelCount = width * height;
+        m_packedDepth.resize(pixelCount);
+        m_previousDepth.resize(RECORDING_DEPTH_RVL_DELTA == depthCodec ? pixelCount : 0);
+        m_encodedDepth.resize((DepthCodecMaxEncodedSize(pixelCount) + sizeof(DWORD) - 1) / sizeof(DWORD));
+    }
+
+    m_hFile = CreateFileW(szFileName, GENERIC_WRITE, 0, NULL, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL | FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+    if (INVALID_HANDLE_VALUE == m_hFile)
+    {
+        return HRESULT_FROM_WIN32(GetLastError());
+    }
+
+    // Without calibration data replay falls back to an unregistered mapping
+    ULONG mappingSize = 0;
+    void* pMappingData = NULL;
+    if (FAILED(pSource->GetMappingParameters(&mappingSize, &pMappingData)))
+    {
+        mappingSize = 0;
+        pMappingData = NULL;
+    }
+
+    // The header is written again with the index location once recording stops
+    m_header.magic = cRecordingMagic;
+    m_header.version = cRecordingVersion;
+    m_header.depthResolution = depthResolution;
+    m_header.colorResolution = colorResolution;
+    m_header.mappingParametersSize = mappingSize;
+    m_header.mappingParametersOffset = sizeof(m_header);
+
+    HRESULT hr = Write(&m_header, sizeof(m_header));
+    if (FAILED(hr)) { return hr; }
+
+    return Write(pMappingData, mappingSize);
+}
+
+/// <summary>
+/// Write the index table, complete the header and close the file
+/// </summary>
+/// <returns>S_OK on success, otherwise failure code</returns>
+HRESULT CFrameRecorder::Close()
+{
+    EnterCriticalSection(&m_lock);
+
+    if (INVALID_HANDLE_VALUE == m_hFile)
+    {
+        LeaveCriticalSection(&m_lock);
+        return S_FALSE;
+    }
+
+    // Keep the index naturally aligned for readers that map it
+    LONGLONG indexOffset = (m_position + 7) / 8 * 8;
+    HRESULT hr = WritePadding(indexOffset);
+
+    if (SUCCEEDED(hr) && !m_index.empty())
+    {
+        hr = Write(&m_index[0], static_cast<DWORD>(m_index.size() * sizeof(RecordingIndexEntry)));
+    }
+
+    if (SUCCEEDED(hr))
+    {
+        m_header.indexOffset = indexOffset;
+        m_header.indexCount = static_cast<DWORD>(m_index.size());
+
+        LARGE_INTEGER zero = {0};
+        DWORD written = 0;
+        if (!SetFilePointerEx(m_hFile, zero, NULL, FILE_BEGIN) ||
+            !WriteFile(m_hFile, &m_header, sizeof(m_header), &written, NULL) || written != sizeof(m_header))
+        {
+            hr = HRESULT_FROM_WIN32(GetLastError());
+        }
+    }
+
+    CloseHandle(m_hFile);
+    m_hFile = INVALID_HANDLE_VALUE;
+    m_index.clear();
+
+    LeaveCriticalSection(&m_lock);
+
+    return hr;
+}
+
+/// <summary>
+/// Append a depth frame, compressing it on the calling thread
+/// Only one thread may write depth frames.
+/// </summary>
+HRESULT CFrameRecorder::WriteDepth(const FrameSourceImage& image)
+{
+    m_rawDepthBytes += image.size;
+
+    if (RECORDING_DEPTH_RAW == m_depthCodec)
+    {
+        m_writtenDepthBytes += image.size;
+        return WriteChunk(RECORDING_CHUNK_DEPTH, image.pBits, image.size, image.timeStamp, image.frameNumber, image.pitch);
+    }
+
+    PROFILE_SCOPE("encode depth");
+
+    // The encoder wants tightly packed rows
+    UINT rowBytes = m_depthWidth * sizeof(USHORT);
+    UINT srcPitch = image.pitch ? image.pitch : rowBytes;
+    if (image.size / srcPitch < static_cast<UINT>(m_depthHeight))
+    {
+        return HRESULT_FROM_WIN32(ERROR_BAD_LENGTH);
+    }
+
+    const USHORT* pDepth = reinterpret_cast<const USHORT*>(image.pBits);
+    if (srcPitch != rowBytes)
+    {
+        CopyImageRows(&m_packedDepth[0], rowBytes, image.pBits, srcPitch, rowBytes, m_depthHeight);
+        pDepth = &m_packedDepth[0];
+    }
+
+    size_t pixelCount = m_packedDepth.size();
+    const USHORT* pReference = NULL;
+    if (RECORDING_DEPTH_RVL_DELTA == m_depthCodec)
+    {
+        pReference = (m_depthSinceKeyFrame > 0) ? &m_previousDepth[0] : NULL;
+        m_depthSinceKeyFrame = (m_depthSinceKeyFrame + 1) % cDepthKeyFrameInterval;
+    }
+
+    BYTE* pEncoded = reinterpret_cast<BYTE*>(&m_encodedDepth[0]);
+    DWORD size = static_cast<DWORD>(EncodeDepthSSE2(pDepth, pReference, pixelCount, pEncoded));
+
+    if (RECORDING_DEPTH_RVL_DELTA == m_depthCodec)
+    {
+        memcpy(&m_previousDepth[0], pDepth, pixelCount * sizeof(USHORT));
+    }
+
+    // a frame that failed to write breaks the delta chain until the next key frame
+    HRESULT hr = WriteChunk(RECORDING_CHUNK_DEPTH | cRecordingChunkCompressed, pEncoded, size, image.timeStamp, image.frameNumber, rowBytes);
+    if (FAILED(hr))
+    {
+        m_depthSinceKeyFrame = 0;
+    }
+
+    m_writtenDepthBytes += size;
+
+    return hr;
+}
+
+HRESULT CFrameRecorder::WriteColor(const FrameSourceImage& image)
+{
+    return WriteChunk(RECORDING_CHUNK_COLOR, image.pBits, image.size, image.timeStamp, image.frameNumber, image.pitch);
+}
+
+HRESULT CFrameRecorder::WriteSkeleton(const NUI_SKELETON_FRAME& frame)
+{
+    return WriteChunk(RECORDING_CHUNK_SKELETON, &frame, sizeof(frame), frame.liTimeStamp.QuadPart, frame.dwFrameNumber, 0);
+}
+
+/// <summary>
+/// Append a chunk header and its payload, with the payload aligned for mapping
+/// </summary>
+HRESULT CFrameRecorder::WriteChunk(DWORD type, const void* pData, DWORD size, LONGLONG timeStamp, DWORD frameNumber, DWORD pitch)
+{
+    EnterCriticalSection(&m_lock);
+
+    RecordingIndexEntry entry;
+    entry.offset = RecordingPayloadOffset(m_position);
+    entry.header.type = type;
+    entry.header.size = size;
+    entry.header.timeStamp = timeStamp;
+    entry.header.frameNumber = frameNumber;
+    entry.header.pitch = pitch;
+
+    HRESULT hr = WritePadding(entry.offset - sizeof(entry.header));
+
+    if (SUCCEEDED(hr))
+    {
+        hr = Write(&entry.header, sizeof(entry.header));
+    }
+
+    if (SUCCEEDED(hr))
+    {
+        hr = Write(pData, size);
+    }
+
+    if (SUCCEEDED(hr))
+    {
+        m_index.push_back(entry);
+    }
+
+    LeaveCriticalSection(&m_lock);
+
+    return hr;
+}
+
+/// <summary>
+/// Write zeros up to a file position
+/// </summary>
+HRESULT CFrameRecorder::WritePadding(LONGLONG position)
+{
+    static const BYTE zeros[cRecordingAlignment] = { 0 };
+
+    HRESULT hr = S_OK;
+    while (SUCCEEDED(hr) && m_position < position)
+    {
+        hr = Write(zeros, static_cast<DWORD>(min(position - m_position, static_cast<LONGLONG>(sizeof(zeros)))));
+    }
+
+    return hr;
+}
+
+HRESULT CFrameRecorder::Write(const void* pData, DWORD size)
+{
+    if (INVALID_HANDLE_VALUE == m_hFile)
+    {
+        return E_HANDLE;
+    }
+
+    DWORD written = 0;
+    if (size > 0 && (!WriteFile(m_hFile, pData, size, &written, NULL) || written != size))
+    {
+        return HRESULT_FROM_WIN32(GetLastError());
+    }
+
+    m_position += size;
+
+    return S_OK;
+}
@@ -0,0 +1,107 @@
+﻿//------------------------------------------------------------------------------
+// <copyright file="FrameRecorder.h" company="Microsoft">
+//     Copyright (c) Microsoft Corporation.  All rights reserved.
+// </copyright>
+//------------------------------------------------------------------------------
+
+#pragma once
+
+#include <vector>
+#include "FrameSource.h"
+#include "RecordingFormat.h"
+
+/// <summary>
+/// How depth frames are stored in a recording
+/// </summary>
+enum RecordingDepthCodec
+{
+    // as the sensor delivered them, 600KB a frame at 640x480
+    RECORDING_DEPTH_RAW,
+
+    // compressed losslessly, each frame on its own
+    RECORDING_DEPTH_RVL,
+
+    // compressed losslessly as the difference to the previous frame, smaller for a still scene
+    RECORDING_DEPTH_RVL_DELTA,
+};
+
+/// <summary>
+/// Writes the frames delivered by a frame source to a recording file
+/// Frames of different streams may be written from different threads
+/// </summary>
+class CFrameRecorder
+{
+public:
+    /// <summary>
+    /// Constructor
+    /// </summary>
+    CFrameRecorder();
+
+    /// <summary>
+    /// Destructor, finalizes and closes the file
+    /// </summary>
+    ~CFrameRecorder();
+
+    /// <summary>
+    /// Create the recording file and write its header
+    /// </summary>
+    /// <param name="szFileName">path of the recording</param>
+    /// <param name="depthResolution">resolution of the depth stream</param>
+    /// <param name="colorResolution">resolution of the color stream</param>
+    /// <param name="pSource">source to take calibration data from</param>
+    /// <param name="depthCodec">how depth frames are stored</param>
+    /// <returns>S_OK on success, otherwise failure code</returns>
+    HRESULT                             Open(LPCWSTR szFileName, NUI_IMAGE_RESOLUTION depthResolution, NUI_IMAGE_RESOLUTION colorResolution, IFrameSource* pSource, RecordingDepthCodec depthCodec);
+
+    /// <summary>
+    /// Write the index table, complete the header and close the file
+    /// </summary>
+    /// <returns>S_OK on success, otherwise failure code</returns>
+    HRESULT                             Close();
+
+    /// <summary>
+    /// Append a depth frame, compressing it on the calling thread
+    /// Only one thread may write depth frames.
+    /// </summary>
+    HRESULT                             WriteDepth(const FrameSourceImage& image);
+
+    /// <summary>
+    /// Append a color frame
+    /// </summary>
+    HRESULT                             WriteColor(const FrameSourceImage& image);
+
+    /// <summary>
+    /// Append a skeleton frame
+    /// </summary>
+    HRESULT                             WriteSkeleton(const NUI_SKELETON_FRAME& frame);
+
+    /// <summary>
+    /// Size of the depth frames received, and of what was written for them
+    /// </summary>
+    ULONGLONG                           GetRawDepthBytes() const { return m_rawDepthBytes; }
+    ULONGLONG                           GetWrittenDepthBytes() const { return m_writtenDepthBytes; }
+
+private:
+    // serializes writers of the different streams
+    CRITICAL_SECTION                    m_lock;
+
+    HANDLE                              m_hFile;
+    LONGLONG                            m_position;
+    RecordingFileHeader                 m_header;
+    std::vector<RecordingIndexEntry>    m_index;
+
+    // owned by the depth writer
+    RecordingDepthCodec                 m_depthCodec;
+    LONG                                m_depthWidth;
+    LONG                                m_depthHeight;
+    UINT                                m_depthSinceKeyFrame;
+    std::vector<USHORT>                 m_packedDepth;
+    std::vector<USHORT>                 m_previousDepth;
+    std::vector<DWORD>                  m_encodedDepth;
+    ULONGLONG                           m_rawDepthBytes;
+    ULONGLONG                           m_writtenDepthBytes;
+
+    HRESULT                             WriteChunk(DWORD type, const void* pData, DWORD size, LONGLONG timeStamp, DWORD frameNumber, DWORD pitch);
+    HRESULT                             WritePadding(LONGLONG position);
+    HRESULT                             Write(const void* pData, DWORD size);
+};
@@ -0,0 +1,189 @@
+﻿//------------------------------------------------------------------------------
+// <copyright file="FrameScheduler.cpp" company="Microsoft">
+//     Copyright (c) Microsoft Corporation.  All rights reserved.
+// </copyright>
+//------------------------------------------------------------------------------
+
+#include "FrameScheduler.h"
+#include <algorithm>
+
+namespace
+{
+    // frame rate while the view animates by itself and no cap is set
+    const double cAnimationFps = 60.0;
+}
+
+/// <summary>
+/// Constructor
+/// </summary>
+CFrameScheduler::CFrameScheduler() :
+    m_minIntervalTicks(0),
+    m_bPending(true),
+    m_bInvalid(true),
+    m_bAnimating(false),
+    m_frameStart(0),
+    m_nextFrameTime(0),
+    m_nextAnimationTime(0),
+    m_startTime(0),
+    m_startCpuTime(0),
+    m_waitTicks(0),
+    m_renderCount(0),
+    m_drawnCount(0)
+{
+    QueryPerformanceFrequency(&m_frequency);
+    m_hWake = CreateEventW(NULL, FALSE, FALSE, NULL);
+}
+
+/// <summary>
+/// Destructor
+/// </summary>
+CFrameScheduler::~CFrameScheduler()
+{
+    if (NULL != m_hWake)
+    {
+        CloseHandle(m_hWake);
+    }
+}
+
+/// <summary>
+/// Limit how often frames are rendered
+/// </summary>
+/// <param name="maxFps">frames per second, 0 for no limit</param>
+void CFrameScheduler::SetMaxFrameRate(double maxFps)
+{
+    m_minIntervalTicks = maxFps > 0.0 ? static_cast<LONGLONG>(m_frequency.QuadPart / maxFps) : 0;
+}
+
+/// <summary>
+/// Reset the statistics and the render thread's CPU time, call on the render thread
+/// </summary>
+void CFrameScheduler::Start()
+{
+    m_startTime = Now();
+    m_startCpuTime = GetThreadCpuTime();
+    m_waitTicks = 0;
+    m_renderCount = 0;
+    m_drawnCount = 0;
+}
+
+/// <summary>
+/// Whether a frame should be rendered now
+/// </summary>
+bool CFrameScheduler::IsFrameDue() const
+{
+    if (!m_bPending && !m_bAnimating)
+    {
+        return false;
+    }
+
+    LONGLONG now = Now();
+    return (m_bPending && now >= m_nextFrameTime) || (m_bAnimating && now >= m_nextAnimationTime);
+}
+
+/// <summary>
+/// Start rendering a frame
+/// </summary>
+/// <returns>true if the view was invalidated since the last frame, so it must be drawn</returns>
+bool CFrameScheduler::BeginFrame()
+{
+    bool bInvalid = m_bInvalid;
+    m_bInvalid = false;
+    m_bPending = false;
+    m_frameStart = Now();
+    return bInvalid;
+}
+
+/// <summary>
+/// Finish a frame
+/// </summary>
+/// <param name="bDrawn">whether anything was drawn and presented</param>
+/// <param name="bAnimating">whether the view will change again without a new event</param>
+void CFrameScheduler::EndFrame(bool bDrawn, bool bAnimating)
+{
+    ++m_renderCount;
+    if (bDrawn)
+    {
+        ++m_drawnCount;
+    }
+
+    // the cap counts from the start of the frame, so render time does not lower the rate
+    LONGLONG animationIntervalTicks = static_cast<LONGLONG>(m_frequency.QuadPart / cAnimationFps);
+    m_bAnimating = bAnimating;
+    m_nextFrameTime = m_frameStart + m_minIntervalTicks;
+    m_nextAnimationTime = m_frameStart + (std::max)(m_minIntervalTicks, animationIntervalTicks);
+}
+
+/// <summary>
+/// Sleep until a frame is due, the wake event is signaled or a message arrives
+/// </summary>
+/// <param name="maxWaitMs">longest time to sleep</param>
+void CFrameScheduler::Wait(DWORD maxWaitMs)
+{
+    LONGLONG start = Now();
+
+    // a frame already woken but held back by the cap only waits out the cap
+    DWORD timeoutMs = maxWaitMs;
+    if (m_bPending || m_bAnimating)
+    {
+        // the animation interval is never shorter than the cap
+        LONGLONG due = m_bPending ? m_nextFrameTime : m_nextAnimationTime;
+        if (due <= start)
+        {
+            return;
+        }
+
+        // rounded up, waking early would only spin back here
+        LONGLONG dueMs = ((due - start) * 1000 + m_frequency.QuadPart - 1) / m_frequency.QuadPart;
+        timeoutMs = (std::min)(timeoutMs, static_cast<DWORD>(dueMs));
+    }
+
+    DWORD count = (NULL != m_hWake) ? 1 : 0;
+    DWORD result = MsgWaitForMultipleObjectsEx(count, &m_hWake, timeoutMs, QS_ALLINPUT, MWMO_INPUTAVAILABLE);
+    if (1 == count && WAIT_OBJECT_0 == result)
+    {
+        m_bPending = true;
+    }
+
+    m_waitTicks += Now() - start;
+}
+
+/// <summary>
+/// Statistics since Start, call on the render thread
+/// </summary>
+/// <param name="pStats">receives the statistics</param>
+void CFrameScheduler::GetStats(FrameSchedulerStats* pStats) const
+{
+    pStats->renderCount = m_renderCount;
+    pStats->drawnCount = m_drawnCount;
+    pStats->elapsedMs = (Now() - m_startTime) * 1000.0 / m_frequency.QuadPart;
+    pStats->waitMs = m_waitTicks * 1000.0 / m_frequency.QuadPart;
+
+    // thread times count in 100ns units
+    pStats->cpuMs = (GetThreadCpuTime() - m_startCpuTime) / 10000.0;
+}
+
+LONGLONG CFrameScheduler::Now() const
+{
+    LARGE_INTEGER now;
+    QueryPerformanceCounter(&now);
+    return now.QuadPart;
+}
+
+/// <summary>
+/// Kernel and user time of the calling thread, in 100ns units
+/// </summary>
+ULONGLONG CFrameScheduler::GetThreadCpuTime()
+{
+    FILETIME creation, exit, kernel, user;
+    if (!GetThreadTimes(GetCurrentThread(), &creation, &exit, &kernel, &user))
+    {
+        return 0;
+    }
+
+    ULARGE_INTEGER kernelTime, userTime;
+    kernelTime.LowPart = kernel.dwLowDateTime;
+    kernelTime.HighPart = kernel.dwHighDateTime;
+    userTime.LowPart = user.dwLowDateTime;
+    userTime.HighPart = user.dwHighDateTime;
+    return kernelTime.QuadPart + userTime.QuadPart;
+}
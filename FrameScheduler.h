@@ -0,0 +1,125 @@
+﻿//------------------------------------------------------------------------------
+// <copyright file="FrameScheduler.h" company="Microsoft">
+//     Copyright (c) Microsoft Corporation.  All rights reserved.
+// </copyright>
+//------------------------------------------------------------------------------
+
+#pragma once
+
+#include <windows.h>
+
+/// <summary>
+/// How often the render thread woke, drew and slept
+/// </summary>
+struct FrameSchedulerStats
+{
+    // frames rendered, and the ones that found nothing changed and skipped drawing
+    UINT                                renderCount;
+    UINT                                drawnCount;
+
+    // time since Start, spent waiting, and used by the render thread
+    double                              elapsedMs;
+    double                              waitMs;
+    double                              cpuMs;
+};
+
+/// <summary>
+/// Paces the render thread by events instead of rendering whenever the message queue is empty
+/// Producers signal the wake event when they publish a frame or pose, input invalidates the
+/// view, and in between the thread sleeps in MsgWaitForMultipleObjectsEx so window messages
+/// are still handled at once. A frame rate cap delays frames without dropping what woke them.
+/// While the view keeps changing on its own, as head prediction moves the eyes between poses,
+/// frames are drawn at the cap or 60Hz without waiting for an event.
+/// </summary>
+class CFrameScheduler
+{
+public:
+    /// <summary>
+    /// Constructor
+    /// </summary>
+    CFrameScheduler();
+
+    /// <summary>
+    /// Destructor
+    /// </summary>
+    ~CFrameScheduler();
+
+    /// <summary>
+    /// Auto reset event producers signal when there is something new to draw
+    /// </summary>
+    HANDLE                              GetWakeEvent() const { return m_hWake; }
+
+    /// <summary>
+    /// Limit how often frames are rendered
+    /// </summary>
+    /// <param name="maxFps">frames per second, 0 for no limit</param>
+    void                                SetMaxFrameRate(double maxFps);
+
+    /// <summary>
+    /// Reset the statistics and the render thread's CPU time, call on the render thread
+    /// </summary>
+    void                                Start();
+
+    /// <summary>
+    /// The view changed without a new frame, render the next one
+    /// </summary>
+    void                                Invalidate() { m_bInvalid = true; m_bPending = true; }
+
+    /// <summary>
+    /// Whether a frame should be rendered now
+    /// </summary>
+    bool                                IsFrameDue() const;
+
+    /// <summary>
+    /// Start rendering a frame
+    /// </summary>
+    /// <returns>true if the view was invalidated since the last frame, so it must be drawn</returns>
+    bool                                BeginFrame();
+
+    /// <summary>
+    /// Finish a frame
+    /// </summary>
+    /// <param name="bDrawn">whether anything was drawn and presented</param>
+    /// <param name="bAnimating">whether the view will change again without a new event</param>
+    void                                EndFrame(bool bDrawn, bool bAnimating);
+
+    /// <summary>
+    /// Sleep until a frame is due, the wake event is signaled or a message arrives
+    /// </summary>
+    /// <param name="maxWaitMs">longest time to sleep</param>
+    void                                Wait(DWORD maxWaitMs);
+
+    /// <summary>
+    /// Statistics since Start, call on the render thread
+    /// </summary>
+    /// <param name="pStats">receives the statistics</param>
+    void                                GetStats(FrameSchedulerStats* pStats) const;
+
+private:
+    HANDLE                              m_hWake;
+
+    LARGE_INTEGER                       m_frequency;
+    LONGLONG                            m_minIntervalTicks;
+
+    // set by the wake event or input, cleared when a frame starts
+    bool                                m_bPending;
+    bool                                m_bInvalid;
+    bool                                m_bAnimating;
+
+    LONGLONG                            m_frameStart;
+    LONGLONG                            m_nextFrameTime;
+    LONGLONG                            m_nextAnimationTime;
+
+    LONGLONG                            m_startTime;
+    ULONGLONG                           m_startCpuTime;
+    LONGLONG                            m_waitTicks;
+    UINT                                m_renderCount;
+    UINT                                m_drawnCount;
+
+    LONGLONG                            Now() const;
+    static ULONGLONG                    GetThreadCpuTime();
+
+    // not copyable
+    CFrameScheduler(const CFrameScheduler&);
+    CFrameScheduler& operator=(const CFrameScheduler&);
+};
@@ -0,0 +1,140 @@
+﻿//------------------------------------------------------------------------------
+// <copyright file="FrameSource.h" company="Microsoft">
+//     Copyright (c) Microsoft Corporation.  All rights reserved.
+// </copyright>
+//------------------------------------------------------------------------------
+
+#pragma once
+
+#include <windows.h>
+#include <string.h>
+#include "NuiApi.h"
+
+/// <summary>
+/// Image data handed out by a frame source
+/// pBits stays valid until the matching Release call, or if bRetained is set,
+/// for as long as the source exists, so the frame may be shared instead of copied
+/// </summary>
+struct FrameSourceImage
+{
+    BYTE*                               pBits;
+    UINT                                size;
+    UINT                                pitch;
+    LONGLONG                            timeStamp;
+    DWORD                               frameNumber;
+    bool                                bRetained;
+};
+
+/// <summary>
+/// Copy an image between buffers whose rows may be padded differently
+/// </summary>
+/// <param name="pDest">first destination row</param>
+/// <param name="destPitch">bytes between destination rows</param>
+/// <param name="pSrc">first source row</param>
+/// <param name="srcPitch">bytes between source rows</param>
+/// <param name="rowBytes">bytes of pixel data in a row</param>
+/// <param name="rows">number of rows to copy</param>
+inline void CopyImageRows(void* pDest, UINT destPitch, const void* pSrc, UINT srcPitch, UINT rowBytes, UINT rows)
+{
+    // Tightly packed on both sides is the common case and a single copy
+    if (destPitch == rowBytes && srcPitch == rowBytes)
+    {
+        memcpy(pDest, pSrc, rowBytes * rows);
+        return;
+    }
+
+    BYTE* pDestRow = static_cast<BYTE*>(pDest);
+    const BYTE* pSrcRow = static_cast<const BYTE*>(pSrc);
+    for (UINT y = 0; y < rows; ++y)
+    {
+        memcpy(pDestRow, pSrcRow, rowBytes);
+        pDestRow += destPitch;
+        pSrcRow += srcPitch;
+    }
+}
+
+/// <summary>
+/// Abstract provider of depth, color and skeleton frames
+/// Implemented by the live Kinect sensor and by recording replay
+/// </summary>
+class IFrameSource
+{
+public:
+    virtual ~IFrameSource() {}
+
+    /// <summary>
+    /// Event signaled while a depth frame is ready to be acquired
+    /// </summary>
+    virtual HANDLE                      GetNextDepthFrameEvent() const = 0;
+
+    /// <summary>
+    /// Event signaled while a color frame is ready to be acquired
+    /// </summary>
+    virtual HANDLE                      GetNextColorFrameEvent() const = 0;
+
+    /// <summary>
+    /// Event signaled while a skeleton frame is ready to be acquired
+    /// </summary>
+    virtual HANDLE                      GetNextSkeletonEvent() const = 0;
+
+    /// <summary>
+    /// Get the next depth frame, packed as D13P3
+    /// </summary>
+    /// <param name="pImage">receives the frame data</param>
+    /// <returns>S_OK on success, otherwise failure code</returns>
+    virtual HRESULT                     AcquireDepthFrame(FrameSourceImage* pImage) = 0;
+
+    /// <summary>
+    /// Release the depth frame obtained from AcquireDepthFrame
+    /// </summary>
+    /// <returns>S_OK on success, otherwise failure code</returns>
+    virtual HRESULT                     ReleaseDepthFrame() = 0;
+
+    /// <summary>
+    /// Get the next color frame, as BGRX
+    /// </summary>
+    /// <param name="pImage">receives the frame data</param>
+    /// <returns>S_OK on success, otherwise failure code</returns>
+    virtual HRESULT                     AcquireColorFrame(FrameSourceImage* pImage) = 0;
+
+    /// <summary>
+    /// Release the color frame obtained from AcquireColorFrame
+    /// </summary>
+    /// <returns>S_OK on success, otherwise failure code</returns>
+    virtual HRESULT                     ReleaseColorFrame() = 0;
+
+    /// <summary>
+    /// Get the next skeleton frame, as tracked, without smoothing
+    /// </summary>
+    /// <param name="pFrame">receives the skeleton data</param>
+    /// <returns>S_OK on success, otherwise failure code</returns>
+    virtual HRESULT                     GetSkeletonFrame(NUI_SKELETON_FRAME* pFrame) = 0;
+
+    /// <summary>
+    /// Compute the color pixel coordinates of every depth pixel
+    /// </summary>
+    /// <param name="pDepthD16">depth frame, packed as D13P3</param>
+    /// <param name="pColorCoordinates">receives an x, y pair per depth pixel</param>
+    /// <returns>S_OK on success, otherwise failure code</returns>
+    virtual HRESULT                     MapDepthFrameToColorCoordinates(USHORT* pDepthD16, LONG* pColorCoordinates) = 0;
+
+    /// <summary>
+    /// Get the depth to color calibration blob, for recording
+    /// </summary>
+    /// <param name="pByteCount">receives the size of the blob</param>
+    /// <param name="ppData">receives the blob, owned by the source</param>
+    /// <returns>S_OK on success, otherwise failure code</returns>
+    virtual HRESULT                     GetMappingParameters(ULONG* pByteCount, void** ppData) = 0;
+
+    /// <summary>
+    /// Enable or disable near mode
+    /// </summary>
+    /// <param name="bNearMode">true to enable near mode</param>
+    /// <returns>S_OK on success, otherwise failure code</returns>
+    virtual HRESULT                     SetNearMode(bool bNearMode) = 0;
+
+    /// <summary>
+    /// Whether the source has delivered its last frame
+    /// </summary>
+    virtual bool                        IsEndOfStream() const = 0;
+};
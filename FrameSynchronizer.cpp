@@ -0,0 +1,146 @@
+﻿//------------------------------------------------------------------------------
+// <copyright file="FrameSynchronizer.cpp" company="Microsoft">
+//     Copyright (c) Microsoft Corporation.  All rights reserved.
+// </copyright>
+//------------------------------------------------------------------------------
+
+#include "FrameSynchronizer.h"
+
+#include <string.h>
+
+namespace
+{
+    inline int64_t AbsDifference(int64_t a, int64_t b)
+    {
+        return a > b ? a - b : b - a;
+    }
+}
+
+/// <summary>
+/// Constructor
+/// </summary>
+CFrameSynchronizer::CFrameSynchronizer() :
+    m_policy(FRAME_SYNC_WAIT),
+    m_toleranceMs(17),
+    m_maxWaitMs(34),
+    m_bHolding(false),
+    m_holdStartMs(0),
+    m_bDepthPaired(false)
+{
+    memset(&m_stats, 0, sizeof(m_stats));
+}
+
+/// <summary>
+/// Set the pairing policy
+/// </summary>
+/// <param name="policy">what to do with mismatched frames</param>
+/// <param name="toleranceMs">largest timestamp difference of frames that belong together</param>
+/// <param name="maxWaitMs">how long FRAME_SYNC_WAIT holds mismatched frames before dropping them</param>
+void CFrameSynchronizer::Configure(FrameSyncPolicy policy, int64_t toleranceMs, int64_t maxWaitMs)
+{
+    m_policy = policy;
+    m_toleranceMs = toleranceMs;
+    m_maxWaitMs = maxWaitMs;
+    m_bHolding = false;
+}
+
+/// <summary>
+/// Decide whether the newest depth and color frames make a pair
+/// </summary>
+/// <param name="bNewDepth">whether a depth frame arrived since the last call</param>
+/// <param name="depthTimeStamp">timestamp of the newest depth frame, in milliseconds</param>
+/// <param name="bNewColor">whether a color frame arrived since the last call</param>
+/// <param name="colorTimeStamp">timestamp of the newest color frame, in milliseconds</param>
+/// <param name="nowMs">current time in milliseconds, for the wait policy</param>
+/// <returns>what to do with the frames</returns>
+FrameSyncDecision CFrameSynchronizer::Update(bool bNewDepth, int64_t depthTimeStamp, bool bNewColor, int64_t colorTimeStamp, int64_t nowMs)
+{
+    if (bNewDepth)
+    {
+        m_bDepthPaired = false;
+    }
+
+    // Held frames are looked at again until they pair up or time out
+    // the depth frame, the point cloud and face tracking derived from it are only processed once
+    if ((!bNewDepth && !bNewColor && !m_bHolding) || m_bDepthPaired)
+    {
+        return FRAME_SYNC_IDLE;
+    }
+
+    int64_t skew = AbsDifference(depthTimeStamp, colorTimeStamp);
+
+    if (skew <= m_toleranceMs || FRAME_SYNC_NEAREST == m_policy)
+    {
+        m_bHolding = false;
+        m_bDepthPaired = true;
+
+        ++m_stats.pairedCount;
+        m_stats.pairedSkewSum += skew;
+        if (skew > m_stats.pairedSkewMax)
+        {
+            m_stats.pairedSkewMax = skew;
+        }
+
+        return FRAME_SYNC_PAIRED;
+    }
+
+    if (FRAME_SYNC_WAIT == m_policy)
+    {
+        if (!m_bHolding)
+        {
+            m_bHolding = true;
+            m_holdStartMs = nowMs;
+            ++m_stats.heldCount;
+        }
+
+        if (nowMs - m_holdStartMs < m_maxWaitMs)
+        {
+            return FRAME_SYNC_HELD;
+        }
+
+        m_bHolding = false;
+    }
+
+    ++m_stats.skippedCount;
+    if (skew > m_stats.skippedSkewMax)
+    {
+        m_stats.skippedSkewMax = skew;
+    }
+
+    return FRAME_SYNC_SKIPPED;
+}
+
+/// <summary>
+/// Pick the skeleton frame closest in time to a paired depth frame
+/// </summary>
+/// <param name="pTimeStamps">timestamps of the candidate frames, in milliseconds</param>
+/// <param name="count">number of candidates</param>
+/// <param name="targetTimeStamp">timestamp to match</param>
+/// <returns>index of the closest candidate, or -1 if there are none</returns>
+int CFrameSynchronizer::SelectNearest(const int64_t* pTimeStamps, int count, int64_t targetTimeStamp)
+{
+    int nearest = -1;
+    int64_t nearestSkew = 0;
+
+    for (int i = 0; i < count; ++i)
+    {
+        int64_t skew = AbsDifference(pTimeStamps[i], targetTimeStamp);
+        if (-1 == nearest || skew < nearestSkew)
+        {
+            nearest = i;
+            nearestSkew = skew;
+        }
+    }
+
+    if (-1 != nearest)
+    {
+        ++m_stats.skeletonCount;
+        m_stats.skeletonSkewSum += nearestSkew;
+        if (nearestSkew > m_stats.skeletonSkewMax)
+        {
+            m_stats.skeletonSkewMax = nearestSkew;
+        }
+    }
+
+    return nearest;
+}
@@ -0,0 +1,121 @@
+﻿//------------------------------------------------------------------------------
+// <copyright file="FrameSynchronizer.h" company="Microsoft">
+//     Copyright (c) Microsoft Corporation.  All rights reserved.
+// </copyright>
+//------------------------------------------------------------------------------
+
+#pragma once
+
+#include <stdint.h>
+
+/// <summary>
+/// What to do when the newest depth and color frames are further apart than the tolerance
+/// </summary>
+enum FrameSyncPolicy
+{
+    // skip the pair, nothing derived from both frames is computed
+    FRAME_SYNC_DROP,
+
+    // keep the newest frames and wait for the lagging stream to catch up, dropping after a while
+    FRAME_SYNC_WAIT,
+
+    // use the pair anyway, the closest frames available are the newest ones
+    FRAME_SYNC_NEAREST,
+};
+
+/// <summary>
+/// Outcome of pairing the newest depth and color frames
+/// </summary>
+enum FrameSyncDecision
+{
+    // nothing new since the last decision, or only color for a depth frame that was already paired
+    FRAME_SYNC_IDLE,
+
+    // frames belong together and should be processed
+    FRAME_SYNC_PAIRED,
+
+    // frames are waiting for a better match
+    FRAME_SYNC_HELD,
+
+    // frames don't belong together and should be ignored
+    FRAME_SYNC_SKIPPED,
+};
+
+/// <summary>
+/// Pairing statistics, skews are absolute timestamp differences in milliseconds
+/// </summary>
+struct FrameSyncStats
+{
+    uint32_t                            pairedCount;
+    uint32_t                            skippedCount;
+    // times mismatched frames started being held, whatever became of them
+    uint32_t                            heldCount;
+    int64_t                             pairedSkewSum;
+    int64_t                             pairedSkewMax;
+    int64_t                             skippedSkewMax;
+
+    uint32_t                            skeletonCount;
+    int64_t                             skeletonSkewSum;
+    int64_t                             skeletonSkewMax;
+};
+
+/// <summary>
+/// Pairs depth and color frames by timestamp
+/// Fed once per render pass with the timestamps of the newest frame of each stream
+/// Each depth frame is paired at most once, a newer color frame waits for the next depth frame
+/// </summary>
+class CFrameSynchronizer
+{
+public:
+    /// <summary>
+    /// Constructor
+    /// </summary>
+    CFrameSynchronizer();
+
+    /// <summary>
+    /// Set the pairing policy
+    /// </summary>
+    /// <param name="policy">what to do with mismatched frames</param>
+    /// <param name="toleranceMs">largest timestamp difference of frames that belong together</param>
+    /// <param name="maxWaitMs">how long FRAME_SYNC_WAIT holds mismatched frames before dropping them</param>
+    void                                Configure(FrameSyncPolicy policy, int64_t toleranceMs, int64_t maxWaitMs);
+
+    /// <summary>
+    /// Decide whether the newest depth and color frames make a pair
+    /// </summary>
+    /// <param name="bNewDepth">whether a depth frame arrived since the last call</param>
+    /// <param name="depthTimeStamp">timestamp of the newest depth frame, in milliseconds</param>
+    /// <param name="bNewColor">whether a color frame arrived since the last call</param>
+    /// <param name="colorTimeStamp">timestamp of the newest color frame, in milliseconds</param>
+    /// <param name="nowMs">current time in milliseconds, for the wait policy</param>
+    /// <returns>what to do with the frames</returns>
+    FrameSyncDecision                   Update(bool bNewDepth, int64_t depthTimeStamp, bool bNewColor, int64_t colorTimeStamp, int64_t nowMs);
+
+    /// <summary>
+    /// Pick the skeleton frame closest in time to a paired depth frame
+    /// </summary>
+    /// <param name="pTimeStamps">timestamps of the candidate frames, in milliseconds</param>
+    /// <param name="count">number of candidates</param>
+    /// <param name="targetTimeStamp">timestamp to match</param>
+    /// <returns>index of the closest candidate, or -1 if there are none</returns>
+    int                                 SelectNearest(const int64_t* pTimeStamps, int count, int64_t targetTimeStamp);
+
+    /// <summary>
+    /// Pairing statistics so far
+    /// </summary>
+    const FrameSyncStats&               GetStats() const { return m_stats; }
+
+private:
+    FrameSyncPolicy                     m_policy;
+    int64_t                             m_toleranceMs;
+    int64_t                             m_maxWaitMs;
+
+    // set while mismatched frames are held for the wait policy
+    bool                                m_bHolding;
+    int64_t                             m_holdStartMs;
+
+    // set once the newest depth frame has been paired, so new color alone doesn't process it again
+    bool                                m_bDepthPaired;
+
+    FrameSyncStats                      m_stats;
+};
@@ -0,0 +1,342 @@
+﻿//------------------------------------------------------------------------------
+// <copyright file="HeadPosePredictor.cpp" company="Microsoft">
+//     Copyright (c) Microsoft Corporation.  All rights reserved.
+// </copyright>
+//------------------------------------------------------------------------------
+
+#include "HeadPosePredictor.h"
+#include <math.h>
+#include <algorithm>
+
+namespace
+{
+    const double cPi = 3.14159265358979;
+
+    // tracking gaps longer than this restart the filter instead of smoothing across them
+    const double cMaxGapMs = 500.0;
+
+    /// <summary>
+    /// Smoothing factor of a first order low pass filter
+    /// </summary>
+    /// <param name="cutoff">cutoff frequency, Hz</param>
+    /// <param name="dt">time since the last sample, seconds</param>
+    float LowPassAlpha(float cutoff, float dt)
+    {
+        float tau = static_cast<float>(1.0 / (2.0 * cPi * cutoff));
+        return 1.0f / (1.0f + tau / dt);
+    }
+
+    /// <summary>
+    /// Linearly interpolate the trace position at a time
+    /// </summary>
+    /// <returns>false if the time is past the end of the trace</returns>
+    bool InterpolateTrace(const HeadPoseSample* pTrace, size_t count, size_t* pNext, double timeMs, float position[3])
+    {
+        size_t next = *pNext;
+        while (next < count && pTrace[next].timeMs < timeMs)
+        {
+            ++next;
+        }
+
+        *pNext = next;
+        if (next >= count || 0 == next)
+        {
+            return false;
+        }
+
+        const HeadPoseSample& a = pTrace[next - 1];
+        const HeadPoseSample& b = pTrace[next];
+        float t = b.timeMs > a.timeMs ? static_cast<float>((timeMs - a.timeMs) / (b.timeMs - a.timeMs)) : 0.0f;
+        for (int i = 0; i < 3; ++i)
+        {
+            position[i] = a.position[i] + t * (b.position[i] - a.position[i]);
+        }
+
+        return true;
+    }
+}
+
+/// <summary>
+/// Constructor
+/// </summary>
+CHeadPosePredictor::CHeadPosePredictor()
+{
+    Reset();
+}
+
+/// <summary>
+/// Forget every sample
+/// </summary>
+void CHeadPosePredictor::Reset()
+{
+    m_bHasSample = false;
+    m_lastTimeMs = 0.0;
+    for (int i = 0; i < 3; ++i)
+    {
+        m_position[i] = 0.0f;
+        m_velocity[i] = 0.0f;
+    }
+}
+
+/// <summary>
+/// Filter a newly tracked position
+/// Samples further apart than the filter can bridge restart it
+/// </summary>
+/// <param name="position">head position, meters</param>
+/// <param name="timeMs">time the position was captured, must not go backwards</param>
+void CHeadPosePredictor::AddSample(const float position[3], double timeMs)
+{
+    double gapMs = timeMs - m_lastTimeMs;
+    if (!m_bHasSample || gapMs > cMaxGapMs)
+    {
+        for (int i = 0; i < 3; ++i)
+        {
+            m_position[i] = position[i];
+            m_velocity[i] = 0.0f;
+        }
+
+        m_lastTimeMs = timeMs;
+        m_bHasSample = true;
+        return;
+    }
+
+    // a repeated timestamp carries no motion information
+    if (gapMs <= 0.0)
+    {
+        return;
+    }
+
+    float dt = static_cast<float>(gapMs * 0.001);
+
+    // One euro filter: the velocity is smoothed at a fixed cutoff, and the faster the head
+    // moves the higher the position cutoff, trading jitter at rest for lag in motion
+    float derivativeAlpha = LowPassAlpha(m_params.derivativeCutoff, dt);
+    float speedSquared = 0.0f;
+    for (int i = 0; i < 3; ++i)
+    {
+        float rawVelocity = (position[i] - m_position[i]) / dt;
+        m_velocity[i] += derivativeAlpha * (rawVelocity - m_velocity[i]);
+        speedSquared += m_velocity[i] * m_velocity[i];
+    }
+
+    float alpha = LowPassAlpha(m_params.minCutoff + m_params.beta * sqrtf(speedSquared), dt);
+    for (int i = 0; i < 3; ++i)
+    {
+        m_position[i] += alpha * (position[i] - m_position[i]);
+    }
+
+    m_lastTimeMs = timeMs;
+}
+
+/// <summary>
+/// Predict the head position at a given time
+/// </summary>
+/// <param name="timeMs">time the position is needed for</param>
+/// <param name="position">receives the predicted position</param>
+/// <returns>false if there is no sample yet</returns>
+bool CHeadPosePredictor::Predict(double timeMs, float position[3]) const
+{
+    if (!m_bHasSample)
+    {
+        return false;
+    }
+
+    double leadMs = (std::min)((std::max)(timeMs - m_lastTimeMs, 0.0), static_cast<double>(m_params.maxLeadMs));
+    float lead = static_cast<float>(leadMs * 0.001) * m_params.leadScale;
+    for (int i = 0; i < 3; ++i)
+    {
+        position[i] = m_position[i] + m_velocity[i] * lead;
+    }
+
+    return true;
+}
+
+/// <summary>
+/// Replay a pose trace through the predictor, predicting each sample ahead by the latency
+/// and comparing with the trace interpolated at that time
+/// </summary>
+/// <param name="pTrace">samples in time order</param>
+/// <param name="count">number of samples</param>
+/// <param name="params">tuning to evaluate</param>
+/// <param name="latencyMs">how far ahead to predict</param>
+/// <param name="pError">receives the error</param>
+/// <returns>false if the trace is too short to compare any prediction</returns>
+bool EvaluateHeadPosePredictor(const HeadPoseSample* pTrace, size_t count, const HeadPosePredictorParams& params, double latencyMs, HeadPosePredictionError* pError)
+{
+    CHeadPosePredictor predictor;
+    predictor.SetParams(params);
+
+    double errorSum = 0.0;
+    double errorMax = 0.0;
+    double jitterSum = 0.0;
+    size_t jitterCount = 0;
+    size_t compared = 0;
+    size_t next = 0;
+
+    float previous[3] = { 0.0f, 0.0f, 0.0f };
+    float previousVelocity[3] = { 0.0f, 0.0f, 0.0f };
+    double previousTimeMs = 0.0;
+    int history = 0;
+
+    for (size_t s = 0; s < count; ++s)
+    {
+        predictor.AddSample(pTrace[s].position, pTrace[s].timeMs);
+
+        double targetMs = pTrace[s].timeMs + latencyMs;
+        float predicted[3];
+        float actual[3];
+        predictor.Predict(targetMs, predicted);
+        if (!InterpolateTrace(pTrace, count, &next, targetMs, actual))
+        {
+            break;
+        }
+
+        double squared = 0.0;
+        for (int i = 0; i < 3; ++i)
+        {
+            double d = predicted[i] - actual[i];
+            squared += d * d;
+        }
+
+        errorSum += squared;
+        errorMax = (std::max)(errorMax, sqrt(squared));
+        ++compared;
+
+        // jitter is the change in apparent velocity from one prediction to the next
+        double dt = (targetMs - previousTimeMs) * 0.001;
+        float velocity[3] = { 0.0f, 0.0f, 0.0f };
+        if (history > 0 && dt > 0.0)
+        {
+            double change = 0.0;
+            for (int i = 0; i < 3; ++i)
+            {
+                velocity[i] = static_cast<float>((predicted[i] - previous[i]) / dt);
+                double d = velocity[i] - previousVelocity[i];
+                change += d * d;
+            }
+
+            if (history > 1)
+            {
+                jitterSum += change;
+                ++jitterCount;
+            }
+        }
+
+        for (int i = 0; i < 3; ++i)
+        {
+            previous[i] = predicted[i];
+            previousVelocity[i] = velocity[i];
+        }
+
+        previousTimeMs = targetMs;
+        ++history;
+    }
+
+    if (0 == compared)
+    {
+        return false;
+    }
+
+    pError->rmsError = sqrt(errorSum / compared);
+    pError->maxError = errorMax;
+    pError->jitter = jitterCount > 0 ? sqrt(jitterSum / jitterCount) : 0.0;
+    pError->count = compared;
+
+    return true;
+}
+
+/// <summary>
+/// Write a pose trace as text, one "time x y z" sample per line
+/// </summary>
+/// <param name="pFile">file to write to</param>
+/// <param name="trace">samples to write</param>
+/// <returns>true on success</returns>
+bool WriteHeadPoseTrace(FILE* pFile, const std::vector<HeadPoseSample>& trace)
+{
+    for (size_t i = 0; i < trace.size(); ++i)
+    {
+        const HeadPoseSample& sample = trace[i];
+        if (fprintf(pFile, "%.3f %.5f %.5f %.5f\n", sample.timeMs, sample.position[0], sample.position[1], sample.position[2]) < 0)
+        {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+/// <summary>
+/// Read a pose trace written by WriteHeadPoseTrace
+/// </summary>
+/// <param name="pFile">file to read from</param>
+/// <param name="pTrace">receives the samples</param>
+/// <returns>true if every line was a sample</returns>
+bool ReadHeadPoseTrace(FILE* pFile, std::vector<HeadPoseSample>* pTrace)
+{
+    pTrace->clear();
+
+    char line[256];
+    while (fgets(line, sizeof(line), pFile))
+    {
+        HeadPoseSample sample;
+        if (4 != sscanf_s(line, "%lf %f %f %f", &sample.timeMs, &sample.position[0], &sample.position[1], &sample.position[2]))
+        {
+            return false;
+        }
+
+        pTrace->push_back(sample);
+    }
+
+    return true;
+}
+
+/// <summary>
+/// Check the predictor on a synthetic trace of a swaying head with tracking noise
+/// </summary>
+/// <returns>true if prediction is both closer and steadier than the raw positions</returns>
+bool VerifyHeadPosePredictor()
+{
+    // ten seconds of tracking at 30Hz, the head sways 15cm either side for a
+    // two second cycle, then rests for as long
+    const int cSamples = 300;
+    std::vector<HeadPoseSample> trace(cSamples);
+
+    unsigned int state = 12345;
+    for (int s = 0; s < cSamples; ++s)
+    {
+        double timeMs = s * 1000.0 / 30.0;
+        double phase = timeMs * 0.001 * 2.0 * cPi * 0.5;
+        double sway = (s / 60) % 2 ? 0.0 : 0.15 * sin(phase);
+
+        trace[s].timeMs = timeMs;
+        for (int i = 0; i < 3; ++i)
+        {
+            // +-3mm of tracking noise
+            state = state * 1664525u + 1013904223u;
+            float noise = (static_cast<float>(state >> 8) / 16777216.0f - 0.5f) * 0.006f;
+            trace[s].position[i] = noise;
+        }
+
+        trace[s].position[0] += static_cast<float>(sway);
+        trace[s].position[2] += 1.5f;
+    }
+
+    // the raw positions, as the user view used them before prediction
+    HeadPosePredictorParams raw;
+    raw.minCutoff = 1000000.0f;
+    raw.beta = 0.0f;
+    raw.leadScale = 0.0f;
+
+    HeadPosePredictorParams predicted;
+
+    const double cLatencyMs = 60.0;
+    HeadPosePredictionError rawError;
+    HeadPosePredictionError predictedError;
+    if (!EvaluateHeadPosePredictor(&trace[0], trace.size(), raw, cLatencyMs, &rawError) ||
+        !EvaluateHeadPosePredictor(&trace[0], trace.size(), predicted, cLatencyMs, &predictedError))
+    {
+        return false;
+    }
+
+    return predictedError.rmsError < rawError.rmsError && predictedError.jitter < rawError.jitter;
+}
@@ -0,0 +1,158 @@
+﻿//------------------------------------------------------------------------------
+// <copyright file="HeadPosePredictor.h" company="Microsoft">
+//     Copyright (c) Microsoft Corporation.  All rights reserved.
+// </copyright>
+//------------------------------------------------------------------------------
+
+#pragma once
+
+#include <stddef.h>
+#include <stdio.h>
+#include <vector>
+
+/// <summary>
+/// One tracked head position, as recorded in a pose trace
+/// </summary>
+struct HeadPoseSample
+{
+    // time the frame was captured, in milliseconds of the application clock
+    double                              timeMs;
+
+    // head position in camera space, meters
+    float                               position[3];
+};
+
+/// <summary>
+/// Tuning of the head pose predictor
+/// A lower minimum cutoff steadies a resting head but lags more, a higher beta lets fast
+/// movements through with less lag but more jitter, and the lead scale decides how much
+/// of the measured latency is extrapolated away
+/// </summary>
+struct HeadPosePredictorParams
+{
+    // cutoff of the position filter while the head rests, Hz
+    float                               minCutoff;
+
+    // cutoff added per meter per second of head speed, Hz
+    float                               beta;
+
+    // cutoff of the velocity filter, Hz
+    float                               derivativeCutoff;
+
+    // fraction of the latency to extrapolate over, 0 only smooths
+    float                               leadScale;
+
+    // longest extrapolation, so a lost face does not send the eyes off along the last velocity
+    float                               maxLeadMs;
+
+    HeadPosePredictorParams() :
+        minCutoff(1.0f),
+        beta(20.0f),
+        derivativeCutoff(1.5f),
+        leadScale(1.0f),
+        maxLeadMs(100.0f)
+    {
+    }
+};
+
+/// <summary>
+/// Smooths tracked head positions with a one euro filter and extrapolates them to the
+/// time the frame using them is expected on screen
+/// </summary>
+class CHeadPosePredictor
+{
+public:
+    /// <summary>
+    /// Constructor
+    /// </summary>
+    CHeadPosePredictor();
+
+    /// <summary>
+    /// Change the tuning, takes effect with the next sample
+    /// </summary>
+    /// <param name="params">new tuning</param>
+    void                                SetParams(const HeadPosePredictorParams& params) { m_params = params; }
+    const HeadPosePredictorParams&      GetParams() const { return m_params; }
+
+    /// <summary>
+    /// Forget every sample
+    /// </summary>
+    void                                Reset();
+
+    /// <summary>
+    /// Whether there is a sample to predict from
+    /// </summary>
+    bool                                HasSample() const { return m_bHasSample; }
+
+    /// <summary>
+    /// Filter a newly tracked position
+    /// Samples further apart than the filter can bridge restart it
+    /// </summary>
+    /// <param name="position">head position, meters</param>
+    /// <param name="timeMs">time the position was captured, must not go backwards</param>
+    void                                AddSample(const float position[3], double timeMs);
+
+    /// <summary>
+    /// Predict the head position at a given time
+    /// </summary>
+    /// <param name="timeMs">time the position is needed for</param>
+    /// <param name="position">receives the predicted position</param>
+    /// <returns>false if there is no sample yet</returns>
+    bool                                Predict(double timeMs, float position[3]) const;
+
+private:
+    HeadPosePredictorParams             m_params;
+    bool                                m_bHasSample;
+    double                              m_lastTimeMs;
+    float                               m_position[3];
+    float                               m_velocity[3];
+};
+
+/// <summary>
+/// How well the predictor follows a pose trace
+/// </summary>
+struct HeadPosePredictionError
+{
+    // distance between prediction and where the head really was, meters
+    double                              rmsError;
+    double                              maxError;
+
+    // root mean square of the frame to frame change in prediction velocity, meters per second
+    double                              jitter;
+
+    size_t                              count;
+};
+
+/// <summary>
+/// Replay a pose trace through the predictor, predicting each sample ahead by the latency
+/// and comparing with the trace interpolated at that time
+/// </summary>
+/// <param name="pTrace">samples in time order</param>
+/// <param name="count">number of samples</param>
+/// <param name="params">tuning to evaluate</param>
+/// <param name="latencyMs">how far ahead to predict</param>
+/// <param name="pError">receives the error</param>
+/// <returns>false if the trace is too short to compare any prediction</returns>
+bool EvaluateHeadPosePredictor(const HeadPoseSample* pTrace, size_t count, const HeadPosePredictorParams& params, double latencyMs, HeadPosePredictionError* pError);
+
+/// <summary>
+/// Write a pose trace as text, one "time x y z" sample per line
+/// </summary>
+/// <param name="pFile">file to write to</param>
+/// <param name="trace">samples to write</param>
+/// <returns>true on success</returns>
+bool WriteHeadPoseTrace(FILE* pFile, const std::vector<HeadPoseSample>& trace);
+
+/// <summary>
+/// Read a pose trace written by WriteHeadPoseTrace
+/// </summary>
+/// <param name="pFile">file to read from</param>
+/// <param name="pTrace">receives the samples</param>
+/// <returns>true if every line was a sample</returns>
+bool ReadHeadPoseTrace(FILE* pFile, std::vector<HeadPoseSample>* pTrace);
+
+/// <summary>
+/// Check the predictor on a synthetic trace of a swaying head with tracking noise
+/// </summary>
+/// <returns>true if prediction is both closer and steadier than the raw positions</returns>
+bool VerifyHeadPosePredictor();
@@ -0,0 +1,124 @@
+﻿//------------------------------------------------------------------------------
+// <copyright file="HeadTracker.cpp" company="Microsoft">
+//     Copyright (c) Microsoft Corporation.  All rights reserved.
+// </copyright>
+//------------------------------------------------------------------------------
+
+#include "HeadTracker.h"
+#include <math.h>
+#include <algorithm>
+
+namespace
+{
+    // tangents of half the color camera's nominal field of view, 62 by 48.6 degrees
+    const float cHalfFovTanX = 0.6009f;
+    const float cHalfFovTanY = 0.4515f;
+
+    // width of the reported face rectangle, meters
+    const float cFaceSize = 0.2f;
+
+    // half size of the search region in neck to head distances, and its lower bound in meters
+    // about twice the face, leaving room for the offset between the depth and color cameras
+    const float cRegionScale = 1.0f;
+    const float cMinRegionHalfSize = 0.15f;
+}
+
+/// <summary>
+/// Project the skeleton's head into a color image region large enough to hold the face
+/// The region is sized from the neck to head distance, so it shrinks as the user steps back
+/// </summary>
+/// <param name="neck">neck position in skeleton space</param>
+/// <param name="head">head position in skeleton space</param>
+/// <param name="colorWidth">width of the color frames</param>
+/// <param name="colorHeight">height of the color frames</param>
+/// <param name="pRegion">receives the region in color pixels, clipped to the image</param>
+/// <returns>true if the head is in front of the camera and the region is not empty</returns>
+bool ProjectHeadRegion(const float neck[3], const float head[3], LONG colorWidth, LONG colorHeight, RECT* pRegion)
+{
+    if (head[2] <= 0.0f)
+    {
+        return false;
+    }
+
+    float dx = head[0] - neck[0];
+    float dy = head[1] - neck[1];
+    float dz = head[2] - neck[2];
+    float halfSize = cRegionScale * sqrtf(dx * dx + dy * dy + dz * dz);
+    if (halfSize < cMinRegionHalfSize)
+    {
+        halfSize = cMinRegionHalfSize;
+    }
+
+    // pixels per meter at the head's distance
+    float scaleX = 0.5f * colorWidth / (head[2] * cHalfFovTanX);
+    float scaleY = 0.5f * colorHeight / (head[2] * cHalfFovTanY);
+    float centerX = 0.5f * colorWidth + head[0] * scaleX;
+    float centerY = 0.5f * colorHeight - head[1] * scaleY;
+
+    LONG left = static_cast<LONG>(centerX - halfSize * scaleX);
+    LONG right = static_cast<LONG>(centerX + halfSize * scaleX);
+    LONG top = static_cast<LONG>(centerY - halfSize * scaleY);
+    LONG bottom = static_cast<LONG>(centerY + halfSize * scaleY);
+
+    pRegion->left = (std::max)(left, 0L);
+    pRegion->right = (std::min)(right, colorWidth);
+    pRegion->top = (std::max)(top, 0L);
+    pRegion->bottom = (std::min)(bottom, colorHeight);
+
+    return pRegion->left < pRegion->right && pRegion->top < pRegion->bottom;
+}
+
+/// <summary>
+/// Constructor
+/// </summary>
+/// <param name="trackingMs">time each Track call takes, to model a slow tracker</param>
+CStubHeadTracker::CStubHeadTracker(DWORD trackingMs) :
+    m_trackingMs(trackingMs),
+    m_trackedCount(0)
+{
+}
+
+/// <summary>
+/// Report the hint's head as the pose, and a face sized rectangle around its projection
+/// </summary>
+/// <param name="frame">frame to search, only valid during the call</param>
+/// <param name="pPose">receives the pose, bTracked is false if the frame has no hint</param>
+/// <returns>S_OK on success, otherwise failure code</returns>
+HRESULT CStubHeadTracker::Track(const HeadTrackerFrame& frame, HeadPose* pPose)
+{
+    if (NULL == pPose)
+    {
+        return E_POINTER;
+    }
+
+    if (m_trackingMs > 0)
+    {
+        Sleep(m_trackingMs);
+    }
+
+    InterlockedIncrement(&m_trackedCount);
+
+    const float* pHead = frame.hint[1];
+    pPose->timeStamp = frame.timeStamp;
+    pPose->bTracked = frame.bHasHint && pHead[2] > 0.0f;
+    if (!pPose->bTracked)
+    {
+        return S_OK;
+    }
+
+    pPose->translation[0] = pHead[0];
+    pPose->translation[1] = pHead[1];
+    pPose->translation[2] = pHead[2];
+
+    float centerX = 0.5f + 0.5f * pHead[0] / (pHead[2] * cHalfFovTanX);
+    float centerY = 0.5f - 0.5f * pHead[1] / (pHead[2] * cHalfFovTanY);
+    float halfWidth = 0.25f * cFaceSize / (pHead[2] * cHalfFovTanX);
+    float halfHeight = 0.25f * cFaceSize / (pHead[2] * cHalfFovTanY);
+
+    pPose->rect[0] = centerX - halfWidth;
+    pPose->rect[1] = centerX + halfWidth;
+    pPose->rect[2] = centerY - halfHeight;
+    pPose->rect[3] = centerY + halfHeight;
+
+    return S_OK;
+}
@@ -0,0 +1,110 @@
+﻿//------------------------------------------------------------------------------
+// <copyright file="HeadTracker.h" company="Microsoft">
+//     Copyright (c) Microsoft Corporation.  All rights reserved.
+// </copyright>
+//------------------------------------------------------------------------------
+
+#pragma once
+
+#include <windows.h>
+#include "FrameBufferPool.h"
+
+/// <summary>
+/// One synchronized RGB-D frame handed to a head tracker
+/// </summary>
+struct HeadTrackerFrame
+{
+    // BGRX color and D13P3 depth, tightly packed, shared with the capture that filled them
+    CFrameBuffer                        color;
+    CFrameBuffer                        depth;
+    LONG                                colorWidth;
+    LONG                                colorHeight;
+    LONG                                depthWidth;
+    LONG                                depthHeight;
+
+    // timestamp of the depth frame, in milliseconds
+    LONGLONG                            timeStamp;
+
+    // neck and head of the followed skeleton in skeleton space, when there is one
+    bool                                bHasHint;
+    float                               hint[2][3];
+};
+
+/// <summary>
+/// Head position found in one frame
+/// </summary>
+struct HeadPose
+{
+    bool                                bTracked;
+
+    // head position in camera space, meters
+    float                               translation[3];
+
+    // face rectangle in normalized color image coordinates: left, right, top, bottom
+    float                               rect[4];
+
+    // timestamp of the frame the pose was found in, in milliseconds
+    LONGLONG                            timeStamp;
+};
+
+/// <summary>
+/// Project the skeleton's head into a color image region large enough to hold the face
+/// The region is sized from the neck to head distance, so it shrinks as the user steps back
+/// </summary>
+/// <param name="neck">neck position in skeleton space</param>
+/// <param name="head">head position in skeleton space</param>
+/// <param name="colorWidth">width of the color frames</param>
+/// <param name="colorHeight">height of the color frames</param>
+/// <param name="pRegion">receives the region in color pixels, clipped to the image</param>
+/// <returns>true if the head is in front of the camera and the region is not empty</returns>
+bool ProjectHeadRegion(const float neck[3], const float head[3], LONG colorWidth, LONG colorHeight, RECT* pRegion);
+
+/// <summary>
+/// Abstract head tracker
+/// Implemented by FaceTrackLib and by a stub that needs no tracking library
+/// Trackers are only ever called from one thread at a time
+/// </summary>
+class IHeadTracker
+{
+public:
+    virtual ~IHeadTracker() {}
+
+    /// <summary>
+    /// Find the head in a frame, following on from the previous frame if that one succeeded
+    /// </summary>
+    /// <param name="frame">frame to search, only valid during the call</param>
+    /// <param name="pPose">receives the pose, bTracked is false if no head was found</param>
+    /// <returns>S_OK on success, otherwise failure code</returns>
+    virtual HRESULT                     Track(const HeadTrackerFrame& frame, HeadPose* pPose) = 0;
+
+    /// <summary>
+    /// Forget the previous frame, the next Track searches the whole image
+    /// </summary>
+    virtual void                        Reset() = 0;
+};
+
+/// <summary>
+/// Head tracker reporting the skeleton hint's head as the pose, after an optional delay
+/// Stands in for FaceTrackLib so the tracking schedule can be exercised without it
+/// </summary>
+class CStubHeadTracker : public IHeadTracker
+{
+public:
+    /// <summary>
+    /// Constructor
+    /// </summary>
+    /// <param name="trackingMs">time each Track call takes, to model a slow tracker</param>
+    explicit CStubHeadTracker(DWORD trackingMs);
+
+    virtual HRESULT                     Track(const HeadTrackerFrame& frame, HeadPose* pPose);
+    virtual void                        Reset() {}
+
+    /// <summary>
+    /// Number of frames tracked so far
+    /// </summary>
+    LONG                                GetTrackedCount() const { return m_trackedCount; }
+
+private:
+    DWORD                               m_trackingMs;
+    volatile LONG                       m_trackedCount;
+};
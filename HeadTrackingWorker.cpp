@@ -0,0 +1,268 @@
+﻿//------------------------------------------------------------------------------
+// <copyright file="HeadTrackingWorker.cpp" company="Microsoft">
+//     Copyright (c) Microsoft Corporation.  All rights reserved.
+// </copyright>
+//------------------------------------------------------------------------------
+
+#include "HeadTrackingWorker.h"
+#include "FrameProfiler.h"
+
+/// <summary>
+/// Constructor
+/// </summary>
+CHeadTrackingWorker::CHeadTrackingWorker() :
+    m_pTracker(NULL),
+    m_hStop(NULL),
+    m_hSubmitted(NULL),
+    m_hThread(NULL),
+    m_hPublished(NULL),
+    m_busy(0),
+    m_submittedCount(0),
+    m_skippedCount(0),
+    m_trackedCount(0)
+{
+}
+
+/// <summary>
+/// Destructor, stops the tracking thread
+/// </summary>
+CHeadTrackingWorker::~CHeadTrackingWorker()
+{
+    Stop();
+}
+
+/// <summary>
+/// Start the tracking thread
+/// </summary>
+/// <param name="pTracker">tracker to run, must outlive the worker</param>
+/// <param name="colorWidth">width of the color frames</param>
+/// <param name="colorHeight">height of the color frames</param>
+/// <param name="depthWidth">width of the depth frames</param>
+/// <param name="depthHeight">height of the depth frames</param>
+/// <returns>S_OK on success, otherwise failure code</returns>
+HRESULT CHeadTrackingWorker::Start(IHeadTracker* pTracker, LONG colorWidth, LONG colorHeight, LONG depthWidth, LONG depthHeight)
+{
+    Stop();
+
+    if (NULL == pTracker)
+    {
+        return E_POINTER;
+    }
+
+    m_pTracker = pTracker;
+    m_pTracker->Reset();
+
+    // Submitting hands over references to the captured buffers, the slots hold no images of their own
+    for (int i = 0; i < 3; ++i)
+    {
+        HeadTrackerFrame& frame = m_frames.GetSlot(i);
+        frame.color.Reset();
+        frame.depth.Reset();
+        frame.colorWidth = colorWidth;
+        frame.colorHeight = colorHeight;
+        frame.depthWidth = depthWidth;
+        frame.depthHeight = depthHeight;
+        frame.timeStamp = 0;
+        frame.bHasHint = false;
+        ZeroMemory(frame.hint, sizeof(frame.hint));
+
+        ZeroMemory(&m_poses.GetSlot(i), sizeof(HeadPose));
+    }
+
+    m_submittedCount = 0;
+    m_skippedCount = 0;
+    m_trackedCount = 0;
+
+    m_hStop = CreateEventW(NULL, TRUE, FALSE, NULL);
+    m_hSubmitted = CreateEventW(NULL, FALSE, FALSE, NULL);
+    if (NULL == m_hStop || NULL == m_hSubmitted)
+    {
+        HRESULT hr = HRESULT_FROM_WIN32(GetLastError());
+        Stop();
+        return hr;
+    }
+
+    m_hThread = CreateThread(NULL, 0, TrackingThread, this, 0, NULL);
+    if (NULL == m_hThread)
+    {
+        HRESULT hr = HRESULT_FROM_WIN32(GetLastError());
+        Stop();
+        return hr;
+    }
+
+    return S_OK;
+}
+
+/// <summary>
+/// Stop and join the tracking thread, releasing the frames it still holds
+/// </summary>
+void CHeadTrackingWorker::Stop()
+{
+    if (NULL != m_hThread)
+    {
+        SetEvent(m_hStop);
+        WaitForSingleObject(m_hThread, INFINITE);
+        CloseHandle(m_hThread);
+        m_hThread = NULL;
+    }
+
+    if (NULL != m_hStop)
+    {
+        CloseHandle(m_hStop);
+        m_hStop = NULL;
+    }
+
+    if (NULL != m_hSubmitted)
+    {
+        CloseHandle(m_hSubmitted);
+        m_hSubmitted = NULL;
+    }
+
+    // hand the frames back to the capture's pools
+    for (int i = 0; i < 3; ++i)
+    {
+        m_frames.GetSlot(i).color.Reset();
+        m_frames.GetSlot(i).depth.Reset();
+    }
+}
+
+/// <summary>
+/// Submitting side, hand the filled frame to the tracker
+/// </summary>
+void CHeadTrackingWorker::Submit()
+{
+    InterlockedIncrement(&m_submittedCount);
+
+    // the tracker never started on the frame this replaces
+    if (m_frames.Publish())
+    {
+        InterlockedIncrement(&m_skippedCount);
+    }
+
+    SetEvent(m_hSubmitted);
+}
+
+/// <summary>
+/// Wait until every submitted frame has been tracked or skipped
+/// </summary>
+/// <param name="timeoutMs">longest time to wait</param>
+/// <returns>true if the worker is idle</returns>
+bool CHeadTrackingWorker::WaitIdle(DWORD timeoutMs) const
+{
+    DWORD start = GetTickCount();
+    while (0 != m_busy || m_frames.IsPending())
+    {
+        if (GetTickCount() - start >= timeoutMs)
+        {
+            return false;
+        }
+
+        Sleep(1);
+    }
+
+    return true;
+}
+
+DWORD WINAPI CHeadTrackingWorker::TrackingThread(LPVOID lpParam)
+{
+    static_cast<CHeadTrackingWorker*>(lpParam)->TrackingLoop();
+    return 0;
+}
+
+/// <summary>
+/// Track the newest submitted frame until stopped
+/// </summary>
+void CHeadTrackingWorker::TrackingLoop()
+{
+    CFrameProfiler::SetThreadName("face tracking");
+
+    HANDLE waits[2] = { m_hStop, m_hSubmitted };
+
+    for (;;)
+    {
+        if (WAIT_OBJECT_0 + 1 != WaitForMultipleObjects(2, waits, FALSE, INFINITE))
+        {
+            break;
+        }
+
+        // Cleared only once nothing is pending, so WaitIdle never misses a frame in flight
+        InterlockedExchange(&m_busy, 1);
+
+        // Frames submitted meanwhile have replaced each other, only the newest is tracked
+        while (m_frames.Acquire())
+        {
+            PROFILE_SCOPE("face tracking");
+
+            const HeadTrackerFrame& frame = m_frames.GetFront();
+            HeadPose& pose = m_poses.GetBack();
+            if ( FAILED(m_pTracker->Track(frame, &pose)) )
+            {
+                pose.bTracked = false;
+                pose.timeStamp = frame.timeStamp;
+            }
+
+            m_poses.Publish();
+            InterlockedIncrement(&m_trackedCount);
+
+            if (NULL != m_hPublished)
+            {
+                SetEvent(m_hPublished);
+            }
+        }
+
+        InterlockedExchange(&m_busy, 0);
+    }
+}
+
+/// <summary>
+/// Drive the worker with a slow stub tracker and check it skips to the newest frame
+/// </summary>
+/// <returns>true if the worker behaves as expected</returns>
+bool VerifyHeadTrackingWorker()
+{
+    const int cFrames = 30;
+
+    // far slower than the frames come in, so most have to be skipped
+    CStubHeadTracker tracker(20);
+
+    CHeadTrackingWorker worker;
+    if ( FAILED(worker.Start(&tracker, 64, 48, 64, 48)) )
+    {
+        return false;
+    }
+
+    bool match = true;
+    LONGLONG lastPoseTime = -1;
+
+    for (int i = 0; i < cFrames; ++i)
+    {
+        HeadTrackerFrame& frame = worker.GetNextFrame();
+        frame.timeStamp = i;
+        frame.bHasHint = true;
+        frame.hint[1][0] = i * 0.01f;
+        frame.hint[1][1] = 0.0f;
+        frame.hint[1][2] = 1.5f;
+        worker.Submit();
+
+        // poses only ever move forward in time
+        if (worker.AcquirePose())
+        {
+            match = match && worker.GetPose().timeStamp > lastPoseTime;
+            lastPoseTime = worker.GetPose().timeStamp;
+        }
+    }
+
+    match = match && worker.WaitIdle(5000);
+
+    // the last frame submitted is always tracked, and every frame is accounted for once
+    match = match && worker.AcquirePose() && worker.GetPose().timeStamp == cFrames - 1;
+    match = match && worker.GetPose().bTracked && worker.GetPose().translation[0] == (cFrames - 1) * 0.01f;
+    match = match && worker.GetSubmittedCount() == cFrames;
+    match = match && worker.GetTrackedCount() + worker.GetSkippedCount() == cFrames;
+    match = match && worker.GetSkippedCount() > 0;
+    match = match && tracker.GetTrackedCount() == worker.GetTrackedCount();
+
+    worker.Stop();
+
+    return match;
+}
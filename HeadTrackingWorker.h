@@ -0,0 +1,124 @@
+﻿//------------------------------------------------------------------------------
+// <copyright file="HeadTrackingWorker.h" company="Microsoft">
+//     Copyright (c) Microsoft Corporation.  All rights reserved.
+// </copyright>
+//------------------------------------------------------------------------------
+
+#pragma once
+
+#include <windows.h>
+#include "HeadTracker.h"
+#include "TripleBuffer.h"
+
+/// <summary>
+/// Runs a head tracker on its own thread so a slow tracking iteration never stalls rendering
+/// The render thread submits synchronized frames and picks up poses, neither side waits.
+/// A frame submitted while the tracker is busy replaces any frame still waiting, so the
+/// tracker always moves on to the newest frame and skips the ones it fell behind on.
+/// </summary>
+class CHeadTrackingWorker
+{
+public:
+    /// <summary>
+    /// Constructor
+    /// </summary>
+    CHeadTrackingWorker();
+
+    /// <summary>
+    /// Destructor, stops the tracking thread
+    /// </summary>
+    ~CHeadTrackingWorker();
+
+    /// <summary>
+    /// Start the tracking thread
+    /// </summary>
+    /// <param name="pTracker">tracker to run, must outlive the worker</param>
+    /// <param name="colorWidth">width of the color frames</param>
+    /// <param name="colorHeight">height of the color frames</param>
+    /// <param name="depthWidth">width of the depth frames</param>
+    /// <param name="depthHeight">height of the depth frames</param>
+    /// <returns>S_OK on success, otherwise failure code</returns>
+    HRESULT                             Start(IHeadTracker* pTracker, LONG colorWidth, LONG colorHeight, LONG depthWidth, LONG depthHeight);
+
+    /// <summary>
+    /// Stop and join the tracking thread, releasing the frames it still holds
+    /// </summary>
+    void                                Stop();
+
+    /// <summary>
+    /// Whether the tracking thread is running
+    /// </summary>
+    bool                                IsRunning() const { return NULL != m_hThread; }
+
+    /// <summary>
+    /// Event to signal whenever a pose is published, so the render thread can sleep until one arrives
+    /// The caller owns the event, call before Start
+    /// </summary>
+    /// <param name="hEvent">event to signal, or NULL for none</param>
+    void                                SetPublishEvent(HANDLE hEvent) { m_hPublished = hEvent; }
+
+    /// <summary>
+    /// Submitting side, the frame to fill next
+    /// </summary>
+    HeadTrackerFrame&                   GetNextFrame() { return m_frames.GetBack(); }
+
+    /// <summary>
+    /// Submitting side, hand the filled frame to the tracker
+    /// </summary>
+    void                                Submit();
+
+    /// <summary>
+    /// Take the newest pose, if one was found since the last call
+    /// The pose stays valid until the next successful call
+    /// </summary>
+    /// <returns>true if GetPose now returns a new pose</returns>
+    bool                                AcquirePose() { return m_poses.Acquire(); }
+    const HeadPose&                     GetPose() const { return m_poses.GetFront(); }
+
+    /// <summary>
+    /// Wait until every submitted frame has been tracked or skipped
+    /// </summary>
+    /// <param name="timeoutMs">longest time to wait</param>
+    /// <returns>true if the worker is idle</returns>
+    bool                                WaitIdle(DWORD timeoutMs) const;
+
+    /// <summary>
+    /// Frames submitted, frames replaced before the tracker got to them, and frames tracked
+    /// </summary>
+    LONG                                GetSubmittedCount() const { return m_submittedCount; }
+    LONG                                GetSkippedCount() const { return m_skippedCount; }
+    LONG                                GetTrackedCount() const { return m_trackedCount; }
+
+private:
+    static DWORD WINAPI                 TrackingThread(LPVOID lpParam);
+
+    /// <summary>
+    /// Track the newest submitted frame until stopped
+    /// </summary>
+    void                                TrackingLoop();
+
+    IHeadTracker*                       m_pTracker;
+
+    HANDLE                              m_hStop;
+    HANDLE                              m_hSubmitted;
+    HANDLE                              m_hThread;
+
+    // signaled after every pose, owned by the caller
+    HANDLE                              m_hPublished;
+
+    CTripleBuffer<HeadTrackerFrame>     m_frames;
+    CTripleBuffer<HeadPose>             m_poses;
+
+    // set while the thread works through submitted frames
+    volatile LONG                       m_busy;
+
+    volatile LONG                       m_submittedCount;
+    volatile LONG                       m_skippedCount;
+    volatile LONG                       m_trackedCount;
+};
+
+/// <summary>
+/// Drive the worker with a slow stub tracker and check it skips to the newest frame
+/// </summary>
+/// <returns>true if the worker behaves as expected</returns>
+bool VerifyHeadTrackingWorker();
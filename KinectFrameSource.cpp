@@ -0,0 +1,256 @@
+﻿//------------------------------------------------------------------------------
+// <copyright file="KinectFrameSource.cpp" company="Microsoft">
+//     Copyright (c) Microsoft Corporation.  All rights reserved.
+// </copyright>
+//------------------------------------------------------------------------------
+
+#include "KinectFrameSource.h"
+#include "DX11Utils.h"
+
+/// <summary>
+/// Constructor
+/// </summary>
+/// <param name="depthResolution">resolution of the depth stream</param>
+/// <param name="colorResolution">resolution of the color stream</param>
+CKinectFrameSource::CKinectFrameSource(NUI_IMAGE_RESOLUTION depthResolution, NUI_IMAGE_RESOLUTION colorResolution) :
+    m_depthResolution(depthResolution),
+    m_colorResolution(colorResolution),
+    m_pNuiSensor(NULL),
+    m_pMapper(NULL),
+    m_hNextDepthFrameEvent(INVALID_HANDLE_VALUE),
+    m_pDepthStreamHandle(INVALID_HANDLE_VALUE),
+    m_hNextColorFrameEvent(INVALID_HANDLE_VALUE),
+    m_pColorStreamHandle(INVALID_HANDLE_VALUE),
+    m_hNextSkeletonEvent(INVALID_HANDLE_VALUE),
+    m_bDepthLocked(false),
+    m_bColorLocked(false)
+{
+    DWORD width = 0;
+    DWORD height = 0;
+    NuiImageResolutionToSize(depthResolution, width, height);
+    m_depthPixelCount = width * height;
+}
+
+/// <summary>
+/// Destructor
+/// </summary>
+CKinectFrameSource::~CKinectFrameSource()
+{
+    SAFE_RELEASE(m_pMapper);
+
+    if (NULL != m_pNuiSensor)
+    {
+        m_pNuiSensor->NuiShutdown();
+        m_pNuiSensor->Release();
+    }
+
+    CloseHandle(m_hNextDepthFrameEvent);
+    CloseHandle(m_hNextColorFrameEvent);
+    CloseHandle(m_hNextSkeletonEvent);
+}
+
+/// <summary>
+/// Create a connected Kinect and open its streams, for using several sensors at once
+/// </summary>
+/// <param name="connectedIndex">which of the ready sensors to use, counting from 0</param>
+/// <param name="bSkeletonTracking">true to track skeletons, which only one sensor of a process may do</param>
+/// <returns>S_OK on success, otherwise failure code</returns>
+HRESULT CKinectFrameSource::CreateConnected(UINT connectedIndex, bool bSkeletonTracking)
+{
+    INuiSensor * pNuiSensor = NULL;
+    HRESULT hr;
+
+    int iSensorCount = 0;
+    hr = NuiGetSensorCount(&iSensorCount);
+    if (FAILED(hr) ) { return hr; }
+
+    // Look at each Kinect sensor
+    for (int i = 0; i < iSensorCount; ++i)
+    {
+        // Create the sensor so we can check status, if we can't create it, move on to the next
+        hr = NuiCreateSensorByIndex(i, &pNuiSensor);
+        if (FAILED(hr))
+        {
+            continue;
+        }
+
+        // Get the status of the sensor, and if connected, then we can initialize it
+        // the first connectedIndex ready sensors are left to other instances
+        hr = pNuiSensor->NuiStatus();
+        if (S_OK == hr && 0 == connectedIndex--)
+        {
+            m_pNuiSensor = pNuiSensor;
+            break;
+        }
+
+        // This sensor wasn't OK or is someone else's, so release it since we're not using it
+        pNuiSensor->Release();
+    }
+
+    if (NULL == m_pNuiSensor)
+    {
+        return E_FAIL;
+    }
+
+    // Initialize the Kinect and specify that we'll be using depth and color
+    DWORD dwInitializeFlags = NUI_INITIALIZE_FLAG_USES_COLOR | NUI_INITIALIZE_FLAG_USES_DEPTH_AND_PLAYER_INDEX;
+    if (bSkeletonTracking)
+    {
+        dwInitializeFlags |= NUI_INITIALIZE_FLAG_USES_SKELETON;
+    }
+
+    hr = m_pNuiSensor->NuiInitialize(dwInitializeFlags);
+    if (FAILED(hr) ) { return hr; }
+
+    // Create an event that will be signaled when depth data is available
+    m_hNextDepthFrameEvent = CreateEvent(NULL, TRUE, FALSE, NULL);
+
+    // Open a depth image stream to receive depth frames
+    hr = m_pNuiSensor->NuiImageStreamOpen(
+        NUI_IMAGE_TYPE_DEPTH_AND_PLAYER_INDEX,
+        m_depthResolution,
+        0,
+        2,
+        m_hNextDepthFrameEvent,
+        &m_pDepthStreamHandle);
+    if (FAILED(hr) ) { return hr; }
+
+    // Create an event that will be signaled when color data is available
+    m_hNextColorFrameEvent = CreateEvent(NULL, TRUE, FALSE, NULL);
+
+    // Open a color image stream to receive color frames
+    hr = m_pNuiSensor->NuiImageStreamOpen(
+        NUI_IMAGE_TYPE_COLOR,
+        m_colorResolution,
+        0,
+        2,
+        m_hNextColorFrameEvent,
+        &m_pColorStreamHandle );
+    if (FAILED(hr) ) { return hr; }
+
+    // Without tracking the event is never signaled, the skeleton capture thread just waits
+    m_hNextSkeletonEvent = CreateEventW(NULL, TRUE, FALSE, NULL);
+    if (bSkeletonTracking)
+    {
+        DWORD dwSkeletonFlags = NUI_SKELETON_TRACKING_FLAG_ENABLE_IN_NEAR_RANGE | NUI_SKELETON_TRACKING_FLAG_ENABLE_SEATED_SUPPORT;
+        hr = m_pNuiSensor->NuiSkeletonTrackingEnable(m_hNextSkeletonEvent, dwSkeletonFlags);
+        if (FAILED(hr)) { return hr; }
+    }
+
+    // The mapper is only needed to hand out calibration data for recordings
+    hr = m_pNuiSensor->NuiGetCoordinateMapper(&m_pMapper);
+
+    return hr;
+}
+
+/// <summary>
+/// Get the next frame of a stream and lock its pixels
+/// </summary>
+/// <param name="hStream">stream to read from</param>
+/// <param name="pFrame">receives the SDK frame, kept until ReleaseFrame</param>
+/// <param name="pImage">receives the frame data</param>
+/// <returns>S_OK on success, otherwise failure code</returns>
+HRESULT CKinectFrameSource::AcquireFrame(HANDLE hStream, NUI_IMAGE_FRAME* pFrame, FrameSourceImage* pImage)
+{
+    HRESULT hr = m_pNuiSensor->NuiImageStreamGetNextFrame(hStream, 0, pFrame);
+    if ( FAILED(hr) ) { return hr; }
+
+    NUI_LOCKED_RECT LockedRect;
+    hr = pFrame->pFrameTexture->LockRect(0, &LockedRect, NULL, 0);
+    if ( FAILED(hr) )
+    {
+        m_pNuiSensor->NuiImageStreamReleaseFrame(hStream, pFrame);
+        return hr;
+    }
+
+    pImage->pBits = LockedRect.pBits;
+    pImage->size = LockedRect.size;
+    pImage->pitch = LockedRect.Pitch;
+    pImage->timeStamp = pFrame->liTimeStamp.QuadPart;
+    pImage->frameNumber = pFrame->dwFrameNumber;
+    pImage->bRetained = false;
+
+    return hr;
+}
+
+/// <summary>
+/// Unlock and hand a frame back to the SDK
+/// </summary>
+/// <param name="hStream">stream the frame came from</param>
+/// <param name="pFrame">frame obtained from AcquireFrame</param>
+/// <returns>S_OK on success, otherwise failure code</returns>
+HRESULT CKinectFrameSource::ReleaseFrame(HANDLE hStream, NUI_IMAGE_FRAME* pFrame)
+{
+    HRESULT hr = pFrame->pFrameTexture->UnlockRect(0);
+    if ( FAILED(hr) ) { return hr; }
+
+    return m_pNuiSensor->NuiImageStreamReleaseFrame(hStream, pFrame);
+}
+
+HRESULT CKinectFrameSource::AcquireDepthFrame(FrameSourceImage* pImage)
+{
+    HRESULT hr = AcquireFrame(m_pDepthStreamHandle, &m_depthFrame, pImage);
+    m_bDepthLocked = SUCCEEDED(hr);
+    return hr;
+}
+
+HRESULT CKinectFrameSource::ReleaseDepthFrame()
+{
+    if (!m_bDepthLocked)
+    {
+        return E_UNEXPECTED;
+    }
+
+    m_bDepthLocked = false;
+    return ReleaseFrame(m_pDepthStreamHandle, &m_depthFrame);
+}
+
+HRESULT CKinectFrameSource::AcquireColorFrame(FrameSourceImage* pImage)
+{
+    HRESULT hr = AcquireFrame(m_pColorStreamHandle, &m_colorFrame, pImage);
+    m_bColorLocked = SUCCEEDED(hr);
+    return hr;
+}
+
+HRESULT CKinectFrameSource::ReleaseColorFrame()
+{
+    if (!m_bColorLocked)
+    {
+        return E_UNEXPECTED;
+    }
+
+    m_bColorLocked = false;
+    return ReleaseFrame(m_pColorStreamHandle, &m_colorFrame);
+}
+
+HRESULT CKinectFrameSource::GetSkeletonFrame(NUI_SKELETON_FRAME* pFrame)
+{
+    return m_pNuiSensor->NuiSkeletonGetNextFrame(0, pFrame);
+}
+
+HRESULT CKinectFrameSource::MapDepthFrameToColorCoordinates(USHORT* pDepthD16, LONG* pColorCoordinates)
+{
+    return m_pNuiSensor->NuiImageGetColorPixelCoordinateFrameFromDepthPixelFrameAtResolution(
+        m_colorResolution,
+        m_depthResolution,
+        m_depthPixelCount,
+        pDepthD16,
+        m_depthPixelCount*2,
+        pColorCoordinates
+        );
+}
+
+HRESULT CKinectFrameSource::GetMappingParameters(ULONG* pByteCount, void** ppData)
+{
+    if (NULL == m_pMapper)
+    {
+        return E_NOINTERFACE;
+    }
+
+    return m_pMapper->GetColorToDepthRelationalParameters(pByteCount, ppData);
+}
+
+HRESULT CKinectFrameSource::SetNearMode(bool bNearMode)
+{
+    return m_pNuiSensor->NuiImageStreamSetImageFrameFlags(m_pDepthStreamHandle, bNearMode ? NUI_IMAGE_STREAM_FLAG_ENABLE_NEAR_MODE : 0);
+}
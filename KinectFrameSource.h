@@ -0,0 +1,78 @@
+﻿//------------------------------------------------------------------------------
+// <copyright file="KinectFrameSource.h" company="Microsoft">
+//     Copyright (c) Microsoft Corporation.  All rights reserved.
+// </copyright>
+//------------------------------------------------------------------------------
+
+#pragma once
+
+#include "FrameSource.h"
+
+/// <summary>
+/// Frame source backed by a connected Kinect sensor
+/// </summary>
+class CKinectFrameSource : public IFrameSource
+{
+public:
+    /// <summary>
+    /// Constructor
+    /// </summary>
+    /// <param name="depthResolution">resolution of the depth stream</param>
+    /// <param name="colorResolution">resolution of the color stream</param>
+    CKinectFrameSource(NUI_IMAGE_RESOLUTION depthResolution, NUI_IMAGE_RESOLUTION colorResolution);
+
+    /// <summary>
+    /// Destructor
+    /// </summary>
+    ~CKinectFrameSource();
+
+    /// <summary>
+    /// Create the first connected Kinect found and open its streams
+    /// </summary>
+    /// <returns>S_OK on success, otherwise failure code</returns>
+    HRESULT                             CreateFirstConnected() { return CreateConnected(0, true); }
+
+    /// <summary>
+    /// Create a connected Kinect and open its streams, for using several sensors at once
+    /// </summary>
+    /// <param name="connectedIndex">which of the ready sensors to use, counting from 0</param>
+    /// <param name="bSkeletonTracking">true to track skeletons, which only one sensor of a process may do</param>
+    /// <returns>S_OK on success, otherwise failure code</returns>
+    HRESULT                             CreateConnected(UINT connectedIndex, bool bSkeletonTracking);
+
+    HANDLE                              GetNextDepthFrameEvent() const { return m_hNextDepthFrameEvent; }
+    HANDLE                              GetNextColorFrameEvent() const { return m_hNextColorFrameEvent; }
+    HANDLE                              GetNextSkeletonEvent() const { return m_hNextSkeletonEvent; }
+
+    HRESULT                             AcquireDepthFrame(FrameSourceImage* pImage);
+    HRESULT                             ReleaseDepthFrame();
+    HRESULT                             AcquireColorFrame(FrameSourceImage* pImage);
+    HRESULT                             ReleaseColorFrame();
+    HRESULT                             GetSkeletonFrame(NUI_SKELETON_FRAME* pFrame);
+    HRESULT                             MapDepthFrameToColorCoordinates(USHORT* pDepthD16, LONG* pColorCoordinates);
+    HRESULT                             GetMappingParameters(ULONG* pByteCount, void** ppData);
+    HRESULT                             SetNearMode(bool bNearMode);
+    bool                                IsEndOfStream() const { return false; }
+
+private:
+    NUI_IMAGE_RESOLUTION                m_depthResolution;
+    NUI_IMAGE_RESOLUTION                m_colorResolution;
+    DWORD                               m_depthPixelCount;
+
+    INuiSensor*                         m_pNuiSensor;
+    INuiCoordinateMapper*               m_pMapper;
+    HANDLE                              m_hNextDepthFrameEvent;
+    HANDLE                              m_pDepthStreamHandle;
+    HANDLE                              m_hNextColorFrameEvent;
+    HANDLE                              m_pColorStreamHandle;
+    HANDLE                              m_hNextSkeletonEvent;
+
+    // frames currently locked by the caller
+    NUI_IMAGE_FRAME                     m_depthFrame;
+    NUI_IMAGE_FRAME                     m_colorFrame;
+    bool                                m_bDepthLocked;
+    bool                                m_bColorLocked;
+
+    HRESULT                             AcquireFrame(HANDLE hStream, NUI_IMAGE_FRAME* pFrame, FrameSourceImage* pImage);
+    HRESULT                             ReleaseFrame(HANDLE hStream, NUI_IMAGE_FRAME* pFrame);
+};
@@ -0,0 +1,442 @@
+﻿//------------------------------------------------------------------------------
+// <copyright file="PointCloud.cpp" company="Microsoft">
+//     Copyright (c) Microsoft Corporation.  All rights reserved.
+// </copyright>
+//------------------------------------------------------------------------------
+
+#include "PointCloud.h"
+
+#include <math.h>
+#include <vector>
+#include <emmintrin.h>
+
+namespace
+{
+    // the shader's conversion of D13P3 depth to meters, player index bits included
+    const float cDepthToMeters = 1.0f / 8000.0f;
+
+    /// <summary>
+    /// Per byte average rounding up, what _mm_avg_epu8 computes
+    /// </summary>
+    inline uint32_t AveragePixels(uint32_t a, uint32_t b)
+    {
+        return (a | b) - (((a ^ b) & 0xfefefefe) >> 1);
+    }
+
+    /// <summary>
+    /// Color the shader samples for a depth pixel
+    /// The texture coordinate lands on the corner between four texels, which the
+    /// linear sampler blends equally, wrapping around at the image edges.
+    /// The corner offsets of the quad are whole texture sizes, so all four match.
+    /// </summary>
+    inline uint32_t SampleColor(const PointCloudDesc& desc, int x, int y)
+    {
+        int cx = x * desc.colorWidth / desc.depthWidth;
+        int cy = y * desc.colorHeight / desc.depthHeight;
+        int left = cx > 0 ? cx - 1 : desc.colorWidth - 1;
+        int up = cy > 0 ? cy - 1 : desc.colorHeight - 1;
+
+        const uint32_t* pUp = reinterpret_cast<const uint32_t*>(desc.pColor + up * desc.colorPitch);
+        const uint32_t* pRow = reinterpret_cast<const uint32_t*>(desc.pColor + cy * desc.colorPitch);
+
+        return AveragePixels(AveragePixels(pUp[left], pUp[cx]), AveragePixels(pRow[left], pRow[cx]));
+    }
+
+    /// <summary>
+    /// Convert a single pixel
+    /// </summary>
+    /// <returns>true if the shader would emit the pixel</returns>
+    inline bool GeneratePoint(const PointCloudDesc& desc, int x, int y, float rowScale, float halfWidthOffset, PointCloudPoint* pPoint)
+    {
+        int depth = desc.pDepth[y * desc.depthWidth + x];
+
+        // check that depth is in the valid range
+        if (depth < cPointCloudMinDepth || depth > cPointCloudMaxDepth)
+        {
+            return false;
+        }
+
+        float realDepth = depth * cDepthToMeters;
+        pPoint->x = (x - halfWidthOffset) * desc.xyScale * realDepth;
+        pPoint->y = rowScale * realDepth;
+        pPoint->z = realDepth;
+        pPoint->color = SampleColor(desc, x, y);
+
+        return true;
+    }
+}
+
+/// <summary>
+/// Reference implementation, one pixel at a time
+/// </summary>
+int GeneratePointCloudScalar(const PointCloudDesc& desc, int rowBegin, int rowEnd, PointCloudPoint* pPoints)
+{
+    float halfWidthOffset = desc.depthWidth / 2.0f - 0.5f;
+    float halfHeightOffset = desc.depthHeight / 2.0f - 0.5f;
+    PointCloudPoint* pOut = pPoints;
+
+    for (int y = rowBegin; y < rowEnd; ++y)
+    {
+        // y is flipped, the shader's XYScale.y is negative
+        float rowScale = (y - halfHeightOffset) * -desc.xyScale;
+
+        for (int x = 0; x < desc.depthWidth; ++x)
+        {
+            if (GeneratePoint(desc, x, y, rowScale, halfWidthOffset, pOut))
+            {
+                ++pOut;
+            }
+        }
+    }
+
+    return static_cast<int>(pOut - pPoints);
+}
+
+/// <summary>
+/// SSE2 implementation, four pixels at a time
+/// </summary>
+int GeneratePointCloudSSE2(const PointCloudDesc& desc, int rowBegin, int rowEnd, PointCloudPoint* pPoints)
+{
+    float halfWidthOffset = desc.depthWidth / 2.0f - 0.5f;
+    float halfHeightOffset = desc.depthHeight / 2.0f - 0.5f;
+
+    // with matching resolutions the four texels of neighboring pixels are neighbors too
+    bool bSameSize = desc.colorWidth == desc.depthWidth && desc.colorHeight == desc.depthHeight;
+
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i minDepth = _mm_set1_epi32(cPointCloudMinDepth);
+    const __m128i maxDepth = _mm_set1_epi32(cPointCloudMaxDepth);
+    const __m128 depthToMeters = _mm_set1_ps(cDepthToMeters);
+    const __m128 xyScale = _mm_set1_ps(desc.xyScale);
+    const __m128 lanes = _mm_setr_ps(0.0f, 1.0f, 2.0f, 3.0f);
+
+    PointCloudPoint* pOut = pPoints;
+
+    for (int y = rowBegin; y < rowEnd; ++y)
+    {
+        float rowScale = (y - halfHeightOffset) * -desc.xyScale;
+        const uint16_t* pDepthRow = desc.pDepth + y * desc.depthWidth;
+
+        const uint32_t* pColorUp = NULL;
+        const uint32_t* pColorRow = NULL;
+        if (bSameSize)
+        {
+            int up = y > 0 ? y - 1 : desc.colorHeight - 1;
+            pColorUp = reinterpret_cast<const uint32_t*>(desc.pColor + up * desc.colorPitch);
+            pColorRow = reinterpret_cast<const uint32_t*>(desc.pColor + y * desc.colorPitch);
+        }
+
+        int x = 0;
+        for (; x + 4 <= desc.depthWidth; x += 4)
+        {
+            __m128i depth = _mm_unpacklo_epi16(_mm_loadl_epi64(reinterpret_cast<const __m128i*>(pDepthRow + x)), zero);
+            __m128i rejected = _mm_or_si128(_mm_cmplt_epi32(depth, minDepth), _mm_cmpgt_epi32(depth, maxDepth));
+            int validMask = ~_mm_movemask_ps(_mm_castsi128_ps(rejected)) & 0xf;
+
+            // background and holes come in long runs
+            if (0 == validMask)
+            {
+                continue;
+            }
+
+            __m128 realDepth = _mm_mul_ps(_mm_cvtepi32_ps(depth), depthToMeters);
+            __m128 column = _mm_sub_ps(_mm_add_ps(_mm_set1_ps(static_cast<float>(x)), lanes), _mm_set1_ps(halfWidthOffset));
+            __m128 worldX = _mm_mul_ps(_mm_mul_ps(column, xyScale), realDepth);
+            __m128 worldY = _mm_mul_ps(_mm_set1_ps(rowScale), realDepth);
+
+            __m128i color;
+            if (bSameSize && x > 0)
+            {
+                // texels x - 1 and x of this row and the one above, for four pixels at once
+                __m128i upLeft = _mm_loadu_si128(reinterpret_cast<const __m128i*>(pColorUp + x - 1));
+                __m128i upRight = _mm_loadu_si128(reinterpret_cast<const __m128i*>(pColorUp + x));
+                __m128i left = _mm_loadu_si128(reinterpret_cast<const __m128i*>(pColorRow + x - 1));
+                __m128i right = _mm_loadu_si128(reinterpret_cast<const __m128i*>(pColorRow + x));
+                color = _mm_avg_epu8(_mm_avg_epu8(upLeft, upRight), _mm_avg_epu8(left, right));
+            }
+            else
+            {
+                color = _mm_setr_epi32(
+                    static_cast<int>(SampleColor(desc, x, y)),
+                    static_cast<int>(SampleColor(desc, x + 1, y)),
+                    static_cast<int>(SampleColor(desc, x + 2, y)),
+                    static_cast<int>(SampleColor(desc, x + 3, y)));
+            }
+
+            // rows of x, y, z, color become one point per register
+            __m128 point0 = worldX;
+            __m128 point1 = worldY;
+            __m128 point2 = realDepth;
+            __m128 point3 = _mm_castsi128_ps(color);
+            _MM_TRANSPOSE4_PS(point0, point1, point2, point3);
+
+            // every lane is stored, rejected ones are overwritten by the next point
+            _mm_storeu_ps(&pOut->x, point0);
+            pOut += validMask & 1;
+            _mm_storeu_ps(&pOut->x, point1);
+            pOut += (validMask >> 1) & 1;
+            _mm_storeu_ps(&pOut->x, point2);
+            pOut += (validMask >> 2) & 1;
+            _mm_storeu_ps(&pOut->x, point3);
+            pOut += (validMask >> 3) & 1;
+        }
+
+        for (; x < desc.depthWidth; ++x)
+        {
+            if (GeneratePoint(desc, x, y, rowScale, halfWidthOffset, pOut))
+            {
+                ++pOut;
+            }
+        }
+    }
+
+    return static_cast<int>(pOut - pPoints);
+}
+
+/// <summary>
+/// The transform that leaves points where they are, for the sensor whose space is the shared one
+/// </summary>
+void SetIdentityTransform(PointCloudTransform* pTransform)
+{
+    for (int r = 0; r < 4; ++r)
+    {
+        for (int c = 0; c < 4; ++c)
+        {
+            pTransform->m[r][c] = (r == c) ? 1.0f : 0.0f;
+        }
+    }
+}
+
+/// <summary>
+/// Reference implementation, one point at a time
+/// </summary>
+void TransformPointCloudScalar(const PointCloudTransform& transform, PointCloudPoint* pPoints, int count)
+{
+    const float (*m)[4] = transform.m;
+
+    for (int i = 0; i < count; ++i)
+    {
+        PointCloudPoint& point = pPoints[i];
+        float x = point.x;
+        float y = point.y;
+        float z = point.z;
+
+        point.x = x * m[0][0] + y * m[1][0] + z * m[2][0] + m[3][0];
+        point.y = x * m[0][1] + y * m[1][1] + z * m[2][1] + m[3][1];
+        point.z = x * m[0][2] + y * m[1][2] + z * m[2][2] + m[3][2];
+    }
+}
+
+/// <summary>
+/// SSE2 implementation, four points at a time
+/// </summary>
+void TransformPointCloudSSE2(const PointCloudTransform& transform, PointCloudPoint* pPoints, int count)
+{
+    __m128 m[4][3];
+    for (int r = 0; r < 4; ++r)
+    {
+        for (int c = 0; c < 3; ++c)
+        {
+            m[r][c] = _mm_set1_ps(transform.m[r][c]);
+        }
+    }
+
+    int i = 0;
+    for (; i + 4 <= count; i += 4)
+    {
+        float* p = &pPoints[i].x;
+
+        // one point per register becomes rows of x, y, z and color, the color bits only get shuffled
+        __m128 x = _mm_loadu_ps(p);
+        __m128 y = _mm_loadu_ps(p + 4);
+        __m128 z = _mm_loadu_ps(p + 8);
+        __m128 color = _mm_loadu_ps(p + 12);
+        _MM_TRANSPOSE4_PS(x, y, z, color);
+
+        __m128 movedX = _mm_add_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(x, m[0][0]), _mm_mul_ps(y, m[1][0])), _mm_mul_ps(z, m[2][0])), m[3][0]);
+        __m128 movedY = _mm_add_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(x, m[0][1]), _mm_mul_ps(y, m[1][1])), _mm_mul_ps(z, m[2][1])), m[3][1]);
+        __m128 movedZ = _mm_add_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(x, m[0][2]), _mm_mul_ps(y, m[1][2])), _mm_mul_ps(z, m[2][2])), m[3][2]);
+        _MM_TRANSPOSE4_PS(movedX, movedY, movedZ, color);
+
+        _mm_storeu_ps(p, movedX);
+        _mm_storeu_ps(p + 4, movedY);
+        _mm_storeu_ps(p + 8, movedZ);
+        _mm_storeu_ps(p + 12, color);
+    }
+
+    TransformPointCloudScalar(transform, pPoints + i, count - i);
+}
+
+/// <summary>
+/// Collect the index of every depth pixel the shader keeps, in row major order
+/// Drawing one primitive per index skips the pixels the shader would throw away
+/// </summary>
+/// <param name="pDepth">D13P3 depth image, tightly packed</param>
+/// <param name="depthWidth">pixels per depth row</param>
+/// <param name="rowBegin">first depth row to scan</param>
+/// <param name="rowEnd">one past the last depth row to scan</param>
+/// <param name="pIndices">receives the pixel indices, room for every pixel of the band</param>
+/// <returns>number of indices written</returns>
+int BuildPointIndices(const uint16_t* pDepth, int depthWidth, int rowBegin, int rowEnd, uint32_t* pIndices)
+{
+    // depths are unsigned, flipping the top bit lets the signed compares order them
+    const __m128i bias = _mm_set1_epi16(static_cast<short>(0x8000));
+    const __m128i minDepth = _mm_set1_epi16(static_cast<short>(cPointCloudMinDepth ^ 0x8000));
+    const __m128i maxDepth = _mm_set1_epi16(static_cast<short>(cPointCloudMaxDepth ^ 0x8000));
+    const __m128i lanes = _mm_setr_epi32(0, 1, 2, 3);
+
+    uint32_t* pOut = pIndices;
+
+    for (int y = rowBegin; y < rowEnd; ++y)
+    {
+        uint32_t rowStart = static_cast<uint32_t>(y * depthWidth);
+        const uint16_t* pDepthRow = pDepth + rowStart;
+
+        int x = 0;
+        for (; x + 8 <= depthWidth; x += 8)
+        {
+            __m128i depth = _mm_xor_si128(_mm_loadu_si128(reinterpret_cast<const __m128i*>(pDepthRow + x)), bias);
+            __m128i rejected = _mm_or_si128(_mm_cmplt_epi16(depth, minDepth), _mm_cmpgt_epi16(depth, maxDepth));
+
+            // two mask bits per pixel
+            int rejectedMask = _mm_movemask_epi8(rejected);
+
+            // background and holes come in long runs, so does the subject
+            if (0xffff == rejectedMask)
+            {
+                continue;
+            }
+
+            __m128i first = _mm_add_epi32(_mm_set1_epi32(static_cast<int>(rowStart + x)), lanes);
+            if (0 == rejectedMask)
+            {
+                _mm_storeu_si128(reinterpret_cast<__m128i*>(pOut), first);
+                _mm_storeu_si128(reinterpret_cast<__m128i*>(pOut + 4), _mm_add_epi32(first, _mm_set1_epi32(4)));
+                pOut += 8;
+                continue;
+            }
+
+            // every pixel is stored, rejected ones are overwritten by the next index
+            for (int i = 0; i < 8; ++i)
+            {
+                *pOut = rowStart + x + i;
+                pOut += 1 - ((rejectedMask >> (2 * i)) & 1);
+            }
+        }
+
+        for (; x < depthWidth; ++x)
+        {
+            int depth = pDepthRow[x];
+            if (depth >= cPointCloudMinDepth && depth <= cPointCloudMaxDepth)
+            {
+                *pOut++ = rowStart + x;
+            }
+        }
+    }
+
+    return static_cast<int>(pOut - pIndices);
+}
+
+/// <summary>
+/// Compare the SSE2 implementation against the scalar reference on synthetic data
+/// </summary>
+/// <returns>true if both implementations agree</returns>
+bool VerifyPointCloud()
+{
+    // odd widths exercise the scalar tails, color at the same and at twice the depth resolution
+    static const int colorScales[] = { 1, 2 };
+    const int depthWidth = 86;
+    const int depthHeight = 30;
+
+    unsigned int seed = 12345;
+    bool match = true;
+
+    for (size_t s = 0; s < sizeof(colorScales) / sizeof(colorScales[0]); ++s)
+    {
+        PointCloudDesc desc;
+        desc.depthWidth = depthWidth;
+        desc.depthHeight = depthHeight;
+        desc.colorWidth = depthWidth * colorScales[s];
+        desc.colorHeight = depthHeight * colorScales[s];
+        desc.colorPitch = desc.colorWidth * 4 + 20;
+        desc.xyScale = 0.0018f;
+
+        // depths on both sides of the valid range, with runs of rejected pixels
+        std::vector<uint16_t> depth(depthWidth * depthHeight);
+        for (size_t i = 0; i < depth.size(); ++i)
+        {
+            seed = seed * 1664525 + 1013904223;
+            depth[i] = static_cast<uint16_t>((seed >> 8) % (cPointCloudMaxDepth + 4000));
+            if (0 == (i / 8) % 5)
+            {
+                depth[i] = 0;
+            }
+        }
+
+        std::vector<uint8_t> color(desc.colorPitch * desc.colorHeight);
+        for (size_t i = 0; i < color.size(); ++i)
+        {
+            seed = seed * 1664525 + 1013904223;
+            color[i] = static_cast<uint8_t>(seed >> 16);
+        }
+
+        desc.pDepth = &depth[0];
+        desc.pColor = &color[0];
+
+        std::vector<PointCloudPoint> expected(depth.size());
+        std::vector<PointCloudPoint> actual(depth.size());
+
+        int expectedCount = GeneratePointCloudScalar(desc, 0, depthHeight, &expected[0]);
+        int actualCount = GeneratePointCloudSSE2(desc, 0, depthHeight, &actual[0]);
+        match = match && (expectedCount == actualCount);
+
+        // the index list has to name exactly the pixels that became points
+        std::vector<uint32_t> indices(depth.size());
+        int indexCount = BuildPointIndices(&depth[0], depthWidth, 0, depthHeight, &indices[0]);
+        match = match && (expectedCount == indexCount);
+        for (int i = 0; match && i < indexCount; ++i)
+        {
+            int pixelDepth = depth[indices[i]];
+            match = pixelDepth >= cPointCloudMinDepth && pixelDepth <= cPointCloudMaxDepth &&
+                expected[i].z == pixelDepth * cDepthToMeters;
+        }
+
+        for (int i = 0; match && i < expectedCount; ++i)
+        {
+            const PointCloudPoint& e = expected[i];
+            const PointCloudPoint& a = actual[i];
+
+            // the compiler may contract or reorder the scalar math differently
+            match = fabsf(e.x - a.x) <= 1e-5f && fabsf(e.y - a.y) <= 1e-5f && e.z == a.z && e.color == a.color;
+        }
+
+        // a quarter turn about y and an offset, an odd count exercises the scalar tail
+        PointCloudTransform transform;
+        SetIdentityTransform(&transform);
+        transform.m[0][0] = 0.0f;
+        transform.m[0][2] = -1.0f;
+        transform.m[2][0] = 1.0f;
+        transform.m[2][2] = 0.0f;
+        transform.m[3][0] = 0.5f;
+        transform.m[3][1] = -0.25f;
+        transform.m[3][2] = 2.0f;
+
+        int movedCount = expectedCount | 1;
+        std::vector<PointCloudPoint> movedScalar(expected);
+        std::vector<PointCloudPoint> movedSSE2(expected);
+        TransformPointCloudScalar(transform, &movedScalar[0], movedCount);
+        TransformPointCloudSSE2(transform, &movedSSE2[0], movedCount);
+
+        for (int i = 0; match && i < movedCount; ++i)
+        {
+            const PointCloudPoint& e = expected[i];
+            const PointCloudPoint& s = movedScalar[i];
+            const PointCloudPoint& a = movedSSE2[i];
+
+            match = fabsf(s.x - (e.z + 0.5f)) <= 1e-5f && fabsf(s.y - (e.y - 0.25f)) <= 1e-5f && fabsf(s.z - (2.0f - e.x)) <= 1e-5f &&
+                fabsf(s.x - a.x) <= 1e-5f && fabsf(s.y - a.y) <= 1e-5f && fabsf(s.z - a.z) <= 1e-5f && s.color == a.color && e.color == a.color;
+        }
+    }
+
+    return match;
+}
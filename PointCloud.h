@@ -0,0 +1,119 @@
+﻿//------------------------------------------------------------------------------
+// <copyright file="PointCloud.h" company="Microsoft">
+//     Copyright (c) Microsoft Corporation.  All rights reserved.
+// </copyright>
+//------------------------------------------------------------------------------
+
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Depths the geometry shader keeps, in D13P3 units
+// The minimum of near mode and standard, and the maximum of near mode and standard
+const int cPointCloudMinDepth = 300 << 3;
+const int cPointCloudMaxDepth = 4000 << 3;
+
+/// <summary>
+/// Inputs of the depth to world space conversion done by the geometry shader
+/// </summary>
+struct PointCloudDesc
+{
+    // D13P3 depth image, tightly packed
+    const uint16_t*                     pDepth;
+
+    // BGRX color image already remapped into depth space by MapColorToDepth
+    const uint8_t*                      pColor;
+    size_t                              colorPitch;
+
+    int                                 depthWidth;
+    int                                 depthHeight;
+    int                                 colorWidth;
+    int                                 colorHeight;
+
+    // world units per depth pixel at one meter, the shader's XYScale.x
+    float                               xyScale;
+};
+
+/// <summary>
+/// World space position in meters and color of one depth pixel
+/// </summary>
+struct PointCloudPoint
+{
+    float                               x;
+    float                               y;
+    float                               z;
+    uint32_t                            color;
+};
+
+/// <summary>
+/// Rigid transform of one sensor's points into the space the clouds of several sensors are merged in
+/// Row vectors like the shader's matrices, so the translation is the last row
+/// </summary>
+struct PointCloudTransform
+{
+    float                               m[4][4];
+};
+
+/// <summary>
+/// Convert a band of depth rows into points, skipping depths the shader rejects
+/// Points are written in row major order with no gaps
+/// </summary>
+/// <param name="desc">conversion inputs</param>
+/// <param name="rowBegin">first depth row to convert</param>
+/// <param name="rowEnd">one past the last depth row to convert</param>
+/// <param name="pPoints">receives the points, room for every pixel of the band</param>
+/// <returns>number of points written</returns>
+typedef int (*GeneratePointCloudFunc)(const PointCloudDesc& desc, int rowBegin, int rowEnd, PointCloudPoint* pPoints);
+
+/// <summary>
+/// Reference implementation, one pixel at a time
+/// </summary>
+int GeneratePointCloudScalar(const PointCloudDesc& desc, int rowBegin, int rowEnd, PointCloudPoint* pPoints);
+
+/// <summary>
+/// SSE2 implementation, four pixels at a time
+/// </summary>
+int GeneratePointCloudSSE2(const PointCloudDesc& desc, int rowBegin, int rowEnd, PointCloudPoint* pPoints);
+
+/// <summary>
+/// The transform that leaves points where they are, for the sensor whose space is the shared one
+/// </summary>
+/// <param name="pTransform">receives the transform</param>
+void SetIdentityTransform(PointCloudTransform* pTransform);
+
+/// <summary>
+/// Move points into the shared space in place, as the shader's World matrix does
+/// </summary>
+/// <param name="transform">sensor to shared space transform</param>
+/// <param name="pPoints">points to move, colors are left alone</param>
+/// <param name="count">number of points</param>
+typedef void (*TransformPointCloudFunc)(const PointCloudTransform& transform, PointCloudPoint* pPoints, int count);
+
+/// <summary>
+/// Reference implementation, one point at a time
+/// </summary>
+void TransformPointCloudScalar(const PointCloudTransform& transform, PointCloudPoint* pPoints, int count);
+
+/// <summary>
+/// SSE2 implementation, four points at a time
+/// </summary>
+void TransformPointCloudSSE2(const PointCloudTransform& transform, PointCloudPoint* pPoints, int count);
+
+/// <summary>
+/// Collect the index of every depth pixel the shader keeps, in row major order
+/// Drawing one primitive per index skips the pixels the shader would throw away
+/// </summary>
+/// <param name="pDepth">D13P3 depth image, tightly packed</param>
+/// <param name="depthWidth">pixels per depth row</param>
+/// <param name="rowBegin">first depth row to scan</param>
+/// <param name="rowEnd">one past the last depth row to scan</param>
+/// <param name="pIndices">receives the pixel indices, room for every pixel of the band</param>
+/// <returns>number of indices written</returns>
+int BuildPointIndices(const uint16_t* pDepth, int depthWidth, int rowBegin, int rowEnd, uint32_t* pIndices);
+
+/// <summary>
+/// Compare the SSE2 implementation against the scalar reference on synthetic data
+/// </summary>
+/// <returns>true if both implementations agree</returns>
+bool VerifyPointCloud();
@@ -0,0 +1,87 @@
+﻿//------------------------------------------------------------------------------
+// <copyright file="RecordingFormat.h" company="Microsoft">
+//     Copyright (c) Microsoft Corporation.  All rights reserved.
+// </copyright>
+//------------------------------------------------------------------------------
+
+#pragma once
+
+#include <windows.h>
+
+// File layout, designed to be memory mapped:
+//   RecordingFileHeader, padded to cRecordingAlignment
+//   mapping parameters blob (mappingParametersSize bytes at mappingParametersOffset)
+//   chunks, each a RecordingChunkHeader immediately followed by its payload
+//   index table, indexCount RecordingIndexEntry records at indexOffset
+//
+// Every payload starts on a cRecordingAlignment boundary, so a replayed frame can be
+// handed out as a pointer straight into the mapped file and used with aligned loads.
+// The chunk headers duplicate the index so a recording that was cut short, and has no
+// index, can still be recovered by walking the chunks.
+//
+// From version 4 depth chunks may be compressed by the depth codec, flagged in the chunk type.
+// Their pitch is that of the decoded frame, which is tightly packed. A compressed delta frame
+// codes the difference to the depth chunk before it, every so often a frame stands alone so
+// replay can recover from a damaged chunk.
+
+static const DWORD cRecordingMagic     = 0x44424752; // 'RGBD'
+static const DWORD cRecordingVersion   = 4;
+static const DWORD cRecordingAlignment = 4096;
+
+// Version 2 recorded skeletons smoothed by NuiTransformSmooth, later versions record
+// them as tracked and leave smoothing to the replay, just like a live sensor
+static const DWORD cRecordingMinVersion         = 2;
+static const DWORD cRecordingRawSkeletonVersion = 3;
+
+// the stream is in the low bits of a chunk type, flags above them
+static const DWORD cRecordingChunkTypeMask   = 0xff;
+static const DWORD cRecordingChunkCompressed = 0x100;
+
+enum RecordingChunkType
+{
+    RECORDING_CHUNK_DEPTH    = 1,
+    RECORDING_CHUNK_COLOR    = 2,
+    RECORDING_CHUNK_SKELETON = 3,
+};
+
+#pragma pack(push, 4)
+
+struct RecordingFileHeader
+{
+    DWORD                               magic;
+    DWORD                               version;
+    DWORD                               depthResolution;
+    DWORD                               colorResolution;
+    DWORD                               mappingParametersSize;
+    DWORD                               indexCount;
+    LONGLONG                            mappingParametersOffset;
+    LONGLONG                            indexOffset;
+};
+
+struct RecordingChunkHeader
+{
+    DWORD                               type;
+    DWORD                               size;
+    LONGLONG                            timeStamp;
+    DWORD                               frameNumber;
+    DWORD                               pitch;
+};
+
+struct RecordingIndexEntry
+{
+    LONGLONG                            offset;
+    RecordingChunkHeader                header;
+};
+
+#pragma pack(pop)
+
+/// <summary>
+/// File offset of the payload of a chunk whose header may start at or after position
+/// </summary>
+/// <param name="position">first free byte in the file</param>
+/// <returns>aligned payload offset, the chunk header sits just before it</returns>
+inline LONGLONG RecordingPayloadOffset(LONGLONG position)
+{
+    LONGLONG payload = position + sizeof(RecordingChunkHeader);
+    return (payload + cRecordingAlignment - 1) / cRecordingAlignment * cRecordingAlignment;
+}
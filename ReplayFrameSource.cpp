@@ -0,0 +1,578 @@
+﻿//------------------------------------------------------------------------------
+// <copyright file="ReplayFrameSource.cpp" company="Microsoft">
+//     Copyright (c) Microsoft Corporation.  All rights reserved.
+// </copyright>
+//------------------------------------------------------------------------------
+
+#include "ReplayFrameSource.h"
+#include "DX11Utils.h"
+#include "DepthCodec.h"
+#include "FrameProfiler.h"
+
+/// <summary>
+/// Constructor
+/// </summary>
+/// <param name="bRealTime">true to pace frames by their timestamps, false to deliver as fast as possible</param>
+/// <param name="bLoop">true to restart from the beginning once all streams are exhausted</param>
+CReplayFrameSource::CReplayFrameSource(bool bRealTime, bool bLoop) :
+    m_bRealTime(bRealTime),
+    m_bLoop(bLoop),
+    m_hFile(INVALID_HANDLE_VALUE),
+    m_hMapping(NULL),
+    m_fileSize(0),
+    m_pFileView(NULL),
+    m_version(0),
+    m_depthResolution(NUI_IMAGE_RESOLUTION_640x480),
+    m_colorResolution(NUI_IMAGE_RESOLUTION_640x480),
+    m_depthWidth(0),
+    m_depthHeight(0),
+    m_colorWidth(0),
+    m_colorHeight(0),
+    m_pMapper(NULL),
+    m_decodedIndex(0),
+    m_bDepthReference(false),
+    m_startQpc(0),
+    m_firstTimeStamp(0)
+{
+    InitializeCriticalSection(&m_lock);
+
+    for (int i = 0; i < cStreamCount; ++i)
+    {
+        m_streams[i].next = 0;
+        m_streams[i].pView = NULL;
+
+        // Manual reset timers stand in for the SDK's frame events
+        m_streams[i].hTimer = CreateWaitableTimerW(NULL, TRUE, NULL);
+    }
+
+    QueryPerformanceFrequency(&m_qpcFrequency);
+
+    SYSTEM_INFO systemInfo;
+    GetSystemInfo(&systemInfo);
+    m_allocationGranularity = systemInfo.dwAllocationGranularity;
+}
+
+/// <summary>
+/// Destructor
+/// </summary>
+CReplayFrameSource::~CReplayFrameSource()
+{
+    SAFE_RELEASE(m_pMapper);
+
+    for (int i = 0; i < cStreamCount; ++i)
+    {
+        CloseHandle(m_streams[i].hTimer);
+
+        if (NULL != m_streams[i].pView)
+        {
+            UnmapViewOfFile(m_streams[i].pView);
+        }
+    }
+
+    if (NULL != m_pFileView)
+    {
+        UnmapViewOfFile(m_pFileView);
+    }
+
+    if (NULL != m_hMapping)
+    {
+        CloseHandle(m_hMapping);
+    }
+
+    if (INVALID_HANDLE_VALUE != m_hFile)
+    {
+        CloseHandle(m_hFile);
+    }
+
+    DeleteCriticalSection(&m_lock);
+}
+
+/// <summary>
+/// Map a recording and load its index
+/// </summary>
+/// <param name="szFileName">path of the recording</param>
+/// <returns>S_OK on success, otherwise failure code</returns>
+HRESULT CReplayFrameSource::Open(LPCWSTR szFileName)
+{
+    m_hFile = CreateFileW(szFileName, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL | FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+    if (INVALID_HANDLE_VALUE == m_hFile)
+    {
+        return HRESULT_FROM_WIN32(GetLastError());
+    }
+
+    LARGE_INTEGER fileSize;
+    if (!GetFileSizeEx(m_hFile, &fileSize))
+    {
+        return HRESULT_FROM_WIN32(GetLastError());
+    }
+
+    m_fileSize = fileSize.QuadPart;
+    if (m_fileSize < static_cast<LONGLONG>(sizeof(RecordingFileHeader)))
+    {
+        return HRESULT_FROM_WIN32(ERROR_BAD_FORMAT);
+    }
+
+    m_hMapping = CreateFileMappingW(m_hFile, NULL, PAGE_READONLY, 0, 0, NULL);
+    if (NULL == m_hMapping)
+    {
+        return HRESULT_FROM_WIN32(GetLastError());
+    }
+
+    // With a 64 bit address space even very long sessions fit in a single view,
+    // otherwise each stream maps a window around its current frame
+    if (sizeof(void*) >= 8)
+    {
+        m_pFileView = static_cast<BYTE*>(MapViewOfFile(m_hMapping, FILE_MAP_READ, 0, 0, 0));
+        if (NULL == m_pFileView)
+        {
+            return HRESULT_FROM_WIN32(GetLastError());
+        }
+    }
+
+    RecordingFileHeader header;
+    memcpy(&header, MapRange(0, 0, sizeof(header)), sizeof(header));
+
+    if (header.magic != cRecordingMagic || header.version < cRecordingMinVersion || header.version > cRecordingVersion)
+    {
+        return HRESULT_FROM_WIN32(ERROR_BAD_FORMAT);
+    }
+
+    m_version = header.version;
+
+    m_depthResolution = static_cast<NUI_IMAGE_RESOLUTION>(header.depthResolution);
+    m_colorResolution = static_cast<NUI_IMAGE_RESOLUTION>(header.colorResolution);
+
+    DWORD width = 0;
+    DWORD height = 0;
+    NuiImageResolutionToSize(m_depthResolution, width, height);
+    m_depthWidth  = static_cast<LONG>(width);
+    m_depthHeight = static_cast<LONG>(height);
+
+    NuiImageResolutionToSize(m_colorResolution, width, height);
+    m_colorWidth  = static_cast<LONG>(width);
+    m_colorHeight = static_cast<LONG>(height);
+
+    if (header.mappingParametersSize > 0)
+    {
+        if (header.mappingParametersOffset + header.mappingParametersSize > m_fileSize)
+        {
+            return HRESULT_FROM_WIN32(ERROR_BAD_FORMAT);
+        }
+
+        const BYTE* pParameters = MapRange(0, header.mappingParametersOffset, header.mappingParametersSize);
+        if (NULL == pParameters)
+        {
+            return HRESULT_FROM_WIN32(GetLastError());
+        }
+
+        m_mappingParameters.assign(pParameters, pParameters + header.mappingParametersSize);
+
+        // Rebuild the sensor's depth to color registration without a sensor attached
+        if (SUCCEEDED(NuiCreateCoordinateMapperFromParameters(header.mappingParametersSize, &m_mappingParameters[0], &m_pMapper)))
+        {
+            m_depthPixels.resize(m_depthWidth * m_depthHeight);
+        }
+    }
+
+    HRESULT hr = LoadIndex(header);
+    if (FAILED(hr)) { return hr; }
+
+    if (NULL != m_streams[0].pView)
+    {
+        UnmapViewOfFile(m_streams[0].pView);
+        m_streams[0].pView = NULL;
+    }
+
+    if (m_streams[RECORDING_CHUNK_DEPTH].chunks.empty() || m_streams[RECORDING_CHUNK_COLOR].chunks.empty())
+    {
+        return HRESULT_FROM_WIN32(ERROR_BAD_FORMAT);
+    }
+
+    Rewind();
+
+    return S_OK;
+}
+
+/// <summary>
+/// Sort the recording's chunks into per stream lists
+/// Uses the index table, or walks the chunk headers if the recording was cut short
+/// </summary>
+/// <param name="header">file header of the recording</param>
+/// <returns>S_OK on success, otherwise failure code</returns>
+HRESULT CReplayFrameSource::LoadIndex(const RecordingFileHeader& header)
+{
+    // Frames that don't match the recorded resolutions are skipped rather than overrunning buffers
+    DWORD expectedSize[cStreamCount + 1] = { 0 };
+    expectedSize[RECORDING_CHUNK_DEPTH] = m_depthWidth * m_depthHeight * sizeof(USHORT);
+    expectedSize[RECORDING_CHUNK_COLOR] = m_colorWidth * m_colorHeight * 4;
+    expectedSize[RECORDING_CHUNK_SKELETON] = sizeof(NUI_SKELETON_FRAME);
+    expectedSize[cStreamCount] = MAXDWORD;
+
+    size_t depthPixelCount = m_depthWidth * m_depthHeight;
+    DWORD maxCompressedDepthSize = static_cast<DWORD>(DepthCodecMaxEncodedSize(depthPixelCount));
+    bool bCompressedDepth = false;
+
+    std::vector<RecordingIndexEntry> entries;
+
+    if (0 != header.indexOffset)
+    {
+        DWORD indexSize = header.indexCount * sizeof(RecordingIndexEntry);
+        if (header.indexOffset + indexSize > m_fileSize)
+        {
+            return HRESULT_FROM_WIN32(ERROR_BAD_FORMAT);
+        }
+
+        const RecordingIndexEntry* pIndex = reinterpret_cast<const RecordingIndexEntry*>(MapRange(0, header.indexOffset, indexSize));
+        if (NULL == pIndex)
+        {
+            return HRESULT_FROM_WIN32(GetLastError());
+        }
+
+        entries.assign(pIndex, pIndex + header.indexCount);
+    }
+    else
+    {
+        LONGLONG position = header.mappingParametersOffset + header.mappingParametersSize;
+        for (;;)
+        {
+            RecordingIndexEntry entry;
+            entry.offset = RecordingPayloadOffset(position);
+            if (entry.offset > m_fileSize)
+            {
+                break;
+            }
+
+            const BYTE* pHeader = MapRange(0, entry.offset - sizeof(entry.header), sizeof(entry.header));
+            if (NULL == pHeader)
+            {
+                break;
+            }
+
+            memcpy(&entry.header, pHeader, sizeof(entry.header));
+            if (entry.header.type == 0 || entry.offset + entry.header.size > m_fileSize)
+            {
+                break;
+            }
+
+            entries.push_back(entry);
+            position = entry.offset + entry.header.size;
+        }
+    }
+
+    bool haveTimeStamp = false;
+    for (size_t i = 0; i < entries.size(); ++i)
+    {
+        const RecordingIndexEntry& entry = entries[i];
+        DWORD type = min(entry.header.type & cRecordingChunkTypeMask, static_cast<DWORD>(cStreamCount));
+        bool bCompressed = 0 != (entry.header.type & cRecordingChunkCompressed);
+
+        if (0 == type || entry.offset + entry.header.size > m_fileSize)
+        {
+            continue;
+        }
+
+        // Only depth is ever compressed, to a size that varies from frame to frame
+        if (bCompressed ? (RECORDING_CHUNK_DEPTH != type || entry.header.size > maxCompressedDepthSize) : entry.header.size != expectedSize[type])
+        {
+            continue;
+        }
+
+        bCompressedDepth = bCompressedDepth || bCompressed;
+
+        m_streams[type].chunks.push_back(entry);
+
+        if (!haveTimeStamp || entry.header.timeStamp < m_firstTimeStamp)
+        {
+            m_firstTimeStamp = entry.header.timeStamp;
+            haveTimeStamp = true;
+        }
+    }
+
+    if (bCompressedDepth)
+    {
+        m_decodedDepth[0].resize(depthPixelCount);
+        m_decodedDepth[1].resize(depthPixelCount);
+    }
+
+    return S_OK;
+}
+
+/// <summary>
+/// Get a pointer to a range of the recording
+/// </summary>
+/// <param name="stream">stream whose view to use, replacing the view's previous range</param>
+/// <param name="offset">file offset of the range</param>
+/// <param name="size">size of the range</param>
+/// <returns>pointer to the range, or NULL on failure</returns>
+const BYTE* CReplayFrameSource::MapRange(int stream, LONGLONG offset, DWORD size)
+{
+    if (NULL != m_pFileView)
+    {
+        return m_pFileView + offset;
+    }
+
+    ReplayStream& s = m_streams[stream];
+    if (NULL != s.pView)
+    {
+        UnmapViewOfFile(s.pView);
+        s.pView = NULL;
+    }
+
+    // Views must start on an allocation granularity boundary
+    LONGLONG base = offset - offset % m_allocationGranularity;
+    SIZE_T viewSize = static_cast<SIZE_T>(offset - base) + size;
+
+    s.pView = MapViewOfFile(m_hMapping, FILE_MAP_READ, static_cast<DWORD>(base >> 32), static_cast<DWORD>(base), viewSize);
+    if (NULL == s.pView)
+    {
+        return NULL;
+    }
+
+    return static_cast<const BYTE*>(s.pView) + (offset - base);
+}
+
+/// <summary>
+/// Restart all streams and the playback clock
+/// </summary>
+void CReplayFrameSource::Rewind()
+{
+    LARGE_INTEGER now;
+    QueryPerformanceCounter(&now);
+    m_startQpc = now.QuadPart;
+
+    // the first depth chunk never refers to an earlier one
+    m_bDepthReference = false;
+
+    for (int i = 1; i < cStreamCount; ++i)
+    {
+        m_streams[i].next = 0;
+        Arm(i);
+    }
+}
+
+/// <summary>
+/// Set a stream's timer to fire when its next chunk is due
+/// </summary>
+/// <param name="stream">stream to arm</param>
+void CReplayFrameSource::Arm(int stream)
+{
+    ReplayStream& s = m_streams[stream];
+    LARGE_INTEGER dueTime;
+
+    if (s.next >= s.chunks.size())
+    {
+        // Nothing left, push the timer out of reach so the stream reads as idle
+        dueTime.QuadPart = -10000000LL * 60 * 60 * 24;
+    }
+    else if (m_bRealTime)
+    {
+        LARGE_INTEGER now;
+        QueryPerformanceCounter(&now);
+
+        LONGLONG dueQpc = m_startQpc + (s.chunks[s.next].header.timeStamp - m_firstTimeStamp) * m_qpcFrequency.QuadPart / 1000;
+        LONGLONG remaining = (dueQpc - now.QuadPart) * 10000000LL / m_qpcFrequency.QuadPart;
+
+        // Relative due times are negative, in 100ns units
+        dueTime.QuadPart = -max(remaining, 1LL);
+    }
+    else
+    {
+        dueTime.QuadPart = -1;
+    }
+
+    SetWaitableTimer(s.hTimer, &dueTime, 0, NULL, NULL, FALSE);
+}
+
+/// <summary>
+/// Hand out the next chunk of a stream, straight from the mapped file
+/// </summary>
+/// <param name="stream">stream to read</param>
+/// <param name="pImage">receives the frame data</param>
+/// <returns>S_OK on success, otherwise failure code</returns>
+HRESULT CReplayFrameSource::ReadChunk(int stream, FrameSourceImage* pImage)
+{
+    EnterCriticalSection(&m_lock);
+
+    ReplayStream& s = m_streams[stream];
+    if (s.next >= s.chunks.size())
+    {
+        LeaveCriticalSection(&m_lock);
+        return E_FAIL;
+    }
+
+    const RecordingIndexEntry& chunk = s.chunks[s.next];
+
+    const BYTE* pBits = MapRange(stream, chunk.offset, chunk.header.size);
+    if (NULL == pBits)
+    {
+        HRESULT hr = HRESULT_FROM_WIN32(GetLastError());
+        LeaveCriticalSection(&m_lock);
+        return hr;
+    }
+
+    // The view is read only, callers only ever read frame data
+    // A damaged compressed frame is still consumed, so playback moves on to the next key frame
+    // Only a frame in the whole file view outlives the next read, a decoded frame is overwritten
+    // two frames on and a stream's own view moves along with the stream
+    HRESULT hr = S_OK;
+    if (0 != (chunk.header.type & cRecordingChunkCompressed))
+    {
+        hr = DecodeDepth(pBits, chunk.header.size, pImage);
+        pImage->bRetained = false;
+    }
+    else
+    {
+        pImage->pBits = const_cast<BYTE*>(pBits);
+        pImage->size = chunk.header.size;
+        pImage->pitch = chunk.header.pitch;
+        pImage->bRetained = (NULL != m_pFileView);
+    }
+
+    pImage->timeStamp = chunk.header.timeStamp;
+    pImage->frameNumber = chunk.header.frameNumber;
+
+    ++s.next;
+
+    if (m_bLoop && IsEndOfStream())
+    {
+        Rewind();
+    }
+    else
+    {
+        Arm(stream);
+    }
+
+    LeaveCriticalSection(&m_lock);
+
+    return hr;
+}
+
+/// <summary>
+/// Decode a compressed depth chunk into the buffer not holding the previous frame
+/// </summary>
+/// <param name="pEncoded">chunk payload</param>
+/// <param name="size">payload size</param>
+/// <param name="pImage">receives the decoded frame</param>
+/// <returns>S_OK on success, ERROR_INVALID_DATA for a damaged frame or one whose reference is missing</returns>
+HRESULT CReplayFrameSource::DecodeDepth(const BYTE* pEncoded, DWORD size, FrameSourceImage* pImage)
+{
+    PROFILE_SCOPE("decode depth");
+
+    int next = 1 - m_decodedIndex;
+    std::vector<USHORT>& decoded = m_decodedDepth[next];
+    const USHORT* pReference = m_bDepthReference ? &m_decodedDepth[m_decodedIndex][0] : NULL;
+
+    if (!DecodeDepthSSE2(pEncoded, size, pReference, decoded.size(), &decoded[0]))
+    {
+        // delta frames up to the next key frame have nothing to refer to
+        m_bDepthReference = false;
+        return HRESULT_FROM_WIN32(ERROR_INVALID_DATA);
+    }
+
+    m_decodedIndex = next;
+    m_bDepthReference = true;
+
+    pImage->pBits = reinterpret_cast<BYTE*>(&decoded[0]);
+    pImage->size = static_cast<UINT>(decoded.size() * sizeof(USHORT));
+    pImage->pitch = static_cast<UINT>(m_depthWidth * sizeof(USHORT));
+
+    return S_OK;
+}
+
+HRESULT CReplayFrameSource::AcquireDepthFrame(FrameSourceImage* pImage)
+{
+    return ReadChunk(RECORDING_CHUNK_DEPTH, pImage);
+}
+
+HRESULT CReplayFrameSource::AcquireColorFrame(FrameSourceImage* pImage)
+{
+    return ReadChunk(RECORDING_CHUNK_COLOR, pImage);
+}
+
+HRESULT CReplayFrameSource::GetSkeletonFrame(NUI_SKELETON_FRAME* pFrame)
+{
+    // Skeletons are handed out as recorded, see HasRawSkeletons
+    FrameSourceImage image;
+    HRESULT hr = ReadChunk(RECORDING_CHUNK_SKELETON, &image);
+    if (FAILED(hr)) { return hr; }
+
+    if (image.size != sizeof(NUI_SKELETON_FRAME))
+    {
+        return HRESULT_FROM_WIN32(ERROR_BAD_FORMAT);
+    }
+
+    memcpy(pFrame, image.pBits, sizeof(NUI_SKELETON_FRAME));
+    return S_OK;
+}
+
+HRESULT CReplayFrameSource::MapDepthFrameToColorCoordinates(USHORT* pDepthD16, LONG* pColorCoordinates)
+{
+    LONG pixelCount = m_depthWidth * m_depthHeight;
+
+    if (NULL == m_pMapper)
+    {
+        // No calibration was recorded, assume the cameras are registered
+        for (LONG y = 0; y < m_depthHeight; ++y)
+        {
+            for (LONG x = 0; x < m_depthWidth; ++x)
+            {
+                *pColorCoordinates++ = x * m_colorWidth / m_depthWidth;
+                *pColorCoordinates++ = y * m_colorHeight / m_depthHeight;
+            }
+        }
+
+        return S_OK;
+    }
+
+    // The mapper wants unpacked depth
+    for (LONG i = 0; i < pixelCount; ++i)
+    {
+        m_depthPixels[i].playerIndex = NuiDepthPixelToPlayerIndex(pDepthD16[i]);
+        m_depthPixels[i].depth = NuiDepthPixelToDepth(pDepthD16[i]);
+    }
+
+    // NUI_COLOR_IMAGE_POINT is laid out as the x, y pair of LONGs we hand back
+    return m_pMapper->MapDepthFrameToColorFrame(
+        m_depthResolution,
+        pixelCount,
+        &m_depthPixels[0],
+        NUI_IMAGE_TYPE_COLOR,
+        m_colorResolution,
+        pixelCount,
+        reinterpret_cast<NUI_COLOR_IMAGE_POINT*>(pColorCoordinates));
+}
+
+HRESULT CReplayFrameSource::GetMappingParameters(ULONG* pByteCount, void** ppData)
+{
+    if (m_mappingParameters.empty())
+    {
+        return E_NOINTERFACE;
+    }
+
+    *pByteCount = static_cast<ULONG>(m_mappingParameters.size());
+    *ppData = &m_mappingParameters[0];
+    return S_OK;
+}
+
+/// <summary>
+/// Whether every stream has delivered its last chunk
+/// </summary>
+bool CReplayFrameSource::IsEndOfStream() const
+{
+    bool bEnd = true;
+
+    EnterCriticalSection(&m_lock);
+
+    for (int i = 1; i < cStreamCount; ++i)
+    {
+        if (m_streams[i].next < m_streams[i].chunks.size())
+        {
+            bEnd = false;
+            break;
+        }
+    }
+
+    LeaveCriticalSection(&m_lock);
+
+    return bEnd;
+}
@@ -0,0 +1,127 @@
+﻿//------------------------------------------------------------------------------
+// <copyright file="ReplayFrameSource.h" company="Microsoft">
+//     Copyright (c) Microsoft Corporation.  All rights reserved.
+// </copyright>
+//------------------------------------------------------------------------------
+
+#pragma once
+
+#include <vector>
+#include "FrameSource.h"
+#include "RecordingFormat.h"
+
+/// <summary>
+/// Frame source that plays back a file written by CFrameRecorder
+/// Frames are paced by their recorded timestamps, or delivered as fast as they are consumed
+/// The recording is memory mapped and frames are handed out as pointers into the mapping
+/// </summary>
+class CReplayFrameSource : public IFrameSource
+{
+public:
+    /// <summary>
+    /// Constructor
+    /// </summary>
+    /// <param name="bRealTime">true to pace frames by their timestamps, false to deliver as fast as possible</param>
+    /// <param name="bLoop">true to restart from the beginning once all streams are exhausted</param>
+    CReplayFrameSource(bool bRealTime, bool bLoop);
+
+    /// <summary>
+    /// Destructor
+    /// </summary>
+    ~CReplayFrameSource();
+
+    /// <summary>
+    /// Map a recording and load its index
+    /// </summary>
+    /// <param name="szFileName">path of the recording</param>
+    /// <returns>S_OK on success, otherwise failure code</returns>
+    HRESULT                             Open(LPCWSTR szFileName);
+
+    /// <summary>
+    /// Resolution of the recorded depth stream
+    /// </summary>
+    NUI_IMAGE_RESOLUTION                GetDepthResolution() const { return m_depthResolution; }
+
+    /// <summary>
+    /// Resolution of the recorded color stream
+    /// </summary>
+    NUI_IMAGE_RESOLUTION                GetColorResolution() const { return m_colorResolution; }
+
+    /// <summary>
+    /// Whether the skeletons were recorded before smoothing, older recordings hold smoothed ones
+    /// </summary>
+    bool                                HasRawSkeletons() const { return m_version >= cRecordingRawSkeletonVersion; }
+
+    HANDLE                              GetNextDepthFrameEvent() const { return m_streams[RECORDING_CHUNK_DEPTH].hTimer; }
+    HANDLE                              GetNextColorFrameEvent() const { return m_streams[RECORDING_CHUNK_COLOR].hTimer; }
+    HANDLE                              GetNextSkeletonEvent() const { return m_streams[RECORDING_CHUNK_SKELETON].hTimer; }
+
+    HRESULT                             AcquireDepthFrame(FrameSourceImage* pImage);
+    HRESULT                             ReleaseDepthFrame() { return S_OK; }
+    HRESULT                             AcquireColorFrame(FrameSourceImage* pImage);
+    HRESULT                             ReleaseColorFrame() { return S_OK; }
+    HRESULT                             GetSkeletonFrame(NUI_SKELETON_FRAME* pFrame);
+    HRESULT                             MapDepthFrameToColorCoordinates(USHORT* pDepthD16, LONG* pColorCoordinates);
+    HRESULT                             GetMappingParameters(ULONG* pByteCount, void** ppData);
+    HRESULT                             SetNearMode(bool bNearMode) { UNREFERENCED_PARAMETER(bNearMode); return E_NOTIMPL; }
+    bool                                IsEndOfStream() const;
+
+private:
+    static const int                    cStreamCount = RECORDING_CHUNK_SKELETON + 1;
+
+    struct ReplayStream
+    {
+        std::vector<RecordingIndexEntry> chunks;
+        size_t                          next;
+        HANDLE                          hTimer;
+
+        // view holding the stream's current frame when the file isn't mapped whole
+        void*                           pView;
+    };
+
+    bool                                m_bRealTime;
+    bool                                m_bLoop;
+    HANDLE                              m_hFile;
+    HANDLE                              m_hMapping;
+    LONGLONG                            m_fileSize;
+    DWORD                               m_allocationGranularity;
+
+    // view of the entire file, used when the address space is large enough
+    BYTE*                               m_pFileView;
+
+    DWORD                               m_version;
+    NUI_IMAGE_RESOLUTION                m_depthResolution;
+    NUI_IMAGE_RESOLUTION                m_colorResolution;
+    LONG                                m_depthWidth;
+    LONG                                m_depthHeight;
+    LONG                                m_colorWidth;
+    LONG                                m_colorHeight;
+
+    std::vector<BYTE>                   m_mappingParameters;
+    INuiCoordinateMapper*               m_pMapper;
+    std::vector<NUI_DEPTH_IMAGE_PIXEL>  m_depthPixels;
+
+    // compressed depth is decoded into one buffer while the other holds the previous frame,
+    // which delta frames refer to and callers may still be reading
+    std::vector<USHORT>                 m_decodedDepth[2];
+    int                                 m_decodedIndex;
+    bool                                m_bDepthReference;
+
+    // streams are addressed by chunk type, index 0 is used for reading the header and index
+    ReplayStream                        m_streams[cStreamCount];
+
+    // streams may be read from different threads, and rewinding touches all of them
+    mutable CRITICAL_SECTION            m_lock;
+
+    // playback clock
+    LARGE_INTEGER                       m_qpcFrequency;
+    LONGLONG                            m_startQpc;
+    LONGLONG                            m_firstTimeStamp;
+
+    const BYTE*                         MapRange(int stream, LONGLONG offset, DWORD size);
+    HRESULT                             LoadIndex(const RecordingFileHeader& header);
+    HRESULT                             ReadChunk(int stream, FrameSourceImage* pImage);
+    HRESULT                             DecodeDepth(const BYTE* pEncoded, DWORD size, FrameSourceImage* pImage);
+    void                                Rewind();
+    void                                Arm(int stream);
+};
@@ -0,0 +1,178 @@
+﻿//------------------------------------------------------------------------------
+// <copyright file="SensorCloud.cpp" company="Microsoft">
+//     Copyright (c) Microsoft Corporation.  All rights reserved.
+// </copyright>
+//------------------------------------------------------------------------------
+
+#include "SensorCloud.h"
+#include "DX11Utils.h"
+#include "FrameProfiler.h"
+
+/// <summary>
+/// Constructor
+/// </summary>
+/// <param name="pSource">frame source of the sensor, deleted with it</param>
+/// <param name="extrinsics">transform from this sensor's space into the primary sensor's</param>
+CSensorCloud::CSensorCloud(IFrameSource* pSource, const PointCloudTransform& extrinsics) :
+    m_pSource(pSource),
+    m_extrinsics(extrinsics),
+    m_depthWidth(0),
+    m_depthHeight(0),
+    m_colorWidth(0),
+    m_colorHeight(0),
+    m_bDepthReceived(false),
+    m_bColorReceived(false),
+    m_frameCount(0)
+{
+    QueryPerformanceFrequency(&m_qpcFrequency);
+}
+
+/// <summary>
+/// Destructor, stops the capture threads and deletes the frame source
+/// </summary>
+CSensorCloud::~CSensorCloud()
+{
+    // the capture threads use the source
+    m_capture.Stop();
+
+    SAFE_DELETE(m_pSource);
+}
+
+/// <summary>
+/// Create the textures the sensor's frames are uploaded to
+/// </summary>
+/// <param name="pDevice">device to create them on</param>
+/// <param name="depthWidth">width of the depth stream</param>
+/// <param name="depthHeight">height of the depth stream</param>
+/// <param name="colorWidth">width of the color stream, a whole multiple of the depth width</param>
+/// <param name="colorHeight">height of the color stream</param>
+/// <returns>S_OK for success, or failure code</returns>
+HRESULT CSensorCloud::CreateTextures(ID3D11Device* pDevice, LONG depthWidth, LONG depthHeight, LONG colorWidth, LONG colorHeight)
+{
+    m_depthWidth = depthWidth;
+    m_depthHeight = depthHeight;
+    m_colorWidth = colorWidth;
+    m_colorHeight = colorHeight;
+
+    return m_textures.Create(pDevice, depthWidth, depthHeight, colorWidth, colorHeight);
+}
+
+/// <summary>
+/// Start draining the frame source on capture threads, call after CreateTextures
+/// </summary>
+/// <param name="bLossless">true to deliver every frame, pacing the source to rendering, false to keep only the latest</param>
+/// <param name="hPublishEvent">event to signal when a frame arrives, or NULL</param>
+/// <returns>S_OK on success, otherwise failure code</returns>
+HRESULT CSensorCloud::StartCapture(bool bLossless, HANDLE hPublishEvent)
+{
+    m_capture.SetPublishEvent(hPublishEvent);
+
+    // skeletons are only tracked for the primary sensor, they are not smoothed here either
+    m_capture.SetSkeletonSmoothing(false);
+
+    return m_capture.Start(m_pSource, NULL, m_depthWidth, m_depthHeight, m_colorWidth, m_colorHeight, bLossless);
+}
+
+/// <summary>
+/// Pick up the newest frames and upload them once depth and color pair up
+/// </summary>
+/// <param name="pContext">context to upload with</param>
+/// <param name="pfnMap">color to depth remap implementation</param>
+/// <param name="pPool">threads for the per-pixel work</param>
+/// <returns>true if a new frame pair was uploaded</returns>
+bool CSensorCloud::Update(ID3D11DeviceContext* pContext, MapColorToDepthFunc pfnMap, CWorkerPool* pPool)
+{
+    PROFILE_SCOPE("update sensor");
+
+    bool bNewDepth = m_capture.AcquireDepth();
+    bool bNewColor = m_capture.AcquireColor();
+
+    // taken only so lossless capture of a replay does not stall on them
+    m_capture.AcquireSkeleton();
+
+    m_bDepthReceived = m_bDepthReceived || bNewDepth;
+    m_bColorReceived = m_bColorReceived || bNewColor;
+    if (!m_bDepthReceived || !m_bColorReceived)
+    {
+        return false;
+    }
+
+    const CFrameCapture::DepthFrame& depth = m_capture.GetDepth();
+    const CFrameCapture::ColorFrame& color = m_capture.GetColor();
+
+    LARGE_INTEGER now;
+    QueryPerformanceCounter(&now);
+
+    // each sensor pairs its own frames, the sensors' clocks are not related
+    if (FRAME_SYNC_PAIRED != m_synchronizer.Update(bNewDepth, depth.timeStamp, bNewColor, color.timeStamp, now.QuadPart * 1000 / m_qpcFrequency.QuadPart))
+    {
+        return false;
+    }
+
+    const USHORT* pDepth = depth.depth.Get<USHORT>();
+    m_textures.UploadDepth(pContext, pDepth);
+    m_textures.UploadPointIndices(pContext, pDepth, pPool);
+
+    // the sensor's LONG coordinates are 32 bit, which the remap kernels rely on
+    C_ASSERT(sizeof(LONG) == sizeof(int32_t));
+
+    ColorMappingDesc desc;
+    desc.pColorCoordinates = reinterpret_cast<const int32_t*>(depth.colorCoordinates.Get<LONG>());
+    desc.pColor = color.color.GetData();
+    desc.colorWidth = m_colorWidth;
+    desc.colorHeight = m_colorHeight;
+    desc.depthWidth = m_depthWidth;
+    desc.colorToDepthDivisor = m_colorWidth / m_depthWidth;
+    m_textures.UploadColor(pContext, desc, pfnMap, pPool);
+
+    ++m_frameCount;
+
+    return true;
+}
+
+/// <summary>
+/// Read the extrinsic calibration of the additional sensors
+/// </summary>
+/// <param name="pFile">file to read from</param>
+/// <param name="pExtrinsics">receives a transform per sensor</param>
+/// <returns>true if every other line was a transform</returns>
+bool ReadSensorExtrinsics(FILE* pFile, std::vector<PointCloudTransform>* pExtrinsics)
+{
+    pExtrinsics->clear();
+
+    char line[512];
+    while (fgets(line, sizeof(line), pFile))
+    {
+        char first = 0;
+        if (1 != sscanf_s(line, " %c", &first, 1) || '#' == first)
+        {
+            continue;
+        }
+
+        float r[3][4];
+        if (12 != sscanf_s(line, "%f %f %f %f %f %f %f %f %f %f %f %f",
+            &r[0][0], &r[0][1], &r[0][2], &r[0][3],
+            &r[1][0], &r[1][1], &r[1][2], &r[1][3],
+            &r[2][0], &r[2][1], &r[2][2], &r[2][3]))
+        {
+            return false;
+        }
+
+        // points are row vectors on the way to the shader, so the rotation is transposed
+        // and the translation becomes the last row
+        PointCloudTransform transform;
+        SetIdentityTransform(&transform);
+        for (int row = 0; row < 3; ++row)
+        {
+            for (int column = 0; column < 3; ++column)
+            {
+                transform.m[column][row] = r[row][column];
+            }
+            transform.m[3][row] = r[row][3];
+        }
+
+        pExtrinsics->push_back(transform);
+    }
+
+    return true;
+}
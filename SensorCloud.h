@@ -0,0 +1,149 @@
+﻿//------------------------------------------------------------------------------
+// <copyright file="SensorCloud.h" company="Microsoft">
+//     Copyright (c) Microsoft Corporation.  All rights reserved.
+// </copyright>
+//------------------------------------------------------------------------------
+
+#pragma once
+
+#include <windows.h>
+#include <stdio.h>
+#include <vector>
+#include <d3d11.h>
+#include "ColorMapping.h"
+#include "FrameCapture.h"
+#include "FrameSource.h"
+#include "FrameSynchronizer.h"
+#include "PointCloud.h"
+#include "SensorTextures.h"
+#include "WorkerPool.h"
+
+/// <summary>
+/// A sensor besides the primary one, drawn into the same scene
+/// It has capture threads, frame pairing and textures of its own, so another sensor adds capture
+/// threads rather than waits on the render thread. Its points are moved into the primary sensor's
+/// space by its extrinsic calibration, which is where the clouds merge. Face tracking, recording
+/// and publishing stay with the primary sensor.
+/// </summary>
+class CSensorCloud
+{
+public:
+    /// <summary>
+    /// Constructor
+    /// </summary>
+    /// <param name="pSource">frame source of the sensor, deleted with it</param>
+    /// <param name="extrinsics">transform from this sensor's space into the primary sensor's</param>
+    CSensorCloud(IFrameSource* pSource, const PointCloudTransform& extrinsics);
+
+    /// <summary>
+    /// Destructor, stops the capture threads and deletes the frame source
+    /// </summary>
+    ~CSensorCloud();
+
+    /// <summary>
+    /// Set how depth and color frames are paired, as for the primary sensor
+    /// </summary>
+    /// <param name="policy">what to do with frames further apart than the tolerance</param>
+    /// <param name="toleranceMs">largest timestamp difference of frames that belong together</param>
+    /// <param name="maxWaitMs">how long the wait policy holds mismatched frames</param>
+    void                                ConfigureSync(FrameSyncPolicy policy, int toleranceMs, int maxWaitMs) { m_synchronizer.Configure(policy, toleranceMs, maxWaitMs); }
+
+    /// <summary>
+    /// Create the textures the sensor's frames are uploaded to
+    /// </summary>
+    /// <param name="pDevice">device to create them on</param>
+    /// <param name="depthWidth">width of the depth stream</param>
+    /// <param name="depthHeight">height of the depth stream</param>
+    /// <param name="colorWidth">width of the color stream, a whole multiple of the depth width</param>
+    /// <param name="colorHeight">height of the color stream</param>
+    /// <returns>S_OK for success, or failure code</returns>
+    HRESULT                             CreateTextures(ID3D11Device* pDevice, LONG depthWidth, LONG depthHeight, LONG colorWidth, LONG colorHeight);
+
+    /// <summary>
+    /// Start draining the frame source on capture threads, call after CreateTextures
+    /// </summary>
+    /// <param name="bLossless">true to deliver every frame, pacing the source to rendering, false to keep only the latest</param>
+    /// <param name="hPublishEvent">event to signal when a frame arrives, or NULL</param>
+    /// <returns>S_OK on success, otherwise failure code</returns>
+    HRESULT                             StartCapture(bool bLossless, HANDLE hPublishEvent);
+
+    /// <summary>
+    /// Stop the capture threads, no new frames arrive afterwards
+    /// </summary>
+    void                                StopCapture() { m_capture.Stop(); }
+
+    /// <summary>
+    /// Switch the sensor between near and default range
+    /// </summary>
+    /// <param name="bNearMode">true for near mode</param>
+    /// <returns>S_OK for success, or failure code</returns>
+    HRESULT                             SetNearMode(bool bNearMode) { return m_pSource->SetNearMode(bNearMode); }
+
+    /// <summary>
+    /// Pick up the newest frames and upload them once depth and color pair up
+    /// </summary>
+    /// <param name="pContext">context to upload with</param>
+    /// <param name="pfnMap">color to depth remap implementation</param>
+    /// <param name="pPool">threads for the per-pixel work</param>
+    /// <returns>true if a new frame pair was uploaded</returns>
+    bool                                Update(ID3D11DeviceContext* pContext, MapColorToDepthFunc pfnMap, CWorkerPool* pPool);
+
+    /// <summary>
+    /// Textures of the newest uploaded frame pair, to bind for a draw
+    /// </summary>
+    const CSensorTextures&              GetTextures() const { return m_textures; }
+
+    /// <summary>
+    /// Transform from this sensor's space into the primary sensor's
+    /// </summary>
+    const PointCloudTransform&          GetExtrinsics() const { return m_extrinsics; }
+
+    /// <summary>
+    /// Whether the frame source has delivered its last frame and it was picked up
+    /// </summary>
+    bool                                IsEndOfStream() const { return m_pSource->IsEndOfStream() && m_capture.IsDrained(); }
+
+    /// <summary>
+    /// Frame pairs uploaded so far
+    /// </summary>
+    UINT                                GetFrameCount() const { return m_frameCount; }
+
+    /// <summary>
+    /// Depth and color pairing statistics
+    /// </summary>
+    const FrameSyncStats&               GetSyncStats() const { return m_synchronizer.GetStats(); }
+
+private:
+    IFrameSource*                       m_pSource;
+    PointCloudTransform                 m_extrinsics;
+
+    LONG                                m_depthWidth;
+    LONG                                m_depthHeight;
+    LONG                                m_colorWidth;
+    LONG                                m_colorHeight;
+
+    CFrameCapture                       m_capture;
+    CFrameSynchronizer                  m_synchronizer;
+    LARGE_INTEGER                       m_qpcFrequency;
+    bool                                m_bDepthReceived;
+    bool                                m_bColorReceived;
+    UINT                                m_frameCount;
+
+    CSensorTextures                     m_textures;
+
+    // not copyable
+    CSensorCloud(const CSensorCloud&);
+    CSensorCloud& operator=(const CSensorCloud&);
+};
+
+/// <summary>
+/// Read the extrinsic calibration of the additional sensors
+/// One line per sensor in the order they are added, of twelve numbers: the rows of the 3x4 matrix
+/// [R | t] that takes a point p of the sensor to R p + t in the primary sensor's space. Both spaces
+/// are the ones the clouds are drawn in, meters with y up and z away from the sensor. Empty lines
+/// and lines starting with # are skipped.
+/// </summary>
+/// <param name="pFile">file to read from</param>
+/// <param name="pExtrinsics">receives a transform per sensor</param>
+/// <returns>true if every other line was a transform</returns>
+bool ReadSensorExtrinsics(FILE* pFile, std::vector<PointCloudTransform>* pExtrinsics);
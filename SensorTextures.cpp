@@ -0,0 +1,248 @@
+﻿//------------------------------------------------------------------------------
+// <copyright file="SensorTextures.cpp" company="Microsoft">
+//     Copyright (c) Microsoft Corporation.  All rights reserved.
+// </copyright>
+//------------------------------------------------------------------------------
+
+#include "SensorTextures.h"
+#include "DX11Utils.h"
+#include "FrameProfiler.h"
+#include "FrameSource.h"
+#include "PointCloud.h"
+
+namespace
+{
+    // Fewer rows than this aren't worth waking another thread for
+    const int cMinRowsPerBand = 16;
+
+    /// <summary>
+    /// Arguments of BuildPointIndexBand
+    /// </summary>
+    struct PointIndexBands
+    {
+        const USHORT*                   pDepth;
+        int                             depthWidth;
+
+        // each row is compacted in place, at the start of its own slice
+        UINT*                           pIndices;
+        UINT*                           pRowCounts;
+    };
+
+    /// <summary>
+    /// Collect the valid pixels of one band of rows, called from the worker pool
+    /// </summary>
+    /// <param name="pContext">PointIndexBands describing the frame</param>
+    /// <param name="rowBegin">first row of the band</param>
+    /// <param name="rowEnd">one past the last row of the band</param>
+    void BuildPointIndexBand(void* pContext, int rowBegin, int rowEnd)
+    {
+        const PointIndexBands* pBands = static_cast<const PointIndexBands*>(pContext);
+
+        for (int y = rowBegin; y < rowEnd; ++y)
+        {
+            pBands->pRowCounts[y] = BuildPointIndices(pBands->pDepth, pBands->depthWidth, y, y + 1, pBands->pIndices + y * pBands->depthWidth);
+        }
+    }
+}
+
+/// <summary>
+/// Constructor
+/// </summary>
+CSensorTextures::CSensorTextures() :
+    m_depthWidth(0),
+    m_depthHeight(0),
+    m_colorHeight(0),
+    m_pDepthTexture2D(NULL),
+    m_pDepthTextureRV(NULL),
+    m_pColorTexture2D(NULL),
+    m_pColorTextureRV(NULL),
+    m_pPointIndexBuffer(NULL),
+    m_pPointIndexRV(NULL),
+    m_pointCount(0)
+{
+}
+
+/// <summary>
+/// Destructor, releases the textures
+/// </summary>
+CSensorTextures::~CSensorTextures()
+{
+    SAFE_RELEASE(m_pDepthTexture2D);
+    SAFE_RELEASE(m_pDepthTextureRV);
+    SAFE_RELEASE(m_pColorTexture2D);
+    SAFE_RELEASE(m_pColorTextureRV);
+    SAFE_RELEASE(m_pPointIndexBuffer);
+    SAFE_RELEASE(m_pPointIndexRV);
+}
+
+/// <summary>
+/// Create the textures and the point index buffer for the stream resolutions
+/// </summary>
+/// <param name="pDevice">device to create them on</param>
+/// <param name="depthWidth">width of the depth stream</param>
+/// <param name="depthHeight">height of the depth stream</param>
+/// <param name="colorWidth">width of the color stream</param>
+/// <param name="colorHeight">height of the color stream</param>
+/// <returns>S_OK for success, or failure code</returns>
+HRESULT CSensorTextures::Create(ID3D11Device* pDevice, LONG depthWidth, LONG depthHeight, LONG colorWidth, LONG colorHeight)
+{
+    m_depthWidth = depthWidth;
+    m_depthHeight = depthHeight;
+    m_colorHeight = colorHeight;
+
+    // Create depth texture
+    D3D11_TEXTURE2D_DESC depthTexDesc = {0};
+    depthTexDesc.Width = depthWidth;
+    depthTexDesc.Height = depthHeight;
+    depthTexDesc.MipLevels = 1;
+    depthTexDesc.ArraySize = 1;
+    depthTexDesc.Format = DXGI_FORMAT_R16_SINT;
+    depthTexDesc.SampleDesc.Count = 1;
+    depthTexDesc.SampleDesc.Quality = 0;
+    depthTexDesc.Usage = D3D11_USAGE_DYNAMIC;
+    depthTexDesc.BindFlags = D3D11_BIND_SHADER_RESOURCE;
+    depthTexDesc.CPUAccessFlags = D3D11_CPU_ACCESS_WRITE;
+    depthTexDesc.MiscFlags = 0;
+
+    HRESULT hr = pDevice->CreateTexture2D(&depthTexDesc, NULL, &m_pDepthTexture2D);
+    if ( FAILED(hr) ) { return hr; }
+
+    hr = pDevice->CreateShaderResourceView(m_pDepthTexture2D, NULL, &m_pDepthTextureRV);
+    if ( FAILED(hr) ) { return hr; }
+
+    // Create color texture
+    D3D11_TEXTURE2D_DESC colorTexDesc = {0};
+    colorTexDesc.Width = colorWidth;
+    colorTexDesc.Height = colorHeight;
+    colorTexDesc.MipLevels = 1;
+    colorTexDesc.ArraySize = 1;
+    colorTexDesc.Format = DXGI_FORMAT_B8G8R8A8_UNORM;
+    colorTexDesc.SampleDesc.Count = 1;
+    colorTexDesc.SampleDesc.Quality = 0;
+    colorTexDesc.Usage = D3D11_USAGE_DYNAMIC;
+    colorTexDesc.BindFlags = D3D11_BIND_SHADER_RESOURCE;
+    colorTexDesc.CPUAccessFlags = D3D11_CPU_ACCESS_WRITE;
+    colorTexDesc.MiscFlags = 0;
+
+    hr = pDevice->CreateTexture2D(&colorTexDesc, NULL, &m_pColorTexture2D);
+    if ( FAILED(hr) ) { return hr; }
+
+    hr = pDevice->CreateShaderResourceView(m_pColorTexture2D, NULL, &m_pColorTextureRV);
+    if ( FAILED(hr) ) { return hr; }
+
+    // Create the list of depth pixels to draw, one primitive each
+    UINT depthPixels = depthWidth * depthHeight;
+    m_pointIndices.resize(depthPixels);
+    m_pointRowCounts.resize(depthHeight);
+
+    D3D11_BUFFER_DESC indexDesc = {0};
+    indexDesc.ByteWidth = depthPixels * sizeof(UINT);
+    indexDesc.Usage = D3D11_USAGE_DYNAMIC;
+    indexDesc.BindFlags = D3D11_BIND_SHADER_RESOURCE;
+    indexDesc.CPUAccessFlags = D3D11_CPU_ACCESS_WRITE;
+
+    hr = pDevice->CreateBuffer(&indexDesc, NULL, &m_pPointIndexBuffer);
+    if ( FAILED(hr) ) { return hr; }
+
+    D3D11_SHADER_RESOURCE_VIEW_DESC indexViewDesc;
+    ZeroMemory(&indexViewDesc, sizeof(indexViewDesc));
+    indexViewDesc.Format = DXGI_FORMAT_R32_UINT;
+    indexViewDesc.ViewDimension = D3D11_SRV_DIMENSION_BUFFER;
+    indexViewDesc.Buffer.FirstElement = 0;
+    indexViewDesc.Buffer.NumElements = depthPixels;
+
+    return pDevice->CreateShaderResourceView(m_pPointIndexBuffer, &indexViewDesc, &m_pPointIndexRV);
+}
+
+/// <summary>
+/// Copy a depth frame to the depth texture
+/// </summary>
+/// <param name="pContext">context to map the texture with</param>
+/// <param name="pDepth">tightly packed depth frame</param>
+/// <returns>S_OK for success, or failure code</returns>
+HRESULT CSensorTextures::UploadDepth(ID3D11DeviceContext* pContext, const USHORT* pDepth)
+{
+    PROFILE_SCOPE("upload depth");
+
+    // copy to our d3d 11 depth texture, whose rows may be padded
+    D3D11_MAPPED_SUBRESOURCE msT;
+    HRESULT hr = pContext->Map(m_pDepthTexture2D, NULL, D3D11_MAP_WRITE_DISCARD, NULL, &msT);
+    if ( FAILED(hr) ) { return hr; }
+
+    UINT rowBytes = m_depthWidth * sizeof(USHORT);
+    CopyImageRows(msT.pData, msT.RowPitch, pDepth, rowBytes, rowBytes, m_depthHeight);
+    pContext->Unmap(m_pDepthTexture2D, NULL);
+
+    return hr;
+}
+
+/// <summary>
+/// Upload the indices of the depth pixels worth drawing, so draws scale with the scene instead of the sensor
+/// </summary>
+/// <param name="pContext">context to map the buffer with</param>
+/// <param name="pDepth">tightly packed depth frame</param>
+/// <param name="pPool">threads to scan the rows with</param>
+/// <returns>S_OK for success, or failure code</returns>
+HRESULT CSensorTextures::UploadPointIndices(ID3D11DeviceContext* pContext, const USHORT* pDepth, CWorkerPool* pPool)
+{
+    PROFILE_SCOPE("upload point indices");
+
+    PointIndexBands bands;
+    bands.pDepth = pDepth;
+    bands.depthWidth = m_depthWidth;
+    bands.pIndices = &m_pointIndices[0];
+    bands.pRowCounts = &m_pointRowCounts[0];
+
+    pPool->ParallelFor(0, m_depthHeight, cMinRowsPerBand, BuildPointIndexBand, &bands);
+
+    D3D11_MAPPED_SUBRESOURCE msT;
+    HRESULT hr = pContext->Map(m_pPointIndexBuffer, NULL, D3D11_MAP_WRITE_DISCARD, NULL, &msT);
+    if ( FAILED(hr) ) { return hr; }
+
+    // stitch the rows together, the mapped buffer is only ever written front to back
+    UINT* pDest = static_cast<UINT*>(msT.pData);
+    UINT pointCount = 0;
+    for (LONG y = 0; y < m_depthHeight; ++y)
+    {
+        memcpy(pDest + pointCount, &m_pointIndices[y * m_depthWidth], m_pointRowCounts[y] * sizeof(UINT));
+        pointCount += m_pointRowCounts[y];
+    }
+
+    pContext->Unmap(m_pPointIndexBuffer, NULL);
+
+    m_pointCount = pointCount;
+
+    return hr;
+}
+
+/// <summary>
+/// Remap a color frame to depth space straight into the color texture
+/// </summary>
+/// <param name="pContext">context to map the texture with</param>
+/// <param name="desc">the remap of the frame</param>
+/// <param name="pfnMap">remap implementation</param>
+/// <param name="pPool">threads to remap with</param>
+/// <returns>S_OK for success, or failure code</returns>
+HRESULT CSensorTextures::UploadColor(ID3D11DeviceContext* pContext, const ColorMappingDesc& desc, MapColorToDepthFunc pfnMap, CWorkerPool* pPool)
+{
+    D3D11_MAPPED_SUBRESOURCE msT;
+    HRESULT hr = pContext->Map(m_pColorTexture2D, NULL, D3D11_MAP_WRITE_DISCARD, NULL, &msT);
+    if ( FAILED(hr) ) { return hr; }
+
+    // each band of rows goes straight into the mapped texture
+    MapColorToDepthParallel(desc, pfnMap, static_cast<BYTE*>(msT.pData), msT.RowPitch, pPool);
+
+    pContext->Unmap(m_pColorTexture2D, NULL);
+
+    return hr;
+}
+
+/// <summary>
+/// Bind the depth texture, color texture and point indices to geometry shader slots t0 to t2
+/// </summary>
+/// <param name="pContext">context to bind them on</param>
+void CSensorTextures::Bind(ID3D11DeviceContext* pContext) const
+{
+    ID3D11ShaderResourceView* views[3] = { m_pDepthTextureRV, m_pColorTextureRV, m_pPointIndexRV };
+    pContext->GSSetShaderResources(0, _countof(views), views);
+}
@@ -0,0 +1,102 @@
+﻿//------------------------------------------------------------------------------
+// <copyright file="SensorTextures.h" company="Microsoft">
+//     Copyright (c) Microsoft Corporation.  All rights reserved.
+// </copyright>
+//------------------------------------------------------------------------------
+
+#pragma once
+
+#include <windows.h>
+#include <d3d11.h>
+#include <vector>
+#include "ColorMapping.h"
+#include "WorkerPool.h"
+
+/// <summary>
+/// What the geometry shader draws one sensor's point cloud from: the depth frame, the color frame
+/// remapped to depth space, and the list of depth pixels worth drawing
+/// Every sensor has its own, so the frames of one can be uploaded while another's are drawn.
+/// </summary>
+class CSensorTextures
+{
+public:
+    /// <summary>
+    /// Constructor
+    /// </summary>
+    CSensorTextures();
+
+    /// <summary>
+    /// Destructor, releases the textures
+    /// </summary>
+    ~CSensorTextures();
+
+    /// <summary>
+    /// Create the textures and the point index buffer for the stream resolutions
+    /// </summary>
+    /// <param name="pDevice">device to create them on</param>
+    /// <param name="depthWidth">width of the depth stream</param>
+    /// <param name="depthHeight">height of the depth stream</param>
+    /// <param name="colorWidth">width of the color stream</param>
+    /// <param name="colorHeight">height of the color stream</param>
+    /// <returns>S_OK for success, or failure code</returns>
+    HRESULT                             Create(ID3D11Device* pDevice, LONG depthWidth, LONG depthHeight, LONG colorWidth, LONG colorHeight);
+
+    /// <summary>
+    /// Copy a depth frame to the depth texture
+    /// </summary>
+    /// <param name="pContext">context to map the texture with</param>
+    /// <param name="pDepth">tightly packed depth frame</param>
+    /// <returns>S_OK for success, or failure code</returns>
+    HRESULT                             UploadDepth(ID3D11DeviceContext* pContext, const USHORT* pDepth);
+
+    /// <summary>
+    /// Upload the indices of the depth pixels worth drawing, so draws scale with the scene instead of the sensor
+    /// </summary>
+    /// <param name="pContext">context to map the buffer with</param>
+    /// <param name="pDepth">tightly packed depth frame</param>
+    /// <param name="pPool">threads to scan the rows with</param>
+    /// <returns>S_OK for success, or failure code</returns>
+    HRESULT                             UploadPointIndices(ID3D11DeviceContext* pContext, const USHORT* pDepth, CWorkerPool* pPool);
+
+    /// <summary>
+    /// Remap a color frame to depth space straight into the color texture
+    /// </summary>
+    /// <param name="pContext">context to map the texture with</param>
+    /// <param name="desc">the remap of the frame</param>
+    /// <param name="pfnMap">remap implementation</param>
+    /// <param name="pPool">threads to remap with</param>
+    /// <returns>S_OK for success, or failure code</returns>
+    HRESULT                             UploadColor(ID3D11DeviceContext* pContext, const ColorMappingDesc& desc, MapColorToDepthFunc pfnMap, CWorkerPool* pPool);
+
+    /// <summary>
+    /// Bind the depth texture, color texture and point indices to geometry shader slots t0 to t2
+    /// </summary>
+    /// <param name="pContext">context to bind them on</param>
+    void                                Bind(ID3D11DeviceContext* pContext) const;
+
+    /// <summary>
+    /// Number of points the last uploaded indices name, the primitive count to draw
+    /// </summary>
+    UINT                                GetPointCount() const { return m_pointCount; }
+
+private:
+    LONG                                m_depthWidth;
+    LONG                                m_depthHeight;
+    LONG                                m_colorHeight;
+
+    ID3D11Texture2D*                    m_pDepthTexture2D;
+    ID3D11ShaderResourceView*           m_pDepthTextureRV;
+    ID3D11Texture2D*                    m_pColorTexture2D;
+    ID3D11ShaderResourceView*           m_pColorTextureRV;
+
+    // indices of the depth pixels inside the valid range, one primitive is drawn per index
+    ID3D11Buffer*                       m_pPointIndexBuffer;
+    ID3D11ShaderResourceView*           m_pPointIndexRV;
+    std::vector<UINT>                   m_pointIndices;
+    std::vector<UINT>                   m_pointRowCounts;
+    UINT                                m_pointCount;
+
+    // not copyable
+    CSensorTextures(const CSensorTextures&);
+    CSensorTextures& operator=(const CSensorTextures&);
+};
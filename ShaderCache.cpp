@@ -0,0 +1,280 @@
+﻿//------------------------------------------------------------------------------
+// <copyright file="ShaderCache.cpp" company="Microsoft">
+//     Copyright (c) Microsoft Corporation.  All rights reserved.
+// </copyright>
+//------------------------------------------------------------------------------
+
+#include "ShaderCache.h"
+#include "DX11Utils.h"
+#include <d3dcompiler.h>
+#include <stdio.h>
+
+namespace
+{
+    const ULONGLONG cFnvOffsetBasis = 14695981039346656037ULL;
+    const ULONGLONG cFnvPrime = 1099511628211ULL;
+
+    /// <summary>
+    /// Continue a 64 bit FNV-1a hash over a run of bytes
+    /// </summary>
+    ULONGLONG HashBytes(ULONGLONG hash, const void* pData, size_t size)
+    {
+        const BYTE* pBytes = static_cast<const BYTE*>(pData);
+        for (size_t i = 0; i < size; ++i)
+        {
+            hash = (hash ^ pBytes[i]) * cFnvPrime;
+        }
+
+        return hash;
+    }
+
+    /// <summary>
+    /// Continue a hash over a string, including its terminator so "ab","c" and "a","bc" differ
+    /// </summary>
+    ULONGLONG HashString(ULONGLONG hash, LPCSTR sz)
+    {
+        return HashBytes(hash, sz, strlen(sz) + 1);
+    }
+
+    double ElapsedMs(const LARGE_INTEGER& start)
+    {
+        LARGE_INTEGER now, frequency;
+        QueryPerformanceCounter(&now);
+        QueryPerformanceFrequency(&frequency);
+        return static_cast<double>(now.QuadPart - start.QuadPart) * 1000.0 / frequency.QuadPart;
+    }
+}
+
+/// <summary>
+/// Constructor
+/// </summary>
+CShaderCache::CShaderCache() :
+    m_compileFlags(0),
+    m_sourceHash(cFnvOffsetBasis)
+{
+    ZeroMemory(&m_stats, sizeof(m_stats));
+}
+
+/// <summary>
+/// Read the shader source and hash it
+/// </summary>
+/// <param name="szSourceFile">shader source file</param>
+/// <param name="szCacheDirectory">directory holding the .cso files, created on the first miss</param>
+/// <param name="compileFlags">D3DCOMPILE flags used on a miss</param>
+/// <returns>S_OK on success, otherwise failure code</returns>
+HRESULT CShaderCache::Open(LPCWSTR szSourceFile, LPCWSTR szCacheDirectory, UINT compileFlags)
+{
+    m_sourceFile = szSourceFile;
+    m_cacheDirectory = szCacheDirectory;
+    m_compileFlags = compileFlags;
+    m_source.clear();
+    ZeroMemory(&m_stats, sizeof(m_stats));
+
+    FILE* pFile = NULL;
+    if (0 != _wfopen_s(&pFile, szSourceFile, L"rb"))
+    {
+        return HRESULT_FROM_WIN32(ERROR_FILE_NOT_FOUND);
+    }
+
+    char buffer[4096];
+    size_t read = 0;
+    while ((read = fread(buffer, 1, sizeof(buffer), pFile)) > 0)
+    {
+        m_source.append(buffer, read);
+    }
+
+    bool bError = 0 != ferror(pFile);
+    fclose(pFile);
+    if (bError)
+    {
+        return HRESULT_FROM_WIN32(ERROR_READ_FAULT);
+    }
+
+    // a newer compiler or different flags produce different bytecode from the same source
+    UINT compilerVersion = D3D_COMPILER_VERSION;
+    m_sourceHash = HashBytes(cFnvOffsetBasis, m_source.data(), m_source.size());
+    m_sourceHash = HashBytes(m_sourceHash, &compilerVersion, sizeof(compilerVersion));
+    m_sourceHash = HashBytes(m_sourceHash, &m_compileFlags, sizeof(m_compileFlags));
+
+    return S_OK;
+}
+
+/// <summary>
+/// Get the bytecode of an entry point, from the cache if it holds a current copy, otherwise
+/// compiled and written to the cache. Failing to write the cache does not fail the load.
+/// </summary>
+/// <param name="szEntryPoint">entry point of shader</param>
+/// <param name="szShaderModel">shader model to compile for</param>
+/// <param name="ppBlob">receives the bytecode</param>
+/// <returns>S_OK for success, or failure code</returns>
+HRESULT CShaderCache::Load(LPCSTR szEntryPoint, LPCSTR szShaderModel, ID3D10Blob** ppBlob)
+{
+    LARGE_INTEGER start;
+    QueryPerformanceCounter(&start);
+
+    ULONGLONG hash = HashString(HashString(m_sourceHash, szEntryPoint), szShaderModel);
+
+    WCHAR fileName[MAX_PATH];
+    swprintf_s(fileName, L"\\%hs.%hs.%016llx.cso", szEntryPoint, szShaderModel, hash);
+    std::wstring path = m_cacheDirectory + fileName;
+
+    WCHAR message[256];
+    HRESULT hr = Read(path, ppBlob);
+    if (SUCCEEDED(hr))
+    {
+        ++m_stats.hitCount;
+        swprintf_s(message, L"ShaderCache: hit %hs %hs\n", szEntryPoint, szShaderModel);
+    }
+    else
+    {
+        LARGE_INTEGER compileStart;
+        QueryPerformanceCounter(&compileStart);
+
+        hr = Compile(szEntryPoint, szShaderModel, ppBlob);
+        if (FAILED(hr))
+        {
+            return hr;
+        }
+
+        double compileMs = ElapsedMs(compileStart);
+        m_stats.compileMs += compileMs;
+        ++m_stats.missCount;
+
+        HRESULT hrWrite = Write(szEntryPoint, szShaderModel, path, *ppBlob);
+        swprintf_s(message, L"ShaderCache: miss %hs %hs, compiled in %.1f ms%s\n", szEntryPoint, szShaderModel, compileMs,
+            FAILED(hrWrite) ? L", could not write the cache" : L"");
+    }
+
+    OutputDebugStringW(message);
+
+    m_stats.loadMs += ElapsedMs(start);
+
+    return S_OK;
+}
+
+/// <summary>
+/// Compile an entry point of the source read by Open
+/// </summary>
+HRESULT CShaderCache::Compile(LPCSTR szEntryPoint, LPCSTR szShaderModel, ID3D10Blob** ppBlob)
+{
+    // the file name only labels compiler messages
+    char sourceName[MAX_PATH];
+    if (0 == WideCharToMultiByte(CP_ACP, 0, m_sourceFile.c_str(), -1, sourceName, _countof(sourceName), NULL, NULL))
+    {
+        sourceName[0] = '\0';
+    }
+
+    ID3D10Blob* pErrorBlob = NULL;
+    HRESULT hr = D3DCompile(m_source.data(), m_source.size(), sourceName, NULL, NULL, szEntryPoint, szShaderModel,
+        m_compileFlags, 0, ppBlob, &pErrorBlob);
+
+    if (FAILED(hr) && NULL != pErrorBlob)
+    {
+        OutputDebugStringA(static_cast<char*>(pErrorBlob->GetBufferPointer()));
+    }
+
+    SAFE_RELEASE(pErrorBlob);
+
+    return hr;
+}
+
+/// <summary>
+/// Read a cached .cso file
+/// </summary>
+HRESULT CShaderCache::Read(const std::wstring& path, ID3D10Blob** ppBlob)
+{
+    HANDLE hFile = CreateFileW(path.c_str(), GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL | FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+    if (INVALID_HANDLE_VALUE == hFile)
+    {
+        return HRESULT_FROM_WIN32(GetLastError());
+    }
+
+    HRESULT hr = S_OK;
+    LARGE_INTEGER size;
+    if (!GetFileSizeEx(hFile, &size))
+    {
+        hr = HRESULT_FROM_WIN32(GetLastError());
+    }
+    else if (0 == size.QuadPart || size.QuadPart > MAXDWORD)
+    {
+        hr = HRESULT_FROM_WIN32(ERROR_BAD_FORMAT);
+    }
+
+    ID3D10Blob* pBlob = NULL;
+    if (SUCCEEDED(hr))
+    {
+        hr = D3DCreateBlob(static_cast<SIZE_T>(size.QuadPart), &pBlob);
+    }
+
+    DWORD read = 0;
+    if (SUCCEEDED(hr) && (!ReadFile(hFile, pBlob->GetBufferPointer(), size.LowPart, &read, NULL) || read != size.LowPart))
+    {
+        hr = HRESULT_FROM_WIN32(ERROR_READ_FAULT);
+    }
+
+    CloseHandle(hFile);
+
+    if (FAILED(hr))
+    {
+        SAFE_RELEASE(pBlob);
+        return hr;
+    }
+
+    *ppBlob = pBlob;
+    return S_OK;
+}
+
+/// <summary>
+/// Write compiled bytecode to the cache and remove the stale copies of the entry point
+/// </summary>
+HRESULT CShaderCache::Write(LPCSTR szEntryPoint, LPCSTR szShaderModel, const std::wstring& path, ID3D10Blob* pBlob)
+{
+    if (!CreateDirectoryW(m_cacheDirectory.c_str(), NULL) && ERROR_ALREADY_EXISTS != GetLastError())
+    {
+        return HRESULT_FROM_WIN32(GetLastError());
+    }
+
+    // Written under a temporary name and renamed, so an application killed mid-write never
+    // leaves a truncated file behind for the next start to load
+    std::wstring tempPath = path + L".tmp";
+    HANDLE hFile = CreateFileW(tempPath.c_str(), GENERIC_WRITE, 0, NULL, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (INVALID_HANDLE_VALUE == hFile)
+    {
+        return HRESULT_FROM_WIN32(GetLastError());
+    }
+
+    DWORD size = static_cast<DWORD>(pBlob->GetBufferSize());
+    DWORD written = 0;
+    bool bWritten = WriteFile(hFile, pBlob->GetBufferPointer(), size, &written, NULL) && written == size;
+    CloseHandle(hFile);
+
+    if (!bWritten || !MoveFileExW(tempPath.c_str(), path.c_str(), MOVEFILE_REPLACE_EXISTING))
+    {
+        DeleteFileW(tempPath.c_str());
+        return HRESULT_FROM_WIN32(ERROR_WRITE_FAULT);
+    }
+
+    // copies compiled from earlier versions of the source would otherwise pile up
+    WCHAR pattern[MAX_PATH];
+    swprintf_s(pattern, L"\\%hs.%hs.*.cso", szEntryPoint, szShaderModel);
+    std::wstring directory = m_cacheDirectory + L"\\";
+
+    WIN32_FIND_DATAW findData;
+    HANDLE hFind = FindFirstFileW((m_cacheDirectory + pattern).c_str(), &findData);
+    if (INVALID_HANDLE_VALUE != hFind)
+    {
+        do
+        {
+            std::wstring stalePath = directory + findData.cFileName;
+            if (stalePath != path)
+            {
+                DeleteFileW(stalePath.c_str());
+            }
+        }
+        while (FindNextFileW(hFind, &findData));
+
+        FindClose(hFind);
+    }
+
+    return S_OK;
+}
@@ -0,0 +1,75 @@
+﻿//------------------------------------------------------------------------------
+// <copyright file="ShaderCache.h" company="Microsoft">
+//     Copyright (c) Microsoft Corporation.  All rights reserved.
+// </copyright>
+//------------------------------------------------------------------------------
+
+#pragma once
+
+#include <windows.h>
+#include <d3d11.h>
+#include <string>
+
+/// <summary>
+/// Shaders served from the cache and compiled, and the time it took
+/// </summary>
+struct ShaderCacheStats
+{
+    UINT                                hitCount;
+    UINT                                missCount;
+
+    // time spent in the compiler on misses, and in Load overall
+    double                              compileMs;
+    double                              loadMs;
+};
+
+/// <summary>
+/// On-disk cache of compiled shader bytecode, one .cso file per entry point
+/// Each file is named after a hash of the shader source, entry point, shader model, compile flags
+/// and compiler version, so any change to those misses the cache and recompiles rather than
+/// loading stale bytecode. The source must not #include other files, they are not hashed.
+/// </summary>
+class CShaderCache
+{
+public:
+    /// <summary>
+    /// Constructor
+    /// </summary>
+    CShaderCache();
+
+    /// <summary>
+    /// Read the shader source and hash it
+    /// </summary>
+    /// <param name="szSourceFile">shader source file</param>
+    /// <param name="szCacheDirectory">directory holding the .cso files, created on the first miss</param>
+    /// <param name="compileFlags">D3DCOMPILE flags used on a miss</param>
+    /// <returns>S_OK on success, otherwise failure code</returns>
+    HRESULT                             Open(LPCWSTR szSourceFile, LPCWSTR szCacheDirectory, UINT compileFlags);
+
+    /// <summary>
+    /// Get the bytecode of an entry point, from the cache if it holds a current copy, otherwise
+    /// compiled and written to the cache. Failing to write the cache does not fail the load.
+    /// </summary>
+    /// <param name="szEntryPoint">entry point of shader</param>
+    /// <param name="szShaderModel">shader model to compile for</param>
+    /// <param name="ppBlob">receives the bytecode</param>
+    /// <returns>S_OK for success, or failure code</returns>
+    HRESULT                             Load(LPCSTR szEntryPoint, LPCSTR szShaderModel, ID3D10Blob** ppBlob);
+
+    /// <summary>
+    /// Hits, misses and timings since Open
+    /// </summary>
+    const ShaderCacheStats&             GetStats() const { return m_stats; }
+
+private:
+    std::wstring                        m_sourceFile;
+    std::wstring                        m_cacheDirectory;
+    std::string                         m_source;
+    UINT                                m_compileFlags;
+    ULONGLONG                           m_sourceHash;
+    ShaderCacheStats                    m_stats;
+
+    HRESULT                             Compile(LPCSTR szEntryPoint, LPCSTR szShaderModel, ID3D10Blob** ppBlob);
+    HRESULT                             Read(const std::wstring& path, ID3D10Blob** ppBlob);
+    HRESULT                             Write(LPCSTR szEntryPoint, LPCSTR szShaderModel, const std::wstring& path, ID3D10Blob* pBlob);
+};
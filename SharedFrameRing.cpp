@@ -0,0 +1,445 @@
+﻿//------------------------------------------------------------------------------
+// <copyright file="SharedFrameRing.cpp" company="Microsoft">
+//     Copyright (c) Microsoft Corporation.  All rights reserved.
+// </copyright>
+//------------------------------------------------------------------------------
+
+#include "SharedFrameRing.h"
+#include <stdio.h>
+
+namespace
+{
+    // slots and images start on cache lines, so the producer and readers of neighboring
+    // slots do not share lines
+    const DWORD cSharedFrameAlignment = 64;
+
+    DWORD AlignUp(ULONGLONG size)
+    {
+        return static_cast<DWORD>((size + cSharedFrameAlignment - 1) & ~static_cast<ULONGLONG>(cSharedFrameAlignment - 1));
+    }
+
+    /// <summary>
+    /// Map a sequence number to its slot, sequences start at 1
+    /// </summary>
+    DWORD SlotIndex(LONG sequence, DWORD slotCount)
+    {
+        return static_cast<DWORD>(sequence - 1) % slotCount;
+    }
+}
+
+/// <summary>
+/// Constructor
+/// </summary>
+CSharedFrameWriter::CSharedFrameWriter() :
+    m_hMapping(NULL),
+    m_pHeader(NULL),
+    m_pSlots(NULL),
+    m_sequence(0)
+{
+}
+
+/// <summary>
+/// Destructor, closes the mapping
+/// </summary>
+CSharedFrameWriter::~CSharedFrameWriter()
+{
+    Close();
+}
+
+/// <summary>
+/// Create the named mapping and write its header
+/// </summary>
+/// <param name="szName">mapping name, for example Local\DepthWithColor</param>
+/// <param name="slotCount">frames kept, at least 2, more give slow readers longer to catch up</param>
+/// <param name="depthWidth">width of the depth frames</param>
+/// <param name="depthHeight">height of the depth frames</param>
+/// <param name="colorWidth">width of the color frames</param>
+/// <param name="colorHeight">height of the color frames</param>
+/// <returns>S_OK on success, otherwise failure code</returns>
+HRESULT CSharedFrameWriter::Create(LPCWSTR szName, UINT slotCount, LONG depthWidth, LONG depthHeight, LONG colorWidth, LONG colorHeight)
+{
+    Close();
+
+    if (NULL == szName || slotCount < 2 || depthWidth <= 0 || depthHeight <= 0 || colorWidth <= 0 || colorHeight <= 0)
+    {
+        return E_INVALIDARG;
+    }
+
+    DWORD headerSize = AlignUp(sizeof(SharedFrameRingHeader));
+    DWORD depthOffset = AlignUp(sizeof(SharedFrameInfo));
+    DWORD colorOffset = depthOffset + AlignUp(static_cast<ULONGLONG>(depthWidth) * depthHeight * sizeof(USHORT));
+    DWORD slotStride = colorOffset + AlignUp(static_cast<ULONGLONG>(colorWidth) * colorHeight * 4);
+    ULONGLONG mappingSize = headerSize + static_cast<ULONGLONG>(slotStride) * slotCount;
+
+    // backed by the paging file, nothing touches the disk unless memory runs short
+    m_hMapping = CreateFileMappingW(INVALID_HANDLE_VALUE, NULL, PAGE_READWRITE,
+        static_cast<DWORD>(mappingSize >> 32), static_cast<DWORD>(mappingSize), szName);
+    if (NULL == m_hMapping)
+    {
+        return HRESULT_FROM_WIN32(GetLastError());
+    }
+
+    // another producer owns the name, its readers must not see two writers
+    if (ERROR_ALREADY_EXISTS == GetLastError())
+    {
+        Close();
+        return HRESULT_FROM_WIN32(ERROR_ALREADY_EXISTS);
+    }
+
+    BYTE* pView = static_cast<BYTE*>(MapViewOfFile(m_hMapping, FILE_MAP_ALL_ACCESS, 0, 0, 0));
+    if (NULL == pView)
+    {
+        HRESULT hr = HRESULT_FROM_WIN32(GetLastError());
+        Close();
+        return hr;
+    }
+
+    // a new mapping is zeroed, so every slot lock starts even and no frame is published
+    m_pHeader = reinterpret_cast<SharedFrameRingHeader*>(pView);
+    m_pSlots = pView + headerSize;
+    m_pHeader->version = cSharedFrameRingVersion;
+    m_pHeader->slotCount = slotCount;
+    m_pHeader->slotStride = slotStride;
+    m_pHeader->headerSize = headerSize;
+    m_pHeader->depthOffset = depthOffset;
+    m_pHeader->colorOffset = colorOffset;
+    m_pHeader->depthWidth = depthWidth;
+    m_pHeader->depthHeight = depthHeight;
+    m_pHeader->colorWidth = colorWidth;
+    m_pHeader->colorHeight = colorHeight;
+    m_pHeader->latestSequence = 0;
+
+    // readers opening the mapping meanwhile wait for the magic before trusting the rest
+    MemoryBarrier();
+    m_pHeader->magic = cSharedFrameRingMagic;
+
+    m_sequence = 0;
+
+    return S_OK;
+}
+
+/// <summary>
+/// Close the mapping, it goes away once every reader has closed it too
+/// </summary>
+void CSharedFrameWriter::Close()
+{
+    if (NULL != m_pHeader)
+    {
+        UnmapViewOfFile(m_pHeader);
+        m_pHeader = NULL;
+        m_pSlots = NULL;
+    }
+
+    if (NULL != m_hMapping)
+    {
+        CloseHandle(m_hMapping);
+        m_hMapping = NULL;
+    }
+}
+
+/// <summary>
+/// Take the slot of the next frame and lock it, readers still looking at the frame it held
+/// fail to validate it from now on. Fill in the info and the images, then call EndFrame.
+/// </summary>
+/// <param name="pSlot">receives the slot</param>
+void CSharedFrameWriter::BeginFrame(SharedFrameSlot* pSlot)
+{
+    LONG sequence = m_sequence + 1;
+    BYTE* pSlotStart = m_pSlots + static_cast<SIZE_T>(SlotIndex(sequence, m_pHeader->slotCount)) * m_pHeader->slotStride;
+
+    SharedFrameInfo* pInfo = reinterpret_cast<SharedFrameInfo*>(pSlotStart);
+
+    // a full barrier, the odd lock is visible before any write to the slot
+    InterlockedExchange(&pInfo->lock, sequence * 2 - 1);
+
+    pSlot->pInfo = pInfo;
+    pSlot->pDepth = reinterpret_cast<USHORT*>(pSlotStart + m_pHeader->depthOffset);
+    pSlot->pColor = pSlotStart + m_pHeader->colorOffset;
+}
+
+/// <summary>
+/// Publish the frame written since BeginFrame
+/// </summary>
+void CSharedFrameWriter::EndFrame()
+{
+    LONG sequence = m_sequence + 1;
+    BYTE* pSlotStart = m_pSlots + static_cast<SIZE_T>(SlotIndex(sequence, m_pHeader->slotCount)) * m_pHeader->slotStride;
+
+    SharedFrameInfo* pInfo = reinterpret_cast<SharedFrameInfo*>(pSlotStart);
+    InterlockedExchange(&pInfo->lock, sequence * 2);
+    InterlockedExchange(&m_pHeader->latestSequence, sequence);
+
+    m_sequence = sequence;
+}
+
+/// <summary>
+/// Constructor
+/// </summary>
+CSharedFrameReader::CSharedFrameReader() :
+    m_hMapping(NULL),
+    m_pHeader(NULL),
+    m_pSlots(NULL),
+    m_lastSequence(0),
+    m_droppedCount(0)
+{
+}
+
+/// <summary>
+/// Destructor, closes the mapping
+/// </summary>
+CSharedFrameReader::~CSharedFrameReader()
+{
+    Close();
+}
+
+/// <summary>
+/// Attach to a ring, frames published before are skipped
+/// </summary>
+/// <param name="szName">mapping name the producer created</param>
+/// <returns>S_OK on success, ERROR_NOT_READY while the producer is still writing the header,
+/// ERROR_BAD_FORMAT for a mapping of another layout, otherwise failure code</returns>
+HRESULT CSharedFrameReader::Open(LPCWSTR szName)
+{
+    Close();
+
+    // read only, a misbehaving reader cannot corrupt frames other readers see
+    m_hMapping = OpenFileMappingW(FILE_MAP_READ, FALSE, szName);
+    if (NULL == m_hMapping)
+    {
+        return HRESULT_FROM_WIN32(GetLastError());
+    }
+
+    const BYTE* pView = static_cast<const BYTE*>(MapViewOfFile(m_hMapping, FILE_MAP_READ, 0, 0, 0));
+    if (NULL == pView)
+    {
+        HRESULT hr = HRESULT_FROM_WIN32(GetLastError());
+        Close();
+        return hr;
+    }
+
+    m_pHeader = reinterpret_cast<const SharedFrameRingHeader*>(pView);
+
+    HRESULT hr = S_OK;
+    if (cSharedFrameRingMagic != m_pHeader->magic)
+    {
+        hr = HRESULT_FROM_WIN32(ERROR_NOT_READY);
+    }
+    else
+    {
+        MemoryBarrier();
+
+        // the view covers the whole mapping, which must hold every slot the header claims
+        MEMORY_BASIC_INFORMATION info;
+        ULONGLONG size = m_pHeader->headerSize + static_cast<ULONGLONG>(m_pHeader->slotStride) * m_pHeader->slotCount;
+        if (cSharedFrameRingVersion != m_pHeader->version || m_pHeader->slotCount < 2 ||
+            0 == VirtualQuery(pView, &info, sizeof(info)) || info.RegionSize < size)
+        {
+            hr = HRESULT_FROM_WIN32(ERROR_BAD_FORMAT);
+        }
+    }
+
+    if (FAILED(hr))
+    {
+        Close();
+        return hr;
+    }
+
+    m_pSlots = pView + m_pHeader->headerSize;
+    m_lastSequence = m_pHeader->latestSequence;
+    m_droppedCount = 0;
+
+    return S_OK;
+}
+
+/// <summary>
+/// Detach from the ring
+/// </summary>
+void CSharedFrameReader::Close()
+{
+    if (NULL != m_pHeader)
+    {
+        UnmapViewOfFile(m_pHeader);
+        m_pHeader = NULL;
+        m_pSlots = NULL;
+    }
+
+    if (NULL != m_hMapping)
+    {
+        CloseHandle(m_hMapping);
+        m_hMapping = NULL;
+    }
+}
+
+/// <summary>
+/// Look at the newest frame, skipping any published since the last call
+/// </summary>
+/// <param name="pView">receives the frame</param>
+/// <returns>true if there was a newer frame</returns>
+bool CSharedFrameReader::AcquireLatest(SharedFrameView* pView)
+{
+    // the producer may lap the slot between reading the sequence and its lock, then try again
+    for (;;)
+    {
+        LONG latest = m_pHeader->latestSequence;
+        if (latest == m_lastSequence)
+        {
+            return false;
+        }
+
+        if (Acquire(latest, pView))
+        {
+            m_lastSequence = latest;
+            return true;
+        }
+    }
+}
+
+/// <summary>
+/// Look at the frame after the last one acquired, for readers that want every frame
+/// Frames overwritten before the reader got to them are skipped and counted as dropped.
+/// </summary>
+/// <param name="pView">receives the frame</param>
+/// <returns>true if there was a newer frame</returns>
+bool CSharedFrameReader::AcquireNext(SharedFrameView* pView)
+{
+    for (;;)
+    {
+        LONG latest = m_pHeader->latestSequence;
+        if (latest == m_lastSequence)
+        {
+            return false;
+        }
+
+        // the slot after the newest frame may already be rewritten, the one before it is the
+        // oldest frame still intact
+        LONG next = m_lastSequence + 1;
+        LONG oldest = latest - static_cast<LONG>(m_pHeader->slotCount) + 2;
+        LONG behind = oldest - next;
+        if (behind > 0)
+        {
+            m_droppedCount += behind;
+            next = oldest;
+        }
+
+        m_lastSequence = next;
+        if (Acquire(next, pView))
+        {
+            return true;
+        }
+
+        // overwritten after reading the newest sequence
+        ++m_droppedCount;
+    }
+}
+
+/// <summary>
+/// Whether the producer left a frame alone since it was acquired
+/// Anything read from the frame is only good if this returns true afterwards.
+/// </summary>
+/// <param name="view">frame to check</param>
+/// <returns>true if the frame is still intact</returns>
+bool CSharedFrameReader::Validate(const SharedFrameView& view) const
+{
+    // every read of the frame happens before the lock is read again
+    MemoryBarrier();
+    return view.pInfo->lock == view.sequence * 2;
+}
+
+/// <summary>
+/// Look at the frame of a sequence number if its slot holds it complete
+/// </summary>
+bool CSharedFrameReader::Acquire(LONG sequence, SharedFrameView* pView) const
+{
+    const BYTE* pSlotStart = m_pSlots + static_cast<SIZE_T>(SlotIndex(sequence, m_pHeader->slotCount)) * m_pHeader->slotStride;
+    const SharedFrameInfo* pInfo = reinterpret_cast<const SharedFrameInfo*>(pSlotStart);
+
+    // the lock is read before anything in the frame
+    LONG lock = pInfo->lock;
+    MemoryBarrier();
+    if (lock != sequence * 2)
+    {
+        return false;
+    }
+
+    pView->pInfo = pInfo;
+    pView->pDepth = reinterpret_cast<const USHORT*>(pSlotStart + m_pHeader->depthOffset);
+    pView->pColor = pSlotStart + m_pHeader->colorOffset;
+    pView->sequence = sequence;
+
+    return true;
+}
+
+/// <summary>
+/// Publish and read frames through a ring, including a reader lapped by the producer
+/// </summary>
+/// <returns>true if readers see every intact frame and reject overwritten ones</returns>
+bool VerifySharedFrameRing()
+{
+    const UINT slotCount = 4;
+    const LONG width = 8;
+    const LONG height = 4;
+
+    WCHAR name[64];
+    swprintf_s(name, L"Local\\DepthWithColorVerify%lu", GetCurrentProcessId());
+
+    CSharedFrameWriter writer;
+    CSharedFrameReader reader;
+    if (FAILED(writer.Create(name, slotCount, width, height, width, height)))
+    {
+        return false;
+    }
+
+    SharedFrameSlot slot;
+    SharedFrameView view;
+
+    // frames published before the reader attaches are not seen
+    writer.BeginFrame(&slot);
+    writer.EndFrame();
+
+    bool match = SUCCEEDED(reader.Open(name)) && !reader.AcquireNext(&view);
+    match = match && width == reader.GetHeader()->depthWidth && height == reader.GetHeader()->colorHeight;
+
+    // a reader keeping up sees every frame, in order and intact
+    for (LONG frame = 0; frame < 10 && match; ++frame)
+    {
+        writer.BeginFrame(&slot);
+        slot.pInfo->depthFrameNumber = frame;
+        slot.pDepth[width * height - 1] = static_cast<USHORT>(frame);
+        slot.pColor[width * height * 4 - 1] = static_cast<BYTE>(frame);
+        writer.EndFrame();
+
+        match = reader.AcquireNext(&view) && static_cast<DWORD>(frame) == view.pInfo->depthFrameNumber;
+        match = match && frame == view.pDepth[width * height - 1] && frame == view.pColor[width * height * 4 - 1];
+        match = match && reader.Validate(view) && !reader.AcquireNext(&view);
+    }
+
+    match = match && 0 == reader.GetDroppedCount();
+
+    // a lapped reader resumes at the oldest intact frame and counts the rest as dropped
+    LONG published = writer.GetPublishedCount();
+    for (UINT frame = 0; frame < slotCount + 3; ++frame)
+    {
+        writer.BeginFrame(&slot);
+        writer.EndFrame();
+    }
+
+    LONG latest = writer.GetPublishedCount();
+    LONG oldest = latest - static_cast<LONG>(slotCount) + 2;
+    match = match && reader.AcquireNext(&view) && oldest == view.sequence;
+    match = match && (oldest - published - 1) == reader.GetDroppedCount();
+
+    // a frame rewritten while the reader looks at it fails to validate
+    match = match && reader.Validate(view);
+    writer.BeginFrame(&slot);
+    writer.EndFrame();
+    writer.BeginFrame(&slot);
+    match = match && !reader.Validate(view);
+    writer.EndFrame();
+
+    // the newest frame skips everything in between without counting it as dropped
+    LONG dropped = reader.GetDroppedCount();
+    match = match && reader.AcquireLatest(&view) && writer.GetPublishedCount() == view.sequence;
+    match = match && dropped == reader.GetDroppedCount() && !reader.AcquireLatest(&view);
+
+    return match;
+}
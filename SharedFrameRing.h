@@ -0,0 +1,256 @@
+﻿//------------------------------------------------------------------------------
+// <copyright file="SharedFrameRing.h" company="Microsoft">
+//     Copyright (c) Microsoft Corporation.  All rights reserved.
+// </copyright>
+//------------------------------------------------------------------------------
+
+#pragma once
+
+#include <windows.h>
+
+// A named shared memory ring the application publishes every synchronized frame into, so other
+// processes on the machine can use the frames without a sensor of their own. Reader processes
+// only need this header and SharedFrameRing.cpp.
+//
+// The mapping starts with a SharedFrameRingHeader, followed by slotCount slots of slotStride bytes.
+// Each slot holds a SharedFrameInfo, then the depth image at depthOffset and the color image
+// at colorOffset, both with tightly packed rows. Frame sequence numbers start at 1 and frame n
+// lives in slot (n - 1) % slotCount.
+//
+// The producer never waits for readers. Each slot is guarded by a sequence lock: its lock is odd
+// while the producer rewrites it and twice the frame's sequence number once it is complete. Readers
+// look at the images in place, then Validate the frame to learn whether the producer overwrote it
+// meanwhile, in which case whatever they read must be discarded.
+//
+// Sequence numbers are 32 bit so readers, which map the ring read only, load them atomically in
+// 32 bit processes too. The lock holds twice the sequence, which overflows after 2^30 frames,
+// over a year of publishing at 30 frames per second.
+
+const DWORD cSharedFrameRingMagic = 0x52435744;
+const DWORD cSharedFrameRingVersion = 1;
+
+/// <summary>
+/// Start of the mapping, written once by the producer before the first frame
+/// </summary>
+struct SharedFrameRingHeader
+{
+    // set last, once the rest of the header is valid
+    volatile DWORD                      magic;
+    DWORD                               version;
+
+    DWORD                               slotCount;
+    DWORD                               slotStride;
+
+    // bytes before the first slot, and offsets of the images within a slot
+    DWORD                               headerSize;
+    DWORD                               depthOffset;
+    DWORD                               colorOffset;
+
+    LONG                                depthWidth;
+    LONG                                depthHeight;
+    LONG                                colorWidth;
+    LONG                                colorHeight;
+
+    // sequence number of the newest complete frame, 0 before the first
+    volatile LONG                       latestSequence;
+};
+
+/// <summary>
+/// Start of every slot, describes the frame it holds
+/// Depth pixels are as the sensor packs them, millimeters shifted left by 3 over the player index.
+/// Color is BGRX already remapped to depth space, colorWidth by colorHeight pixels.
+/// </summary>
+struct SharedFrameInfo
+{
+    // odd while the producer writes the slot, otherwise twice the sequence number of the frame
+    volatile LONG                       lock;
+    DWORD                               depthFrameNumber;
+
+    // sensor timestamps in milliseconds
+    LONGLONG                            depthTimeStamp;
+    LONGLONG                            colorTimeStamp;
+
+    // skeleton hint given to face tracking, neck then head in skeleton space, meters
+    BOOL                                bHasHint;
+    float                               hint[2][3];
+
+    // newest face pose when the frame was published, from an earlier frame as tracking lags behind
+    BOOL                                bFaceTracked;
+    float                               faceTranslation[3];
+    float                               faceRect[4];
+    LONGLONG                            faceTimeStamp;
+};
+
+/// <summary>
+/// A slot being written by the producer
+/// </summary>
+struct SharedFrameSlot
+{
+    SharedFrameInfo*                    pInfo;
+    USHORT*                             pDepth;
+    BYTE*                               pColor;
+};
+
+/// <summary>
+/// A frame seen by a reader, in place in the mapping
+/// </summary>
+struct SharedFrameView
+{
+    const SharedFrameInfo*              pInfo;
+    const USHORT*                       pDepth;
+    const BYTE*                         pColor;
+    LONG                                sequence;
+};
+
+/// <summary>
+/// Producer side of the ring, creates the mapping and publishes frames into it
+/// </summary>
+class CSharedFrameWriter
+{
+public:
+    /// <summary>
+    /// Constructor
+    /// </summary>
+    CSharedFrameWriter();
+
+    /// <summary>
+    /// Destructor, closes the mapping
+    /// </summary>
+    ~CSharedFrameWriter();
+
+    /// <summary>
+    /// Create the named mapping and write its header
+    /// </summary>
+    /// <param name="szName">mapping name, for example Local\DepthWithColor</param>
+    /// <param name="slotCount">frames kept, at least 2, more give slow readers longer to catch up</param>
+    /// <param name="depthWidth">width of the depth frames</param>
+    /// <param name="depthHeight">height of the depth frames</param>
+    /// <param name="colorWidth">width of the color frames</param>
+    /// <param name="colorHeight">height of the color frames</param>
+    /// <returns>S_OK on success, otherwise failure code</returns>
+    HRESULT                             Create(LPCWSTR szName, UINT slotCount, LONG depthWidth, LONG depthHeight, LONG colorWidth, LONG colorHeight);
+
+    /// <summary>
+    /// Close the mapping, it goes away once every reader has closed it too
+    /// </summary>
+    void                                Close();
+
+    /// <summary>
+    /// Whether the mapping was created
+    /// </summary>
+    bool                                IsOpen() const { return NULL != m_pHeader; }
+
+    /// <summary>
+    /// Take the slot of the next frame and lock it, readers still looking at the frame it held
+    /// fail to validate it from now on. Fill in the info and the images, then call EndFrame.
+    /// </summary>
+    /// <param name="pSlot">receives the slot</param>
+    void                                BeginFrame(SharedFrameSlot* pSlot);
+
+    /// <summary>
+    /// Publish the frame written since BeginFrame
+    /// </summary>
+    void                                EndFrame();
+
+    /// <summary>
+    /// Frames published so far
+    /// </summary>
+    LONG                                GetPublishedCount() const { return m_sequence; }
+
+private:
+    HANDLE                              m_hMapping;
+    SharedFrameRingHeader*              m_pHeader;
+    BYTE*                               m_pSlots;
+    LONG                                m_sequence;
+
+    // not copyable
+    CSharedFrameWriter(const CSharedFrameWriter&);
+    CSharedFrameWriter& operator=(const CSharedFrameWriter&);
+};
+
+/// <summary>
+/// Reader side of the ring, maps it read only and looks at frames in place
+/// </summary>
+class CSharedFrameReader
+{
+public:
+    /// <summary>
+    /// Constructor
+    /// </summary>
+    CSharedFrameReader();
+
+    /// <summary>
+    /// Destructor, closes the mapping
+    /// </summary>
+    ~CSharedFrameReader();
+
+    /// <summary>
+    /// Attach to a ring, frames published before are skipped
+    /// </summary>
+    /// <param name="szName">mapping name the producer created</param>
+    /// <returns>S_OK on success, ERROR_NOT_READY while the producer is still writing the header,
+    /// ERROR_BAD_FORMAT for a mapping of another layout, otherwise failure code</returns>
+    HRESULT                             Open(LPCWSTR szName);
+
+    /// <summary>
+    /// Detach from the ring
+    /// </summary>
+    void                                Close();
+
+    /// <summary>
+    /// Whether a ring is open
+    /// </summary>
+    bool                                IsOpen() const { return NULL != m_pHeader; }
+
+    /// <summary>
+    /// Image sizes and layout of the open ring
+    /// </summary>
+    const SharedFrameRingHeader*        GetHeader() const { return m_pHeader; }
+
+    /// <summary>
+    /// Look at the newest frame, skipping any published since the last call
+    /// </summary>
+    /// <param name="pView">receives the frame</param>
+    /// <returns>true if there was a newer frame</returns>
+    bool                                AcquireLatest(SharedFrameView* pView);
+
+    /// <summary>
+    /// Look at the frame after the last one acquired, for readers that want every frame
+    /// Frames overwritten before the reader got to them are skipped and counted as dropped.
+    /// </summary>
+    /// <param name="pView">receives the frame</param>
+    /// <returns>true if there was a newer frame</returns>
+    bool                                AcquireNext(SharedFrameView* pView);
+
+    /// <summary>
+    /// Whether the producer left a frame alone since it was acquired
+    /// Anything read from the frame is only good if this returns true afterwards.
+    /// </summary>
+    /// <param name="view">frame to check</param>
+    /// <returns>true if the frame is still intact</returns>
+    bool                                Validate(const SharedFrameView& view) const;
+
+    /// <summary>
+    /// Frames AcquireNext had to skip because the producer overwrote them first
+    /// </summary>
+    LONG                                GetDroppedCount() const { return m_droppedCount; }
+
+private:
+    HANDLE                              m_hMapping;
+    const SharedFrameRingHeader*        m_pHeader;
+    const BYTE*                         m_pSlots;
+    LONG                                m_lastSequence;
+    LONG                                m_droppedCount;
+
+    bool                                Acquire(LONG sequence, SharedFrameView* pView) const;
+
+    // not copyable
+    CSharedFrameReader(const CSharedFrameReader&);
+    CSharedFrameReader& operator=(const CSharedFrameReader&);
+};
+
+/// <summary>
+/// Publish and read frames through a ring, including a reader lapped by the producer
+/// </summary>
+/// <returns>true if readers see every intact frame and reject overwritten ones</returns>
+bool VerifySharedFrameRing();
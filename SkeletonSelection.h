@@ -0,0 +1,60 @@
+﻿//------------------------------------------------------------------------------
+// <copyright file="SkeletonSelection.h" company="Microsoft">
+//     Copyright (c) Microsoft Corporation.  All rights reserved.
+// </copyright>
+//------------------------------------------------------------------------------
+
+#pragma once
+
+#include <math.h>
+
+/// <summary>
+/// Pick the skeleton whose head face tracking should follow
+/// With no previous head position the skeleton closest to the camera wins, otherwise
+/// the one whose head is closest to the previous position, by Manhattan distance
+/// Works on any vector type with float x, y and z members
+/// </summary>
+/// <param name="pTracked">whether each skeleton is tracked</param>
+/// <param name="pHeads">head position of each skeleton</param>
+/// <param name="count">number of skeletons</param>
+/// <param name="previousHead">head position picked last time, all zero if there is none</param>
+/// <returns>index of the selected skeleton, or -1 if none is tracked</returns>
+template <class TVector>
+int SelectClosestSkeleton(const bool* pTracked, const TVector* pHeads, int count, const TVector& previousHead)
+{
+    int selectedSkeleton = -1;
+    float smallestDistance = 0;
+
+    if (previousHead.x == 0 && previousHead.y == 0 && previousHead.z == 0)
+    {
+        // Get the skeleton closest to the camera
+        for (int i = 0; i < count; i++)
+        {
+            if (pTracked[i] && (smallestDistance == 0 || pHeads[i].z < smallestDistance))
+            {
+                smallestDistance = pHeads[i].z;
+                selectedSkeleton = i;
+            }
+        }
+    }
+    else
+    {
+        // Get the skeleton closest to the previous position
+        for (int i = 0; i < count; i++)
+        {
+            if (pTracked[i])
+            {
+                float d = fabsf(pHeads[i].x - previousHead.x) +
+                    fabsf(pHeads[i].y - previousHead.y) +
+                    fabsf(pHeads[i].z - previousHead.z);
+                if (smallestDistance == 0 || d < smallestDistance)
+                {
+                    smallestDistance = d;
+                    selectedSkeleton = i;
+                }
+            }
+        }
+    }
+
+    return selectedSkeleton;
+}
@@ -0,0 +1,488 @@
+﻿//------------------------------------------------------------------------------
+// <copyright file="SkeletonSmoother.cpp" company="Microsoft">
+//     Copyright (c) Microsoft Corporation.  All rights reserved.
+// </copyright>
+//------------------------------------------------------------------------------
+
+#include "SkeletonSmoother.h"
+
+#include <math.h>
+#include <string.h>
+#include <vector>
+#include <emmintrin.h>
+
+namespace
+{
+    /// <summary>
+    /// Smooth one joint, the lane computation both kernels share
+    /// </summary>
+    void SmoothJoint(const SkeletonJointStreams& s, int i)
+    {
+        float raw[3] = { s.pRawX[i], s.pRawY[i], s.pRawZ[i] };
+        float* prevRaw[3] = { &s.pPrevRawX[i], &s.pPrevRawY[i], &s.pPrevRawZ[i] };
+        float* filtered[3] = { &s.pFilteredX[i], &s.pFilteredY[i], &s.pFilteredZ[i] };
+        float* trend[3] = { &s.pTrendX[i], &s.pTrendY[i], &s.pTrendZ[i] };
+        float* out[3] = { &s.pOutX[i], &s.pOutY[i], &s.pOutZ[i] };
+
+        float history = s.pValid[i] > 0.0f ? s.pHistory[i] : 0.0f;
+        float smoothing = s.pSmoothing[i];
+        float correction = s.pCorrection[i];
+
+        // moves shorter than the jitter radius are scaled down towards the last estimate
+        float jitterScale = 1.0f;
+        if (history >= 2.0f)
+        {
+            float lengthSquared = 0.0f;
+            for (int a = 0; a < 3; ++a)
+            {
+                float d = raw[a] - *filtered[a];
+                lengthSquared += d * d;
+            }
+
+            float length = sqrtf(lengthSquared);
+            if (length <= s.pJitterRadius[i] && s.pJitterRadius[i] > 0.0f)
+            {
+                jitterScale = length / s.pJitterRadius[i];
+            }
+        }
+
+        float predicted[3];
+        for (int a = 0; a < 3; ++a)
+        {
+            float estimate;
+            float newTrend;
+            if (history >= 2.0f)
+            {
+                float damped = *filtered[a] + (raw[a] - *filtered[a]) * jitterScale;
+                estimate = damped * (1.0f - smoothing) + (*filtered[a] + *trend[a]) * smoothing;
+                newTrend = (estimate - *filtered[a]) * correction + *trend[a] * (1.0f - correction);
+            }
+            else if (history >= 1.0f)
+            {
+                estimate = (raw[a] + *prevRaw[a]) * 0.5f;
+                newTrend = (estimate - *filtered[a]) * correction + *trend[a] * (1.0f - correction);
+            }
+            else
+            {
+                estimate = raw[a];
+                newTrend = 0.0f;
+            }
+
+            *filtered[a] = estimate;
+            *trend[a] = newTrend;
+            *prevRaw[a] = raw[a];
+            predicted[a] = estimate + newTrend * s.pPrediction[i];
+        }
+
+        // the prediction is pulled back to within the largest deviation of the tracked position
+        float deviationSquared = 0.0f;
+        for (int a = 0; a < 3; ++a)
+        {
+            float d = predicted[a] - raw[a];
+            deviationSquared += d * d;
+        }
+
+        float deviation = sqrtf(deviationSquared);
+        float deviationScale = 1.0f;
+        if (deviation > s.pMaxDeviation[i])
+        {
+            deviationScale = s.pMaxDeviation[i] / deviation;
+        }
+
+        for (int a = 0; a < 3; ++a)
+        {
+            *out[a] = raw[a] + (predicted[a] - raw[a]) * deviationScale;
+        }
+
+        s.pHistory[i] = s.pValid[i] > 0.0f ? (history >= 2.0f ? 2.0f : history + 1.0f) : 0.0f;
+    }
+
+    /// <summary>
+    /// Pick a where the mask is set and b elsewhere
+    /// </summary>
+    inline __m128 Select(__m128 mask, __m128 a, __m128 b)
+    {
+        return _mm_or_ps(_mm_and_ps(mask, a), _mm_andnot_ps(mask, b));
+    }
+}
+
+/// <summary>
+/// Reference implementation, one joint at a time
+/// </summary>
+void SmoothJointsScalar(const SkeletonJointStreams& streams)
+{
+    for (int i = 0; i < streams.count; ++i)
+    {
+        SmoothJoint(streams, i);
+    }
+}
+
+/// <summary>
+/// SSE2 implementation, four joints at a time
+/// Every lane computes all three filter stages and keeps the one its history calls for
+/// </summary>
+void SmoothJointsSSE2(const SkeletonJointStreams& streams)
+{
+    const SkeletonJointStreams& s = streams;
+    const __m128 zero = _mm_setzero_ps();
+    const __m128 one = _mm_set1_ps(1.0f);
+    const __m128 two = _mm_set1_ps(2.0f);
+    const __m128 half = _mm_set1_ps(0.5f);
+
+    float* const pRaw[3] = { const_cast<float*>(s.pRawX), const_cast<float*>(s.pRawY), const_cast<float*>(s.pRawZ) };
+    float* const pPrevRaw[3] = { s.pPrevRawX, s.pPrevRawY, s.pPrevRawZ };
+    float* const pFiltered[3] = { s.pFilteredX, s.pFilteredY, s.pFilteredZ };
+    float* const pTrend[3] = { s.pTrendX, s.pTrendY, s.pTrendZ };
+    float* const pOut[3] = { s.pOutX, s.pOutY, s.pOutZ };
+
+    int i = 0;
+    for (; i + 4 <= s.count; i += 4)
+    {
+        __m128 valid = _mm_cmpgt_ps(_mm_loadu_ps(s.pValid + i), zero);
+        __m128 history = _mm_and_ps(valid, _mm_loadu_ps(s.pHistory + i));
+        __m128 steady = _mm_cmpge_ps(history, two);
+        __m128 second = _mm_andnot_ps(steady, _mm_cmpge_ps(history, one));
+
+        __m128 smoothing = _mm_loadu_ps(s.pSmoothing + i);
+        __m128 correction = _mm_loadu_ps(s.pCorrection + i);
+        __m128 prediction = _mm_loadu_ps(s.pPrediction + i);
+        __m128 jitterRadius = _mm_loadu_ps(s.pJitterRadius + i);
+        __m128 maxDeviation = _mm_loadu_ps(s.pMaxDeviation + i);
+
+        __m128 raw[3];
+        __m128 filtered[3];
+        __m128 trend[3];
+        __m128 lengthSquared = zero;
+        for (int a = 0; a < 3; ++a)
+        {
+            raw[a] = _mm_loadu_ps(pRaw[a] + i);
+            filtered[a] = _mm_loadu_ps(pFiltered[a] + i);
+            trend[a] = _mm_loadu_ps(pTrend[a] + i);
+
+            __m128 d = _mm_sub_ps(raw[a], filtered[a]);
+            lengthSquared = _mm_add_ps(lengthSquared, _mm_mul_ps(d, d));
+        }
+
+        // a zero radius divides to infinity or NaN, neither of which the mask lets through
+        __m128 length = _mm_sqrt_ps(lengthSquared);
+        __m128 damp = _mm_and_ps(_mm_cmple_ps(length, jitterRadius), _mm_cmpgt_ps(jitterRadius, zero));
+        __m128 jitterScale = Select(damp, _mm_div_ps(length, jitterRadius), one);
+
+        __m128 predicted[3];
+        __m128 deviationSquared = zero;
+        for (int a = 0; a < 3; ++a)
+        {
+            __m128 damped = _mm_add_ps(filtered[a], _mm_mul_ps(_mm_sub_ps(raw[a], filtered[a]), jitterScale));
+            __m128 steadyEstimate = _mm_add_ps(_mm_mul_ps(damped, _mm_sub_ps(one, smoothing)),
+                _mm_mul_ps(_mm_add_ps(filtered[a], trend[a]), smoothing));
+            __m128 secondEstimate = _mm_mul_ps(_mm_add_ps(raw[a], _mm_loadu_ps(pPrevRaw[a] + i)), half);
+
+            __m128 estimate = Select(steady, steadyEstimate, Select(second, secondEstimate, raw[a]));
+            __m128 newTrend = _mm_add_ps(_mm_mul_ps(_mm_sub_ps(estimate, filtered[a]), correction),
+                _mm_mul_ps(trend[a], _mm_sub_ps(one, correction)));
+            newTrend = _mm_and_ps(_mm_or_ps(steady, second), newTrend);
+
+            _mm_storeu_ps(pFiltered[a] + i, estimate);
+            _mm_storeu_ps(pTrend[a] + i, newTrend);
+            _mm_storeu_ps(pPrevRaw[a] + i, raw[a]);
+
+            predicted[a] = _mm_add_ps(estimate, _mm_mul_ps(newTrend, prediction));
+            __m128 d = _mm_sub_ps(predicted[a], raw[a]);
+            deviationSquared = _mm_add_ps(deviationSquared, _mm_mul_ps(d, d));
+        }
+
+        __m128 deviation = _mm_sqrt_ps(deviationSquared);
+        __m128 deviationScale = Select(_mm_cmpgt_ps(deviation, maxDeviation), _mm_div_ps(maxDeviation, deviation), one);
+        for (int a = 0; a < 3; ++a)
+        {
+            __m128 out = _mm_add_ps(raw[a], _mm_mul_ps(_mm_sub_ps(predicted[a], raw[a]), deviationScale));
+            _mm_storeu_ps(pOut[a] + i, out);
+        }
+
+        __m128 nextHistory = Select(steady, two, _mm_add_ps(history, one));
+        _mm_storeu_ps(s.pHistory + i, _mm_and_ps(valid, nextHistory));
+    }
+
+    for (; i < s.count; ++i)
+    {
+        SmoothJoint(s, i);
+    }
+}
+
+/// <summary>
+/// Constructor
+/// </summary>
+CSkeletonSmoother::CSkeletonSmoother() :
+    m_pfnSmooth(SmoothJointsSSE2)
+{
+    m_streams.count = cJointCount;
+    m_streams.pRawX = m_rawX;
+    m_streams.pRawY = m_rawY;
+    m_streams.pRawZ = m_rawZ;
+    m_streams.pOutX = m_outX;
+    m_streams.pOutY = m_outY;
+    m_streams.pOutZ = m_outZ;
+    m_streams.pValid = m_valid;
+    m_streams.pSmoothing = m_smoothing;
+    m_streams.pCorrection = m_correction;
+    m_streams.pPrediction = m_prediction;
+    m_streams.pJitterRadius = m_jitterRadius;
+    m_streams.pMaxDeviation = m_maxDeviation;
+    m_streams.pHistory = m_history;
+    m_streams.pPrevRawX = m_prevRaw[0];
+    m_streams.pPrevRawY = m_prevRaw[1];
+    m_streams.pPrevRawZ = m_prevRaw[2];
+    m_streams.pFilteredX = m_filtered[0];
+    m_streams.pFilteredY = m_filtered[1];
+    m_streams.pFilteredZ = m_filtered[2];
+    m_streams.pTrendX = m_trend[0];
+    m_streams.pTrendY = m_trend[1];
+    m_streams.pTrendZ = m_trend[2];
+
+    SetSmoothing(SkeletonJointSmoothing());
+    Reset();
+}
+
+/// <summary>
+/// Use the same parameters for every joint
+/// </summary>
+/// <param name="params">smoothing parameters</param>
+void CSkeletonSmoother::SetSmoothing(const SkeletonJointSmoothing& params)
+{
+    for (int joint = 0; joint < NUI_SKELETON_POSITION_COUNT; ++joint)
+    {
+        m_params[joint] = params;
+    }
+}
+
+/// <summary>
+/// Use different parameters for one joint of every skeleton
+/// </summary>
+/// <param name="joint">joint to change</param>
+/// <param name="params">smoothing parameters</param>
+void CSkeletonSmoother::SetJointSmoothing(NUI_SKELETON_POSITION_INDEX joint, const SkeletonJointSmoothing& params)
+{
+    if (joint >= 0 && joint < NUI_SKELETON_POSITION_COUNT)
+    {
+        m_params[joint] = params;
+    }
+}
+
+/// <summary>
+/// Forget every skeleton, the next frame starts the filters afresh
+/// </summary>
+void CSkeletonSmoother::Reset()
+{
+    memset(m_history, 0, sizeof(m_history));
+    memset(m_prevRaw, 0, sizeof(m_prevRaw));
+    memset(m_filtered, 0, sizeof(m_filtered));
+    memset(m_trend, 0, sizeof(m_trend));
+    memset(&m_stats, 0, sizeof(m_stats));
+}
+
+/// <summary>
+/// Smooth the joints of a frame in place
+/// Skeletons that are not tracked restart their filters, as a new user may take their place
+/// </summary>
+/// <param name="pFrame">frame to smooth</param>
+void CSkeletonSmoother::Smooth(NUI_SKELETON_FRAME* pFrame)
+{
+    // Gather the joints into streams, radii are doubled for inferred joints as the SDK does
+    bool measured[cJointCount];
+    for (int skeleton = 0; skeleton < NUI_SKELETON_COUNT; ++skeleton)
+    {
+        const NUI_SKELETON_DATA& data = pFrame->SkeletonData[skeleton];
+        bool bTracked = NUI_SKELETON_TRACKED == data.eTrackingState;
+
+        for (int joint = 0; joint < NUI_SKELETON_POSITION_COUNT; ++joint)
+        {
+            int i = skeleton * NUI_SKELETON_POSITION_COUNT + joint;
+            const SkeletonJointSmoothing& params = m_params[joint];
+            NUI_SKELETON_POSITION_TRACKING_STATE state = data.eSkeletonPositionTrackingState[joint];
+            bool bValid = bTracked && NUI_SKELETON_POSITION_NOT_TRACKED != state;
+            float radiusScale = NUI_SKELETON_POSITION_INFERRED == state ? 2.0f : 1.0f;
+
+            m_rawX[i] = data.SkeletonPositions[joint].x;
+            m_rawY[i] = data.SkeletonPositions[joint].y;
+            m_rawZ[i] = data.SkeletonPositions[joint].z;
+            m_valid[i] = bValid ? 1.0f : 0.0f;
+            m_smoothing[i] = params.smoothing;
+            m_correction[i] = params.correction;
+            m_prediction[i] = params.prediction;
+            m_jitterRadius[i] = params.jitterRadius * radiusScale;
+            m_maxDeviation[i] = params.maxDeviationRadius * radiusScale;
+
+            // jitter needs this and the two frames before
+            measured[i] = bValid && m_history[i] >= 2.0f;
+        }
+    }
+
+    m_pfnSmooth(m_streams);
+
+    // Scatter the smoothed joints back, leaving joints that were not tracked as they came
+    for (int skeleton = 0; skeleton < NUI_SKELETON_COUNT; ++skeleton)
+    {
+        NUI_SKELETON_DATA& data = pFrame->SkeletonData[skeleton];
+        for (int joint = 0; joint < NUI_SKELETON_POSITION_COUNT; ++joint)
+        {
+            int i = skeleton * NUI_SKELETON_POSITION_COUNT + joint;
+            if (0.0f == m_valid[i])
+            {
+                continue;
+            }
+
+            const float raw[3] = { m_rawX[i], m_rawY[i], m_rawZ[i] };
+            const float out[3] = { m_outX[i], m_outY[i], m_outZ[i] };
+
+            if (measured[i])
+            {
+                double rawJitter = 0.0;
+                double smoothedJitter = 0.0;
+                double deviation = 0.0;
+                for (int a = 0; a < 3; ++a)
+                {
+                    double rawChange = raw[a] - 2.0 * m_statRaw[0][a][i] + m_statRaw[1][a][i];
+                    double smoothedChange = out[a] - 2.0 * m_statOut[0][a][i] + m_statOut[1][a][i];
+                    rawJitter += rawChange * rawChange;
+                    smoothedJitter += smoothedChange * smoothedChange;
+                    deviation += (out[a] - raw[a]) * (out[a] - raw[a]);
+                }
+
+                m_stats.rawJitterSum += sqrt(rawJitter);
+                m_stats.smoothedJitterSum += sqrt(smoothedJitter);
+                m_stats.deviationSum += sqrt(deviation);
+                ++m_stats.samples;
+            }
+
+            for (int a = 0; a < 3; ++a)
+            {
+                m_statRaw[1][a][i] = m_statRaw[0][a][i];
+                m_statRaw[0][a][i] = raw[a];
+                m_statOut[1][a][i] = m_statOut[0][a][i];
+                m_statOut[0][a][i] = out[a];
+            }
+
+            data.SkeletonPositions[joint].x = m_outX[i];
+            data.SkeletonPositions[joint].y = m_outY[i];
+            data.SkeletonPositions[joint].z = m_outZ[i];
+        }
+    }
+}
+
+/// <summary>
+/// Check the SIMD smoothing kernel against the reference on random joints
+/// </summary>
+/// <returns>true if both implementations agree</returns>
+bool VerifySkeletonSmoother()
+{
+    // an odd count exercises the scalar tail
+    const int cJoints = 43;
+    const int cFrames = 40;
+
+    std::vector<float> raw[3];
+    std::vector<float> out[2][3];
+    std::vector<float> valid(cJoints);
+    std::vector<float> smoothing(cJoints);
+    std::vector<float> correction(cJoints);
+    std::vector<float> prediction(cJoints);
+    std::vector<float> jitterRadius(cJoints);
+    std::vector<float> maxDeviation(cJoints);
+    std::vector<float> state[2][10];
+
+    for (int a = 0; a < 3; ++a)
+    {
+        raw[a].resize(cJoints);
+        out[0][a].resize(cJoints);
+        out[1][a].resize(cJoints);
+    }
+
+    for (int k = 0; k < 2; ++k)
+    {
+        for (int v = 0; v < 10; ++v)
+        {
+            state[k][v].assign(cJoints, 0.0f);
+        }
+    }
+
+    unsigned int seed = 12345;
+    for (int i = 0; i < cJoints; ++i)
+    {
+        seed = seed * 1664525 + 1013904223;
+
+        // a few joints pass straight through or have no jitter radius
+        smoothing[i] = 0 == i % 11 ? 0.0f : 0.1f * (seed >> 28);
+        correction[i] = 0.05f + 0.01f * ((seed >> 20) & 15);
+        prediction[i] = 0.1f * ((seed >> 16) & 15);
+        jitterRadius[i] = 0 == i % 13 ? 0.0f : 0.02f + 0.01f * ((seed >> 12) & 15);
+        maxDeviation[i] = 0.02f + 0.01f * ((seed >> 8) & 15);
+    }
+
+    bool match = true;
+    for (int frame = 0; frame < cFrames && match; ++frame)
+    {
+        for (int i = 0; i < cJoints; ++i)
+        {
+            // joints drop out now and then, and move both within and beyond the jitter radius
+            seed = seed * 1664525 + 1013904223;
+            valid[i] = 0 == (seed >> 24) % 9 ? 0.0f : 1.0f;
+            for (int a = 0; a < 3; ++a)
+            {
+                seed = seed * 1664525 + 1013904223;
+                float step = 0 == frame % 5 ? 0.2f : 0.02f;
+                raw[a][i] = 0.1f * a + frame * 0.01f * (i % 4) + step * ((seed >> 8) / 16777216.0f - 0.5f);
+            }
+        }
+
+        for (int k = 0; k < 2; ++k)
+        {
+            SkeletonJointStreams s;
+            s.count = cJoints;
+            s.pRawX = &raw[0][0];
+            s.pRawY = &raw[1][0];
+            s.pRawZ = &raw[2][0];
+            s.pOutX = &out[k][0][0];
+            s.pOutY = &out[k][1][0];
+            s.pOutZ = &out[k][2][0];
+            s.pValid = &valid[0];
+            s.pSmoothing = &smoothing[0];
+            s.pCorrection = &correction[0];
+            s.pPrediction = &prediction[0];
+            s.pJitterRadius = &jitterRadius[0];
+            s.pMaxDeviation = &maxDeviation[0];
+            s.pHistory = &state[k][0][0];
+            s.pPrevRawX = &state[k][1][0];
+            s.pPrevRawY = &state[k][2][0];
+            s.pPrevRawZ = &state[k][3][0];
+            s.pFilteredX = &state[k][4][0];
+            s.pFilteredY = &state[k][5][0];
+            s.pFilteredZ = &state[k][6][0];
+            s.pTrendX = &state[k][7][0];
+            s.pTrendY = &state[k][8][0];
+            s.pTrendZ = &state[k][9][0];
+
+            if (0 == k)
+            {
+                SmoothJointsScalar(s);
+            }
+            else
+            {
+                SmoothJointsSSE2(s);
+            }
+        }
+
+        // the filter state feeds back, so rounding differences are allowed to build up a little
+        for (int i = 0; i < cJoints; ++i)
+        {
+            match = match && state[0][0][i] == state[1][0][i];
+            for (int a = 0; a < 3; ++a)
+            {
+                if (valid[i] > 0.0f)
+                {
+                    match = match && fabsf(out[0][a][i] - out[1][a][i]) <= 1e-5f;
+                }
+            }
+        }
+    }
+
+    return match;
+}
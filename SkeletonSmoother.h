@@ -0,0 +1,191 @@
+﻿//------------------------------------------------------------------------------
+// <copyright file="SkeletonSmoother.h" company="Microsoft">
+//     Copyright (c) Microsoft Corporation.  All rights reserved.
+// </copyright>
+//------------------------------------------------------------------------------
+
+#pragma once
+
+#include <windows.h>
+#include "NuiApi.h"
+
+/// <summary>
+/// Holt double exponential smoothing of one joint, the fields of NUI_TRANSFORM_SMOOTH_PARAMETERS
+/// </summary>
+struct SkeletonJointSmoothing
+{
+    // weight of the previous estimate against the new position, 0 passes positions through
+    float                               smoothing;
+
+    // how quickly the trend follows changes in velocity
+    float                               correction;
+
+    // frames of trend added on top of the estimate
+    float                               prediction;
+
+    // movements shorter than this, in meters, are damped as jitter
+    float                               jitterRadius;
+
+    // furthest the output may stray from the tracked position, in meters
+    float                               maxDeviationRadius;
+
+    // the parameters the sample always passed to NuiTransformSmooth
+    SkeletonJointSmoothing() :
+        smoothing(0.5f),
+        correction(0.1f),
+        prediction(0.5f),
+        jitterRadius(0.1f),
+        maxDeviationRadius(0.1f)
+    {
+    }
+};
+
+/// <summary>
+/// Joint state of every skeleton, one array entry per joint of every skeleton
+/// The smoothing kernels read the positions and parameters and update the state in place
+/// </summary>
+struct SkeletonJointStreams
+{
+    int                                 count;
+
+    // tracked positions, and where the smoothed positions are written
+    const float*                        pRawX;
+    const float*                        pRawY;
+    const float*                        pRawZ;
+    float*                              pOutX;
+    float*                              pOutY;
+    float*                              pOutZ;
+
+    // 1 for a joint tracked or inferred in this frame, 0 restarts its filter
+    const float*                        pValid;
+
+    // per joint parameters, radii already widened for inferred joints
+    const float*                        pSmoothing;
+    const float*                        pCorrection;
+    const float*                        pPrediction;
+    const float*                        pJitterRadius;
+    const float*                        pMaxDeviation;
+
+    // filter state carried from frame to frame
+    // history counts the frames the joint has been valid for, up to 2
+    float*                              pHistory;
+    float*                              pPrevRawX;
+    float*                              pPrevRawY;
+    float*                              pPrevRawZ;
+    float*                              pFilteredX;
+    float*                              pFilteredY;
+    float*                              pFilteredZ;
+    float*                              pTrendX;
+    float*                              pTrendY;
+    float*                              pTrendZ;
+};
+
+/// <summary>
+/// Smooth one frame of joints
+/// </summary>
+/// <param name="streams">positions, parameters and filter state</param>
+typedef void (*SmoothJointsFunc)(const SkeletonJointStreams& streams);
+
+/// <summary>
+/// Reference implementation, one joint at a time
+/// </summary>
+void SmoothJointsScalar(const SkeletonJointStreams& streams);
+
+/// <summary>
+/// SSE2 implementation, four joints at a time
+/// </summary>
+void SmoothJointsSSE2(const SkeletonJointStreams& streams);
+
+/// <summary>
+/// How much the smoother steadies the joints, and how far it strays from them
+/// </summary>
+struct SkeletonSmootherStats
+{
+    // joints measured, each tracked for the last three frames
+    ULONGLONG                           samples;
+
+    // summed length of the frame to frame change in velocity, meters per frame squared
+    double                              rawJitterSum;
+    double                              smoothedJitterSum;
+
+    // summed distance between the smoothed and the tracked position, meters, the price paid in lag
+    double                              deviationSum;
+};
+
+/// <summary>
+/// Smooths every joint of every skeleton in a frame, replacing NuiTransformSmooth
+/// Joints are kept as structure of arrays so a frame is filtered a few joints per instruction
+/// </summary>
+class CSkeletonSmoother
+{
+public:
+    static const int                    cJointCount = NUI_SKELETON_COUNT * NUI_SKELETON_POSITION_COUNT;
+
+    /// <summary>
+    /// Constructor
+    /// </summary>
+    CSkeletonSmoother();
+
+    /// <summary>
+    /// Use the same parameters for every joint
+    /// </summary>
+    /// <param name="params">smoothing parameters</param>
+    void                                SetSmoothing(const SkeletonJointSmoothing& params);
+
+    /// <summary>
+    /// Use different parameters for one joint of every skeleton
+    /// </summary>
+    /// <param name="joint">joint to change</param>
+    /// <param name="params">smoothing parameters</param>
+    void                                SetJointSmoothing(NUI_SKELETON_POSITION_INDEX joint, const SkeletonJointSmoothing& params);
+
+    /// <summary>
+    /// Forget every skeleton, the next frame starts the filters afresh
+    /// </summary>
+    void                                Reset();
+
+    /// <summary>
+    /// Smooth the joints of a frame in place
+    /// Skeletons that are not tracked restart their filters, as a new user may take their place
+    /// </summary>
+    /// <param name="pFrame">frame to smooth</param>
+    void                                Smooth(NUI_SKELETON_FRAME* pFrame);
+
+    /// <summary>
+    /// Jitter and deviation measured since the last Reset
+    /// </summary>
+    const SkeletonSmootherStats&        GetStats() const { return m_stats; }
+
+private:
+    SmoothJointsFunc                    m_pfnSmooth;
+    SkeletonJointStreams                m_streams;
+    SkeletonJointSmoothing              m_params[NUI_SKELETON_POSITION_COUNT];
+    SkeletonSmootherStats               m_stats;
+
+    float                               m_rawX[cJointCount];
+    float                               m_rawY[cJointCount];
+    float                               m_rawZ[cJointCount];
+    float                               m_outX[cJointCount];
+    float                               m_outY[cJointCount];
+    float                               m_outZ[cJointCount];
+    float                               m_valid[cJointCount];
+    float                               m_smoothing[cJointCount];
+    float                               m_correction[cJointCount];
+    float                               m_prediction[cJointCount];
+    float                               m_jitterRadius[cJointCount];
+    float                               m_maxDeviation[cJointCount];
+    float                               m_history[cJointCount];
+    float                               m_prevRaw[3][cJointCount];
+    float                               m_filtered[3][cJointCount];
+    float                               m_trend[3][cJointCount];
+
+    // last two tracked and smoothed positions, for the jitter measurement
+    float                               m_statRaw[2][3][cJointCount];
+    float                               m_statOut[2][3][cJointCount];
+};
+
+/// <summary>
+/// Check the SIMD smoothing kernel against the reference on random joints
+/// </summary>
+/// <returns>true if both implementations agree</returns>
+bool VerifySkeletonSmoother();
@@ -0,0 +1,540 @@
+﻿//------------------------------------------------------------------------------
+// <copyright file="SoftwareRenderer.cpp" company="Microsoft">
+//     Copyright (c) Microsoft Corporation.  All rights reserved.
+// </copyright>
+//------------------------------------------------------------------------------
+
+#include "SoftwareRenderer.h"
+
+#include <math.h>
+#include <string.h>
+
+namespace
+{
+    // the shader scales point sprites up a little to fill in holes, and more with distance against aliasing
+    const float cPointSpriteScale = 2.5f;
+
+    // the shader adds float4(0.2, 0, 0, 1) to the red channel of tinted points
+    const int cTintRed = 51;
+
+    /// <summary>
+    /// Multiply a row vector by a matrix, as HLSL mul(vector, matrix) does
+    /// </summary>
+    inline void Transform(const float v[4], const float* m, float result[4])
+    {
+        for (int i = 0; i < 4; ++i)
+        {
+            result[i] = v[0] * m[i] + v[1] * m[4 + i] + v[2] * m[8 + i] + v[3] * m[12 + i];
+        }
+    }
+
+    inline int Max(int a, int b) { return a > b ? a : b; }
+    inline int Min(int a, int b) { return a < b ? a : b; }
+
+    /// <summary>
+    /// Write a little endian value of the given size
+    /// </summary>
+    void WriteLittleEndian(uint8_t** ppOut, uint32_t value, int bytes)
+    {
+        for (int i = 0; i < bytes; ++i)
+        {
+            *(*ppOut)++ = static_cast<uint8_t>(value >> (8 * i));
+        }
+    }
+}
+
+/// <summary>
+/// Constructor
+/// </summary>
+CSoftwareRenderer::CSoftwareRenderer() :
+    m_width(0),
+    m_height(0),
+    m_tilesX(0),
+    m_tilesY(0),
+    m_viewCount(0),
+    m_pProjection(NULL),
+    m_pRect(NULL)
+{
+    m_desc.pDepth = NULL;
+    m_desc.pColor = NULL;
+    m_desc.colorPitch = 0;
+    m_desc.depthWidth = 0;
+    m_desc.depthHeight = 0;
+    m_desc.colorWidth = 0;
+    m_desc.colorHeight = 0;
+    m_desc.xyScale = 0.0f;
+
+    for (int v = 0; v < cMaxViews; ++v)
+    {
+        m_pViews[v] = NULL;
+        m_viewports[v].x = 0;
+        m_viewports[v].y = 0;
+        m_viewports[v].width = 0;
+        m_viewports[v].height = 0;
+    }
+}
+
+/// <summary>
+/// Size the color and depth buffers
+/// </summary>
+/// <param name="width">width in pixels</param>
+/// <param name="height">height in pixels</param>
+void CSoftwareRenderer::Resize(int width, int height)
+{
+    m_width = width;
+    m_height = height;
+    m_tilesX = (width + cTileSize - 1) / cTileSize;
+    m_tilesY = (height + cTileSize - 1) / cTileSize;
+    m_color.resize(width * height);
+    m_depth.resize(width * height);
+}
+
+/// <summary>
+/// Fill the color buffer and reset the depth buffer to the far plane
+/// </summary>
+/// <param name="color">BGRA fill color</param>
+void CSoftwareRenderer::Clear(uint32_t color)
+{
+    for (size_t i = 0; i < m_color.size(); ++i)
+    {
+        m_color[i] = color;
+        m_depth[i] = 1.0f;
+    }
+}
+
+/// <summary>
+/// Convert a depth frame into the points drawn by the following DrawSplats calls
+/// </summary>
+/// <param name="desc">depth frame and color remapped into depth space, must stay valid until the last draw</param>
+/// <param name="pPool">threads to convert rows with</param>
+void CSoftwareRenderer::SetPoints(const PointCloudDesc& desc, CWorkerPool* pPool)
+{
+    m_desc = desc;
+
+    int chunkCount = (desc.depthHeight + cRowsPerChunk - 1) / cRowsPerChunk;
+    m_chunks.resize(chunkCount);
+    for (int c = 0; c < chunkCount; ++c)
+    {
+        m_chunks[c].points.resize(cRowsPerChunk * desc.depthWidth);
+        m_chunks[c].pixels.resize(cRowsPerChunk * desc.depthWidth);
+        m_chunks[c].pointCount = 0;
+    }
+
+    pPool->ParallelFor(0, chunkCount, 1, ConvertChunks, this);
+}
+
+/// <summary>
+/// Draw the current points with depth testing
+/// </summary>
+/// <param name="constants">view, projection and face rectangle</param>
+/// <param name="viewport">part of the target to draw into</param>
+/// <param name="pPool">threads to transform and shade with</param>
+void CSoftwareRenderer::DrawSplats(const SplatConstants& constants, const SplatViewport& viewport, CWorkerPool* pPool)
+{
+    m_viewCount = 1;
+    m_pViews[0] = &constants.view[0][0];
+    m_viewports[0] = viewport;
+    m_pProjection = &constants.projection[0][0];
+    m_pRect = constants.rect;
+
+    Draw(pPool);
+}
+
+/// <summary>
+/// Draw the current points for both eyes in one pass, as the stereo geometry shader does
+/// Every point is unprojected and colored once and then placed in each eye's viewport
+/// </summary>
+/// <param name="constants">eye views, projection and face rectangle</param>
+/// <param name="viewports">left and right eye viewports, must not overlap</param>
+/// <param name="pPool">threads to transform and shade with</param>
+void CSoftwareRenderer::DrawStereoSplats(const StereoSplatConstants& constants, const SplatViewport viewports[2], CWorkerPool* pPool)
+{
+    m_viewCount = 2;
+    for (int v = 0; v < 2; ++v)
+    {
+        m_pViews[v] = &constants.eyeView[v][0][0];
+        m_viewports[v] = viewports[v];
+    }
+    m_pProjection = &constants.projection[0][0];
+    m_pRect = constants.rect;
+
+    Draw(pPool);
+}
+
+/// <summary>
+/// Bin and shade the points into the views set up by the caller
+/// </summary>
+/// <param name="pPool">threads to transform and shade with</param>
+void CSoftwareRenderer::Draw(CWorkerPool* pPool)
+{
+    size_t tileCount = m_tilesX * m_tilesY;
+    for (size_t c = 0; c < m_chunks.size(); ++c)
+    {
+        m_chunks[c].bins.resize(tileCount);
+    }
+
+    // Chunks are binned in parallel, then every tile walks the chunks in order so
+    // splats at equal depth resolve the same way the GPU's primitive order does
+    pPool->ParallelFor(0, static_cast<int>(m_chunks.size()), 1, BinChunks, this);
+    pPool->ParallelFor(0, static_cast<int>(tileCount), 1, ShadeTiles, this);
+
+    m_viewCount = 0;
+}
+
+/// <summary>
+/// Convert the depth rows of a range of chunks into points
+/// </summary>
+void CSoftwareRenderer::ConvertChunks(void* pContext, int begin, int end)
+{
+    CSoftwareRenderer* pThis = static_cast<CSoftwareRenderer*>(pContext);
+    const PointCloudDesc& desc = pThis->m_desc;
+
+    for (int c = begin; c < end; ++c)
+    {
+        Chunk& chunk = pThis->m_chunks[c];
+        int rowBegin = c * cRowsPerChunk;
+        int rowEnd = Min(rowBegin + cRowsPerChunk, desc.depthHeight);
+
+        // both list the same pixels in the same order
+        chunk.pointCount = GeneratePointCloudSSE2(desc, rowBegin, rowEnd, &chunk.points[0]);
+        BuildPointIndices(desc.pDepth, desc.depthWidth, rowBegin, rowEnd, &chunk.pixels[0]);
+    }
+}
+
+/// <summary>
+/// Project the points of a range of chunks into splats and sort them into tiles
+/// Follows the geometry shader: the quad is expanded in view space and then projected
+/// </summary>
+void CSoftwareRenderer::BinChunks(void* pContext, int begin, int end)
+{
+    CSoftwareRenderer* pThis = static_cast<CSoftwareRenderer*>(pContext);
+    const PointCloudDesc& desc = pThis->m_desc;
+    const float* pRect = pThis->m_pRect;
+
+    // drawing is limited to each viewport and the target
+    int clipLeft[cMaxViews], clipTop[cMaxViews], clipRight[cMaxViews], clipBottom[cMaxViews];
+    for (int view = 0; view < pThis->m_viewCount; ++view)
+    {
+        const SplatViewport& viewport = pThis->m_viewports[view];
+        clipLeft[view] = Max(viewport.x, 0);
+        clipTop[view] = Max(viewport.y, 0);
+        clipRight[view] = Min(viewport.x + viewport.width, pThis->m_width);
+        clipBottom[view] = Min(viewport.y + viewport.height, pThis->m_height);
+    }
+
+    float spriteScaleX = cPointSpriteScale / desc.depthWidth * 0.5f;
+    float spriteScaleY = cPointSpriteScale / desc.depthHeight * 0.5f;
+
+    for (int c = begin; c < end; ++c)
+    {
+        Chunk& chunk = pThis->m_chunks[c];
+        chunk.splats.clear();
+        for (size_t t = 0; t < chunk.bins.size(); ++t)
+        {
+            chunk.bins[t].clear();
+        }
+
+        for (int i = 0; i < chunk.pointCount; ++i)
+        {
+            const PointCloudPoint& point = chunk.points[i];
+
+            // the color pixel stays, the alpha written is always one
+            uint32_t color = point.color | 0xff000000;
+
+            // tint the face rectangle
+            uint32_t pixel = chunk.pixels[i];
+            float u = static_cast<float>(pixel % desc.depthWidth) / desc.depthWidth;
+            float v = static_cast<float>(pixel / desc.depthWidth) / desc.depthHeight;
+            if (u > pRect[0] && u < pRect[1] && v > pRect[2] && v < pRect[3])
+            {
+                uint32_t red = Min(static_cast<int>((color >> 16) & 0xff) + cTintRed, 255);
+                color = (color & 0xff00ffff) | (red << 16);
+            }
+
+            float worldPos[4] = { point.x, point.y, point.z, 1.0f };
+            float halfWidth = spriteScaleX * point.z;
+            float halfHeight = spriteScaleY * point.z;
+
+            // a stereo draw emits the point for each eye in turn, like the geometry shader's strips
+            for (int view = 0; view < pThis->m_viewCount; ++view)
+            {
+                const SplatViewport& viewport = pThis->m_viewports[view];
+
+                // convert to camera space, then the corners are offset in x and y only
+                float viewPos[4];
+                Transform(worldPos, pThis->m_pViews[view], viewPos);
+
+                float minX = 0.0f, maxX = 0.0f, minY = 0.0f, maxY = 0.0f;
+                bool bVisible = true;
+                for (int corner = 0; corner < 4 && bVisible; ++corner)
+                {
+                    float expanded[4] =
+                    {
+                        viewPos[0] + ((corner & 1) ? halfWidth : -halfWidth),
+                        viewPos[1] + ((corner & 2) ? halfHeight : -halfHeight),
+                        viewPos[2],
+                        viewPos[3]
+                    };
+
+                    float clipPos[4];
+                    Transform(expanded, pThis->m_pProjection, clipPos);
+
+                    // splats crossing the near or far plane are dropped rather than clipped, they are a few pixels at most
+                    if (clipPos[3] <= 0.0f || clipPos[2] < 0.0f || clipPos[2] > clipPos[3])
+                    {
+                        bVisible = false;
+                        break;
+                    }
+
+                    float screenX = viewport.x + (clipPos[0] / clipPos[3] + 1.0f) * 0.5f * viewport.width;
+                    float screenY = viewport.y + (1.0f - clipPos[1] / clipPos[3]) * 0.5f * viewport.height;
+                    if (0 == corner)
+                    {
+                        minX = maxX = screenX;
+                        minY = maxY = screenY;
+                    }
+                    else
+                    {
+                        minX = screenX < minX ? screenX : minX;
+                        maxX = screenX > maxX ? screenX : maxX;
+                        minY = screenY < minY ? screenY : minY;
+                        maxY = screenY > maxY ? screenY : maxY;
+                    }
+                }
+
+                if (!bVisible)
+                {
+                    continue;
+                }
+
+                // pixels whose centers are inside, with the top left edges inclusive
+                Splat splat;
+                splat.left = Max(static_cast<int>(ceilf(minX - 0.5f)), clipLeft[view]);
+                splat.top = Max(static_cast<int>(ceilf(minY - 0.5f)), clipTop[view]);
+                splat.right = Min(static_cast<int>(ceilf(maxX - 0.5f)), clipRight[view]);
+                splat.bottom = Min(static_cast<int>(ceilf(maxY - 0.5f)), clipBottom[view]);
+                if (splat.left >= splat.right || splat.top >= splat.bottom)
+                {
+                    continue;
+                }
+
+                float clipCenter[4];
+                Transform(viewPos, pThis->m_pProjection, clipCenter);
+                splat.depth = clipCenter[2] / clipCenter[3];
+                splat.color = color;
+
+                uint32_t index = static_cast<uint32_t>(chunk.splats.size());
+                chunk.splats.push_back(splat);
+
+                for (int ty = splat.top / cTileSize; ty <= (splat.bottom - 1) / cTileSize; ++ty)
+                {
+                    for (int tx = splat.left / cTileSize; tx <= (splat.right - 1) / cTileSize; ++tx)
+                    {
+                        chunk.bins[ty * pThis->m_tilesX + tx].push_back(index);
+                    }
+                }
+            }
+        }
+    }
+}
+
+/// <summary>
+/// Rasterize the splats of a range of tiles, depth tested with less than
+/// </summary>
+void CSoftwareRenderer::ShadeTiles(void* pContext, int begin, int end)
+{
+    CSoftwareRenderer* pThis = static_cast<CSoftwareRenderer*>(pContext);
+    int width = pThis->m_width;
+
+    for (int t = begin; t < end; ++t)
+    {
+        int tileLeft = (t % pThis->m_tilesX) * cTileSize;
+        int tileTop = (t / pThis->m_tilesX) * cTileSize;
+        int tileRight = Min(tileLeft + cTileSize, width);
+        int tileBottom = Min(tileTop + cTileSize, pThis->m_height);
+
+        for (size_t c = 0; c < pThis->m_chunks.size(); ++c)
+        {
+            const Chunk& chunk = pThis->m_chunks[c];
+            const std::vector<uint32_t>& bin = chunk.bins[t];
+
+            for (size_t i = 0; i < bin.size(); ++i)
+            {
+                const Splat& splat = chunk.splats[bin[i]];
+                int left = Max(splat.left, tileLeft);
+                int right = Min(splat.right, tileRight);
+                int top = Max(splat.top, tileTop);
+                int bottom = Min(splat.bottom, tileBottom);
+
+                for (int y = top; y < bottom; ++y)
+                {
+                    uint32_t* pColor = &pThis->m_color[y * width];
+                    float* pDepth = &pThis->m_depth[y * width];
+
+                    for (int x = left; x < right; ++x)
+                    {
+                        if (splat.depth < pDepth[x])
+                        {
+                            pDepth[x] = splat.depth;
+                            pColor[x] = splat.color;
+                        }
+                    }
+                }
+            }
+        }
+    }
+}
+
+/// <summary>
+/// Write the color buffer as a 32 bit bitmap file
+/// </summary>
+/// <param name="pFile">file opened for binary writing</param>
+/// <returns>true on success</returns>
+bool CSoftwareRenderer::WriteBitmap(FILE* pFile) const
+{
+    const uint32_t cFileHeaderSize = 14;
+    const uint32_t cInfoHeaderSize = 40;
+    uint32_t imageSize = static_cast<uint32_t>(m_color.size() * sizeof(uint32_t));
+
+    uint8_t header[cFileHeaderSize + cInfoHeaderSize];
+    uint8_t* pOut = header;
+
+    // BITMAPFILEHEADER
+    WriteLittleEndian(&pOut, 'B' | ('M' << 8), 2);
+    WriteLittleEndian(&pOut, sizeof(header) + imageSize, 4);
+    WriteLittleEndian(&pOut, 0, 4);
+    WriteLittleEndian(&pOut, sizeof(header), 4);
+
+    // BITMAPINFOHEADER, a negative height stores rows top down
+    WriteLittleEndian(&pOut, cInfoHeaderSize, 4);
+    WriteLittleEndian(&pOut, static_cast<uint32_t>(m_width), 4);
+    WriteLittleEndian(&pOut, static_cast<uint32_t>(-m_height), 4);
+    WriteLittleEndian(&pOut, 1, 2);
+    WriteLittleEndian(&pOut, 32, 2);
+    WriteLittleEndian(&pOut, 0, 4);
+    WriteLittleEndian(&pOut, imageSize, 4);
+    WriteLittleEndian(&pOut, 2835, 4);
+    WriteLittleEndian(&pOut, 2835, 4);
+    WriteLittleEndian(&pOut, 0, 4);
+    WriteLittleEndian(&pOut, 0, 4);
+
+    if (1 != fwrite(header, sizeof(header), 1, pFile))
+    {
+        return false;
+    }
+
+    return m_color.empty() || 1 == fwrite(&m_color[0], imageSize, 1, pFile);
+}
+
+/// <summary>
+/// Compare single pass stereo against drawing each eye separately on synthetic data
+/// </summary>
+/// <returns>true if both produce the same image</returns>
+bool VerifyStereoSplats()
+{
+    const int depthWidth = 160;
+    const int depthHeight = 120;
+    const int targetWidth = 200;
+    const int targetHeight = 90;
+
+    // a tilted plane with a bump in front of it and a ring of rejected pixels
+    std::vector<uint16_t> depth(depthWidth * depthHeight);
+    std::vector<uint32_t> color(depthWidth * depthHeight);
+    for (int y = 0; y < depthHeight; ++y)
+    {
+        for (int x = 0; x < depthWidth; ++x)
+        {
+            int dx = x - depthWidth / 2;
+            int dy = y - depthHeight / 2;
+            int radiusSquared = dx * dx + dy * dy;
+
+            int millimeters = 2000 + x * 4 + y * 2;
+            if (radiusSquared < 900)
+            {
+                millimeters = 1200 + radiusSquared;
+            }
+            else if (radiusSquared < 1000)
+            {
+                millimeters = 0;
+            }
+
+            depth[y * depthWidth + x] = static_cast<uint16_t>(millimeters << 3);
+            color[y * depthWidth + x] = static_cast<uint32_t>(x * 1601 + y * 40503);
+        }
+    }
+
+    PointCloudDesc desc;
+    desc.pDepth = &depth[0];
+    desc.pColor = reinterpret_cast<const uint8_t*>(&color[0]);
+    desc.colorPitch = depthWidth * 4;
+    desc.depthWidth = depthWidth;
+    desc.depthHeight = depthHeight;
+    desc.colorWidth = depthWidth;
+    desc.colorHeight = depthHeight;
+    desc.xyScale = 0.0036f;
+
+    // eyes 0.2 apart looking from slightly behind the sensor, perspective like XMMatrixPerspectiveFovLH
+    StereoSplatConstants stereo;
+    memset(&stereo, 0, sizeof(stereo));
+    for (int eye = 0; eye < 2; ++eye)
+    {
+        stereo.eyeView[eye][0][0] = stereo.eyeView[eye][1][1] = stereo.eyeView[eye][2][2] = stereo.eyeView[eye][3][3] = 1.0f;
+        stereo.eyeView[eye][3][0] = eye ? -0.1f : 0.1f;
+        stereo.eyeView[eye][3][2] = 0.3f;
+    }
+
+    const float nearZ = 0.1f;
+    const float farZ = 100.0f;
+    float yScale = 1.0f / tanf(3.14159265f / 8.0f);
+    stereo.projection[0][0] = yScale * targetHeight / (targetWidth / 2);
+    stereo.projection[1][1] = yScale;
+    stereo.projection[2][2] = farZ / (farZ - nearZ);
+    stereo.projection[2][3] = 1.0f;
+    stereo.projection[3][2] = -nearZ * farZ / (farZ - nearZ);
+    stereo.rect[0] = 0.3f;
+    stereo.rect[1] = 0.7f;
+    stereo.rect[2] = 0.2f;
+    stereo.rect[3] = 0.6f;
+
+    SplatViewport viewports[2] =
+    {
+        { 0, 0, targetWidth / 2, targetHeight },
+        { targetWidth / 2, 0, targetWidth / 2, targetHeight }
+    };
+
+    CWorkerPool pool;
+    pool.Start(2);
+
+    CSoftwareRenderer twoPass;
+    twoPass.Resize(targetWidth, targetHeight);
+    twoPass.Clear(0xff000000);
+    twoPass.SetPoints(desc, &pool);
+
+    for (int eye = 0; eye < 2; ++eye)
+    {
+        SplatConstants constants;
+        memcpy(constants.view, stereo.eyeView[eye], sizeof(constants.view));
+        memcpy(constants.projection, stereo.projection, sizeof(constants.projection));
+        memcpy(constants.rect, stereo.rect, sizeof(constants.rect));
+        twoPass.DrawSplats(constants, viewports[eye], &pool);
+    }
+
+    CSoftwareRenderer singlePass;
+    singlePass.Resize(targetWidth, targetHeight);
+    singlePass.Clear(0xff000000);
+    singlePass.SetPoints(desc, &pool);
+    singlePass.DrawStereoSplats(stereo, viewports, &pool);
+
+    // something has to be drawn for the comparison to mean anything
+    int drawn = 0;
+    for (int i = 0; i < targetWidth * targetHeight; ++i)
+    {
+        if (twoPass.GetPixels()[i] != singlePass.GetPixels()[i])
+        {
+            return false;
+        }
+        drawn += (0xff000000 != twoPass.GetPixels()[i]) ? 1 : 0;
+    }
+
+    return drawn > 0;
+}
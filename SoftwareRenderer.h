@@ -0,0 +1,185 @@
+﻿//------------------------------------------------------------------------------
+// <copyright file="SoftwareRenderer.h" company="Microsoft">
+//     Copyright (c) Microsoft Corporation.  All rights reserved.
+// </copyright>
+//------------------------------------------------------------------------------
+
+#pragma once
+
+#include <stdint.h>
+#include <stdio.h>
+#include <vector>
+#include "PointCloud.h"
+#include "WorkerPool.h"
+
+/// <summary>
+/// Per draw inputs of the splat renderer, the CPU side of cbChangesEveryFrame
+/// </summary>
+struct SplatConstants
+{
+    // matrices applied to row vectors, laid out like DirectX::XMFLOAT4X4 before transposing for HLSL
+    float                               view[4][4];
+    float                               projection[4][4];
+
+    // pixels whose normalized depth image coordinates fall inside left, right, top, bottom are tinted red
+    float                               rect[4];
+};
+
+/// <summary>
+/// Per draw inputs of a single pass stereo draw, the CPU side of cbStereoEveryFrame
+/// </summary>
+struct StereoSplatConstants
+{
+    // view matrices of the left and the right eye
+    float                               eyeView[2][4][4];
+    float                               projection[4][4];
+    float                               rect[4];
+};
+
+/// <summary>
+/// Area of the render target a draw covers, in pixels
+/// </summary>
+struct SplatViewport
+{
+    int                                 x;
+    int                                 y;
+    int                                 width;
+    int                                 height;
+};
+
+/// <summary>
+/// Renders the depth point cloud the way the geometry and pixel shaders do, without a GPU
+/// Each point becomes a screen aligned square, binned into tiles which are shaded in parallel.
+/// Points are set once per frame and can be drawn into several viewports, like the three D3D draws.
+/// </summary>
+class CSoftwareRenderer
+{
+public:
+    /// <summary>
+    /// Constructor
+    /// </summary>
+    CSoftwareRenderer();
+
+    /// <summary>
+    /// Size the color and depth buffers
+    /// </summary>
+    /// <param name="width">width in pixels</param>
+    /// <param name="height">height in pixels</param>
+    void                                Resize(int width, int height);
+
+    int                                 GetWidth() const { return m_width; }
+    int                                 GetHeight() const { return m_height; }
+
+    /// <summary>
+    /// Rendered image, BGRA bytes, rows tightly packed top down
+    /// </summary>
+    const uint32_t*                     GetPixels() const { return m_color.empty() ? NULL : &m_color[0]; }
+
+    /// <summary>
+    /// Fill the color buffer and reset the depth buffer to the far plane
+    /// </summary>
+    /// <param name="color">BGRA fill color</param>
+    void                                Clear(uint32_t color);
+
+    /// <summary>
+    /// Convert a depth frame into the points drawn by the following DrawSplats calls
+    /// </summary>
+    /// <param name="desc">depth frame and color remapped into depth space, must stay valid until the last draw</param>
+    /// <param name="pPool">threads to convert rows with</param>
+    void                                SetPoints(const PointCloudDesc& desc, CWorkerPool* pPool);
+
+    /// <summary>
+    /// Draw the current points with depth testing
+    /// </summary>
+    /// <param name="constants">view, projection and face rectangle</param>
+    /// <param name="viewport">part of the target to draw into</param>
+    /// <param name="pPool">threads to transform and shade with</param>
+    void                                DrawSplats(const SplatConstants& constants, const SplatViewport& viewport, CWorkerPool* pPool);
+
+    /// <summary>
+    /// Draw the current points for both eyes in one pass, as the stereo geometry shader does
+    /// Every point is unprojected and colored once and then placed in each eye's viewport
+    /// </summary>
+    /// <param name="constants">eye views, projection and face rectangle</param>
+    /// <param name="viewports">left and right eye viewports, must not overlap</param>
+    /// <param name="pPool">threads to transform and shade with</param>
+    void                                DrawStereoSplats(const StereoSplatConstants& constants, const SplatViewport viewports[2], CWorkerPool* pPool);
+
+    /// <summary>
+    /// Write the color buffer as a 32 bit bitmap file
+    /// </summary>
+    /// <param name="pFile">file opened for binary writing</param>
+    /// <returns>true on success</returns>
+    bool                                WriteBitmap(FILE* pFile) const;
+
+private:
+    // square screen tiles shaded by one thread each
+    static const int                    cTileSize = 64;
+
+    // depth rows converted and transformed together, fixed so tiles see splats in draw order
+    static const int                    cRowsPerChunk = 16;
+
+    // views a single draw projects into
+    static const int                    cMaxViews = 2;
+
+    /// <summary>
+    /// One point as it lands on screen, pixel bounds exclusive at the end
+    /// </summary>
+    struct Splat
+    {
+        int                             left;
+        int                             top;
+        int                             right;
+        int                             bottom;
+        float                           depth;
+        uint32_t                        color;
+    };
+
+    /// <summary>
+    /// Points of a band of depth rows and the splats they produce
+    /// </summary>
+    struct Chunk
+    {
+        std::vector<PointCloudPoint>    points;
+        std::vector<uint32_t>           pixels;
+        int                             pointCount;
+
+        std::vector<Splat>              splats;
+
+        // splats of this chunk overlapping each tile
+        std::vector<std::vector<uint32_t> > bins;
+    };
+
+    /// <summary>
+    /// Bin and shade the points into the views set up by the caller
+    /// </summary>
+    /// <param name="pPool">threads to transform and shade with</param>
+    void                                Draw(CWorkerPool* pPool);
+
+    static void                         ConvertChunks(void* pContext, int begin, int end);
+    static void                         BinChunks(void* pContext, int begin, int end);
+    static void                         ShadeTiles(void* pContext, int begin, int end);
+
+    int                                 m_width;
+    int                                 m_height;
+    int                                 m_tilesX;
+    int                                 m_tilesY;
+    std::vector<uint32_t>               m_color;
+    std::vector<float>                  m_depth;
+
+    PointCloudDesc                      m_desc;
+    std::vector<Chunk>                  m_chunks;
+
+    // inputs of the draw in progress, 4x4 matrices as 16 floats
+    int                                 m_viewCount;
+    const float*                        m_pViews[cMaxViews];
+    SplatViewport                       m_viewports[cMaxViews];
+    const float*                        m_pProjection;
+    const float*                        m_pRect;
+};
+
+/// <summary>
+/// Compare single pass stereo against drawing each eye separately on synthetic data
+/// </summary>
+/// <returns>true if both produce the same image</returns>
+bool VerifyStereoSplats();
@@ -0,0 +1,96 @@
+﻿//------------------------------------------------------------------------------
+// <copyright file="TripleBuffer.h" company="Microsoft">
+//     Copyright (c) Microsoft Corporation.  All rights reserved.
+// </copyright>
+//------------------------------------------------------------------------------
+
+#pragma once
+
+#include <windows.h>
+
+/// <summary>
+/// Lock-free hand off of the latest value from one producer thread to one consumer thread
+/// The producer fills a back slot and publishes it, replacing any value the consumer
+/// hasn't picked up yet. The consumer takes the latest published slot without ever waiting.
+/// Neither side touches the other's slot, so slots can hold large frames without copying.
+/// </summary>
+template <class T>
+class CTripleBuffer
+{
+public:
+    /// <summary>
+    /// Constructor
+    /// </summary>
+    CTripleBuffer() :
+        m_back(0),
+        m_middle(1),
+        m_front(2)
+    {
+    }
+
+    /// <summary>
+    /// Access a slot directly, for sizing them before either thread starts
+    /// </summary>
+    /// <param name="index">slot index, 0 to 2</param>
+    T&                                  GetSlot(int index) { return m_slots[index]; }
+
+    /// <summary>
+    /// Producer side, the slot to fill next
+    /// </summary>
+    T&                                  GetBack() { return m_slots[m_back]; }
+
+    /// <summary>
+    /// Producer side, make the back slot the latest value
+    /// </summary>
+    /// <returns>true if this replaced a value the consumer never picked up</returns>
+    bool                                Publish()
+    {
+        LONG previous = InterlockedExchange(&m_middle, m_back | cFresh);
+        m_back = previous & cIndexMask;
+        return 0 != (previous & cFresh);
+    }
+
+    /// <summary>
+    /// Producer side, whether the last published value is still waiting for the consumer
+    /// </summary>
+    bool                                IsPending() const
+    {
+        return 0 != (m_middle & cFresh);
+    }
+
+    /// <summary>
+    /// Consumer side, take the latest published value if there is a new one
+    /// </summary>
+    /// <returns>true if the front slot now holds a value not seen before</returns>
+    bool                                Acquire()
+    {
+        if (!IsPending())
+        {
+            return false;
+        }
+
+        m_front = InterlockedExchange(&m_middle, m_front) & cIndexMask;
+        return true;
+    }
+
+    /// <summary>
+    /// Consumer side, the value taken by the last successful Acquire
+    /// </summary>
+    const T&                            GetFront() const { return m_slots[m_front]; }
+
+private:
+    // the middle index carries a flag saying it was published and not yet acquired
+    static const LONG                   cFresh = 4;
+    static const LONG                   cIndexMask = 3;
+
+    T                                   m_slots[3];
+
+    // owned by the producer
+    LONG                                m_back;
+
+    // swapped between the two threads
+    volatile LONG                       m_middle;
+
+    // owned by the consumer
+    LONG                                m_front;
+};
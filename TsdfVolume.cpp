@@ -0,0 +1,935 @@
+﻿//------------------------------------------------------------------------------
+// <copyright file="TsdfVolume.cpp" company="Microsoft">
+//     Copyright (c) Microsoft Corporation.  All rights reserved.
+// </copyright>
+//------------------------------------------------------------------------------
+
+#include "TsdfVolume.h"
+
+#include <math.h>
+#include <string.h>
+#include <algorithm>
+
+namespace
+{
+    // the shader's conversion of D13P3 depth to meters, player index bits included
+    const float cDepthToMeters = 1.0f / 8000.0f;
+
+    // block coordinates are packed into 21 bits each, enough for +-10km of 1cm voxels
+    const int cKeyBits = 21;
+    const int cKeyBias = 1 << (cKeyBits - 1);
+    const uint64_t cKeyMask = (1ull << cKeyBits) - 1;
+
+    // voxels of a block and the layer of its neighbors a cell or an edge reaches into
+    const int cApronSize = cTsdfBlockSize + 2;
+
+    // cells whose corners are all within the apron, one more than the block on the low side
+    const int cCellSize = cTsdfBlockSize + 1;
+
+    /// <summary>
+    /// Index of a voxel in the apron around a block, coordinates from -1 to cTsdfBlockSize
+    /// </summary>
+    inline int ApronIndex(int x, int y, int z)
+    {
+        return (x + 1) + cApronSize * ((y + 1) + cApronSize * (z + 1));
+    }
+
+    /// <summary>
+    /// Index of a cell by its lowest corner, coordinates from -1 to cTsdfBlockSize - 1
+    /// </summary>
+    inline int CellIndex(int x, int y, int z)
+    {
+        return (x + 1) + cCellSize * ((y + 1) + cCellSize * (z + 1));
+    }
+
+    /// <summary>
+    /// Block holding a voxel coordinate, rounding towards negative infinity
+    /// </summary>
+    inline int FloorDiv(int value, int divisor)
+    {
+        return (value >= 0) ? value / divisor : -((-value + divisor - 1) / divisor);
+    }
+
+    /// <summary>
+    /// Per byte running average, blend is the sample's share
+    /// </summary>
+    inline uint32_t AverageColor(uint32_t average, uint32_t sample, float blend)
+    {
+        uint32_t result = 0;
+        for (int shift = 0; shift < 32; shift += 8)
+        {
+            int a = (average >> shift) & 0xff;
+            int s = (sample >> shift) & 0xff;
+            result |= static_cast<uint32_t>(a + (s - a) * blend) << shift;
+        }
+        return result;
+    }
+
+    /// <summary>
+    /// Distance field of one block and its neighbors, gathered for extraction
+    /// </summary>
+    struct Apron
+    {
+        float                           sdf[cApronSize * cApronSize * cApronSize];
+        uint32_t                        color[cApronSize * cApronSize * cApronSize];
+        bool                            valid[cApronSize * cApronSize * cApronSize];
+    };
+
+    /// <summary>
+    /// Surface vertex of one cell, if the surface passes through it
+    /// </summary>
+    struct CellVertex
+    {
+        float                           position[3];
+        uint32_t                        color;
+        bool                            valid;
+    };
+
+    /// <summary>
+    /// Vertex of the cell whose lowest corner is apron voxel x, y, z, valid only if the surface passes through it
+    /// The vertex is the mean of where the distance crosses zero along the cell's edges.
+    /// </summary>
+    void ComputeCell(const Apron& apron, int x, int y, int z, const int origin[3], float voxelSize, CellVertex* pCell)
+    {
+        pCell->valid = false;
+
+        // corner i is offset by bit 0 in x, bit 1 in y and bit 2 in z
+        int corners[8];
+        bool bAllValid = true;
+        int insideCount = 0;
+        for (int c = 0; c < 8; ++c)
+        {
+            corners[c] = ApronIndex(x + (c & 1), y + ((c >> 1) & 1), z + ((c >> 2) & 1));
+            bAllValid = bAllValid && apron.valid[corners[c]];
+            insideCount += apron.sdf[corners[c]] < 0 ? 1 : 0;
+        }
+
+        if (!bAllValid || 0 == insideCount || 8 == insideCount)
+        {
+            return;
+        }
+
+        float sum[3] = { 0.0f, 0.0f, 0.0f };
+        int crossings = 0;
+        int nearest = corners[0];
+        for (int c = 0; c < 8; ++c)
+        {
+            if (fabsf(apron.sdf[corners[c]]) < fabsf(apron.sdf[nearest]))
+            {
+                nearest = corners[c];
+            }
+
+            for (int axis = 0; axis < 3; ++axis)
+            {
+                int bit = 1 << axis;
+                if (c & bit)
+                {
+                    continue;
+                }
+
+                float a = apron.sdf[corners[c]];
+                float b = apron.sdf[corners[c | bit]];
+                if ((a < 0) == (b < 0))
+                {
+                    continue;
+                }
+
+                float t = a / (a - b);
+                sum[0] += (c & 1) + (0 == axis ? t : 0.0f);
+                sum[1] += ((c >> 1) & 1) + (1 == axis ? t : 0.0f);
+                sum[2] += ((c >> 2) & 1) + (2 == axis ? t : 0.0f);
+                ++crossings;
+            }
+        }
+
+        pCell->position[0] = (origin[0] + x + sum[0] / crossings) * voxelSize;
+        pCell->position[1] = (origin[1] + y + sum[1] / crossings) * voxelSize;
+        pCell->position[2] = (origin[2] + z + sum[2] / crossings) * voxelSize;
+        pCell->color = apron.color[nearest];
+        pCell->valid = true;
+    }
+}
+
+/// <summary>
+/// Constructor
+/// </summary>
+CTsdfVolume::CTsdfVolume() :
+    m_tableMask(0)
+{
+    memset(&m_stats, 0, sizeof(m_stats));
+    memset(&m_desc, 0, sizeof(m_desc));
+}
+
+/// <summary>
+/// Allocate the voxel blocks and the hash table, dropping anything integrated before
+/// </summary>
+/// <param name="params">resolution and memory budget</param>
+void CTsdfVolume::Create(const TsdfVolumeParams& params)
+{
+    m_params = params;
+
+    m_voxels.resize(m_params.maxBlocks * cTsdfBlockVoxels);
+    m_blocks.resize(m_params.maxBlocks);
+
+    uint32_t tableSize = 1;
+    while (tableSize < 2u * m_params.maxBlocks)
+    {
+        tableSize *= 2;
+    }
+    m_table.resize(tableSize);
+    m_tableMask = tableSize - 1;
+
+    Reset();
+}
+
+/// <summary>
+/// Drop every integrated frame, keeping the memory
+/// </summary>
+void CTsdfVolume::Reset()
+{
+    for (size_t i = 0; i < m_table.size(); ++i)
+    {
+        m_table[i].block = -1;
+    }
+
+    // handed out from the back, so the lowest blocks are used first
+    m_freeBlocks.resize(m_blocks.size());
+    for (size_t i = 0; i < m_blocks.size(); ++i)
+    {
+        m_blocks[i].lastSeen = 0;
+        m_freeBlocks[i] = static_cast<int>(m_blocks.size() - 1 - i);
+    }
+
+    memset(&m_stats, 0, sizeof(m_stats));
+}
+
+/// <summary>
+/// Hash key of a block position
+/// </summary>
+uint64_t CTsdfVolume::MakeKey(int x, int y, int z)
+{
+    return ((static_cast<uint64_t>(x + cKeyBias) & cKeyMask) << (2 * cKeyBits)) |
+           ((static_cast<uint64_t>(y + cKeyBias) & cKeyMask) << cKeyBits) |
+            (static_cast<uint64_t>(z + cKeyBias) & cKeyMask);
+}
+
+/// <summary>
+/// Slot a key is looked up from, probing continues in the following slots
+/// </summary>
+uint32_t CTsdfVolume::GetHomeSlot(uint64_t key) const
+{
+    // Fibonacci hashing spreads the neighboring keys of a surface over the table
+    return static_cast<uint32_t>((key * 0x9E3779B97F4A7C15ull) >> 32) & m_tableMask;
+}
+
+/// <summary>
+/// Find the block at a position
+/// </summary>
+/// <returns>index of the block, or -1 if there is none</returns>
+int CTsdfVolume::FindBlock(int x, int y, int z) const
+{
+    uint64_t key = MakeKey(x, y, z);
+    for (uint32_t slot = GetHomeSlot(key); m_table[slot].block >= 0; slot = (slot + 1) & m_tableMask)
+    {
+        if (m_table[slot].key == key)
+        {
+            return m_table[slot].block;
+        }
+    }
+
+    return -1;
+}
+
+/// <summary>
+/// Find the block at a position, taking a free one if there is none yet
+/// </summary>
+/// <returns>index of the block, or -1 if there is none and no block is free</returns>
+int CTsdfVolume::AllocateBlock(int x, int y, int z)
+{
+    uint64_t key = MakeKey(x, y, z);
+    uint32_t slot = GetHomeSlot(key);
+    for (; m_table[slot].block >= 0; slot = (slot + 1) & m_tableMask)
+    {
+        if (m_table[slot].key == key)
+        {
+            return m_table[slot].block;
+        }
+    }
+
+    if (m_freeBlocks.empty())
+    {
+        return -1;
+    }
+
+    int block = m_freeBlocks.back();
+    m_freeBlocks.pop_back();
+
+    m_table[slot].key = key;
+    m_table[slot].block = block;
+
+    Block& newBlock = m_blocks[block];
+    newBlock.x = x;
+    newBlock.y = y;
+    newBlock.z = z;
+
+    // unseen voxels have no weight, which keeps them out of the surface
+    memset(&m_voxels[block * cTsdfBlockVoxels], 0, cTsdfBlockVoxels * sizeof(Voxel));
+
+    return block;
+}
+
+/// <summary>
+/// Free a block and take it out of the hash table
+/// </summary>
+/// <param name="block">index of an allocated block</param>
+void CTsdfVolume::RemoveBlock(int block)
+{
+    Block& oldBlock = m_blocks[block];
+    uint64_t key = MakeKey(oldBlock.x, oldBlock.y, oldBlock.z);
+
+    uint32_t hole = GetHomeSlot(key);
+    while (m_table[hole].key != key || m_table[hole].block != block)
+    {
+        hole = (hole + 1) & m_tableMask;
+    }
+
+    // shift later entries of the probe sequence back, so lookups never stop at the hole too early
+    for (uint32_t next = (hole + 1) & m_tableMask; m_table[next].block >= 0; next = (next + 1) & m_tableMask)
+    {
+        uint32_t home = GetHomeSlot(m_table[next].key);
+        bool bReachable = (hole <= next) ? (hole < home && home <= next) : (hole < home || home <= next);
+        if (!bReachable)
+        {
+            m_table[hole] = m_table[next];
+            hole = next;
+        }
+    }
+
+    m_table[hole].block = -1;
+
+    oldBlock.lastSeen = 0;
+    m_freeBlocks.push_back(block);
+}
+
+/// <summary>
+/// Free the quarter of the budget seen least recently, sparing the blocks of the current frame
+/// Evicting in batches keeps the scan over all blocks rare.
+/// </summary>
+/// <returns>true if any block was freed, false if every block belongs to the current frame</returns>
+bool CTsdfVolume::EvictBlocks()
+{
+    std::vector<int>& candidates = m_evictCandidates;
+    candidates.clear();
+    for (size_t i = 0; i < m_blocks.size(); ++i)
+    {
+        if (0 != m_blocks[i].lastSeen && m_stats.frameCount != m_blocks[i].lastSeen)
+        {
+            candidates.push_back(static_cast<int>(i));
+        }
+    }
+
+    size_t count = (std::min)(candidates.size(), static_cast<size_t>((std::max)(1, m_params.maxBlocks / 4)));
+    if (0 == count)
+    {
+        return false;
+    }
+
+    const std::vector<Block>& blocks = m_blocks;
+    std::nth_element(candidates.begin(), candidates.begin() + (count - 1), candidates.end(),
+        [&blocks](int a, int b) { return blocks[a].lastSeen < blocks[b].lastSeen; });
+
+    for (size_t i = 0; i < count; ++i)
+    {
+        RemoveBlock(candidates[i]);
+    }
+
+    m_stats.evictedCount += static_cast<uint32_t>(count);
+    return true;
+}
+
+/// <summary>
+/// Fuse a depth frame into the volume
+/// </summary>
+/// <param name="desc">depth frame and color remapped into depth space</param>
+/// <param name="pPool">threads to update blocks with</param>
+void CTsdfVolume::Integrate(const PointCloudDesc& desc, CWorkerPool* pPool)
+{
+    if (m_blocks.empty())
+    {
+        return;
+    }
+
+    ++m_stats.frameCount;
+    m_desc = desc;
+
+    // which blocks the truncation band around the surface passes through, a list per row
+    int rowCount = (desc.depthHeight + cAllocationStride - 1) / cAllocationStride;
+    m_rowKeys.resize(rowCount);
+    pPool->ParallelFor(0, rowCount, 1, CollectBlocks, this);
+
+    // the hash table is only changed here, on one thread
+    m_visibleBlocks.clear();
+
+    // set once an eviction frees nothing, so the rest of the frame only finds blocks it already has
+    bool bFull = false;
+    for (int row = 0; row < rowCount; ++row)
+    {
+        const std::vector<uint64_t>& keys = m_rowKeys[row];
+        for (size_t i = 0; i < keys.size(); ++i)
+        {
+            int x = static_cast<int>((keys[i] >> (2 * cKeyBits)) & cKeyMask) - cKeyBias;
+            int y = static_cast<int>((keys[i] >> cKeyBits) & cKeyMask) - cKeyBias;
+            int z = static_cast<int>(keys[i] & cKeyMask) - cKeyBias;
+
+            int block = AllocateBlock(x, y, z);
+            if (block < 0 && !bFull)
+            {
+                if (EvictBlocks())
+                {
+                    block = AllocateBlock(x, y, z);
+                }
+                else
+                {
+                    bFull = true;
+                }
+            }
+
+            if (block < 0)
+            {
+                ++m_stats.droppedCount;
+            }
+            else if (m_stats.frameCount != m_blocks[block].lastSeen)
+            {
+                m_blocks[block].lastSeen = m_stats.frameCount;
+                m_visibleBlocks.push_back(block);
+            }
+        }
+    }
+
+    pPool->ParallelFor(0, static_cast<int>(m_visibleBlocks.size()), cMinBlocksPerBand, IntegrateBlocks, this);
+
+    m_stats.visibleBlockCount = static_cast<uint32_t>(m_visibleBlocks.size());
+    m_stats.blockCount = static_cast<uint32_t>(m_blocks.size() - m_freeBlocks.size());
+}
+
+/// <summary>
+/// Collect the blocks the truncation band crosses along every sampled ray of a band of rows, called from the worker pool
+/// </summary>
+/// <param name="pContext">the volume</param>
+/// <param name="begin">first sampled row of the band</param>
+/// <param name="end">one past the last sampled row of the band</param>
+void CTsdfVolume::CollectBlocks(void* pContext, int begin, int end)
+{
+    CTsdfVolume* pThis = static_cast<CTsdfVolume*>(pContext);
+    const PointCloudDesc& desc = pThis->m_desc;
+    const TsdfVolumeParams& params = pThis->m_params;
+
+    float halfWidthOffset = desc.depthWidth / 2.0f - 0.5f;
+    float halfHeightOffset = desc.depthHeight / 2.0f - 0.5f;
+    float blocksPerMeter = 1.0f / (params.voxelSize * cTsdfBlockSize);
+
+    // short enough that a block is only missed where the band clips its corner
+    float step = params.voxelSize * cTsdfBlockSize / 4.0f;
+
+    for (int row = begin; row < end; ++row)
+    {
+        std::vector<uint64_t>& keys = pThis->m_rowKeys[row];
+        keys.clear();
+
+        int y = row * cAllocationStride;
+
+        // y is flipped, the shader's XYScale.y is negative
+        float rowScale = (y - halfHeightOffset) * -desc.xyScale;
+
+        for (int x = 0; x < desc.depthWidth; x += cAllocationStride)
+        {
+            int depth = desc.pDepth[y * desc.depthWidth + x];
+            if (depth < cPointCloudMinDepth || depth > cPointCloudMaxDepth)
+            {
+                continue;
+            }
+
+            float realDepth = depth * cDepthToMeters;
+            float columnScale = (x - halfWidthOffset) * desc.xyScale;
+
+            float farDepth = realDepth + params.truncation;
+            for (float t = realDepth - params.truncation; ; t += step)
+            {
+                t = (std::min)(t, farDepth);
+
+                int bx = static_cast<int>(floorf(columnScale * t * blocksPerMeter));
+                int by = static_cast<int>(floorf(rowScale * t * blocksPerMeter));
+                int bz = static_cast<int>(floorf(t * blocksPerMeter));
+
+                // neighboring samples mostly land in the same block
+                uint64_t key = MakeKey(bx, by, bz);
+                if (keys.empty() || keys.back() != key)
+                {
+                    keys.push_back(key);
+                }
+
+                if (t >= farDepth)
+                {
+                    break;
+                }
+            }
+        }
+    }
+}
+
+/// <summary>
+/// Update the voxels of a band of the visible blocks, called from the worker pool
+/// Every voxel is projected into the depth frame like the shader unprojects pixels, and the
+/// distance along the ray to the measured depth is averaged into it.
+/// </summary>
+/// <param name="pContext">the volume</param>
+/// <param name="begin">first entry of m_visibleBlocks</param>
+/// <param name="end">one past the last entry of m_visibleBlocks</param>
+void CTsdfVolume::IntegrateBlocks(void* pContext, int begin, int end)
+{
+    CTsdfVolume* pThis = static_cast<CTsdfVolume*>(pContext);
+    const PointCloudDesc& desc = pThis->m_desc;
+    const TsdfVolumeParams& params = pThis->m_params;
+
+    float halfWidthOffset = desc.depthWidth / 2.0f - 0.5f;
+    float halfHeightOffset = desc.depthHeight / 2.0f - 0.5f;
+    float depthWidth = static_cast<float>(desc.depthWidth);
+    float depthHeight = static_cast<float>(desc.depthHeight);
+    float sdfPerMeter = cSdfScale / params.truncation;
+
+    // only voxels close to the surface take its color, further out they may see past an edge
+    float colorDistance = params.truncation * 0.5f;
+
+    for (int i = begin; i < end; ++i)
+    {
+        int block = pThis->m_visibleBlocks[i];
+        const Block& position = pThis->m_blocks[block];
+        Voxel* pVoxel = &pThis->m_voxels[block * cTsdfBlockVoxels];
+
+        for (int vz = 0; vz < cTsdfBlockSize; ++vz)
+        {
+            float z = (position.z * cTsdfBlockSize + vz) * params.voxelSize;
+            if (z <= 0.0f)
+            {
+                pVoxel += cTsdfBlockSize * cTsdfBlockSize;
+                continue;
+            }
+
+            // pixels per meter across at this depth
+            float pixelScale = 1.0f / (desc.xyScale * z);
+
+            for (int vy = 0; vy < cTsdfBlockSize; ++vy)
+            {
+                float y = (position.y * cTsdfBlockSize + vy) * params.voxelSize;
+                // rounded by truncation, which only matches floor once negative rows are out
+                float row = halfHeightOffset - y * pixelScale + 0.5f;
+                if (row < 0.0f || row >= depthHeight)
+                {
+                    pVoxel += cTsdfBlockSize;
+                    continue;
+                }
+
+                int pixelY = static_cast<int>(row);
+                const uint16_t* pDepthRow = desc.pDepth + pixelY * desc.depthWidth;
+                const uint32_t* pColorRow = reinterpret_cast<const uint32_t*>(desc.pColor + (pixelY * desc.colorHeight / desc.depthHeight) * desc.colorPitch);
+
+                for (int vx = 0; vx < cTsdfBlockSize; ++vx, ++pVoxel)
+                {
+                    float x = (position.x * cTsdfBlockSize + vx) * params.voxelSize;
+                    float column = x * pixelScale + halfWidthOffset + 0.5f;
+                    if (column < 0.0f || column >= depthWidth)
+                    {
+                        continue;
+                    }
+
+                    int pixelX = static_cast<int>(column);
+
+                    int depth = pDepthRow[pixelX];
+                    if (depth < cPointCloudMinDepth || depth > cPointCloudMaxDepth)
+                    {
+                        continue;
+                    }
+
+                    // voxels far behind the surface are hidden by it, nothing is known about them
+                    float distance = depth * cDepthToMeters - z;
+                    if (distance < -params.truncation)
+                    {
+                        continue;
+                    }
+
+                    float clamped = (std::min)(distance, params.truncation);
+                    int sdf = static_cast<int>(floorf(clamped * sdfPerMeter + 0.5f));
+
+                    // running average, one reciprocal rather than a division per channel
+                    int weight = pVoxel->weight;
+                    float blend = 1.0f / (weight + 1);
+                    pVoxel->sdf = static_cast<int16_t>(pVoxel->sdf + (sdf - pVoxel->sdf) * blend);
+
+                    if (fabsf(distance) < colorDistance)
+                    {
+                        pVoxel->color = AverageColor(pVoxel->color, pColorRow[pixelX * desc.colorWidth / desc.depthWidth], blend);
+                    }
+
+                    pVoxel->weight = static_cast<uint16_t>((std::min)(weight + 1, params.maxWeight));
+                }
+            }
+        }
+    }
+}
+
+/// <summary>
+/// Extract the fused surface as a triangle list, three vertices per triangle
+/// </summary>
+/// <param name="pPool">threads to extract blocks with</param>
+/// <param name="pVertices">receives the triangles, positions in meters and BGRX colors</param>
+void CTsdfVolume::ExtractSurface(CWorkerPool* pPool, std::vector<PointCloudPoint>* pVertices)
+{
+    m_extractBlocks.clear();
+    for (size_t i = 0; i < m_blocks.size(); ++i)
+    {
+        if (0 != m_blocks[i].lastSeen)
+        {
+            m_extractBlocks.push_back(static_cast<int>(i));
+        }
+    }
+
+    // each block writes its own triangles, the lists keep their memory between extractions
+    if (m_blockMeshes.size() < m_extractBlocks.size())
+    {
+        m_blockMeshes.resize(m_extractBlocks.size());
+    }
+
+    pPool->ParallelFor(0, static_cast<int>(m_extractBlocks.size()), cMinBlocksPerBand, ExtractBlocks, this);
+
+    size_t vertexCount = 0;
+    for (size_t i = 0; i < m_extractBlocks.size(); ++i)
+    {
+        vertexCount += m_blockMeshes[i].size();
+    }
+
+    pVertices->clear();
+    pVertices->reserve(vertexCount);
+    for (size_t i = 0; i < m_extractBlocks.size(); ++i)
+    {
+        pVertices->insert(pVertices->end(), m_blockMeshes[i].begin(), m_blockMeshes[i].end());
+    }
+}
+
+/// <summary>
+/// Extract the surface of a band of blocks, called from the worker pool
+/// </summary>
+/// <param name="pContext">the volume</param>
+/// <param name="begin">first entry of m_extractBlocks</param>
+/// <param name="end">one past the last entry of m_extractBlocks</param>
+void CTsdfVolume::ExtractBlocks(void* pContext, int begin, int end)
+{
+    CTsdfVolume* pThis = static_cast<CTsdfVolume*>(pContext);
+
+    for (int i = begin; i < end; ++i)
+    {
+        pThis->ExtractBlock(pThis->m_extractBlocks[i], &pThis->m_blockMeshes[i]);
+    }
+}
+
+/// <summary>
+/// Extract the quads of the voxel edges a block owns, those starting at one of its voxels
+/// </summary>
+/// <param name="block">index of the block</param>
+/// <param name="pVertices">receives the block's triangles</param>
+void CTsdfVolume::ExtractBlock(int block, std::vector<PointCloudPoint>* pVertices) const
+{
+    pVertices->clear();
+
+    const Block& position = m_blocks[block];
+
+    // the cells around the block's edges reach one voxel into the neighbors
+    const Voxel* pNeighbors[3][3][3];
+    for (int dz = -1; dz <= 1; ++dz)
+    {
+        for (int dy = -1; dy <= 1; ++dy)
+        {
+            for (int dx = -1; dx <= 1; ++dx)
+            {
+                int neighbor = (0 == dx && 0 == dy && 0 == dz) ? block : FindBlock(position.x + dx, position.y + dy, position.z + dz);
+                pNeighbors[dz + 1][dy + 1][dx + 1] = (neighbor >= 0) ? &m_voxels[neighbor * cTsdfBlockVoxels] : NULL;
+            }
+        }
+    }
+
+    Apron apron;
+    bool bInside = false;
+    bool bOutside = false;
+    for (int z = -1; z <= cTsdfBlockSize; ++z)
+    {
+        int nz = FloorDiv(z, cTsdfBlockSize);
+        int vz = z - nz * cTsdfBlockSize;
+
+        for (int y = -1; y <= cTsdfBlockSize; ++y)
+        {
+            int ny = FloorDiv(y, cTsdfBlockSize);
+            int vy = y - ny * cTsdfBlockSize;
+
+            for (int x = -1; x <= cTsdfBlockSize; ++x)
+            {
+                int nx = FloorDiv(x, cTsdfBlockSize);
+                int vx = x - nx * cTsdfBlockSize;
+
+                int index = ApronIndex(x, y, z);
+                const Voxel* pBlock = pNeighbors[nz + 1][ny + 1][nx + 1];
+                if (NULL == pBlock)
+                {
+                    apron.valid[index] = false;
+                    apron.sdf[index] = 0.0f;
+                    continue;
+                }
+
+                const Voxel& voxel = pBlock[vx + cTsdfBlockSize * (vy + cTsdfBlockSize * vz)];
+                apron.valid[index] = voxel.weight >= m_params.minSurfaceWeight;
+                apron.sdf[index] = voxel.sdf;
+                apron.color[index] = voxel.color;
+
+                if (apron.valid[index])
+                {
+                    bInside = bInside || voxel.sdf < 0;
+                    bOutside = bOutside || voxel.sdf >= 0;
+                }
+            }
+        }
+    }
+
+    // the surface crosses nothing here
+    if (!bInside || !bOutside)
+    {
+        return;
+    }
+
+    // cells are computed on first use, most of them are nowhere near the surface
+    int origin[3] = { position.x * cTsdfBlockSize, position.y * cTsdfBlockSize, position.z * cTsdfBlockSize };
+    CellVertex cells[cCellSize * cCellSize * cCellSize];
+    bool cellKnown[cCellSize * cCellSize * cCellSize];
+    memset(cellKnown, 0, sizeof(cellKnown));
+
+    // a quad of the four cells around every owned voxel edge the surface crosses
+    for (int z = 0; z < cTsdfBlockSize; ++z)
+    {
+        for (int y = 0; y < cTsdfBlockSize; ++y)
+        {
+            for (int x = 0; x < cTsdfBlockSize; ++x)
+            {
+                int from = ApronIndex(x, y, z);
+                if (!apron.valid[from])
+                {
+                    continue;
+                }
+
+                for (int axis = 0; axis < 3; ++axis)
+                {
+                    int v[3] = { x, y, z };
+                    int to[3] = { x, y, z };
+                    ++to[axis];
+
+                    int toIndex = ApronIndex(to[0], to[1], to[2]);
+                    bool bFromInside = apron.sdf[from] < 0;
+                    if (!apron.valid[toIndex] || bFromInside == (apron.sdf[toIndex] < 0))
+                    {
+                        continue;
+                    }
+
+                    // the other two axes in cyclic order, so every edge direction winds the same way
+                    int b = (axis + 1) % 3;
+                    int c = (axis + 2) % 3;
+
+                    int quad[4][3];
+                    for (int k = 0; k < 3; ++k)
+                    {
+                        quad[0][k] = quad[1][k] = quad[2][k] = quad[3][k] = v[k];
+                    }
+                    --quad[1][b];
+                    --quad[2][b];
+                    --quad[2][c];
+                    --quad[3][c];
+
+                    const CellVertex* pQuad[4];
+                    bool bQuadValid = true;
+                    for (int k = 0; k < 4; ++k)
+                    {
+                        int cell = CellIndex(quad[k][0], quad[k][1], quad[k][2]);
+                        if (!cellKnown[cell])
+                        {
+                            ComputeCell(apron, quad[k][0], quad[k][1], quad[k][2], origin, m_params.voxelSize, &cells[cell]);
+                            cellKnown[cell] = true;
+                        }
+
+                        pQuad[k] = &cells[cell];
+                        bQuadValid = bQuadValid && pQuad[k]->valid;
+                    }
+
+                    if (!bQuadValid)
+                    {
+                        continue;
+                    }
+
+                    // 0 1 2 faces along the edge, towards its far voxel, flipped to face the outside
+                    static const int cFacingFar[6] = { 0, 1, 2, 0, 2, 3 };
+                    static const int cFacingNear[6] = { 0, 2, 1, 0, 3, 2 };
+                    const int* pOrder = bFromInside ? cFacingFar : cFacingNear;
+
+                    for (int k = 0; k < 6; ++k)
+                    {
+                        const CellVertex& cell = *pQuad[pOrder[k]];
+                        PointCloudPoint vertex = { cell.position[0], cell.position[1], cell.position[2], cell.color };
+                        pVertices->push_back(vertex);
+                    }
+                }
+            }
+        }
+    }
+}
+
+namespace
+{
+    /// <summary>
+    /// Depth frame of a plane facing the sensor, valid only inside a rectangle of pixels
+    /// </summary>
+    void FillPlane(std::vector<uint16_t>* pDepth, int depthWidth, int left, int top, int right, int bottom, int millimeters)
+    {
+        for (int y = 0; y < static_cast<int>(pDepth->size()) / depthWidth; ++y)
+        {
+            for (int x = 0; x < depthWidth; ++x)
+            {
+                bool bInside = x >= left && x < right && y >= top && y < bottom;
+                (*pDepth)[y * depthWidth + x] = static_cast<uint16_t>(bInside ? millimeters << 3 : 0);
+            }
+        }
+    }
+
+    /// <summary>
+    /// Check the triangles lie on the plane z = planeZ and face the sensor
+    /// </summary>
+    /// <returns>total area of the triangles, or a negative value if one is off the plane or faces away</returns>
+    double MeasurePlane(const std::vector<PointCloudPoint>& vertices, float planeZ, float tolerance, uint32_t color)
+    {
+        if (0 != vertices.size() % 3)
+        {
+            return -1.0;
+        }
+
+        double area = 0.0;
+        for (size_t i = 0; i < vertices.size(); i += 3)
+        {
+            const PointCloudPoint* p = &vertices[i];
+            for (int k = 0; k < 3; ++k)
+            {
+                if (fabsf(p[k].z - planeZ) > tolerance || p[k].color != color)
+                {
+                    return -1.0;
+                }
+            }
+
+            float e1[3] = { p[1].x - p[0].x, p[1].y - p[0].y, p[1].z - p[0].z };
+            float e2[3] = { p[2].x - p[0].x, p[2].y - p[0].y, p[2].z - p[0].z };
+            float normalZ = e1[0] * e2[1] - e1[1] * e2[0];
+
+            // the sensor looks along +z, the free space in front of the plane is towards -z
+            if (normalZ > 0.0f)
+            {
+                return -1.0;
+            }
+            area -= 0.5 * normalZ;
+        }
+
+        return area;
+    }
+}
+
+/// <summary>
+/// Fuse synthetic planes and check the extracted surface lies on them and that eviction keeps to the budget
+/// </summary>
+/// <returns>true if the surface and the eviction are as expected</returns>
+bool VerifyTsdfVolume()
+{
+    const int depthWidth = 160;
+    const int depthHeight = 120;
+    const uint32_t planeColor = 0x00408020;
+
+    std::vector<uint16_t> depth(depthWidth * depthHeight);
+    std::vector<uint32_t> color(depthWidth * depthHeight, planeColor);
+
+    PointCloudDesc desc;
+    desc.pDepth = &depth[0];
+    desc.pColor = reinterpret_cast<const uint8_t*>(&color[0]);
+    desc.colorPitch = depthWidth * 4;
+    desc.depthWidth = depthWidth;
+    desc.depthHeight = depthHeight;
+    desc.colorWidth = depthWidth;
+    desc.colorHeight = depthHeight;
+    desc.xyScale = 0.0068f;
+
+    CWorkerPool pool;
+    pool.Start(2);
+
+    TsdfVolumeParams params;
+    params.maxBlocks = 4096;
+    params.minSurfaceWeight = 1;
+
+    // a plane 1.5m away filling the frame, seen a few times
+    const int planeMillimeters = 1500;
+    const float planeZ = planeMillimeters / 1000.0f;
+    FillPlane(&depth, depthWidth, 0, 0, depthWidth, depthHeight, planeMillimeters);
+
+    CTsdfVolume volume;
+    volume.Create(params);
+    for (int frame = 0; frame < 3; ++frame)
+    {
+        volume.Integrate(desc, &pool);
+    }
+
+    std::vector<PointCloudPoint> vertices;
+    volume.ExtractSurface(&pool, &vertices);
+
+    // the surface stops a cell short of the edges of the frustum, where the rays run out
+    double frameWidth = depthWidth * desc.xyScale * planeZ;
+    double frameHeight = depthHeight * desc.xyScale * planeZ;
+    double borderArea = 2.0 * (frameWidth + frameHeight) * 2.0 * params.voxelSize;
+    double area = MeasurePlane(vertices, planeZ, params.voxelSize * 0.5f, planeColor);
+    if (area < frameWidth * frameHeight - borderArea || area > frameWidth * frameHeight)
+    {
+        return false;
+    }
+
+    if (0 != volume.GetStats().evictedCount || 0 != volume.GetStats().droppedCount)
+    {
+        return false;
+    }
+
+    // a patch on the left, then one on the right, with room for only a little more than one of them
+    std::vector<PointCloudPoint> rightOnly;
+    FillPlane(&depth, depthWidth, 110, 40, 150, 80, planeMillimeters);
+    volume.Create(params);
+    volume.Integrate(desc, &pool);
+    volume.ExtractSurface(&pool, &rightOnly);
+
+    params.maxBlocks = volume.GetStats().blockCount * 3 / 2;
+    volume.Create(params);
+
+    FillPlane(&depth, depthWidth, 10, 40, 50, 80, planeMillimeters);
+    volume.Integrate(desc, &pool);
+    FillPlane(&depth, depthWidth, 110, 40, 150, 80, planeMillimeters);
+    volume.Integrate(desc, &pool);
+
+    const TsdfVolumeStats& stats = volume.GetStats();
+    if (0 == stats.evictedCount || 0 != stats.droppedCount || stats.blockCount > static_cast<uint32_t>(params.maxBlocks))
+    {
+        return false;
+    }
+
+    // the right patch comes out whole, whatever is left of the left one
+    volume.ExtractSurface(&pool, &vertices);
+    size_t rightCount = 0;
+    for (size_t i = 0; i < vertices.size(); ++i)
+    {
+        rightCount += vertices[i].x > 0.0f ? 1 : 0;
+    }
+
+    return !rightOnly.empty() && rightOnly.size() == rightCount && MeasurePlane(vertices, planeZ, params.voxelSize * 0.5f, planeColor) > 0.0;
+}
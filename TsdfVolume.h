@@ -0,0 +1,206 @@
+﻿//------------------------------------------------------------------------------
+// <copyright file="TsdfVolume.h" company="Microsoft">
+//     Copyright (c) Microsoft Corporation.  All rights reserved.
+// </copyright>
+//------------------------------------------------------------------------------
+
+#pragma once
+
+#include <stdint.h>
+#include <vector>
+#include "PointCloud.h"
+#include "WorkerPool.h"
+
+/// <summary>
+/// Resolution and memory budget of a fused volume
+/// </summary>
+struct TsdfVolumeParams
+{
+    // edge of one voxel, meters
+    float                               voxelSize;
+
+    // distance in front of and behind the measured surface that is integrated, meters
+    float                               truncation;
+
+    // blocks kept at once, each holds cTsdfBlockSize cubed voxels
+    // the blocks seen least recently are evicted to make room for new ones
+    int                                 maxBlocks;
+
+    // observations a voxel averages over, fewer adapt faster to a changing scene
+    int                                 maxWeight;
+
+    // observations a voxel needs before it takes part in the extracted surface, hides single noisy frames
+    int                                 minSurfaceWeight;
+
+    TsdfVolumeParams() :
+        voxelSize(0.01f),
+        truncation(0.04f),
+        maxBlocks(16384),
+        maxWeight(64),
+        minSurfaceWeight(3)
+    {
+    }
+};
+
+// voxels along each edge of a block, the unit space is allocated and evicted in
+const int cTsdfBlockSize = 8;
+const int cTsdfBlockVoxels = cTsdfBlockSize * cTsdfBlockSize * cTsdfBlockSize;
+
+/// <summary>
+/// Counters of a fused volume
+/// </summary>
+struct TsdfVolumeStats
+{
+    // frames integrated
+    uint32_t                            frameCount;
+
+    // blocks holding voxels right now
+    uint32_t                            blockCount;
+
+    // blocks integrated by the last frame
+    uint32_t                            visibleBlockCount;
+
+    // blocks evicted to make room, over all frames
+    uint32_t                            evictedCount;
+
+    // blocks a frame needed but could not get because its own blocks filled the budget
+    uint32_t                            droppedCount;
+};
+
+/// <summary>
+/// Truncated signed distance field of the scene, fused from depth frames
+/// Only the space near a measured surface holds voxels. It is split into blocks of voxels found
+/// through a hash of their coordinates, so memory follows the surface rather than the volume it
+/// spans. Frames are integrated block by block in parallel, and the surface is extracted as a
+/// triangle mesh whenever the caller wants to draw it. Noise averages out over frames and holes
+/// of one frame are filled from earlier ones, so the mesh is steadier than the frame's point cloud.
+/// Space is the depth sensor's, unprojected with the shader's XYScale, the sensor does not move.
+/// </summary>
+class CTsdfVolume
+{
+public:
+    /// <summary>
+    /// Constructor
+    /// </summary>
+    CTsdfVolume();
+
+    /// <summary>
+    /// Allocate the voxel blocks and the hash table, dropping anything integrated before
+    /// </summary>
+    /// <param name="params">resolution and memory budget</param>
+    void                                Create(const TsdfVolumeParams& params);
+
+    /// <summary>
+    /// Drop every integrated frame, keeping the memory
+    /// </summary>
+    void                                Reset();
+
+    /// <summary>
+    /// Fuse a depth frame into the volume
+    /// Blocks along the measured surface are allocated first, evicting the least recently seen
+    /// ones when the budget is spent, then every one of them is updated on the worker pool.
+    /// </summary>
+    /// <param name="desc">depth frame and color remapped into depth space</param>
+    /// <param name="pPool">threads to update blocks with</param>
+    void                                Integrate(const PointCloudDesc& desc, CWorkerPool* pPool);
+
+    /// <summary>
+    /// Extract the fused surface as a triangle list, three vertices per triangle
+    /// Each cell of eight voxels the surface passes through gets a vertex where the distance
+    /// crosses zero, and every voxel edge it crosses joins the four cells around the edge in a quad.
+    /// The mesh has no holes between blocks, all triangles face the sensor's side of the surface.
+    /// </summary>
+    /// <param name="pPool">threads to extract blocks with</param>
+    /// <param name="pVertices">receives the triangles, positions in meters and BGRX colors</param>
+    void                                ExtractSurface(CWorkerPool* pPool, std::vector<PointCloudPoint>* pVertices);
+
+    const TsdfVolumeStats&              GetStats() const { return m_stats; }
+    const TsdfVolumeParams&             GetParams() const { return m_params; }
+
+private:
+    // depth pixels between the rays that allocate blocks, a block spans many pixels at any range
+    static const int                    cAllocationStride = 2;
+
+    // fewer blocks than this aren't worth waking another thread for
+    static const int                    cMinBlocksPerBand = 4;
+
+    // largest magnitude of a stored distance, which stands for the truncation distance
+    static const int                    cSdfScale = 32767;
+
+    /// <summary>
+    /// One sample of the distance field
+    /// </summary>
+    struct Voxel
+    {
+        // distance to the surface over the truncation distance, positive in front of it
+        int16_t                         sdf;
+
+        // observations averaged, 0 for a voxel never seen
+        uint16_t                        weight;
+
+        // BGRX running average of the color seen at the surface
+        uint32_t                        color;
+    };
+
+    /// <summary>
+    /// Position of a block, in blocks, and when it was last seen
+    /// </summary>
+    struct Block
+    {
+        int                             x;
+        int                             y;
+        int                             z;
+
+        // frame that last integrated the block, 0 while the block is free
+        uint32_t                        lastSeen;
+    };
+
+    /// <summary>
+    /// Slot of the open addressing hash table from block position to block
+    /// </summary>
+    struct HashEntry
+    {
+        uint64_t                        key;
+
+        // index into m_blocks, -1 for an empty slot
+        int32_t                         block;
+    };
+
+    static uint64_t                     MakeKey(int x, int y, int z);
+    uint32_t                            GetHomeSlot(uint64_t key) const;
+    int                                 FindBlock(int x, int y, int z) const;
+    int                                 AllocateBlock(int x, int y, int z);
+    void                                RemoveBlock(int block);
+    bool                                EvictBlocks();
+
+    static void                         CollectBlocks(void* pContext, int begin, int end);
+    static void                         IntegrateBlocks(void* pContext, int begin, int end);
+    static void                         ExtractBlocks(void* pContext, int begin, int end);
+
+    void                                ExtractBlock(int block, std::vector<PointCloudPoint>* pVertices) const;
+
+    TsdfVolumeParams                    m_params;
+    TsdfVolumeStats                     m_stats;
+
+    std::vector<Voxel>                  m_voxels;
+    std::vector<Block>                  m_blocks;
+    std::vector<int>                    m_freeBlocks;
+
+    // twice as many slots as blocks keeps the probe sequences short
+    std::vector<HashEntry>              m_table;
+    uint32_t                            m_tableMask;
+
+    // inputs of the pass in progress
+    PointCloudDesc                      m_desc;
+    std::vector<std::vector<uint64_t> > m_rowKeys;
+    std::vector<int>                    m_visibleBlocks;
+    std::vector<int>                    m_evictCandidates;
+    std::vector<int>                    m_extractBlocks;
+    std::vector<std::vector<PointCloudPoint> > m_blockMeshes;
+};
+
+/// <summary>
+/// Fuse synthetic planes and check the extracted surface lies on them and that eviction keeps to the budget
+/// </summary>
+/// <returns>true if the surface and the eviction are as expected</returns>
+bool VerifyTsdfVolume();
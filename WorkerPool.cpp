@@ -0,0 +1,234 @@
+﻿//------------------------------------------------------------------------------
+// <copyright file="WorkerPool.cpp" company="Microsoft">
+//     Copyright (c) Microsoft Corporation.  All rights reserved.
+// </copyright>
+//------------------------------------------------------------------------------
+
+#include "WorkerPool.h"
+#include "FrameProfiler.h"
+#include <stddef.h>
+
+// Bands handed out per thread, a few more than one evens out threads that start late
+static const int cBandsPerThread = 2;
+
+/// <summary>
+/// Constructor
+/// </summary>
+CWorkerPool::CWorkerPool() :
+    m_busyWorkers(0),
+    m_func(NULL),
+    m_pContext(NULL),
+    m_begin(0),
+    m_end(0),
+    m_bandSize(1),
+    m_nextBand(0)
+{
+    InitializeCriticalSection(&m_submitLock);
+
+    // without them Start keeps every call inline
+    m_hStop = CreateEventW(NULL, TRUE, FALSE, NULL);
+    m_hDone = CreateEventW(NULL, FALSE, FALSE, NULL);
+}
+
+/// <summary>
+/// Destructor
+/// </summary>
+CWorkerPool::~CWorkerPool()
+{
+    Stop();
+
+    if (NULL != m_hStop)
+    {
+        CloseHandle(m_hStop);
+    }
+
+    if (NULL != m_hDone)
+    {
+        CloseHandle(m_hDone);
+    }
+
+    DeleteCriticalSection(&m_submitLock);
+}
+
+/// <summary>
+/// Start the worker threads
+/// </summary>
+/// <param name="threadCount">total threads including the caller, 0 for one per hardware thread</param>
+void CWorkerPool::Start(unsigned int threadCount)
+{
+    Stop();
+
+    if (0 == threadCount)
+    {
+        SYSTEM_INFO systemInfo;
+        GetSystemInfo(&systemInfo);
+        threadCount = systemInfo.dwNumberOfProcessors;
+    }
+
+    if (threadCount <= 1 || NULL == m_hStop || NULL == m_hDone)
+    {
+        return;
+    }
+
+    ResetEvent(m_hStop);
+
+    // the threads are handed pointers into the vector, so it must not grow once they run
+    m_workers.resize(threadCount - 1);
+    for (size_t i = 0; i < m_workers.size(); ++i)
+    {
+        Worker& worker = m_workers[i];
+        worker.pPool = this;
+        worker.hThread = NULL;
+        worker.hWake = CreateEventW(NULL, FALSE, FALSE, NULL);
+        if (NULL != worker.hWake)
+        {
+            worker.hThread = CreateThread(NULL, 0, WorkerThread, &worker, 0, NULL);
+        }
+
+        // carry on with the workers that did start
+        if (NULL == worker.hThread)
+        {
+            if (NULL != worker.hWake)
+            {
+                CloseHandle(worker.hWake);
+            }
+
+            m_workers.resize(i);
+            break;
+        }
+    }
+}
+
+/// <summary>
+/// Stop and join the worker threads, later calls run inline
+/// </summary>
+void CWorkerPool::Stop()
+{
+    if (m_workers.empty())
+    {
+        return;
+    }
+
+    SetEvent(m_hStop);
+
+    for (size_t i = 0; i < m_workers.size(); ++i)
+    {
+        WaitForSingleObject(m_workers[i].hThread, INFINITE);
+        CloseHandle(m_workers[i].hThread);
+        CloseHandle(m_workers[i].hWake);
+    }
+
+    m_workers.clear();
+}
+
+/// <summary>
+/// Run func over [begin, end) split into bands, returning once every band is done
+/// Calls from several threads are serialized
+/// </summary>
+/// <param name="begin">first item</param>
+/// <param name="end">one past the last item</param>
+/// <param name="minBand">smallest number of items worth handing to a thread</param>
+/// <param name="func">called once per band, possibly concurrently</param>
+/// <param name="pContext">passed through to func</param>
+void CWorkerPool::ParallelFor(int begin, int end, int minBand, BandFunc func, void* pContext)
+{
+    if (end <= begin)
+    {
+        return;
+    }
+
+    int count = end - begin;
+    int threads = static_cast<int>(GetThreadCount());
+    int bandSize = (count + threads * cBandsPerThread - 1) / (threads * cBandsPerThread);
+    if (bandSize < minBand)
+    {
+        bandSize = minBand;
+    }
+
+    // single-threaded fallback, also taken when there's too little work to share
+    if (m_workers.empty() || bandSize >= count)
+    {
+        func(pContext, begin, end);
+        return;
+    }
+
+    EnterCriticalSection(&m_submitLock);
+
+    // SetEvent is a full barrier, the workers see the whole job once they wake
+    m_func = func;
+    m_pContext = pContext;
+    m_begin = begin;
+    m_end = end;
+    m_bandSize = bandSize;
+    m_nextBand = 0;
+    m_busyWorkers = static_cast<LONG>(m_workers.size());
+
+    for (size_t i = 0; i < m_workers.size(); ++i)
+    {
+        SetEvent(m_workers[i].hWake);
+    }
+
+    RunBands();
+
+    // the job description must stay put until every worker has let go of it
+    WaitForSingleObject(m_hDone, INFINITE);
+
+    LeaveCriticalSection(&m_submitLock);
+}
+
+DWORD WINAPI CWorkerPool::WorkerThread(LPVOID lpParam)
+{
+    const Worker* pWorker = static_cast<const Worker*>(lpParam);
+    pWorker->pPool->WorkerLoop(pWorker);
+    return 0;
+}
+
+/// <summary>
+/// Run every job the worker is woken for until stopped
+/// </summary>
+/// <param name="pWorker">the worker this thread is</param>
+void CWorkerPool::WorkerLoop(const Worker* pWorker)
+{
+    CFrameProfiler::SetThreadName("worker");
+
+    HANDLE waits[2] = { m_hStop, pWorker->hWake };
+
+    for (;;)
+    {
+        if (WAIT_OBJECT_0 + 1 != WaitForMultipleObjects(2, waits, FALSE, INFINITE))
+        {
+            return;
+        }
+
+        RunBands();
+
+        if (0 == InterlockedDecrement(&m_busyWorkers))
+        {
+            SetEvent(m_hDone);
+        }
+    }
+}
+
+/// <summary>
+/// Claim and run bands of the current job until none are left
+/// </summary>
+void CWorkerPool::RunBands()
+{
+    for (;;)
+    {
+        int band = static_cast<int>(InterlockedIncrement(&m_nextBand)) - 1;
+        int bandBegin = m_begin + band * m_bandSize;
+        if (bandBegin >= m_end)
+        {
+            return;
+        }
+
+        int bandEnd = bandBegin + m_bandSize;
+        if (bandEnd > m_end)
+        {
+            bandEnd = m_end;
+        }
+
+        m_func(m_pContext, bandBegin, bandEnd);
+    }
+}
@@ -0,0 +1,110 @@
+﻿//------------------------------------------------------------------------------
+// <copyright file="WorkerPool.h" company="Microsoft">
+//     Copyright (c) Microsoft Corporation.  All rights reserved.
+// </copyright>
+//------------------------------------------------------------------------------
+
+#pragma once
+
+#include <windows.h>
+#include <vector>
+
+/// <summary>
+/// Persistent set of threads that split a range of work items into bands
+/// The calling thread works on bands too, so a pool of one thread runs everything inline
+/// </summary>
+class CWorkerPool
+{
+public:
+    /// <summary>
+    /// Work on the items [begin, end)
+    /// </summary>
+    /// <param name="pContext">caller supplied data</param>
+    /// <param name="begin">first item of the band</param>
+    /// <param name="end">one past the last item of the band</param>
+    typedef void (*BandFunc)(void* pContext, int begin, int end);
+
+    /// <summary>
+    /// Constructor
+    /// </summary>
+    CWorkerPool();
+
+    /// <summary>
+    /// Destructor
+    /// </summary>
+    ~CWorkerPool();
+
+    /// <summary>
+    /// Start the worker threads
+    /// </summary>
+    /// <param name="threadCount">total threads including the caller, 0 for one per hardware thread</param>
+    void                                Start(unsigned int threadCount);
+
+    /// <summary>
+    /// Stop and join the worker threads, later calls run inline
+    /// </summary>
+    void                                Stop();
+
+    /// <summary>
+    /// Number of threads working on a ParallelFor, including the caller
+    /// </summary>
+    unsigned int                        GetThreadCount() const { return static_cast<unsigned int>(m_workers.size()) + 1; }
+
+    /// <summary>
+    /// Run func over [begin, end) split into bands, returning once every band is done
+    /// Calls from several threads are serialized
+    /// </summary>
+    /// <param name="begin">first item</param>
+    /// <param name="end">one past the last item</param>
+    /// <param name="minBand">smallest number of items worth handing to a thread</param>
+    /// <param name="func">called once per band, possibly concurrently</param>
+    /// <param name="pContext">passed through to func</param>
+    void                                ParallelFor(int begin, int end, int minBand, BandFunc func, void* pContext);
+
+private:
+    /// <summary>
+    /// One worker thread and the event that hands it a job
+    /// </summary>
+    struct Worker
+    {
+        CWorkerPool*                    pPool;
+
+        // one per worker rather than one shared, so no worker can take a job twice
+        HANDLE                          hWake;
+        HANDLE                          hThread;
+    };
+
+    static DWORD WINAPI                 WorkerThread(LPVOID lpParam);
+
+    /// <summary>
+    /// Run every job the worker is woken for until stopped
+    /// </summary>
+    /// <param name="pWorker">the worker this thread is</param>
+    void                                WorkerLoop(const Worker* pWorker);
+
+    /// <summary>
+    /// Claim and run bands of the current job until none are left
+    /// </summary>
+    void                                RunBands();
+
+    // sized once in Start, the threads hold pointers to their entries
+    std::vector<Worker>                 m_workers;
+
+    // one ParallelFor at a time
+    CRITICAL_SECTION                    m_submitLock;
+
+    // manual reset, makes every worker return
+    HANDLE                              m_hStop;
+
+    // signaled by the last worker to finish the current job
+    HANDLE                              m_hDone;
+    volatile LONG                       m_busyWorkers;
+
+    // current job, written before the wake events are set
+    BandFunc                            m_func;
+    void*                               m_pContext;
+    int                                 m_begin;
+    int                                 m_end;
+    int                                 m_bandSize;
+    volatile LONG                       m_nextBand;
+};